@@ -0,0 +1,422 @@
+#ifndef AVL_IMAGE_H
+#define AVL_IMAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "avlbst.h"
+
+/**
+* The on-disk image that saveAVLImage (AVLTree::saveTo) writes and
+* loadAVLImage (AVLTree::loadFrom) and MappedAVLTree read: a 64-byte header followed by the items as fixed-size
+* records, sorted by key. There are no pointers and no shape: a sorted run
+* is all buildFromSorted needs to link a balanced tree in O(n), and it can
+* be binary-searched where it lies.
+*
+* Key and Value must be trivially copyable, since records are their raw
+* bytes. The header records the format version, the byte order and the
+* sizes of Key, Value and a record, and readers refuse an image whose
+* values differ from theirs; they cannot tell two types of the same size
+* apart, nor check that the image was sorted with the same Compare.
+* The records start 64 bytes in, so a mapped image has them aligned.
+*/
+
+struct AVLImageHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t keySize;
+    uint32_t valueSize;
+    uint32_t recordSize;
+    uint32_t reserved;
+    uint64_t count;
+    char pad[24];
+};
+
+static const char kAVLImageMagic[8] = { 'A', 'V', 'L', 'I', 'M', 'A', 'G', 'E' };
+static const uint32_t kAVLImageVersion = 1;
+static const uint32_t kAVLImageByteOrder = 0x01020304;
+
+/**
+* One item of an image. The members are named as in std::pair, so code
+* written against tree iterators reads records the same way.
+*/
+template<typename Key, typename Value>
+struct AVLImageRecord
+{
+    Key first;
+    Value second;
+};
+
+/**
+* A file mapped read-only into memory, unmapped on destruction.
+*/
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    const char* data() const;
+    size_t size() const;
+    void adviseSequential() const;
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    void* data_;
+    size_t size_;
+};
+
+/**
+* A read-only map over an image file, queried where it is mapped: no
+* item is copied to the heap and opening costs O(1) besides the header
+* check, as pages are read in on first touch. Lookups binary-search the
+* records in O(log n) comparisons; iteration walks them in order.
+* Compare must be the one the image was saved with.
+*/
+template <class Key, class Value, class Compare = std::less<Key> >
+class MappedAVLTree
+{
+public:
+    typedef AVLImageRecord<Key, Value> RecordT;
+    typedef const RecordT* const_iterator;
+    typedef const_iterator iterator;
+
+    explicit MappedAVLTree(const std::string& path, const Compare& comp = Compare());
+
+    bool empty() const;
+    size_t size() const;
+    const Value& operator[](const Key& key) const;
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator find(const Key& key) const;
+    const_iterator lower_bound(const Key& key) const;
+
+private:
+    MappedFile file_;
+    const RecordT* records_;
+    size_t size_;
+    Compare comp_;
+};
+
+void syncDirectoryOf(const std::string& path);
+template<typename Key, typename Value, typename Next>
+void writeAVLImage(const std::string& path, size_t count, Next next);
+template<typename Key, typename Value>
+const AVLImageRecord<Key, Value>* checkAVLImage(const MappedFile& file, size_t& count);
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void saveAVLImage(const AVLTree<Key, Value, Alloc, NodeT, Compare>& tree, const std::string& path);
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void loadAVLImage(AVLTree<Key, Value, Alloc, NodeT, Compare>& tree, const std::string& path);
+
+/*
+  ---------------------------------------------
+  Begin implementations for MappedFile.
+  ---------------------------------------------
+*/
+
+/**
+* Throws std::runtime_error if the file cannot be opened or mapped.
+*/
+inline MappedFile::MappedFile(const std::string& path) :
+    data_(nullptr), size_(0)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        throw std::runtime_error("cannot open " + path);
+    struct stat info;
+    if(::fstat(fd, &info) != 0 || info.st_size == 0){
+        ::close(fd);
+        throw std::runtime_error("cannot read " + path);
+    }
+    size_ = (size_t)info.st_size;
+    data_ = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(data_ == MAP_FAILED)
+        throw std::runtime_error("cannot map " + path);
+}
+
+inline MappedFile::~MappedFile()
+{
+    ::munmap(data_, size_);
+}
+
+inline const char* MappedFile::data() const
+{
+    return static_cast<const char*>(data_);
+}
+
+inline size_t MappedFile::size() const
+{
+    return size_;
+}
+
+/**
+* Tells the kernel the file will be read front to back once, so it reads
+* ahead aggressively.
+*/
+inline void MappedFile::adviseSequential() const
+{
+    ::madvise(data_, size_, MADV_SEQUENTIAL);
+}
+
+/*
+  ---------------------------------------------
+  Begin implementations for the image functions.
+  ---------------------------------------------
+*/
+
+/**
+* Flushes the directory holding path to disk, so that a rename into it
+* survives a power loss. Throws std::runtime_error if that fails.
+*/
+inline void syncDirectoryOf(const std::string& path)
+{
+    std::string::size_type slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int fd = ::open(dir.c_str(), O_RDONLY);
+    if(fd < 0)
+        throw std::runtime_error("cannot open " + dir);
+    bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    if(!ok)
+        throw std::runtime_error("cannot sync " + dir);
+}
+
+/**
+* Writes an image of count records to path. next(record) fills in the
+* records in key order and returns false to abort the write.
+* The image goes to path.tmp first, is synced to disk and is then
+* renamed over path, and the directory is synced after the rename, so
+* neither a crash nor a power loss leaves a torn image behind: path
+* holds the old image or the new one. Throws std::runtime_error on any
+* I/O failure.
+*/
+template<typename Key, typename Value, typename Next>
+void writeAVLImage(const std::string& path, size_t count, Next next)
+{
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+                  "images hold raw bytes, so Key and Value must be trivially copyable");
+    typedef AVLImageRecord<Key, Value> RecordT;
+    static_assert(sizeof(AVLImageHeader) == 64, "the header is 64 bytes");
+
+    AVLImageHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, kAVLImageMagic, sizeof(header.magic));
+    header.version = kAVLImageVersion;
+    header.byteOrder = kAVLImageByteOrder;
+    header.keySize = sizeof(Key);
+    header.valueSize = sizeof(Value);
+    header.recordSize = sizeof(RecordT);
+    header.count = count;
+
+    std::string temp = path + ".tmp";
+    std::FILE* out = std::fopen(temp.c_str(), "wb");
+    if(out == nullptr)
+        throw std::runtime_error("cannot create " + temp);
+    bool ok = std::fwrite(&header, sizeof(header), 1, out) == 1;
+    // records are zeroed first so that padding bytes are deterministic
+    std::vector<RecordT> buffer(4096);
+    size_t written = 0;
+    while(ok && written < count){
+        size_t n = std::min(buffer.size(), count - written);
+        std::memset(static_cast<void*>(buffer.data()), 0, n * sizeof(RecordT));
+        for(size_t i = 0; i < n && ok; ++i)
+            ok = next(buffer[i]);
+        ok = ok && std::fwrite(buffer.data(), sizeof(RecordT), n, out) == n;
+        written += n;
+    }
+    // the data must be on disk before the rename can make it the image
+    ok = ok && std::fflush(out) == 0 && ::fsync(fileno(out)) == 0;
+    ok = std::fclose(out) == 0 && ok;
+    if(!ok || std::rename(temp.c_str(), path.c_str()) != 0){
+        std::remove(temp.c_str());
+        throw std::runtime_error("cannot write " + path);
+    }
+    syncDirectoryOf(path);
+}
+
+/**
+* Checks the header of a mapped image against Key and Value and returns
+* its records, setting count. Throws std::runtime_error if the image is
+* not one, is of another version, byte order or layout, or is truncated.
+*/
+template<typename Key, typename Value>
+const AVLImageRecord<Key, Value>* checkAVLImage(const MappedFile& file, size_t& count)
+{
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+                  "images hold raw bytes, so Key and Value must be trivially copyable");
+    typedef AVLImageRecord<Key, Value> RecordT;
+
+    AVLImageHeader header;
+    if(file.size() < sizeof(header))
+        throw std::runtime_error("not a tree image");
+    std::memcpy(&header, file.data(), sizeof(header));
+    if(std::memcmp(header.magic, kAVLImageMagic, sizeof(header.magic)) != 0)
+        throw std::runtime_error("not a tree image");
+    if(header.version != kAVLImageVersion)
+        throw std::runtime_error("unsupported tree image version");
+    if(header.byteOrder != kAVLImageByteOrder)
+        throw std::runtime_error("tree image has another byte order");
+    if(header.keySize != sizeof(Key) || header.valueSize != sizeof(Value) ||
+       header.recordSize != sizeof(RecordT))
+        throw std::runtime_error("tree image holds other key or value types");
+    if(header.count > (file.size() - sizeof(header)) / sizeof(RecordT))
+        throw std::runtime_error("tree image is truncated");
+    count = (size_t)header.count;
+    return reinterpret_cast<const RecordT*>(file.data() + sizeof(header));
+}
+
+/**
+* Writes the items of tree to path as an image that loadAVLImage and
+* MappedAVLTree read back. The file is replaced whole or not at all;
+* throws std::runtime_error on I/O failure.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void saveAVLImage(const AVLTree<Key, Value, Alloc, NodeT, Compare>& tree, const std::string& path)
+{
+    typedef typename AVLTree<Key, Value, Alloc, NodeT, Compare>::const_iterator ConstIterator;
+    ConstIterator it = tree.begin();
+    ConstIterator last = tree.end();
+    writeAVLImage<Key, Value>(path, tree.size(), [&](AVLImageRecord<Key, Value>& record) {
+        if(it == last)
+            return false;
+        record.first = it->first;
+        record.second = it->second;
+        ++it;
+        return true;
+    });
+}
+
+/**
+* Replaces the contents of tree with the image at path. The file is
+* mapped and its sorted records are linked into a balanced tree by
+* buildFromSorted: O(n), no inserts, no rotations. Throws
+* std::runtime_error as checkAVLImage, leaving tree as it was.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void loadAVLImage(AVLTree<Key, Value, Alloc, NodeT, Compare>& tree, const std::string& path)
+{
+    MappedFile file(path);
+    size_t count;
+    const AVLImageRecord<Key, Value>* records = checkAVLImage<Key, Value>(file, count);
+    file.adviseSequential();
+    tree.buildFromSorted(records, records + count);
+}
+
+/*
+  ---------------------------------------------
+  Begin implementations for the AVLTree image members.
+  ---------------------------------------------
+*/
+
+/**
+* Same as saveAVLImage(*this, path).
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::saveTo(const std::string& path) const
+{
+    saveAVLImage(*this, path);
+}
+
+/**
+* Same as loadAVLImage(*this, path).
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::loadFrom(const std::string& path)
+{
+    loadAVLImage(*this, path);
+}
+
+/*
+  ---------------------------------------------
+  Begin implementations for MappedAVLTree.
+  ---------------------------------------------
+*/
+
+/**
+* Maps the image at path. Throws std::runtime_error as checkAVLImage.
+*/
+template<class Key, class Value, class Compare>
+MappedAVLTree<Key, Value, Compare>::MappedAVLTree(const std::string& path, const Compare& comp) :
+    file_(path), records_(nullptr), size_(0), comp_(comp)
+{
+    records_ = checkAVLImage<Key, Value>(file_, size_);
+}
+
+template<class Key, class Value, class Compare>
+bool MappedAVLTree<Key, Value, Compare>::empty() const
+{
+    return size_ == 0;
+}
+
+template<class Key, class Value, class Compare>
+size_t MappedAVLTree<Key, Value, Compare>::size() const
+{
+    return size_;
+}
+
+/**
+* Returns the value of key; throws std::out_of_range if absent.
+*/
+template<class Key, class Value, class Compare>
+const Value& MappedAVLTree<Key, Value, Compare>::operator[](const Key& key) const
+{
+    const_iterator it = find(key);
+    if(it == end())
+        throw std::out_of_range("Invalid key");
+    return it->second;
+}
+
+template<class Key, class Value, class Compare>
+typename MappedAVLTree<Key, Value, Compare>::const_iterator
+MappedAVLTree<Key, Value, Compare>::begin() const
+{
+    return records_;
+}
+
+template<class Key, class Value, class Compare>
+typename MappedAVLTree<Key, Value, Compare>::const_iterator
+MappedAVLTree<Key, Value, Compare>::end() const
+{
+    return records_ + size_;
+}
+
+template<class Key, class Value, class Compare>
+typename MappedAVLTree<Key, Value, Compare>::const_iterator
+MappedAVLTree<Key, Value, Compare>::find(const Key& key) const
+{
+    const_iterator it = lower_bound(key);
+    if(it == end() || comp_(key, it->first))
+        return end();
+    return it;
+}
+
+/**
+* The first record whose key is not less than key.
+*/
+template<class Key, class Value, class Compare>
+typename MappedAVLTree<Key, Value, Compare>::const_iterator
+MappedAVLTree<Key, Value, Compare>::lower_bound(const Key& key) const
+{
+    const Compare& comp = comp_;
+    return std::lower_bound(begin(), end(), key,
+        [&comp](const RecordT& record, const Key& k) { return comp(record.first, k); });
+}
+
+#endif
@@ -6,10 +6,38 @@
 #include <cstdlib>
 #include <cstdint>
 #include <algorithm>
+#include <iterator>
+#include <vector>
+#include <string>
+#include <stdexcept>
 #include "bst.h"
+#include "task_pool.h"
 
 struct KeyError { };
 
+/**
+* Merge policies for AVLTree::unionWith and intersectWith. For a key both
+* trees hold, merge(ours, theirs) is called with the two values and ours
+* is what the result keeps. The calls may come from several threads at
+* once, so a policy must not share state between them.
+*/
+struct KeepOurs
+{
+    template<typename V>
+    void operator()(V&, V&) const
+    {
+    }
+};
+
+struct TakeTheirs
+{
+    template<typename V>
+    void operator()(V& ours, V& theirs) const
+    {
+        ours = std::move(theirs);
+    }
+};
+
 /**
 * A special kind of node for an AVL tree, which adds the balance as a data member, plus
 * other additional helper functions. You do NOT need to implement any functionality or
@@ -21,7 +49,9 @@ class AVLNode : public Node<Key, Value>
 public:
     // Constructor/destructor.
     AVLNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent);
-    virtual ~AVLNode();
+    template<typename... Args>
+    AVLNode(AVLNode<Key, Value>* parent, Args&&... args);
+    ~AVLNode();
 
     // Getter/setter for the node's height.
     int8_t getBalance () const;
@@ -29,11 +59,13 @@ public:
     void updateBalance(int8_t diff);
 
     // Getters for parent, left, and right. These need to be redefined since they
-    // return pointers to AVLNodes - not plain Nodes. See the Node class in bst.h
-    // for more information.
-    virtual AVLNode<Key, Value>* getParent() const override;
-    virtual AVLNode<Key, Value>* getLeft() const override;
-    virtual AVLNode<Key, Value>* getRight() const override;
+    // return pointers to AVLNodes - not plain Nodes. They hide the Node
+    // versions rather than override them, so calls through an AVLNode pointer
+    // are resolved at compile time. See the Node class in bst.h for more
+    // information.
+    AVLNode<Key, Value>* getParent() const;
+    AVLNode<Key, Value>* getLeft() const;
+    AVLNode<Key, Value>* getRight() const;
 
 protected:
     int8_t balance_;    // effectively a signed char
@@ -55,6 +87,17 @@ AVLNode<Key, Value>::AVLNode(const Key& key, const Value& value, AVLNode<Key, Va
 
 }
 
+/**
+* Builds the item in place; see the matching Node constructor.
+*/
+template<class Key, class Value>
+template<typename... Args>
+AVLNode<Key, Value>::AVLNode(AVLNode<Key, Value> *parent, Args&&... args) :
+    Node<Key, Value>(parent, std::forward<Args>(args)...), balance_(0)
+{
+
+}
+
 /**
 * A destructor which does nothing.
 */
@@ -92,7 +135,7 @@ void AVLNode<Key, Value>::updateBalance(int8_t diff)
 }
 
 /**
-* An overridden function for getting the parent since a static_cast is necessary to make sure
+* A redefined function for getting the parent since a static_cast is necessary to make sure
 * that our node is a AVLNode.
 */
 template<class Key, class Value>
@@ -126,106 +169,1213 @@ AVLNode<Key, Value> *AVLNode<Key, Value>::getRight() const
   -----------------------------------------------
 */
 
+/**
+* An AVLNode that also stores the number of nodes in its subtree, for the
+* order-statistic operations of OrderStatisticTree.
+*/
+template <typename Key, typename Value>
+class CountedAVLNode : public AVLNode<Key, Value>
+{
+public:
+    CountedAVLNode(const Key& key, const Value& value, CountedAVLNode<Key, Value>* parent);
+    template<typename... Args>
+    CountedAVLNode(CountedAVLNode<Key, Value>* parent, Args&&... args);
+    ~CountedAVLNode();
+
+    size_t getCount() const;
+    void setCount(size_t count);
+    void addCount(long diff);
+
+    CountedAVLNode<Key, Value>* getParent() const;
+    CountedAVLNode<Key, Value>* getLeft() const;
+    CountedAVLNode<Key, Value>* getRight() const;
+
+protected:
+    size_t count_;
+};
 
-template <class Key, class Value>
-class AVLTree : public BinarySearchTree<Key, Value>
+/*
+  -------------------------------------------------
+  Begin implementations for the CountedAVLNode class.
+  -------------------------------------------------
+*/
+
+/**
+* A new node is a leaf, so its subtree holds just itself.
+*/
+template<class Key, class Value>
+CountedAVLNode<Key, Value>::CountedAVLNode(const Key& key, const Value& value, CountedAVLNode<Key, Value> *parent) :
+    AVLNode<Key, Value>(key, value, parent), count_(1)
+{
+
+}
+
+template<class Key, class Value>
+template<typename... Args>
+CountedAVLNode<Key, Value>::CountedAVLNode(CountedAVLNode<Key, Value> *parent, Args&&... args) :
+    AVLNode<Key, Value>(parent, std::forward<Args>(args)...), count_(1)
+{
+
+}
+
+template<class Key, class Value>
+CountedAVLNode<Key, Value>::~CountedAVLNode()
+{
+
+}
+
+/**
+* A getter for the number of nodes in this node's subtree.
+*/
+template<class Key, class Value>
+size_t CountedAVLNode<Key, Value>::getCount() const
+{
+    return count_;
+}
+
+template<class Key, class Value>
+void CountedAVLNode<Key, Value>::setCount(size_t count)
+{
+    count_ = count;
+}
+
+/**
+* Adds diff to the subtree count.
+*/
+template<class Key, class Value>
+void CountedAVLNode<Key, Value>::addCount(long diff)
+{
+    count_ += diff;
+}
+
+template<class Key, class Value>
+CountedAVLNode<Key, Value> *CountedAVLNode<Key, Value>::getParent() const
+{
+    return static_cast<CountedAVLNode<Key, Value>*>(this->parent_);
+}
+
+template<class Key, class Value>
+CountedAVLNode<Key, Value> *CountedAVLNode<Key, Value>::getLeft() const
+{
+    return static_cast<CountedAVLNode<Key, Value>*>(this->left_);
+}
+
+template<class Key, class Value>
+CountedAVLNode<Key, Value> *CountedAVLNode<Key, Value>::getRight() const
+{
+    return static_cast<CountedAVLNode<Key, Value>*>(this->right_);
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the CountedAVLNode class.
+  -----------------------------------------------
+*/
+
+
+/**
+* A self-balancing AVL tree. Alloc is the node allocator policy (see node_alloc.h).
+* NodeT is the node type: AVLNode, or CountedAVLNode for the order-statistic
+* operations (see OrderStatisticTree below). Compare orders the keys, as
+* for std::map.
+*/
+template <class Key, class Value, class Alloc = HeapNodeAlloc, class NodeT = AVLNode<Key, Value>,
+          class Compare = std::less<Key> >
+class AVLTree : public BinarySearchTree<Key, Value, Alloc, NodeT, Compare>
 {
 public:
-    virtual void insert (const std::pair<const Key, Value> &new_item); // TODO
+    typedef typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator iterator;
+    typedef typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator const_iterator;
+
+    AVLTree();
+    explicit AVLTree(const Compare& comp);
+    template<typename InputIt>
+    AVLTree(InputIt first, InputIt last, const Compare& comp = Compare());
+    template<typename InputIt>
+    void buildFromSorted(InputIt first, InputIt last);
+    template<typename InputIt>
+    void insertBatch(InputIt first, InputIt last);
+    template<typename InputIt>
+    void eraseBatch(InputIt first, InputIt last);
+    void join(AVLTree& left, const std::pair<const Key, Value>& pivot, AVLTree& right);
+    void join(AVLTree& left, AVLTree& right);
+    void split(const Key& key, AVLTree& less, AVLTree& greater);
+    template<typename Merge = KeepOurs>
+    void unionWith(AVLTree& other, Merge merge = Merge(), TaskPool* pool = nullptr);
+    template<typename Merge = KeepOurs>
+    void intersectWith(AVLTree& other, Merge merge = Merge(), TaskPool* pool = nullptr);
+    void differenceWith(AVLTree& other, TaskPool* pool = nullptr);
+    template<typename Function>
+    void parallelForEach(Function fn, TaskPool& pool) const;
+    template<typename Function>
+    void parallelForEach(Function fn, size_t threads = std::thread::hardware_concurrency()) const;
+    template<typename T, typename Map, typename Combine>
+    T parallelReduce(Map map, Combine combine, T identity, TaskPool& pool) const;
+    template<typename T, typename Map, typename Combine>
+    T parallelReduce(Map map, Combine combine, T identity,
+                     size_t threads = std::thread::hardware_concurrency()) const;
+    // Defined in avl_image.h, which callers include to use them.
+    void saveTo(const std::string& path) const;
+    void loadFrom(const std::string& path);
+
     virtual void remove(const Key& key);  // TODO
+    virtual size_t height() const;
+
+    // Order statistics; only available when NodeT is a CountedAVLNode.
+    size_t rank(const Key& key) const;
+    iterator select(size_t k);
+    const_iterator select(size_t k) const;
+    size_t countInRange(const Key& lo, const Key& hi) const;
 protected:
-    virtual void nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2);
+    virtual void nodeSwap( NodeT* n1, NodeT* n2);
+    virtual void onInsert(NodeT* node);
+    virtual const char* checkNode(const Node<Key, Value>* node,
+                                  size_t leftHeight, size_t rightHeight) const;
 
     // Add helper functions here
-    int8_t balanceFactor(AVLNode<Key, Value>* node);
-    int8_t getHeight(AVLNode<Key,Value>*ptr) const;   
-    void insert_fix(AVLNode<Key, Value>* p,AVLNode<Key, Value>* n); 
-    void removeFix(AVLNode<Key,Value>*p,int8_t diff);
-    void rotateRight(AVLNode<Key,Value>* p);   
-    void rotateLeft(AVLNode<Key,Value>* p);
-    void avlInsert(const std::pair<const Key, Value> &keyValuePair);   
-
-    void avlRemove(const Key& key);                                                                                 
+    int8_t balanceFactor(NodeT* node) const;
+    size_t getHeight(NodeT*ptr) const;
+    void insert_fix(NodeT* p,NodeT* n); 
+    void removeNode(NodeT* curr);
+    void removeFix(NodeT*p,int8_t diff);
+    void rotateRight(NodeT* p);   
+    void rotateLeft(NodeT* p);
+    NodeT* selectNode(size_t k) const;
+    template<typename InputIt>
+    void buildFromSorted(InputIt first, InputIt last, std::input_iterator_tag);
+    template<typename ForwardIt>
+    void buildFromSorted(ForwardIt first, ForwardIt last, std::forward_iterator_tag);
+    template<typename ForwardIt>
+    NodeT* buildBalanced(ForwardIt& it, ForwardIt last, size_t n);
+    template<typename InputIt>
+    void insertBatch(InputIt first, InputIt last, std::input_iterator_tag);
+    template<typename ForwardIt>
+    void insertBatch(ForwardIt first, ForwardIt last, std::forward_iterator_tag);
+    template<typename InputIt>
+    void eraseBatch(InputIt first, InputIt last, std::input_iterator_tag);
+    template<typename ForwardIt>
+    void eraseBatch(ForwardIt first, ForwardIt last, std::forward_iterator_tag);
+    using BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::kBatchWidth;
+
+    // Split and join work on detached subtrees and pass their heights
+    // along, since nodes only store balances.
+    size_t attach(NodeT* node, NodeT* left, size_t leftHeight, NodeT* right, size_t rightHeight);
+    NodeT* link(NodeT* left, size_t leftHeight, NodeT* node, NodeT* right, size_t rightHeight,
+                size_t& height);
+    NodeT* joinNodes(NodeT* left, size_t leftHeight, NodeT* node, NodeT* right, size_t rightHeight,
+                     size_t& height);
+    NodeT* splitNodes(NodeT* t, size_t h, const Key& key, NodeT*& less, size_t& lessHeight,
+                      NodeT*& greater, size_t& greaterHeight);
+    NodeT* splitLast(NodeT* t, size_t h, NodeT*& rest, size_t& restHeight);
+    NodeT* joinPair(NodeT* left, size_t leftHeight, NodeT* right, size_t rightHeight, size_t& height);
+
+    // The set operations recurse on both halves, in parallel on a pool
+    // while the subtree of this tree is at least kForkHeight high. Each
+    // returns how many keys the two trees had in common.
+    template<typename Merge>
+    NodeT* unionNodes(NodeT* a, size_t aHeight, NodeT* b, size_t bHeight, Merge& merge, TaskPool* pool,
+                      size_t& height, size_t& common);
+    template<typename Merge>
+    NodeT* intersectNodes(NodeT* a, size_t aHeight, NodeT* b, size_t bHeight, Merge& merge, TaskPool* pool,
+                          size_t& height, size_t& common);
+    NodeT* differenceNodes(NodeT* a, size_t aHeight, NodeT* b, size_t bHeight, TaskPool* pool,
+                           size_t& height, size_t& common);
+    template<typename F, typename G>
+    static void forkIf(TaskPool* pool, size_t height, F f, G g);
+    static const size_t kForkHeight = 12;
+
+    // parallelReduce splits by subtree, or by rank into runs of at most
+    // kReduceRun items when the nodes keep counts.
+    template<typename T, typename Map, typename Combine>
+    T reduceNodes(NodeT* node, size_t height, Map& map, Combine& combine, const T& identity,
+                  TaskPool* pool) const;
+    template<typename T, typename Map, typename Combine>
+    T reduceSerial(NodeT* node, Map& map, Combine& combine, T acc) const;
+    template<typename T, typename Map, typename Combine>
+    T reduceRanks(size_t lo, size_t hi, Map& map, Combine& combine, const T& identity,
+                  TaskPool* pool) const;
+    template<typename T, typename Map, typename Combine>
+    T reduceRankRun(NodeT* node, size_t lo, size_t hi, Map& map, Combine& combine, T acc) const;
+    static const size_t kReduceRun = 2048;
+
+    // Subtree count upkeep. These overloads do nothing for plain AVLNodes,
+    // so trees without counts pay nothing for them.
+    static size_t countOf(const AVLNode<Key, Value>* node);
+    static size_t countOf(const CountedAVLNode<Key, Value>* node);
+    static void pullCount(AVLNode<Key, Value>* node);
+    static void pullCount(CountedAVLNode<Key, Value>* node);
+    static void addCountToPath(AVLNode<Key, Value>* node, long diff);
+    static void addCountToPath(CountedAVLNode<Key, Value>* node, long diff);
+    static void swapCounts(AVLNode<Key, Value>* n1, AVLNode<Key, Value>* n2);
+    static void swapCounts(CountedAVLNode<Key, Value>* n1, CountedAVLNode<Key, Value>* n2);
+    static bool countMismatch(const AVLNode<Key, Value>* node);
+    static bool countMismatch(const CountedAVLNode<Key, Value>* node);
+    static bool hasCounts(const AVLNode<Key, Value>* node);
+    static bool hasCounts(const CountedAVLNode<Key, Value>* node);
 };
 
 
 
-/*
- * Recall: If key is already in the tree, you should updat
- * overwrite the current value with the updated value.
- */
-template<class Key, class Value>
-void AVLTree<Key, Value>::avlInsert(const std::pair<const Key, Value> &keyValuePair)
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+AVLTree<Key, Value, Alloc, NodeT, Compare>::AVLTree()
 {
-    
-    AVLNode<Key, Value> *newNode = new AVLNode<Key, Value>(keyValuePair.first, keyValuePair.second,nullptr);
-    if (this->root_ == nullptr){
-        this->root_ = newNode;
+
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+AVLTree<Key, Value, Alloc, NodeT, Compare>::AVLTree(const Compare& comp) :
+    BinarySearchTree<Key, Value, Alloc, NodeT, Compare>(comp)
+{
+
+}
+
+/**
+* Builds the tree from the pairs in [first, last); see buildFromSorted.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename InputIt>
+AVLTree<Key, Value, Alloc, NodeT, Compare>::AVLTree(InputIt first, InputIt last, const Compare& comp) :
+    BinarySearchTree<Key, Value, Alloc, NodeT, Compare>(comp)
+{
+    buildFromSorted(first, last);
+}
+
+/**
+* Replaces the contents of the tree with the pairs in [first, last), which
+* should be sorted by key. Sorted input is linked into a perfectly balanced
+* tree in O(n) with no comparisons against the tree and no rotations; for
+* equal keys the last pair wins, as with repeated inserts. Input that turns
+* out not to be sorted is inserted one pair at a time instead.
+* Single-pass input iterators are first copied into a vector.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename InputIt>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::buildFromSorted(InputIt first, InputIt last)
+{
+    buildFromSorted(first, last, typename std::iterator_traits<InputIt>::iterator_category());
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename InputIt>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::buildFromSorted(InputIt first, InputIt last, std::input_iterator_tag)
+{
+    std::vector<std::pair<Key, Value> > items(first, last);
+    buildFromSorted(items.begin(), items.end(), std::forward_iterator_tag());
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename ForwardIt>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::buildFromSorted(ForwardIt first, ForwardIt last, std::forward_iterator_tag)
+{
+    this->clear();
+    // one pass to count the distinct keys and make sure they are sorted
+    size_t distinct = 0;
+    for(ForwardIt it = first, prev = first; it != last; prev = it, ++it){
+        if(it == first || this->comp_(prev->first, it->first)){
+            ++distinct;
+        }
+        else if(this->comp_(it->first, prev->first)){
+            for(; first != last; ++first)
+                this->insert_or_assign(first->first, first->second);
+            return;
+        }
     }
-    else{
-        Node<Key, Value> * curr = this->root_;
-        while(curr != nullptr){
-            if (keyValuePair.first < curr->getKey()){
-                if (curr->getLeft() == nullptr){
-                    curr->setLeft(newNode);
-                    newNode->setParent(curr);
-                    break;
-                }
-                else{
-                    curr = curr->getLeft();
-                }
+    this->root_ = buildBalanced(first, last, distinct);
+    this->size_ = distinct;
+    this->sizeKnown_ = true;
+}
+
+/**
+* Links the next n distinct keys from it into a subtree and returns its
+* root. The left side gets (n-1)/2 keys and the right side the rest, so a
+* subtree of m keys is exactly floor(log2 m) + 1 high and every balance
+* is known without looking at the children. Recursion depth is O(log n).
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename ForwardIt>
+NodeT* AVLTree<Key, Value, Alloc, NodeT, Compare>::buildBalanced(ForwardIt& it, ForwardIt last, size_t n)
+{
+    if(n == 0)
+        return nullptr;
+    size_t leftCount = (n - 1) / 2;
+    size_t rightCount = n - 1 - leftCount;
+    NodeT* left = buildBalanced(it, last, leftCount);
+
+    // the last pair of a run of equal keys wins
+    ForwardIt item = it;
+    for(++it; it != last && !this->comp_(item->first, it->first); ++it)
+        item = it;
+    NodeT* node = this->alloc_.template create<NodeT>(item->first, item->second, nullptr);
+
+    NodeT* right = buildBalanced(it, last, rightCount);
+    node->setLeft(left);
+    node->setRight(right);
+    if(left != nullptr)
+        left->setParent(node);
+    if(right != nullptr)
+        right->setParent(node);
+    // heights are floor(log2 count) + 1 and differ by at most one
+    size_t leftHeight = 0, rightHeight = 0;
+    for(size_t c = leftCount; c != 0; c >>= 1) ++leftHeight;
+    for(size_t c = rightCount; c != 0; c >>= 1) ++rightHeight;
+    node->setBalance((int8_t)(rightHeight - leftHeight));
+    pullCount(node);
+    return node;
+}
+
+/**
+* Inserts the pairs in [first, last), overwriting the values of keys that
+* are already present, as a loop of insert calls would. For equal keys in
+* the batch the last pair wins.
+*
+* The batch is searched kBatchWidth keys at a time with the interleaved,
+* prefetched descents of findGroup, so the cache misses of a group
+* overlap; the group is then applied in order over the now cached paths.
+* Keys found present only have their values assigned, and an absent key
+* is hung straight at the slot its descent ended at, unless an earlier
+* insert of the group took it or fell between it and the key. Sorted
+* batches also share the upper parts of their paths, and only need the
+* last key added checked against the slot; unsorted groups check every
+* key added before.
+* Batching saves descents and cache misses, not rebalancing: every new
+* node is rebalanced as a single insert would be, so the rotations are
+* the same as for a loop of inserts.
+* Single-pass input iterators are first copied into a vector.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename InputIt>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::insertBatch(InputIt first, InputIt last)
+{
+    insertBatch(first, last, typename std::iterator_traits<InputIt>::iterator_category());
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename InputIt>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::insertBatch(InputIt first, InputIt last, std::input_iterator_tag)
+{
+    std::vector<std::pair<Key, Value> > items(first, last);
+    insertBatch(items.begin(), items.end(), std::random_access_iterator_tag());
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename ForwardIt>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::insertBatch(ForwardIt first, ForwardIt last, std::forward_iterator_tag)
+{
+    const Key* keys[kBatchWidth];
+    Node<Key, Value>* found[kBatchWidth];
+    Node<Key, Value>* slots[kBatchWidth];
+    const Key* added[kBatchWidth];
+    while(first != last){
+        ForwardIt group = first;
+        size_t n = 0;
+        for(; n < kBatchWidth && first != last; ++n, ++first)
+            keys[n] = &first->first;
+        this->findGroup(keys, n, found, slots);
+        // in a non-decreasing group the last key added is the greatest,
+        // so it is the only one that can lie between a slot and its key
+        bool sorted = true;
+        for(size_t i = 1; i < n && sorted; ++i)
+            sorted = !this->comp_(*keys[i], *keys[i - 1]);
+        // inserts never free a node, so the ones found are still there
+        size_t addedCount = 0;
+        for(size_t i = 0; i < n; ++i, ++group){
+            if(found[i] != nullptr){
+                found[i]->getValue() = group->second;
+                continue;
             }
-            else if (keyValuePair.first > curr->getKey()){
-                if (curr->getRight() == nullptr){
-                    curr->setRight(newNode);
-                    newNode->setParent(curr);
-                    break;
-                }
-                else{
-                    curr = curr->getRight();
-                }
+            // rotations keep the order of the nodes, so the slot is still
+            // the key's if it is empty and no key added since lies between
+            Node<Key, Value>* parent = slots[i];
+            bool isLeft = parent != nullptr && this->comp_(group->first, parent->getKey());
+            bool valid = parent == nullptr ? this->root_ == nullptr
+                : (isLeft ? parent->getLeft() : parent->getRight()) == nullptr;
+            for(size_t j = sorted && addedCount > 0 ? addedCount - 1 : 0; j < addedCount && valid; ++j){
+                const Key& other = *added[j];
+                valid = isLeft ? !(this->comp_(other, parent->getKey()) && !this->comp_(other, group->first))
+                               : !(this->comp_(parent->getKey(), other) && !this->comp_(group->first, other));
+            }
+            if(valid){
+                NodeT* node = this->alloc_.template create<NodeT>(static_cast<NodeT*>(parent),
+                                                                  group->first, group->second);
+                this->linkNode(node, parent, isLeft);
             }
             else{
-                delete newNode;
-                curr->setValue(keyValuePair.second);
-                break;
+                this->insert_or_assign(group->first, group->second);
             }
+            added[addedCount++] = &group->first;
         }
     }
 }
 
-template<class Key, class Value>
-int8_t AVLTree<Key, Value>::balanceFactor(AVLNode<Key, Value>* node)
+/**
+* Removes the keys in [first, last) that are present, as a loop of remove
+* calls would. Like insertBatch, the keys are looked up a group at a time
+* with interleaved descents, and the nodes found are then unlinked
+* directly, without a second descent. The rotations are those of a loop
+* of removes.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename InputIt>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::eraseBatch(InputIt first, InputIt last)
+{
+    eraseBatch(first, last, typename std::iterator_traits<InputIt>::iterator_category());
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename InputIt>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::eraseBatch(InputIt first, InputIt last, std::input_iterator_tag)
+{
+    std::vector<Key> keys(first, last);
+    eraseBatch(keys.begin(), keys.end(), std::random_access_iterator_tag());
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename ForwardIt>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::eraseBatch(ForwardIt first, ForwardIt last, std::forward_iterator_tag)
+{
+    if(this->root_ == nullptr)
+        return;
+    const Key* keys[kBatchWidth];
+    Node<Key, Value>* found[kBatchWidth];
+    while(first != last){
+        size_t n = 0;
+        for(; n < kBatchWidth && first != last; ++n, ++first)
+            keys[n] = &*first;
+        this->findGroup(keys, n, found);
+        // removing a node moves others but frees no other node, so the
+        // ones found stay valid unless their key repeats in the group
+        for(size_t i = 0; i < n; ++i){
+            bool repeated = false;
+            for(size_t j = 0; j < i && !repeated; ++j)
+                repeated = found[j] == found[i];
+            if(found[i] != nullptr && !repeated)
+                removeNode(static_cast<NodeT*>(found[i]));
+        }
+    }
+}
+
+/**
+* Replaces the contents of this tree by those of left, the pivot item and
+* right, in that order: every key in left must be less than the pivot's
+* key and every key in right greater, or std::invalid_argument is thrown.
+* The nodes of left and right are moved, not copied, and both trees are
+* left empty; this tree may be one of them.
+*
+* Runs in O(log n): the shorter tree is hung at the matching height on
+* the spine of the taller one and rotations on the way back up restore
+* the balance.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::join(AVLTree& left, const std::pair<const Key, Value>& pivot,
+                                                      AVLTree& right)
+{
+    static_assert(Alloc::kSharesNodes, "join moves nodes between trees, which this allocator does not allow");
+    if((left.root_ != nullptr && !this->comp_(left.getLargestNode()->getKey(), pivot.first)) ||
+       (right.root_ != nullptr && !this->comp_(pivot.first, right.getSmallestNode()->getKey())))
+        throw std::invalid_argument("join: keys out of order");
+    NodeT* node = this->alloc_.template create<NodeT>(pivot.first, pivot.second, nullptr);
+    NodeT* l = static_cast<NodeT*>(left.root_);
+    NodeT* r = static_cast<NodeT*>(right.root_);
+    size_t size = left.size_ + right.size_ + 1;
+    bool known = left.sizeKnown_ && right.sizeKnown_;
+    left.root_ = right.root_ = nullptr;
+    left.size_ = right.size_ = 0;
+    left.sizeKnown_ = right.sizeKnown_ = true;
+    this->clear();
+
+    size_t height;
+    this->root_ = joinNodes(l, getHeight(l), node, r, getHeight(r), height);
+    this->root_->setParent(nullptr);
+    this->size_ = size;
+    this->sizeKnown_ = known;
+}
+
+/**
+* Same as above without a pivot: every key in left must be less than
+* every key in right. The largest node of left is split off and takes
+* the pivot's place, so this is O(log n) as well.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::join(AVLTree& left, AVLTree& right)
+{
+    static_assert(Alloc::kSharesNodes, "join moves nodes between trees, which this allocator does not allow");
+    if(left.root_ != nullptr && right.root_ != nullptr &&
+       !this->comp_(left.getLargestNode()->getKey(), right.getSmallestNode()->getKey()))
+        throw std::invalid_argument("join: keys out of order");
+    NodeT* l = static_cast<NodeT*>(left.root_);
+    NodeT* r = static_cast<NodeT*>(right.root_);
+    size_t size = left.size_ + right.size_;
+    bool known = left.sizeKnown_ && right.sizeKnown_;
+    left.root_ = right.root_ = nullptr;
+    left.size_ = right.size_ = 0;
+    left.sizeKnown_ = right.sizeKnown_ = true;
+    this->clear();
+
+    size_t height;
+    this->root_ = joinPair(l, getHeight(l), r, getHeight(r), height);
+    if(this->root_ != nullptr)
+        this->root_->setParent(nullptr);
+    this->size_ = size;
+    this->sizeKnown_ = known;
+}
+
+/**
+* Moves the items with keys less than key into less and the rest into
+* greater, replacing what those trees held, and leaves this tree empty.
+* less and greater must be different trees; either may be this one.
+*
+* The path to key is cut and the pieces hanging off it are joined back
+* up into two trees, in O(log n) in all. An OrderStatisticTree reads the
+* sizes of the halves off its counts. A plain AVLTree leaves them
+* uncounted instead, and the first size() call on each half counts it;
+* joins and set operations carry an uncounted size along, and inserts
+* and removes work as usual.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::split(const Key& key, AVLTree& less, AVLTree& greater)
+{
+    static_assert(Alloc::kSharesNodes, "split moves nodes between trees, which this allocator does not allow");
+    NodeT* t = static_cast<NodeT*>(this->root_);
+    size_t size = this->size_;
+    bool known = this->sizeKnown_ && hasCounts(t);
+    this->root_ = nullptr;
+    this->size_ = 0;
+    this->sizeKnown_ = true;
+    less.clear();
+    greater.clear();
+
+    NodeT* l;
+    NodeT* g;
+    size_t lh, gh;
+    NodeT* mid = splitNodes(t, getHeight(t), key, l, lh, g, gh);
+    if(mid != nullptr)
+        g = joinNodes(nullptr, 0, mid, g, gh, gh);
+    if(l != nullptr)
+        l->setParent(nullptr);
+    if(g != nullptr)
+        g->setParent(nullptr);
+    less.root_ = l;
+    greater.root_ = g;
+    if(known){
+        less.size_ = countOf(l);
+        greater.size_ = size - less.size_;
+    }
+    else{
+        less.sizeKnown_ = greater.sizeKnown_ = false;
+    }
+}
+
+/**
+* Makes left and right the children of node, whose balance follows from
+* their heights, and returns the height of the result.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+size_t AVLTree<Key, Value, Alloc, NodeT, Compare>::attach(NodeT* node, NodeT* left, size_t leftHeight,
+                                                          NodeT* right, size_t rightHeight)
+{
+    node->setLeft(left);
+    node->setRight(right);
+    if(left != nullptr)
+        left->setParent(node);
+    if(right != nullptr)
+        right->setParent(node);
+    node->setBalance((int8_t)((long)rightHeight - (long)leftHeight));
+    pullCount(node);
+    return std::max(leftHeight, rightHeight) + 1;
+}
+
+/**
+* Links node over two AVL subtrees whose heights differ by at most two
+* and returns the root of the result, after a single or double rotation
+* if the difference is two.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+NodeT* AVLTree<Key, Value, Alloc, NodeT, Compare>::link(NodeT* left, size_t leftHeight, NodeT* node,
+                                                        NodeT* right, size_t rightHeight, size_t& height)
+{
+    if(rightHeight > leftHeight + 1){
+        NodeT* inner = right->getLeft();
+        NodeT* outer = right->getRight();
+        size_t innerHeight = rightHeight - (right->getBalance() > 0 ? 2 : 1);
+        size_t outerHeight = rightHeight - (right->getBalance() < 0 ? 2 : 1);
+        if(outerHeight >= innerHeight){
+            size_t nodeHeight = attach(node, left, leftHeight, inner, innerHeight);
+            height = attach(right, node, nodeHeight, outer, outerHeight);
+            return right;
+        }
+        NodeT* a = inner->getLeft();
+        NodeT* b = inner->getRight();
+        size_t aHeight = innerHeight - (inner->getBalance() > 0 ? 2 : 1);
+        size_t bHeight = innerHeight - (inner->getBalance() < 0 ? 2 : 1);
+        size_t nodeHeight = attach(node, left, leftHeight, a, aHeight);
+        size_t rHeight = attach(right, b, bHeight, outer, outerHeight);
+        height = attach(inner, node, nodeHeight, right, rHeight);
+        return inner;
+    }
+    if(leftHeight > rightHeight + 1){
+        NodeT* inner = left->getRight();
+        NodeT* outer = left->getLeft();
+        size_t innerHeight = leftHeight - (left->getBalance() < 0 ? 2 : 1);
+        size_t outerHeight = leftHeight - (left->getBalance() > 0 ? 2 : 1);
+        if(outerHeight >= innerHeight){
+            size_t nodeHeight = attach(node, inner, innerHeight, right, rightHeight);
+            height = attach(left, outer, outerHeight, node, nodeHeight);
+            return left;
+        }
+        NodeT* a = inner->getLeft();
+        NodeT* b = inner->getRight();
+        size_t aHeight = innerHeight - (inner->getBalance() > 0 ? 2 : 1);
+        size_t bHeight = innerHeight - (inner->getBalance() < 0 ? 2 : 1);
+        size_t lHeight = attach(left, outer, outerHeight, a, aHeight);
+        size_t nodeHeight = attach(node, b, bHeight, right, rightHeight);
+        height = attach(inner, left, lHeight, node, nodeHeight);
+        return inner;
+    }
+    height = attach(node, left, leftHeight, right, rightHeight);
+    return node;
+}
+
+/**
+* Joins left, node and right (keys in that order) into one AVL subtree:
+* descends the taller side until the heights are within one, links node
+* there and rebalances on the way back. O(|leftHeight - rightHeight| + 1).
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+NodeT* AVLTree<Key, Value, Alloc, NodeT, Compare>::joinNodes(NodeT* left, size_t leftHeight, NodeT* node,
+                                                             NodeT* right, size_t rightHeight, size_t& height)
+{
+    if(leftHeight > rightHeight + 1){
+        size_t llHeight = leftHeight - (left->getBalance() > 0 ? 2 : 1);
+        size_t lrHeight = leftHeight - (left->getBalance() < 0 ? 2 : 1);
+        size_t joinedHeight;
+        NodeT* joined = joinNodes(left->getRight(), lrHeight, node, right, rightHeight, joinedHeight);
+        return link(left->getLeft(), llHeight, left, joined, joinedHeight, height);
+    }
+    if(rightHeight > leftHeight + 1){
+        size_t rlHeight = rightHeight - (right->getBalance() > 0 ? 2 : 1);
+        size_t rrHeight = rightHeight - (right->getBalance() < 0 ? 2 : 1);
+        size_t joinedHeight;
+        NodeT* joined = joinNodes(left, leftHeight, node, right->getLeft(), rlHeight, joinedHeight);
+        return link(joined, joinedHeight, right, right->getRight(), rrHeight, height);
+    }
+    height = attach(node, left, leftHeight, right, rightHeight);
+    return node;
+}
+
+/**
+* Splits the subtree t of height h into the keys less than key and those
+* greater, and returns the node holding key, unlinked, or nullptr. The
+* roots of the halves may still point at their old parents.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+NodeT* AVLTree<Key, Value, Alloc, NodeT, Compare>::splitNodes(NodeT* t, size_t h, const Key& key,
+                                                              NodeT*& less, size_t& lessHeight,
+                                                              NodeT*& greater, size_t& greaterHeight)
+{
+    if(t == nullptr){
+        less = greater = nullptr;
+        lessHeight = greaterHeight = 0;
+        return nullptr;
+    }
+    NodeT* left = t->getLeft();
+    NodeT* right = t->getRight();
+    size_t leftHeight = h - (t->getBalance() > 0 ? 2 : 1);
+    size_t rightHeight = h - (t->getBalance() < 0 ? 2 : 1);
+    NodeT* part;
+    size_t partHeight;
+    if(this->comp_(key, t->getKey())){
+        NodeT* mid = splitNodes(left, leftHeight, key, less, lessHeight, part, partHeight);
+        greater = joinNodes(part, partHeight, t, right, rightHeight, greaterHeight);
+        return mid;
+    }
+    if(this->comp_(t->getKey(), key)){
+        NodeT* mid = splitNodes(right, rightHeight, key, part, partHeight, greater, greaterHeight);
+        less = joinNodes(left, leftHeight, t, part, partHeight, lessHeight);
+        return mid;
+    }
+    less = left;
+    lessHeight = leftHeight;
+    greater = right;
+    greaterHeight = rightHeight;
+    t->setLeft(nullptr);
+    t->setRight(nullptr);
+    return t;
+}
+
+/**
+* Unlinks the largest node of the subtree t of height h and returns it;
+* rest is what remains, rebalanced.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+NodeT* AVLTree<Key, Value, Alloc, NodeT, Compare>::splitLast(NodeT* t, size_t h, NodeT*& rest, size_t& restHeight)
+{
+    NodeT* left = t->getLeft();
+    NodeT* right = t->getRight();
+    size_t leftHeight = h - (t->getBalance() > 0 ? 2 : 1);
+    if(right == nullptr){
+        rest = left;
+        restHeight = leftHeight;
+        t->setLeft(nullptr);
+        return t;
+    }
+    NodeT* part;
+    size_t partHeight;
+    NodeT* last = splitLast(right, h - (t->getBalance() < 0 ? 2 : 1), part, partHeight);
+    rest = joinNodes(left, leftHeight, t, part, partHeight, restHeight);
+    return last;
+}
+
+/**
+* Joins two subtrees without a pivot (keys of left before those of right)
+* by splitting off the largest node of left to take its place.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+NodeT* AVLTree<Key, Value, Alloc, NodeT, Compare>::joinPair(NodeT* left, size_t leftHeight,
+                                                            NodeT* right, size_t rightHeight, size_t& height)
+{
+    if(left == nullptr){
+        height = rightHeight;
+        return right;
+    }
+    NodeT* rest;
+    size_t restHeight;
+    NodeT* last = splitLast(left, leftHeight, rest, restHeight);
+    return joinNodes(rest, restHeight, last, right, rightHeight, height);
+}
+
+/**
+* Moves every item of other into this tree and leaves other empty. For a
+* key both trees hold, merge(ours, theirs) decides the value that is kept
+* (see KeepOurs) and the other tree's node is freed.
+*
+* This is the join-based union: other is split at the root key of this
+* tree, the two halves are united with the two subtrees, and the results
+* are joined around the root. Nodes are relinked, never copied. That
+* takes O(m log(n/m + 1)) work for trees of m <= n items, and the two
+* halves are independent, so with a pool they run in parallel with
+* O(log^2 n) depth. Compare and merge must not throw.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename Merge>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::unionWith(AVLTree& other, Merge merge, TaskPool* pool)
+{
+    static_assert(Alloc::kSharesNodes, "unionWith moves nodes between trees, which this allocator does not allow");
+    if(&other == this)
+        return;
+    NodeT* a = static_cast<NodeT*>(this->root_);
+    NodeT* b = static_cast<NodeT*>(other.root_);
+    size_t size = this->size_ + other.size_;
+    bool known = this->sizeKnown_ && other.sizeKnown_;
+    other.root_ = nullptr;
+    other.size_ = 0;
+    other.sizeKnown_ = true;
+
+    size_t height, common;
+    this->root_ = unionNodes(a, getHeight(a), b, getHeight(b), merge, pool, height, common);
+    if(this->root_ != nullptr)
+        this->root_->setParent(nullptr);
+    this->size_ = size - common;
+    this->sizeKnown_ = known;
+}
+
+/**
+* Keeps only the keys that other holds too, merging their values as
+* unionWith does, and leaves other empty. Every node that is not kept is
+* freed. Same cost and requirements as unionWith.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename Merge>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::intersectWith(AVLTree& other, Merge merge, TaskPool* pool)
+{
+    static_assert(Alloc::kSharesNodes, "intersectWith frees nodes of another tree, which this allocator does not allow");
+    if(&other == this)
+        return;
+    NodeT* a = static_cast<NodeT*>(this->root_);
+    NodeT* b = static_cast<NodeT*>(other.root_);
+    other.root_ = nullptr;
+    other.size_ = 0;
+    other.sizeKnown_ = true;
+
+    size_t height, common;
+    this->root_ = intersectNodes(a, getHeight(a), b, getHeight(b), merge, pool, height, common);
+    if(this->root_ != nullptr)
+        this->root_->setParent(nullptr);
+    this->size_ = common;
+    this->sizeKnown_ = true;
+}
+
+/**
+* Removes the keys that other holds and leaves other empty. Same cost and
+* requirements as unionWith.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::differenceWith(AVLTree& other, TaskPool* pool)
+{
+    static_assert(Alloc::kSharesNodes, "differenceWith frees nodes of another tree, which this allocator does not allow");
+    if(&other == this){
+        this->clear();
+        return;
+    }
+    NodeT* a = static_cast<NodeT*>(this->root_);
+    NodeT* b = static_cast<NodeT*>(other.root_);
+    size_t size = this->size_;
+    other.root_ = nullptr;
+    other.size_ = 0;
+    other.sizeKnown_ = true;
+
+    size_t height, common;
+    this->root_ = differenceNodes(a, getHeight(a), b, getHeight(b), pool, height, common);
+    if(this->root_ != nullptr)
+        this->root_->setParent(nullptr);
+    this->size_ = size - common;
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename Merge>
+NodeT* AVLTree<Key, Value, Alloc, NodeT, Compare>::unionNodes(NodeT* a, size_t aHeight, NodeT* b, size_t bHeight,
+                                                              Merge& merge, TaskPool* pool,
+                                                              size_t& height, size_t& common)
+{
+    if(a == nullptr || b == nullptr){
+        height = a == nullptr ? bHeight : aHeight;
+        common = 0;
+        return a == nullptr ? b : a;
+    }
+    NodeT* bLess;
+    NodeT* bGreater;
+    size_t bLessHeight, bGreaterHeight;
+    NodeT* match = splitNodes(b, bHeight, a->getKey(), bLess, bLessHeight, bGreater, bGreaterHeight);
+    NodeT* aLeft = a->getLeft();
+    NodeT* aRight = a->getRight();
+    size_t aLeftHeight = aHeight - (a->getBalance() > 0 ? 2 : 1);
+    size_t aRightHeight = aHeight - (a->getBalance() < 0 ? 2 : 1);
+
+    NodeT* left;
+    NodeT* right;
+    size_t leftHeight, rightHeight, leftCommon, rightCommon;
+    forkIf(pool, aHeight,
+           [&]() { left = unionNodes(aLeft, aLeftHeight, bLess, bLessHeight, merge, pool, leftHeight, leftCommon); },
+           [&]() { right = unionNodes(aRight, aRightHeight, bGreater, bGreaterHeight, merge, pool,
+                                      rightHeight, rightCommon); });
+    common = leftCommon + rightCommon;
+    if(match != nullptr){
+        merge(a->getValue(), match->getValue());
+        this->alloc_.destroy(match);
+        ++common;
+    }
+    return joinNodes(left, leftHeight, a, right, rightHeight, height);
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename Merge>
+NodeT* AVLTree<Key, Value, Alloc, NodeT, Compare>::intersectNodes(NodeT* a, size_t aHeight, NodeT* b, size_t bHeight,
+                                                                  Merge& merge, TaskPool* pool,
+                                                                  size_t& height, size_t& common)
+{
+    if(a == nullptr || b == nullptr){
+        this->deleteNodes(a);
+        this->deleteNodes(b);
+        height = common = 0;
+        return nullptr;
+    }
+    NodeT* bLess;
+    NodeT* bGreater;
+    size_t bLessHeight, bGreaterHeight;
+    NodeT* match = splitNodes(b, bHeight, a->getKey(), bLess, bLessHeight, bGreater, bGreaterHeight);
+    NodeT* aLeft = a->getLeft();
+    NodeT* aRight = a->getRight();
+    size_t aLeftHeight = aHeight - (a->getBalance() > 0 ? 2 : 1);
+    size_t aRightHeight = aHeight - (a->getBalance() < 0 ? 2 : 1);
+
+    NodeT* left;
+    NodeT* right;
+    size_t leftHeight, rightHeight, leftCommon, rightCommon;
+    forkIf(pool, aHeight,
+           [&]() { left = intersectNodes(aLeft, aLeftHeight, bLess, bLessHeight, merge, pool,
+                                         leftHeight, leftCommon); },
+           [&]() { right = intersectNodes(aRight, aRightHeight, bGreater, bGreaterHeight, merge, pool,
+                                          rightHeight, rightCommon); });
+    common = leftCommon + rightCommon;
+    if(match == nullptr){
+        this->alloc_.destroy(a);
+        return joinPair(left, leftHeight, right, rightHeight, height);
+    }
+    merge(a->getValue(), match->getValue());
+    this->alloc_.destroy(match);
+    ++common;
+    return joinNodes(left, leftHeight, a, right, rightHeight, height);
+}
+
+/**
+* Here a is split at each root key of b instead, since it is b's keys
+* that have to be looked for in a.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+NodeT* AVLTree<Key, Value, Alloc, NodeT, Compare>::differenceNodes(NodeT* a, size_t aHeight, NodeT* b, size_t bHeight,
+                                                                   TaskPool* pool, size_t& height, size_t& common)
+{
+    if(a == nullptr || b == nullptr){
+        this->deleteNodes(b);
+        height = a == nullptr ? 0 : aHeight;
+        common = 0;
+        return a;
+    }
+    NodeT* aLess;
+    NodeT* aGreater;
+    size_t aLessHeight, aGreaterHeight;
+    NodeT* match = splitNodes(a, aHeight, b->getKey(), aLess, aLessHeight, aGreater, aGreaterHeight);
+    NodeT* bLeft = b->getLeft();
+    NodeT* bRight = b->getRight();
+    size_t bLeftHeight = bHeight - (b->getBalance() > 0 ? 2 : 1);
+    size_t bRightHeight = bHeight - (b->getBalance() < 0 ? 2 : 1);
+    this->alloc_.destroy(b);
+
+    NodeT* left;
+    NodeT* right;
+    size_t leftHeight, rightHeight, leftCommon, rightCommon;
+    forkIf(pool, std::max(aLessHeight, aGreaterHeight),
+           [&]() { left = differenceNodes(aLess, aLessHeight, bLeft, bLeftHeight, pool, leftHeight, leftCommon); },
+           [&]() { right = differenceNodes(aGreater, aGreaterHeight, bRight, bRightHeight, pool,
+                                           rightHeight, rightCommon); });
+    common = leftCommon + rightCommon;
+    if(match != nullptr){
+        this->alloc_.destroy(match);
+        ++common;
+    }
+    return joinPair(left, leftHeight, right, rightHeight, height);
+}
+
+/**
+* Runs f and g on the pool when there is one and the subtree is high
+* enough to be worth a task, and one after the other otherwise.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename F, typename G>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::forkIf(TaskPool* pool, size_t height, F f, G g)
+{
+    if(pool != nullptr && height >= kForkHeight){
+        pool->invoke(f, g);
+    }
+    else{
+        f();
+        g();
+    }
+}
+
+/**
+* Calls fn(item) once for every item, on the pool's threads and in no
+* particular order, and returns when all calls are done. fn must be safe
+* to call concurrently; the tree must not change meanwhile. See
+* parallelReduce for how the work is split.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename Function>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::parallelForEach(Function fn, TaskPool& pool) const
+{
+    parallelReduce([&fn](const std::pair<const Key, Value>& item) { fn(item); return false; },
+                   [](bool, bool) { return false; }, false, pool);
+}
+
+/**
+* Same, on a pool of the given number of threads made for the call.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename Function>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::parallelForEach(Function fn, size_t threads) const
+{
+    TaskPool pool(threads);
+    parallelForEach(fn, pool);
+}
+
+/**
+* Returns combine(...combine(combine(identity, map(first)), map(second))...),
+* the items taken in key order, computed in parallel on the pool. combine
+* must be associative and identity its identity, since the parts are
+* reduced separately, each starting from identity; it need not be
+* commutative, as the parts are combined in order. map and combine must
+* be safe to call concurrently; the tree must not change meanwhile.
+*
+* The tree is cut along its own shape: the two subtrees of a node are
+* reduced in parallel while they are at least kForkHeight high, and
+* serially below that. AVL balance keeps sibling subtrees within a
+* constant factor of each other. With CountedAVLNodes the cuts are
+* exact instead: ranks are halved until runs of kReduceRun items remain,
+* each found and reduced in one descent.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename T, typename Map, typename Combine>
+T AVLTree<Key, Value, Alloc, NodeT, Compare>::parallelReduce(Map map, Combine combine, T identity,
+                                                            TaskPool& pool) const
+{
+    NodeT* root = static_cast<NodeT*>(this->root_);
+    if(hasCounts(root))
+        return reduceRanks(0, this->size(), map, combine, identity, &pool);
+    return reduceNodes(root, getHeight(root), map, combine, identity, &pool);
+}
+
+/**
+* Same, on a pool of the given number of threads made for the call.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename T, typename Map, typename Combine>
+T AVLTree<Key, Value, Alloc, NodeT, Compare>::parallelReduce(Map map, Combine combine, T identity,
+                                                            size_t threads) const
+{
+    TaskPool pool(threads);
+    return parallelReduce(map, combine, identity, pool);
+}
+
+/**
+* Reduces the subtree at node, whose height is given. The heights of the
+* children follow from the balance.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename T, typename Map, typename Combine>
+T AVLTree<Key, Value, Alloc, NodeT, Compare>::reduceNodes(NodeT* node, size_t height, Map& map,
+                                                         Combine& combine, const T& identity,
+                                                         TaskPool* pool) const
 {
     if(node == nullptr)
-        return 0;
-    int8_t left = getHeight(node->getLeft());
-    int8_t right = getHeight(node->getRight());
-    // if(node->getLeft() == nullptr)
-    //     left = -1;
-    // if(node->getRight() == nullptr)
-    //     right = -1;
-    return right-left;
+        return identity;
+    if(height < kForkHeight)
+        return reduceSerial(node, map, combine, identity);
+    size_t leftHeight = node->getBalance() > 0 ? height - 2 : height - 1;
+    size_t rightHeight = node->getBalance() < 0 ? height - 2 : height - 1;
+    T left = identity;
+    T right = identity;
+    forkIf(pool, height,
+        [&]() { left = reduceNodes(node->getLeft(), leftHeight, map, combine, identity, pool); },
+        [&]() {
+            const Node<Key, Value>* item = node;
+            right = combine(map(item->getItem()),
+                            reduceNodes(node->getRight(), rightHeight, map, combine, identity, pool));
+        });
+    return combine(left, right);
 }
 
-template<class Key, class Value>
-int8_t AVLTree<Key, Value>::getHeight(AVLNode<Key,Value>*ptr) const
+/**
+* Folds the subtree at node into acc in key order, recursing no deeper
+* than the subtree is high.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename T, typename Map, typename Combine>
+T AVLTree<Key, Value, Alloc, NodeT, Compare>::reduceSerial(NodeT* node, Map& map, Combine& combine, T acc) const
+{
+    while(node != nullptr){
+        acc = reduceSerial(node->getLeft(), map, combine, acc);
+        acc = combine(acc, map(static_cast<const Node<Key, Value>*>(node)->getItem()));
+        node = node->getRight();
+    }
+    return acc;
+}
+
+/**
+* Reduces the items of rank lo to hi - 1, halving the range on the pool
+* down to runs of kReduceRun.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename T, typename Map, typename Combine>
+T AVLTree<Key, Value, Alloc, NodeT, Compare>::reduceRanks(size_t lo, size_t hi, Map& map,
+                                                         Combine& combine, const T& identity,
+                                                         TaskPool* pool) const
+{
+    if(hi - lo <= kReduceRun)
+        return reduceRankRun(static_cast<NodeT*>(this->root_), lo, hi, map, combine, identity);
+    size_t mid = lo + (hi - lo) / 2;
+    T left = identity;
+    T right = identity;
+    pool->invoke([&]() { left = reduceRanks(lo, mid, map, combine, identity, pool); },
+                 [&]() { right = reduceRanks(mid, hi, map, combine, identity, pool); });
+    return combine(left, right);
+}
+
+/**
+* Folds the items of rank lo to hi - 1 within the subtree at node into
+* acc in key order. Only the subtrees the range overlaps are entered, so
+* this costs the run length plus the height.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename T, typename Map, typename Combine>
+T AVLTree<Key, Value, Alloc, NodeT, Compare>::reduceRankRun(NodeT* node, size_t lo, size_t hi, Map& map,
+                                                           Combine& combine, T acc) const
+{
+    while(node != nullptr && lo < hi){
+        size_t leftCount = countOf(node->getLeft());
+        if(lo < leftCount)
+            acc = reduceRankRun(node->getLeft(), lo, std::min(hi, leftCount), map, combine, acc);
+        if(hi <= leftCount)
+            break;
+        if(lo <= leftCount){
+            const Node<Key, Value>* item = node;
+            acc = combine(acc, map(item->getItem()));
+        }
+        lo = lo > leftCount ? lo - leftCount - 1 : 0;
+        hi -= leftCount + 1;
+        node = node->getRight();
+    }
+    return acc;
+}
+
+/**
+* Returns the node's balance (height of right minus height of left subtree).
+* insert/remove keep balance_ up to date, so this is O(1).
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+int8_t AVLTree<Key, Value, Alloc, NodeT, Compare>::balanceFactor(NodeT* node) const
 {
-    if(ptr == nullptr)
+    if(node == nullptr)
         return 0;
-    int8_t left = getHeight(ptr->getLeft());
-    int8_t right = getHeight(ptr->getRight());
-    if(left > right)
-        return left + 1;
-    else
-        return right + 1;
+    return node->getBalance();
 }
 
-template<class Key, class Value>
-void AVLTree<Key, Value>::rotateLeft(AVLNode<Key,Value>* x){
-    AVLNode<Key,Value>* y = x->getRight();
-    AVLNode<Key,Value>* z = y->getLeft();
-    AVLNode<Key,Value>* p = x->getParent();
+/**
+* Returns the height of the subtree at ptr in O(log n): in a valid AVL tree
+* the height is one more than that of the taller child, and the balance
+* says which child that is.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+size_t AVLTree<Key, Value, Alloc, NodeT, Compare>::getHeight(NodeT*ptr) const
+{
+    size_t height = 0;
+    while(ptr != nullptr){
+        ++height;
+        ptr = ptr->getBalance() > 0 ? ptr->getRight() : ptr->getLeft();
+    }
+    return height;
+}
+
+/**
+* Returns the height of the tree in O(log n).
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+size_t AVLTree<Key, Value, Alloc, NodeT, Compare>::height() const
+{
+    return getHeight(static_cast<NodeT*>(this->root_));
+}
+
+/**
+* validate() hook: the stored balance must be within [-1, 1] and match the
+* actual subtree heights.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+const char* AVLTree<Key, Value, Alloc, NodeT, Compare>::checkNode(const Node<Key, Value>* node,
+                                                  size_t leftHeight, size_t rightHeight) const
+{
+    int8_t balance = static_cast<const NodeT*>(node)->getBalance();
+    if(balance < -1 || balance > 1)
+        return "balance out of range";
+    if((int)rightHeight - (int)leftHeight != balance)
+        return "stored balance does not match subtree heights";
+    if(countMismatch(static_cast<const NodeT*>(node)))
+        return "subtree count does not match its children";
+    return nullptr;
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::rotateLeft(NodeT* x){
+    NodeT* y = x->getRight();
+    NodeT* z = y->getLeft();
+    NodeT* p = x->getParent();
     if(p == nullptr){
         this->root_ = y;
         y->setParent(nullptr);
@@ -245,13 +1395,15 @@ void AVLTree<Key, Value>::rotateLeft(AVLNode<Key,Value>* x){
     x->setRight(z);
     if(z != nullptr)
         z->setParent(x);
+    pullCount(x);
+    pullCount(y);
 }
 
-template<class Key, class Value>
-void AVLTree<Key, Value>::rotateRight(AVLNode<Key,Value>* z){
-    AVLNode<Key,Value>* y = z->getLeft();
-    AVLNode<Key,Value>* x = y->getRight();
-    AVLNode<Key,Value>* p = z->getParent();
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::rotateRight(NodeT* z){
+    NodeT* y = z->getLeft();
+    NodeT* x = y->getRight();
+    NodeT* p = z->getParent();
     if(p == nullptr){
         this->root_ = y;
         y->setParent(nullptr);
@@ -271,71 +1423,44 @@ void AVLTree<Key, Value>::rotateRight(AVLNode<Key,Value>* z){
     z->setLeft(x);
     if(x != nullptr)
         x->setParent(z);
+    pullCount(z);
+    pullCount(y);
 }
 
-template<class Key, class Value>
-void AVLTree<Key, Value>::insert (const std::pair<const Key, Value> &new_item)
+/*
+ * Recall: If key is already in the tree, you should update
+ * overwrite the current value with the updated value.
+ *
+ * Every insert (insert, emplace, try_emplace, insert_or_assign) makes a
+ * single top-down descent in BinarySearchTree: an existing key is updated
+ * in place, otherwise the new node is linked into the empty slot and this
+ * hook starts rebalancing from its parent.
+ */
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::onInsert(NodeT* node)
 {
-    
-     
-    
-    if(this->root_ == nullptr){
-        AVLTree<Key, Value>::avlInsert(new_item);
-        AVLNode<Key, Value>* node = static_cast<AVLNode<Key, Value>*>(BinarySearchTree<Key, Value>::internalFind(new_item.first));
-        this->root_ = node;
-        node->setBalance(0);
+    NodeT* parent = node->getParent();
+    if(parent == nullptr)
         return;
-    }
-    
-    else 
-    {
-        AVLNode<Key, Value>* node = static_cast<AVLNode<Key, Value>*>(BinarySearchTree<Key, Value>::internalFind(new_item.first));
-        if(node != nullptr){
-            AVLTree<Key, Value>::avlInsert(new_item);
-            return;
-        }
-        AVLTree<Key, Value>::avlInsert(new_item);
-        node = static_cast<AVLNode<Key, Value>*>(BinarySearchTree<Key, Value>::internalFind(new_item.first));
-        node->setBalance(0);
-                
-        // if node is parent's left child
-        // parent updatebalance(-1)
-        // else
-        // updatebalance(1)
-
-        // if parent balance not 0
-        // insert fix
-        AVLNode<Key, Value>* p = node->getParent();
-        int balance = node->getParent()->getBalance();
-        if(balance == 0){
-            //node->getParent()->setBalance(balanceFactor(node->getParent()));
-            if(node == p->getLeft())
-                p->setBalance(-1);
-            if(node == p->getRight())
-                p->setBalance(1);
-            insert_fix(node->getParent(),node);
-        }
-        else if(balance == -1)
-        {
-            node->getParent()->setBalance(0);
-            return;
-        }
-        else if(balance ==1)
-        {
-            node->getParent()->setBalance(0);
-            return;
-        }
+    // counts must be right before insert_fix starts rotating
+    addCountToPath(parent, 1);
 
+    // a parent that leaned either way is now level and its height is unchanged
+    if(parent->getBalance() != 0){
+        parent->setBalance(0);
+        return;
     }
-    
+    bool isLeft = parent->getLeft() == node;
+    parent->setBalance(isLeft ? -1 : 1);
+    insert_fix(parent, node);
 }
 
-template<class Key, class Value>
-void AVLTree<Key, Value>::insert_fix(AVLNode<Key,Value>*p,AVLNode<Key,Value>*n)
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::insert_fix(NodeT*p,NodeT*n)
 {
     if(p == nullptr || p->getParent() == nullptr)
         return;
-    AVLNode<Key,Value>* g = p->getParent();
+    NodeT* g = p->getParent();
 
     //p is left child of g
     if(p->getParent()->getLeft() == p){
@@ -430,111 +1555,41 @@ void AVLTree<Key, Value>::insert_fix(AVLNode<Key,Value>*p,AVLNode<Key,Value>*n)
     }
 }
 
-// template<typename Key, typename Value>
-// void AVLTree<Key, Value>::avlRemove(const Key& key)
-// {    
-//     AVLNode<Key, Value> *curr = static_cast<AVLNode<Key, Value>*>(BinarySearchTree<Key, Value>::internalFind(key));
-//     if(curr == nullptr) return;
-//     else{
-//         //if it has 2 children, swap with its predecessor
-//         if(curr->getLeft()!=nullptr && curr->getRight()!=nullptr){
-//             AVLNode<Key, Value> *pred = static_cast<AVLNode<Key, Value>*>(BinarySearchTree<Key, Value>::predecessor(curr));
-//             //since right most child, could possibly only have left child
-//             if(pred->getLeft() == nullptr){//if no more left child
-//                 nodeSwap(pred,curr);
-//                 if(curr->getParent()->getLeft()==curr)curr->getParent()->setLeft(nullptr);
-//                 else if(curr->getParent()->getRight()==curr)curr->getParent()->setRight(nullptr);
-//                 delete curr;
-//             }
-    
-//             else{//if left child exists on the predecessor
-//                 nodeSwap(pred,curr);
-//                 if(curr->getParent()->getLeft()==curr){
-//                     if(curr->getLeft()!=nullptr){//updating pointer
-//                         curr->getParent()->setLeft(curr->getLeft());
-//                         curr->getLeft()->setParent(curr->getParent());
-//                     } 
-//                     else curr->getParent()->setLeft(nullptr);
-                    
-//                 }
-//                 else if(curr->getParent()->getRight()==curr){
-//                     if(curr->getLeft()!=nullptr)//updating pointer
-//                     {
-//                         curr->getParent()->setRight(curr->getLeft());
-//                         curr->getLeft()->setParent(curr->getParent());
-//                     } 
-//                     else {//updating
-//                         curr->getParent()->setRight(nullptr);
-                        
-//                     }
-//                 }
-//                 delete curr;
-//             }
-//         }
-//         //following 2 cases are if it has 1 child
-//         else if(curr->getLeft()!=nullptr){//child on current's left
-//             curr->getLeft()->setParent(curr->getParent());
-//             if(curr->getParent()==nullptr){
-//                 this->root_ = curr->getLeft();
-//             }
-//             else{
-//                 if(curr->getParent()->getRight()==curr) curr->getParent()->setRight(curr->getLeft());
-//             else if(curr->getParent()->getLeft()==curr) curr->getParent()->setLeft(curr->getLeft());
-//             }
-            
-//             delete curr;
-//         }
-//         else if(curr->getRight()!= nullptr){//child on current's right
-//             curr->getRight()->setParent(curr->getParent());
-//             if(curr->getParent()==nullptr){
-//                 this->root_ = curr->getRight();
-//             }
-//             else{
-//                 if(curr->getParent()->getRight()==curr) curr->getParent()->setRight(curr->getRight());
-//                 else if (curr->getParent()->getLeft()==curr) curr->getParent()->setLeft(curr->getRight());
-//             }
-//             delete curr;
-            
-//         }
-//         else{
-//             if(curr->getParent() == nullptr){
-//                 BinarySearchTree<Key,Value>::clear();
-//             }
-//             else{
-//                 if(curr->getParent()->getLeft()==curr) curr->getParent()->setLeft(nullptr);
-//                 else if(curr->getParent()->getRight()==curr) curr->getParent()->setRight(nullptr);
-//                 delete curr;
-//             }
-//         }
-//     }
-// }
-
-
-
 /*
  * Recall: The writeup specifies that if a node has 2 children you
  * should swap with the predecessor and then remove.
  */
 
-template<class Key, class Value>
-void AVLTree<Key, Value>:: remove(const Key& key)
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>:: remove(const Key& key)
 {
     // TODO
-    int8_t diff;
     //if empty tree
     if(this->root_ == nullptr)
         return;
     
     
-    AVLNode<Key, Value>* curr = static_cast<AVLNode<Key, Value>*>(BinarySearchTree<Key, Value>::internalFind(key));
-    AVLNode<Key, Value>* pred = static_cast<AVLNode<Key, Value>*>(BinarySearchTree<Key, Value>::predecessor(curr));
+    NodeT* curr = static_cast<NodeT*>(BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::internalFind(key));
     if(curr==nullptr)
         return;
+    removeNode(curr);
+}
+
+/**
+* Unlinks and frees curr, a node of this tree, and rebalances. Other
+* nodes keep their items, so pointers to them stay valid.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::removeNode(NodeT* curr)
+{
+    int8_t diff = 0;
+    NodeT* pred = static_cast<NodeT*>(BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::predecessor(curr));
+    --this->size_;
 
     //if n has 2 children, swap with predecessor
     if(curr->getLeft()!=nullptr && curr->getRight()!=nullptr)
         nodeSwap(curr,pred);
-    AVLNode<Key, Value>* p = curr->getParent();
+    NodeT* p = curr->getParent();
     if(p != nullptr)
     {
         if(p->getLeft() == curr){
@@ -577,7 +1632,7 @@ void AVLTree<Key, Value>:: remove(const Key& key)
                         
                     }
                 }
-                delete curr;
+                this->alloc_.destroy(curr);
             }
         }
         //following 2 cases are if it has 1 child
@@ -591,7 +1646,7 @@ void AVLTree<Key, Value>:: remove(const Key& key)
             else if(curr->getParent()->getLeft()==curr) curr->getParent()->setLeft(curr->getLeft());
             }
             
-            delete curr;
+            this->alloc_.destroy(curr);
         }
         else if(curr->getRight()!= nullptr){//child on current's right
             curr->getRight()->setParent(curr->getParent());
@@ -602,32 +1657,34 @@ void AVLTree<Key, Value>:: remove(const Key& key)
                 if(curr->getParent()->getRight()==curr) curr->getParent()->setRight(curr->getRight());
                 else if (curr->getParent()->getLeft()==curr) curr->getParent()->setLeft(curr->getRight());
             }
-            delete curr;
+            this->alloc_.destroy(curr);
             
         }
         else{
             if(curr->getParent() == nullptr){
-                BinarySearchTree<Key,Value>::clear();
+                BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::clear();
             }
             else{
                 if(curr->getParent()->getLeft()==curr) curr->getParent()->setLeft(nullptr);
                 else if(curr->getParent()->getRight()==curr) curr->getParent()->setRight(nullptr);
-                delete curr;
+                this->alloc_.destroy(curr);
             }
         }
 
+    // counts must be right before removeFix starts rotating
+    addCountToPath(p, -1);
     removeFix(p, diff);
    
     
 }
 
-template<class Key, class Value>
-void AVLTree<Key, Value>::removeFix(AVLNode<Key,Value>*n,int8_t diff)
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::removeFix(NodeT*n,int8_t diff)
 {
     if(n == nullptr)
         return;
-    AVLNode<Key, Value>* p = n->getParent();
-    int8_t nDiff;
+    NodeT* p = n->getParent();
+    int8_t nDiff = 0;
     if(p != nullptr){
         if(p->getLeft() == n){
             nDiff = 1;
@@ -639,7 +1696,7 @@ void AVLTree<Key, Value>::removeFix(AVLNode<Key,Value>*n,int8_t diff)
 
     if(diff == -1){//left case
         if(n->getBalance() + diff == -2){
-            AVLNode<Key, Value>* c = n->getLeft();
+            NodeT* c = n->getLeft();
             if(c->getBalance()==-1){
                 rotateRight(n);
                 n->setBalance(0);
@@ -653,7 +1710,7 @@ void AVLTree<Key, Value>::removeFix(AVLNode<Key,Value>*n,int8_t diff)
                 return;
             }
             else if(c->getBalance() == 1){
-                AVLNode<Key, Value>* g = c->getRight();
+                NodeT* g = c->getRight();
                 rotateLeft(c);
                 rotateRight(n);
                 if(g->getBalance() == -1){
@@ -687,7 +1744,7 @@ void AVLTree<Key, Value>::removeFix(AVLNode<Key,Value>*n,int8_t diff)
     else if(diff == 1)//right case
     {
         if(n->getBalance() + diff == 2){
-            AVLNode<Key, Value>* c = n->getRight();
+            NodeT* c = n->getRight();
             if(c->getBalance()==1){
                 rotateLeft(n);
                 n->setBalance(0);
@@ -701,7 +1758,7 @@ void AVLTree<Key, Value>::removeFix(AVLNode<Key,Value>*n,int8_t diff)
                 return;
             }
             else if(c->getBalance() == -1){
-                AVLNode<Key, Value>* g = c->getLeft();
+                NodeT* g = c->getLeft();
                 rotateRight(c);
                 rotateLeft(n);
                 if(g->getBalance() == -1){
@@ -736,14 +1793,175 @@ void AVLTree<Key, Value>::removeFix(AVLNode<Key,Value>*n,int8_t diff)
 
 
 
-template<class Key, class Value>
-void AVLTree<Key, Value>::nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2)
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::nodeSwap( NodeT* n1, NodeT* n2)
 {
-    BinarySearchTree<Key, Value>::nodeSwap(n1, n2);
+    BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::nodeSwap(n1, n2);
     int8_t tempB = n1->getBalance();
     n1->setBalance(n2->getBalance());
     n2->setBalance(tempB);
+    swapCounts(n1, n2);
+}
+
+/**
+* Returns the number of keys less than key, in O(log n).
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+size_t AVLTree<Key, Value, Alloc, NodeT, Compare>::rank(const Key& key) const
+{
+    size_t result = 0;
+    NodeT* curr = static_cast<NodeT*>(this->root_);
+    while(curr != nullptr){
+        if(this->comp_(curr->getKey(), key)){
+            result += countOf(curr->getLeft()) + 1;
+            curr = curr->getRight();
+        }
+        else{
+            curr = curr->getLeft();
+        }
+    }
+    return result;
+}
+
+/**
+* Returns an iterator to the k-th smallest item (counting from 0), or end()
+* if the tree holds k items or fewer. O(log n).
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename AVLTree<Key, Value, Alloc, NodeT, Compare>::iterator
+AVLTree<Key, Value, Alloc, NodeT, Compare>::select(size_t k)
+{
+    return this->makeIterator(selectNode(k));
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename AVLTree<Key, Value, Alloc, NodeT, Compare>::const_iterator
+AVLTree<Key, Value, Alloc, NodeT, Compare>::select(size_t k) const
+{
+    return this->makeIterator(selectNode(k));
+}
+
+/**
+* Returns the number of keys in [lo, hi), in O(log n).
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+size_t AVLTree<Key, Value, Alloc, NodeT, Compare>::countInRange(const Key& lo, const Key& hi) const
+{
+    if(!this->comp_(lo, hi))
+        return 0;
+    return rank(hi) - rank(lo);
 }
 
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+NodeT* AVLTree<Key, Value, Alloc, NodeT, Compare>::selectNode(size_t k) const
+{
+    NodeT* curr = static_cast<NodeT*>(this->root_);
+    while(curr != nullptr){
+        size_t leftCount = countOf(curr->getLeft());
+        if(k < leftCount){
+            curr = curr->getLeft();
+        }
+        else if(k == leftCount){
+            return curr;
+        }
+        else{
+            k -= leftCount + 1;
+            curr = curr->getRight();
+        }
+    }
+    return nullptr;
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+size_t AVLTree<Key, Value, Alloc, NodeT, Compare>::countOf(const AVLNode<Key, Value>*)
+{
+    return 0;
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+size_t AVLTree<Key, Value, Alloc, NodeT, Compare>::countOf(const CountedAVLNode<Key, Value>* node)
+{
+    return node == nullptr ? 0 : node->getCount();
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::pullCount(AVLNode<Key, Value>*)
+{
+
+}
+
+/**
+* Recomputes a node's count from its children, e.g. after a rotation.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::pullCount(CountedAVLNode<Key, Value>* node)
+{
+    node->setCount(countOf(node->getLeft()) + countOf(node->getRight()) + 1);
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::addCountToPath(AVLNode<Key, Value>*, long)
+{
+
+}
+
+/**
+* Adds diff to the count of node and of every ancestor.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::addCountToPath(CountedAVLNode<Key, Value>* node, long diff)
+{
+    for(; node != nullptr; node = node->getParent())
+        node->addCount(diff);
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::swapCounts(AVLNode<Key, Value>*, AVLNode<Key, Value>*)
+{
+
+}
+
+/**
+* Counts belong to positions in the tree, so nodeSwap exchanges them.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void AVLTree<Key, Value, Alloc, NodeT, Compare>::swapCounts(CountedAVLNode<Key, Value>* n1, CountedAVLNode<Key, Value>* n2)
+{
+    size_t tempC = n1->getCount();
+    n1->setCount(n2->getCount());
+    n2->setCount(tempC);
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+bool AVLTree<Key, Value, Alloc, NodeT, Compare>::countMismatch(const AVLNode<Key, Value>*)
+{
+    return false;
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+bool AVLTree<Key, Value, Alloc, NodeT, Compare>::countMismatch(const CountedAVLNode<Key, Value>* node)
+{
+    return node->getCount() != countOf(node->getLeft()) + countOf(node->getRight()) + 1;
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+bool AVLTree<Key, Value, Alloc, NodeT, Compare>::hasCounts(const AVLNode<Key, Value>*)
+{
+    return false;
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+bool AVLTree<Key, Value, Alloc, NodeT, Compare>::hasCounts(const CountedAVLNode<Key, Value>*)
+{
+    return true;
+}
+
+/**
+* An AVL tree whose nodes store subtree counts, adding O(log n) rank(),
+* select() and countInRange().
+*/
+template <class Key, class Value, class Alloc = HeapNodeAlloc, class Compare = std::less<Key> >
+using OrderStatisticTree = AVLTree<Key, Value, Alloc, CountedAVLNode<Key, Value>, Compare>;
+
 
 #endif
@@ -0,0 +1,1457 @@
+#ifndef BPLUS_TREE_H
+#define BPLUS_TREE_H
+
+#include <iostream>
+#include <cstdlib>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+#include <iterator>
+#include <tuple>
+#include "simd_search.h"
+#include "key_compare.h"
+
+/**
+* A B+-tree map with the interface of BinarySearchTree, so that code can
+* switch between the two with a typedef.
+*
+* Items live in leaves that are chained left to right; inner nodes hold
+* only separator keys and child pointers. NodeBytes is the target size of
+* a node (e.g. 64 for one cache line, 4096 for a page) and sets how many
+* items a leaf and how many children an inner node can hold. A lookup
+* touches one node per level, about log_B(n) of them instead of log_2(n).
+*
+* Differences from BinarySearchTree:
+*  - items move within and between leaves, so an insert or remove
+*    invalidates all iterators, references and pointers to items;
+*  - Key must be default constructible and copy assignable (inner nodes
+*    keep copies of separator keys);
+*  - emplace builds the item once and then moves it into its leaf;
+*  - the tree cannot be copied.
+* Compare orders the keys, as for BinarySearchTree; the SIMD node search
+* is only used with the default std::less.
+*/
+template <class Key, class Value, size_t NodeBytes = 256, class Compare = std::less<Key> >
+class BPlusTree
+{
+public:
+    typedef std::pair<const Key, Value> value_type;
+
+    BPlusTree();
+    explicit BPlusTree(const Compare& comp);
+    ~BPlusTree();
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void insert(std::pair<const Key, Value>&& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+    bool isBalanced() const;
+    size_t height() const;
+    void print() const;
+    bool empty() const;
+    size_t size() const;
+    Compare key_comp() const;
+
+    /**
+    * The outcome of validate(). When an invariant is broken, item is an
+    * item of the offending node when it has one, and reason describes the
+    * violation.
+    */
+    struct ValidationResult
+    {
+        const std::pair<const Key, Value>* item;
+        const char* reason;
+        bool ok() const { return reason == nullptr; }
+    };
+    ValidationResult validate() const;
+
+protected:
+    struct Leaf;
+
+public:
+    /**
+    * A bidirectional iterator: a leaf and a slot in it. Stepping follows
+    * the leaf chain, so a full traversal is O(n) with O(1) steps.
+    * Decrementing end() yields the largest item.
+    */
+    class iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef value_type* pointer;
+        typedef value_type& reference;
+
+        iterator();
+
+        std::pair<const Key,Value>& operator*() const;
+        std::pair<const Key,Value>* operator->() const;
+
+        bool operator==(const iterator& rhs) const;
+        bool operator!=(const iterator& rhs) const;
+
+        iterator& operator++();
+        iterator operator++(int);
+        iterator& operator--();
+        iterator operator--(int);
+
+    protected:
+        friend class BPlusTree<Key, Value, NodeBytes, Compare>;
+        iterator(Leaf* leaf, size_t index, const BPlusTree<Key, Value, NodeBytes, Compare>* tree);
+        Leaf* leaf_;
+        size_t index_;
+        const BPlusTree<Key, Value, NodeBytes, Compare>* tree_;
+    };
+
+    /**
+    * The read-only counterpart of iterator, returned when the tree is const.
+    * An iterator converts implicitly to a const_iterator.
+    */
+    class const_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type* pointer;
+        typedef const value_type& reference;
+
+        const_iterator();
+        const_iterator(const iterator& it);
+
+        const std::pair<const Key,Value>& operator*() const;
+        const std::pair<const Key,Value>* operator->() const;
+
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+        const_iterator& operator--();
+        const_iterator operator--(int);
+
+    protected:
+        friend class BPlusTree<Key, Value, NodeBytes, Compare>;
+        const_iterator(Leaf* leaf, size_t index, const BPlusTree<Key, Value, NodeBytes, Compare>* tree);
+        Leaf* leaf_;
+        size_t index_;
+        const BPlusTree<Key, Value, NodeBytes, Compare>* tree_;
+    };
+
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    iterator begin();
+    iterator end();
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator cbegin() const;
+    const_iterator cend() const;
+    reverse_iterator rbegin();
+    reverse_iterator rend();
+    const_reverse_iterator rbegin() const;
+    const_reverse_iterator rend() const;
+    iterator find(const Key& key);
+    const_iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key);
+    const_iterator lower_bound(const Key& key) const;
+    iterator upper_bound(const Key& key);
+    const_iterator upper_bound(const Key& key) const;
+    std::pair<iterator, iterator> equal_range(const Key& key);
+    std::pair<const_iterator, const_iterator> equal_range(const Key& key) const;
+    template<typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args);
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign(const Key& key, M&& value);
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign(Key&& key, M&& value);
+    template<typename Function>
+    void forEachInRange(const Key& lo, const Key& hi, Function fn);
+    template<typename Function>
+    void forEachInRange(const Key& lo, const Key& hi, Function fn) const;
+    Value& operator[](const Key& key);
+    Value const & operator[](const Key& key) const;
+
+    // Node capacities derived from NodeBytes.
+    static const size_t kLeafSlots =
+        NodeBytes > 24 + 4 * sizeof(value_type) ? (NodeBytes - 24) / sizeof(value_type) : 4;
+    static const size_t kInnerSlots =
+        NodeBytes > 8 + 4 * (sizeof(Key) + sizeof(void*)) ?
+        (NodeBytes - 8 + sizeof(Key)) / (sizeof(Key) + sizeof(void*)) : 4;
+
+protected:
+    static const size_t kMinLeaf = kLeafSlots / 2;
+    static const size_t kMinInner = (kInnerSlots + 1) / 2;   // children
+    static const int kMaxDepth = 64;
+
+    static_assert(kLeafSlots < 65536 && kInnerSlots < 65536, "NodeBytes is too large");
+
+    struct Node
+    {
+        uint16_t count_;    // items in a leaf, keys in an inner node
+        bool leaf_;
+    };
+
+    struct Leaf : Node
+    {
+        Leaf* prev_;
+        Leaf* next_;
+        typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type items_[kLeafSlots];
+
+        value_type& item(size_t i) { return *reinterpret_cast<value_type*>(&items_[i]); }
+        const value_type& item(size_t i) const { return *reinterpret_cast<const value_type*>(&items_[i]); }
+    };
+
+    /**
+    * Child i holds the keys k with keys_[i-1] <= k < keys_[i].
+    */
+    struct Inner : Node
+    {
+        Key keys_[kInnerSlots - 1];
+        Node* children_[kInnerSlots];
+    };
+
+    /**
+    * The inner nodes from the root down to a leaf, and the child taken at
+    * each of them.
+    */
+    struct Path
+    {
+        Inner* node[kMaxDepth];
+        size_t index[kMaxDepth];
+        int depth;
+    };
+
+    // Helpers
+    Leaf* newLeaf();
+    Inner* newInner();
+    size_t childIndex(const Inner* node, const Key& key) const;
+    size_t leafLowerBound(const Leaf* leaf, const Key& key) const;
+    size_t leafUpperBound(const Leaf* leaf, const Key& key) const;
+    Leaf* findLeaf(const Key& key, Path* path) const;
+    Leaf* firstLeaf() const;
+    Leaf* lastLeaf() const;
+    void internalFind(const Key& key, Leaf*& leaf, size_t& index) const;
+    void internalLowerBound(const Key& key, Leaf*& leaf, size_t& index) const;
+    void internalUpperBound(const Key& key, Leaf*& leaf, size_t& index) const;
+    static void moveItem(Leaf* to, size_t i, Leaf* from, size_t j);
+    static void openGap(Leaf* leaf, size_t pos);
+    static void closeGap(Leaf* leaf, size_t pos);
+    std::pair<iterator, bool> insertAt(Leaf* leaf, size_t pos, Path& path, value_type&& item);
+    void insertIntoParent(Path& path, Key separator, Node* right);
+    static void removeChild(Inner* node, size_t child);
+    void fixLeaf(Leaf* leaf, Inner* parent, size_t i);
+    void fixInner(Inner* node, Inner* parent, size_t i);
+    void deleteNodes(Node* node);
+
+private:
+    BPlusTree(const BPlusTree&);
+    BPlusTree& operator=(const BPlusTree&);
+
+protected:
+    Node* root_;
+    size_t size_;
+    Compare comp_;
+};
+
+/*
+--------------------------------------------------------------
+Begin implementations for the BPlusTree iterators.
+---------------------------------------------------------------
+*/
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+BPlusTree<Key, Value, NodeBytes, Compare>::iterator::iterator(Leaf* leaf, size_t index, const BPlusTree<Key, Value, NodeBytes, Compare>* tree) :
+    leaf_(leaf), index_(index), tree_(tree)
+{
+
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+BPlusTree<Key, Value, NodeBytes, Compare>::iterator::iterator() :
+    leaf_(nullptr), index_(0), tree_(nullptr)
+{
+
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+std::pair<const Key,Value> & BPlusTree<Key, Value, NodeBytes, Compare>::iterator::operator*() const
+{
+    return leaf_->item(index_);
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+std::pair<const Key,Value> * BPlusTree<Key, Value, NodeBytes, Compare>::iterator::operator->() const
+{
+    return &(leaf_->item(index_));
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+bool BPlusTree<Key, Value, NodeBytes, Compare>::iterator::operator==(const iterator& rhs) const
+{
+    return leaf_ == rhs.leaf_ && index_ == rhs.index_;
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+bool BPlusTree<Key, Value, NodeBytes, Compare>::iterator::operator!=(const iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::iterator&
+BPlusTree<Key, Value, NodeBytes, Compare>::iterator::operator++()
+{
+    if(++index_ == leaf_->count_){
+        leaf_ = leaf_->next_;
+        index_ = 0;
+    }
+    return *this;
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::iterator
+BPlusTree<Key, Value, NodeBytes, Compare>::iterator::operator++(int)
+{
+    iterator old(*this);
+    ++(*this);
+    return old;
+}
+
+/**
+* Steps back; from end() this moves to the largest item.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::iterator&
+BPlusTree<Key, Value, NodeBytes, Compare>::iterator::operator--()
+{
+    if(leaf_ == nullptr){
+        leaf_ = tree_->lastLeaf();
+        index_ = leaf_->count_ - 1;
+    }
+    else if(index_ == 0){
+        leaf_ = leaf_->prev_;
+        index_ = leaf_->count_ - 1;
+    }
+    else{
+        --index_;
+    }
+    return *this;
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::iterator
+BPlusTree<Key, Value, NodeBytes, Compare>::iterator::operator--(int)
+{
+    iterator old(*this);
+    --(*this);
+    return old;
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator::const_iterator(Leaf* leaf, size_t index, const BPlusTree<Key, Value, NodeBytes, Compare>* tree) :
+    leaf_(leaf), index_(index), tree_(tree)
+{
+
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator::const_iterator() :
+    leaf_(nullptr), index_(0), tree_(nullptr)
+{
+
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator::const_iterator(const iterator& it) :
+    leaf_(it.leaf_), index_(it.index_), tree_(it.tree_)
+{
+
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+const std::pair<const Key,Value> & BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator::operator*() const
+{
+    return leaf_->item(index_);
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+const std::pair<const Key,Value> * BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator::operator->() const
+{
+    return &(leaf_->item(index_));
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+bool BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator::operator==(const const_iterator& rhs) const
+{
+    return leaf_ == rhs.leaf_ && index_ == rhs.index_;
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+bool BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator::operator!=(const const_iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator&
+BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator::operator++()
+{
+    if(++index_ == leaf_->count_){
+        leaf_ = leaf_->next_;
+        index_ = 0;
+    }
+    return *this;
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator
+BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator::operator++(int)
+{
+    const_iterator old(*this);
+    ++(*this);
+    return old;
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator&
+BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator::operator--()
+{
+    if(leaf_ == nullptr){
+        leaf_ = tree_->lastLeaf();
+        index_ = leaf_->count_ - 1;
+    }
+    else if(index_ == 0){
+        leaf_ = leaf_->prev_;
+        index_ = leaf_->count_ - 1;
+    }
+    else{
+        --index_;
+    }
+    return *this;
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator
+BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator::operator--(int)
+{
+    const_iterator old(*this);
+    --(*this);
+    return old;
+}
+
+/*
+-------------------------------------------------------------
+End implementations for the BPlusTree iterators.
+-------------------------------------------------------------
+*/
+
+/*
+-------------------------------------------------------------
+Begin implementations for the BPlusTree class.
+-------------------------------------------------------------
+*/
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+BPlusTree<Key, Value, NodeBytes, Compare>::BPlusTree() :
+    root_(nullptr), size_(0), comp_()
+{
+
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+BPlusTree<Key, Value, NodeBytes, Compare>::BPlusTree(const Compare& comp) :
+    root_(nullptr), size_(0), comp_(comp)
+{
+
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+BPlusTree<Key, Value, NodeBytes, Compare>::~BPlusTree()
+{
+    clear();
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+bool BPlusTree<Key, Value, NodeBytes, Compare>::empty() const
+{
+    return size_ == 0;
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+size_t BPlusTree<Key, Value, NodeBytes, Compare>::size() const
+{
+    return size_;
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+Compare BPlusTree<Key, Value, NodeBytes, Compare>::key_comp() const
+{
+    return comp_;
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::Leaf*
+BPlusTree<Key, Value, NodeBytes, Compare>::newLeaf()
+{
+    Leaf* leaf = new Leaf;
+    leaf->count_ = 0;
+    leaf->leaf_ = true;
+    leaf->prev_ = nullptr;
+    leaf->next_ = nullptr;
+    return leaf;
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::Inner*
+BPlusTree<Key, Value, NodeBytes, Compare>::newInner()
+{
+    Inner* node = new Inner;
+    node->count_ = 0;
+    node->leaf_ = false;
+    return node;
+}
+
+/**
+* Returns which child of node may hold key: the number of separators that
+* are not greater than key. Arithmetic keys are counted with SIMD compares
+* (see simd_search.h).
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+size_t BPlusTree<Key, Value, NodeBytes, Compare>::childIndex(const Inner* node, const Key& key) const
+{
+    return KeySearch<Key, Compare>::upperBound(node->keys_, node->count_, key, comp_);
+}
+
+/**
+* Returns the first slot of leaf whose key is not less than key. Items sit
+* next to their values, so this is a scalar binary search, kept free of
+* data-dependent branches.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+size_t BPlusTree<Key, Value, NodeBytes, Compare>::leafLowerBound(const Leaf* leaf, const Key& key) const
+{
+    size_t n = leaf->count_;
+    if(n == 0)
+        return 0;
+    size_t base = 0;
+    while(n > 1){
+        size_t half = n / 2;
+        base = comp_(leaf->item(base + half).first, key) ? base + half : base;
+        n -= half;
+    }
+    return base + comp_(leaf->item(base).first, key);
+}
+
+/**
+* Returns the first slot of leaf whose key is greater than key.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+size_t BPlusTree<Key, Value, NodeBytes, Compare>::leafUpperBound(const Leaf* leaf, const Key& key) const
+{
+    size_t n = leaf->count_;
+    if(n == 0)
+        return 0;
+    size_t base = 0;
+    while(n > 1){
+        size_t half = n / 2;
+        base = comp_(key, leaf->item(base + half).first) ? base : base + half;
+        n -= half;
+    }
+    return base + !comp_(key, leaf->item(base).first);
+}
+
+/**
+* Descends to the leaf where key belongs, recording the path if asked.
+* The tree must not be empty.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::Leaf*
+BPlusTree<Key, Value, NodeBytes, Compare>::findLeaf(const Key& key, Path* path) const
+{
+    Node* node = root_;
+    if(path != nullptr)
+        path->depth = 0;
+    while(!node->leaf_){
+        Inner* inner = static_cast<Inner*>(node);
+        size_t i = childIndex(inner, key);
+        if(path != nullptr){
+            path->node[path->depth] = inner;
+            path->index[path->depth] = i;
+            ++path->depth;
+        }
+        node = inner->children_[i];
+    }
+    return static_cast<Leaf*>(node);
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::Leaf*
+BPlusTree<Key, Value, NodeBytes, Compare>::firstLeaf() const
+{
+    Node* node = root_;
+    if(node == nullptr)
+        return nullptr;
+    while(!node->leaf_)
+        node = static_cast<Inner*>(node)->children_[0];
+    return static_cast<Leaf*>(node);
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::Leaf*
+BPlusTree<Key, Value, NodeBytes, Compare>::lastLeaf() const
+{
+    Node* node = root_;
+    if(node == nullptr)
+        return nullptr;
+    while(!node->leaf_)
+        node = static_cast<Inner*>(node)->children_[node->count_];
+    return static_cast<Leaf*>(node);
+}
+
+/**
+* Sets leaf/index to the item with key, or to end() (NULL, 0).
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+void BPlusTree<Key, Value, NodeBytes, Compare>::internalFind(const Key& key, Leaf*& leaf, size_t& index) const
+{
+    internalLowerBound(key, leaf, index);
+    if(leaf != nullptr && comp_(key, leaf->item(index).first)){
+        leaf = nullptr;
+        index = 0;
+    }
+}
+
+/**
+* Sets leaf/index to the first item whose key is not less than key, or to
+* end() (NULL, 0).
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+void BPlusTree<Key, Value, NodeBytes, Compare>::internalLowerBound(const Key& key, Leaf*& leaf, size_t& index) const
+{
+    leaf = nullptr;
+    index = 0;
+    if(root_ == nullptr)
+        return;
+    leaf = findLeaf(key, nullptr);
+    index = leafLowerBound(leaf, key);
+    if(index == leaf->count_){
+        // every key here is smaller; the answer starts the next leaf
+        leaf = leaf->next_;
+        index = 0;
+    }
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+void BPlusTree<Key, Value, NodeBytes, Compare>::internalUpperBound(const Key& key, Leaf*& leaf, size_t& index) const
+{
+    leaf = nullptr;
+    index = 0;
+    if(root_ == nullptr)
+        return;
+    leaf = findLeaf(key, nullptr);
+    index = leafUpperBound(leaf, key);
+    if(index == leaf->count_){
+        leaf = leaf->next_;
+        index = 0;
+    }
+}
+
+/**
+* Moves the item in slot j of from into the empty slot i of to.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+void BPlusTree<Key, Value, NodeBytes, Compare>::moveItem(Leaf* to, size_t i, Leaf* from, size_t j)
+{
+    new (&to->items_[i]) value_type(std::move(from->item(j)));
+    from->item(j).~value_type();
+}
+
+/**
+* Shifts the items from pos on one slot right, leaving slot pos empty.
+* The leaf must have room; count_ is not changed.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+void BPlusTree<Key, Value, NodeBytes, Compare>::openGap(Leaf* leaf, size_t pos)
+{
+    for(size_t j = leaf->count_; j > pos; --j)
+        moveItem(leaf, j, leaf, j - 1);
+}
+
+/**
+* Shifts the items after the empty slot pos one slot left. count_ is not
+* changed.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+void BPlusTree<Key, Value, NodeBytes, Compare>::closeGap(Leaf* leaf, size_t pos)
+{
+    for(size_t j = pos; j + 1 < leaf->count_; ++j)
+        moveItem(leaf, j, leaf, j + 1);
+}
+
+/**
+* Moves item into slot pos of leaf (the slot findLeaf and leafLowerBound
+* chose), splitting the leaf and then its ancestors as needed. Callers
+* build item before calling: the split and the gap move items of the
+* leaf, and the arguments it is built from may refer to one of them.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+std::pair<typename BPlusTree<Key, Value, NodeBytes, Compare>::iterator, bool>
+BPlusTree<Key, Value, NodeBytes, Compare>::insertAt(Leaf* leaf, size_t pos, Path& path, value_type&& item)
+{
+    Leaf* target = leaf;
+    Leaf* right = nullptr;
+    if(leaf->count_ == kLeafSlots){
+        // split in half, then insert into the half the slot falls in
+        right = newLeaf();
+        size_t split = kLeafSlots / 2;
+        for(size_t j = split; j < kLeafSlots; ++j)
+            moveItem(right, j - split, leaf, j);
+        right->count_ = (uint16_t)(kLeafSlots - split);
+        leaf->count_ = (uint16_t)split;
+        right->next_ = leaf->next_;
+        if(leaf->next_ != nullptr)
+            leaf->next_->prev_ = right;
+        leaf->next_ = right;
+        right->prev_ = leaf;
+        if(pos > split){
+            target = right;
+            pos -= split;
+        }
+    }
+
+    openGap(target, pos);
+    try {
+        new (&target->items_[pos]) value_type(std::move(item));
+    }
+    catch(...) {
+        ++target->count_;
+        closeGap(target, pos);
+        --target->count_;
+        if(right != nullptr){
+            // undo the split
+            for(size_t j = 0; j < right->count_; ++j)
+                moveItem(leaf, leaf->count_ + j, right, j);
+            leaf->count_ += right->count_;
+            leaf->next_ = right->next_;
+            if(right->next_ != nullptr)
+                right->next_->prev_ = leaf;
+            delete right;
+        }
+        throw;
+    }
+    ++target->count_;
+    ++size_;
+    if(right != nullptr)
+        insertIntoParent(path, right->item(0).first, right);
+    return std::make_pair(iterator(target, pos, this), true);
+}
+
+/**
+* After the node at the end of path was split, hangs its new right half
+* (whose keys are all >= separator) next to it, splitting ancestors that
+* are full and growing a new root if the old one splits.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+void BPlusTree<Key, Value, NodeBytes, Compare>::insertIntoParent(Path& path, Key separator, Node* right)
+{
+    for(int d = path.depth - 1; d >= 0; --d){
+        Inner* node = path.node[d];
+        size_t i = path.index[d];
+        if(node->count_ < kInnerSlots - 1){
+            for(size_t j = node->count_; j > i; --j){
+                node->keys_[j] = std::move(node->keys_[j - 1]);
+                node->children_[j + 1] = node->children_[j];
+            }
+            node->keys_[i] = std::move(separator);
+            node->children_[i + 1] = right;
+            ++node->count_;
+            return;
+        }
+
+        // lay out all kInnerSlots keys and kInnerSlots + 1 children, then
+        // keep the lower half, push the middle key up and move the rest
+        Key keys[kInnerSlots];
+        Node* children[kInnerSlots + 1];
+        for(size_t j = 0, k = 0; j < kInnerSlots; ++j)
+            keys[j] = j == i ? std::move(separator) : std::move(node->keys_[k++]);
+        for(size_t j = 0, k = 0; j <= kInnerSlots; ++j)
+            children[j] = j == i + 1 ? right : node->children_[k++];
+
+        size_t mid = kInnerSlots / 2;
+        Inner* sibling = newInner();
+        for(size_t j = 0; j < mid; ++j){
+            node->keys_[j] = std::move(keys[j]);
+            node->children_[j] = children[j];
+        }
+        node->children_[mid] = children[mid];
+        node->count_ = (uint16_t)mid;
+        for(size_t j = mid + 1; j < kInnerSlots; ++j){
+            sibling->keys_[j - mid - 1] = std::move(keys[j]);
+            sibling->children_[j - mid - 1] = children[j];
+        }
+        sibling->children_[kInnerSlots - mid - 1] = children[kInnerSlots];
+        sibling->count_ = (uint16_t)(kInnerSlots - mid - 1);
+        separator = std::move(keys[mid]);
+        right = sibling;
+    }
+
+    Inner* root = newInner();
+    root->keys_[0] = std::move(separator);
+    root->children_[0] = root_;
+    root->children_[1] = right;
+    root->count_ = 1;
+    root_ = root;
+}
+
+/**
+* An insert method to insert into the tree. If key is already in the tree,
+* the current value is overwritten with the new one.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+void BPlusTree<Key, Value, NodeBytes, Compare>::insert(const std::pair<const Key, Value> &keyValuePair)
+{
+    insert_or_assign(keyValuePair.first, keyValuePair.second);
+}
+
+/**
+* Same as above, but the value is moved into the tree.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+void BPlusTree<Key, Value, NodeBytes, Compare>::insert(std::pair<const Key, Value> &&keyValuePair)
+{
+    insert_or_assign(keyValuePair.first, std::move(keyValuePair.second));
+}
+
+/**
+* Builds the item from args, as std::map::emplace does, and moves it into
+* the tree unless its key is already present. Returns the item's position
+* and whether it was inserted.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+template<typename... Args>
+std::pair<typename BPlusTree<Key, Value, NodeBytes, Compare>::iterator, bool>
+BPlusTree<Key, Value, NodeBytes, Compare>::emplace(Args&&... args)
+{
+    value_type item(std::forward<Args>(args)...);
+    if(root_ == nullptr)
+        root_ = newLeaf();
+    Path path;
+    Leaf* leaf = findLeaf(item.first, &path);
+    size_t pos = leafLowerBound(leaf, item.first);
+    if(pos < leaf->count_ && !comp_(item.first, leaf->item(pos).first))
+        return std::make_pair(iterator(leaf, pos, this), false);
+    return insertAt(leaf, pos, path, std::move(item));
+}
+
+/**
+* If key is absent, builds its value from args and moves it into the
+* tree; otherwise does nothing, and args are left untouched.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+template<typename... Args>
+std::pair<typename BPlusTree<Key, Value, NodeBytes, Compare>::iterator, bool>
+BPlusTree<Key, Value, NodeBytes, Compare>::try_emplace(const Key& key, Args&&... args)
+{
+    if(root_ == nullptr)
+        root_ = newLeaf();
+    Path path;
+    Leaf* leaf = findLeaf(key, &path);
+    size_t pos = leafLowerBound(leaf, key);
+    if(pos < leaf->count_ && !comp_(key, leaf->item(pos).first))
+        return std::make_pair(iterator(leaf, pos, this), false);
+    value_type item(std::piecewise_construct,
+        std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+    return insertAt(leaf, pos, path, std::move(item));
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+template<typename... Args>
+std::pair<typename BPlusTree<Key, Value, NodeBytes, Compare>::iterator, bool>
+BPlusTree<Key, Value, NodeBytes, Compare>::try_emplace(Key&& key, Args&&... args)
+{
+    if(root_ == nullptr)
+        root_ = newLeaf();
+    Path path;
+    Leaf* leaf = findLeaf(key, &path);
+    size_t pos = leafLowerBound(leaf, key);
+    if(pos < leaf->count_ && !comp_(key, leaf->item(pos).first))
+        return std::make_pair(iterator(leaf, pos, this), false);
+    value_type item(std::piecewise_construct,
+        std::forward_as_tuple(std::move(key)), std::forward_as_tuple(std::forward<Args>(args)...));
+    return insertAt(leaf, pos, path, std::move(item));
+}
+
+/**
+* Assigns value to key, inserting it if absent. Returns the item's position
+* and whether it was inserted.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+template<typename M>
+std::pair<typename BPlusTree<Key, Value, NodeBytes, Compare>::iterator, bool>
+BPlusTree<Key, Value, NodeBytes, Compare>::insert_or_assign(const Key& key, M&& value)
+{
+    if(root_ == nullptr)
+        root_ = newLeaf();
+    Path path;
+    Leaf* leaf = findLeaf(key, &path);
+    size_t pos = leafLowerBound(leaf, key);
+    if(pos < leaf->count_ && !comp_(key, leaf->item(pos).first)){
+        leaf->item(pos).second = std::forward<M>(value);
+        return std::make_pair(iterator(leaf, pos, this), false);
+    }
+    value_type item(key, std::forward<M>(value));
+    return insertAt(leaf, pos, path, std::move(item));
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+template<typename M>
+std::pair<typename BPlusTree<Key, Value, NodeBytes, Compare>::iterator, bool>
+BPlusTree<Key, Value, NodeBytes, Compare>::insert_or_assign(Key&& key, M&& value)
+{
+    if(root_ == nullptr)
+        root_ = newLeaf();
+    Path path;
+    Leaf* leaf = findLeaf(key, &path);
+    size_t pos = leafLowerBound(leaf, key);
+    if(pos < leaf->count_ && !comp_(key, leaf->item(pos).first)){
+        leaf->item(pos).second = std::forward<M>(value);
+        return std::make_pair(iterator(leaf, pos, this), false);
+    }
+    value_type item(std::move(key), std::forward<M>(value));
+    return insertAt(leaf, pos, path, std::move(item));
+}
+
+/**
+* Removes key from the tree, or does nothing if it is absent. A leaf or
+* inner node left less than half full borrows from a sibling, or merges
+* with one when neither can spare anything; merges can cascade up to the
+* root, which is dropped when it is left with a single child.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+void BPlusTree<Key, Value, NodeBytes, Compare>::remove(const Key& key)
+{
+    if(root_ == nullptr)
+        return;
+    Path path;
+    Leaf* leaf = findLeaf(key, &path);
+    size_t pos = leafLowerBound(leaf, key);
+    if(pos == leaf->count_ || comp_(key, leaf->item(pos).first))
+        return;
+
+    leaf->item(pos).~value_type();
+    closeGap(leaf, pos);
+    --leaf->count_;
+    --size_;
+
+    if(path.depth == 0){
+        if(leaf->count_ == 0){
+            delete leaf;
+            root_ = nullptr;
+        }
+        return;
+    }
+    if(leaf->count_ >= kMinLeaf)
+        return;
+    fixLeaf(leaf, path.node[path.depth - 1], path.index[path.depth - 1]);
+
+    for(int d = path.depth - 1; d > 0; --d){
+        Inner* node = path.node[d];
+        if(node->count_ + 1u >= kMinInner)
+            return;
+        fixInner(node, path.node[d - 1], path.index[d - 1]);
+    }
+    Inner* root = static_cast<Inner*>(root_);
+    if(root->count_ == 0){
+        root_ = root->children_[0];
+        delete root;
+    }
+}
+
+/**
+* Removes separator child - 1 and the child pointer child from node.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+void BPlusTree<Key, Value, NodeBytes, Compare>::removeChild(Inner* node, size_t child)
+{
+    for(size_t j = child; j < node->count_; ++j){
+        node->keys_[j - 1] = std::move(node->keys_[j]);
+        node->children_[j] = node->children_[j + 1];
+    }
+    --node->count_;
+}
+
+/**
+* Refills leaf, child i of parent, which has fallen below half full.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+void BPlusTree<Key, Value, NodeBytes, Compare>::fixLeaf(Leaf* leaf, Inner* parent, size_t i)
+{
+    Leaf* left = i > 0 ? static_cast<Leaf*>(parent->children_[i - 1]) : nullptr;
+    Leaf* right = i < parent->count_ ? static_cast<Leaf*>(parent->children_[i + 1]) : nullptr;
+
+    if(left != nullptr && left->count_ > kMinLeaf){
+        openGap(leaf, 0);
+        moveItem(leaf, 0, left, left->count_ - 1);
+        --left->count_;
+        ++leaf->count_;
+        parent->keys_[i - 1] = leaf->item(0).first;
+    }
+    else if(right != nullptr && right->count_ > kMinLeaf){
+        moveItem(leaf, leaf->count_, right, 0);
+        closeGap(right, 0);
+        --right->count_;
+        ++leaf->count_;
+        parent->keys_[i] = right->item(0).first;
+    }
+    else{
+        // merge the right one of the pair into the left one
+        Leaf* into = left != nullptr ? left : leaf;
+        Leaf* from = left != nullptr ? leaf : right;
+        for(size_t j = 0; j < from->count_; ++j)
+            moveItem(into, into->count_ + j, from, j);
+        into->count_ += from->count_;
+        into->next_ = from->next_;
+        if(from->next_ != nullptr)
+            from->next_->prev_ = into;
+        delete from;
+        removeChild(parent, left != nullptr ? i : i + 1);
+    }
+}
+
+/**
+* Refills node, child i of parent, which has fallen below half full, by
+* rotating a child through the parent from a sibling or by merging.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+void BPlusTree<Key, Value, NodeBytes, Compare>::fixInner(Inner* node, Inner* parent, size_t i)
+{
+    Inner* left = i > 0 ? static_cast<Inner*>(parent->children_[i - 1]) : nullptr;
+    Inner* right = i < parent->count_ ? static_cast<Inner*>(parent->children_[i + 1]) : nullptr;
+
+    if(left != nullptr && left->count_ + 1u > kMinInner){
+        node->children_[node->count_ + 1] = node->children_[node->count_];
+        for(size_t j = node->count_; j > 0; --j){
+            node->keys_[j] = std::move(node->keys_[j - 1]);
+            node->children_[j] = node->children_[j - 1];
+        }
+        node->keys_[0] = std::move(parent->keys_[i - 1]);
+        node->children_[0] = left->children_[left->count_];
+        parent->keys_[i - 1] = std::move(left->keys_[left->count_ - 1]);
+        --left->count_;
+        ++node->count_;
+    }
+    else if(right != nullptr && right->count_ + 1u > kMinInner){
+        node->keys_[node->count_] = std::move(parent->keys_[i]);
+        node->children_[node->count_ + 1] = right->children_[0];
+        parent->keys_[i] = std::move(right->keys_[0]);
+        for(size_t j = 0; j + 1 < right->count_; ++j){
+            right->keys_[j] = std::move(right->keys_[j + 1]);
+            right->children_[j] = right->children_[j + 1];
+        }
+        right->children_[right->count_ - 1] = right->children_[right->count_];
+        --right->count_;
+        ++node->count_;
+    }
+    else{
+        // pull the separator down between the two halves
+        Inner* into = left != nullptr ? left : node;
+        Inner* from = left != nullptr ? node : right;
+        size_t sep = left != nullptr ? i - 1 : i;
+        into->keys_[into->count_] = std::move(parent->keys_[sep]);
+        for(size_t j = 0; j < from->count_; ++j)
+            into->keys_[into->count_ + 1 + j] = std::move(from->keys_[j]);
+        for(size_t j = 0; j <= from->count_; ++j)
+            into->children_[into->count_ + 1 + j] = from->children_[j];
+        into->count_ += from->count_ + 1;
+        delete from;
+        removeChild(parent, sep + 1);
+    }
+}
+
+/**
+* A method to remove all contents of the tree.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+void BPlusTree<Key, Value, NodeBytes, Compare>::clear()
+{
+    if(root_ != nullptr)
+        deleteNodes(root_);
+    root_ = nullptr;
+    size_ = 0;
+}
+
+/**
+* Frees the subtree at node. Recursion depth is the height of the tree,
+* which is logarithmic with a large base.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+void BPlusTree<Key, Value, NodeBytes, Compare>::deleteNodes(Node* node)
+{
+    if(node->leaf_){
+        Leaf* leaf = static_cast<Leaf*>(node);
+        for(size_t j = 0; j < leaf->count_; ++j)
+            leaf->item(j).~value_type();
+        delete leaf;
+        return;
+    }
+    Inner* inner = static_cast<Inner*>(node);
+    for(size_t j = 0; j <= inner->count_; ++j)
+        deleteNodes(inner->children_[j]);
+    delete inner;
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::iterator
+BPlusTree<Key, Value, NodeBytes, Compare>::begin()
+{
+    return iterator(firstLeaf(), 0, this);
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::iterator
+BPlusTree<Key, Value, NodeBytes, Compare>::end()
+{
+    return iterator(nullptr, 0, this);
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator
+BPlusTree<Key, Value, NodeBytes, Compare>::begin() const
+{
+    return const_iterator(firstLeaf(), 0, this);
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator
+BPlusTree<Key, Value, NodeBytes, Compare>::end() const
+{
+    return const_iterator(nullptr, 0, this);
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator
+BPlusTree<Key, Value, NodeBytes, Compare>::cbegin() const
+{
+    return begin();
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator
+BPlusTree<Key, Value, NodeBytes, Compare>::cend() const
+{
+    return end();
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::reverse_iterator
+BPlusTree<Key, Value, NodeBytes, Compare>::rbegin()
+{
+    return reverse_iterator(end());
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::reverse_iterator
+BPlusTree<Key, Value, NodeBytes, Compare>::rend()
+{
+    return reverse_iterator(begin());
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::const_reverse_iterator
+BPlusTree<Key, Value, NodeBytes, Compare>::rbegin() const
+{
+    return const_reverse_iterator(end());
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::const_reverse_iterator
+BPlusTree<Key, Value, NodeBytes, Compare>::rend() const
+{
+    return const_reverse_iterator(begin());
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::iterator
+BPlusTree<Key, Value, NodeBytes, Compare>::find(const Key& key)
+{
+    Leaf* leaf;
+    size_t index;
+    internalFind(key, leaf, index);
+    return iterator(leaf, index, this);
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator
+BPlusTree<Key, Value, NodeBytes, Compare>::find(const Key& key) const
+{
+    Leaf* leaf;
+    size_t index;
+    internalFind(key, leaf, index);
+    return const_iterator(leaf, index, this);
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::iterator
+BPlusTree<Key, Value, NodeBytes, Compare>::lower_bound(const Key& key)
+{
+    Leaf* leaf;
+    size_t index;
+    internalLowerBound(key, leaf, index);
+    return iterator(leaf, index, this);
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator
+BPlusTree<Key, Value, NodeBytes, Compare>::lower_bound(const Key& key) const
+{
+    Leaf* leaf;
+    size_t index;
+    internalLowerBound(key, leaf, index);
+    return const_iterator(leaf, index, this);
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::iterator
+BPlusTree<Key, Value, NodeBytes, Compare>::upper_bound(const Key& key)
+{
+    Leaf* leaf;
+    size_t index;
+    internalUpperBound(key, leaf, index);
+    return iterator(leaf, index, this);
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator
+BPlusTree<Key, Value, NodeBytes, Compare>::upper_bound(const Key& key) const
+{
+    Leaf* leaf;
+    size_t index;
+    internalUpperBound(key, leaf, index);
+    return const_iterator(leaf, index, this);
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+std::pair<typename BPlusTree<Key, Value, NodeBytes, Compare>::iterator,
+          typename BPlusTree<Key, Value, NodeBytes, Compare>::iterator>
+BPlusTree<Key, Value, NodeBytes, Compare>::equal_range(const Key& key)
+{
+    return std::make_pair(lower_bound(key), upper_bound(key));
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+std::pair<typename BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator,
+          typename BPlusTree<Key, Value, NodeBytes, Compare>::const_iterator>
+BPlusTree<Key, Value, NodeBytes, Compare>::equal_range(const Key& key) const
+{
+    return std::make_pair(lower_bound(key), upper_bound(key));
+}
+
+/**
+ * Calls fn on every item with lo <= key < hi, in key order: one descent,
+ * then straight runs through the leaves.
+ */
+template<class Key, class Value, size_t NodeBytes, class Compare>
+template<typename Function>
+void BPlusTree<Key, Value, NodeBytes, Compare>::forEachInRange(const Key& lo, const Key& hi, Function fn)
+{
+    Leaf* leaf;
+    size_t index;
+    internalLowerBound(lo, leaf, index);
+    for(; leaf != nullptr; leaf = leaf->next_, index = 0){
+        for(; index < leaf->count_; ++index){
+            if(!comp_(leaf->item(index).first, hi))
+                return;
+            fn(leaf->item(index));
+        }
+    }
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+template<typename Function>
+void BPlusTree<Key, Value, NodeBytes, Compare>::forEachInRange(const Key& lo, const Key& hi, Function fn) const
+{
+    Leaf* leaf;
+    size_t index;
+    internalLowerBound(lo, leaf, index);
+    for(; leaf != nullptr; leaf = leaf->next_, index = 0){
+        for(; index < leaf->count_; ++index){
+            const Leaf* item = leaf;
+            if(!comp_(item->item(index).first, hi))
+                return;
+            fn(item->item(index));
+        }
+    }
+}
+
+/**
+ * @precondition The key exists in the map
+ * Returns the value associated with the key
+ */
+template<class Key, class Value, size_t NodeBytes, class Compare>
+Value& BPlusTree<Key, Value, NodeBytes, Compare>::operator[](const Key& key)
+{
+    Leaf* leaf;
+    size_t index;
+    internalFind(key, leaf, index);
+    if(leaf == nullptr) throw std::out_of_range("Invalid key");
+    return leaf->item(index).second;
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+Value const & BPlusTree<Key, Value, NodeBytes, Compare>::operator[](const Key& key) const
+{
+    Leaf* leaf;
+    size_t index;
+    internalFind(key, leaf, index);
+    if(leaf == nullptr) throw std::out_of_range("Invalid key");
+    return leaf->item(index).second;
+}
+
+/**
+* Returns the number of levels (0 when empty); every leaf is at the same
+* depth, so following the first children is enough.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+size_t BPlusTree<Key, Value, NodeBytes, Compare>::height() const
+{
+    size_t height = 0;
+    for(Node* node = root_; node != nullptr; ){
+        ++height;
+        node = node->leaf_ ? nullptr : static_cast<Inner*>(node)->children_[0];
+    }
+    return height;
+}
+
+template<class Key, class Value, size_t NodeBytes, class Compare>
+bool BPlusTree<Key, Value, NodeBytes, Compare>::isBalanced() const
+{
+    return validate().ok();
+}
+
+/**
+* Prints the items in key order.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+void BPlusTree<Key, Value, NodeBytes, Compare>::print() const
+{
+    if(root_ == nullptr){
+        std::cout << "<empty tree>" << std::endl;
+        return;
+    }
+    for(const_iterator it = begin(); it != end(); ++it)
+        std::cout << it->first << ": " << it->second << std::endl;
+}
+
+/**
+* Checks every invariant of the tree: keys sorted within each node and
+* within the bounds set by the separators above, every leaf at the same
+* depth, every node but the root at least half full, the leaf chain
+* linking the leaves in order, and size() items in all.
+*/
+template<class Key, class Value, size_t NodeBytes, class Compare>
+typename BPlusTree<Key, Value, NodeBytes, Compare>::ValidationResult
+BPlusTree<Key, Value, NodeBytes, Compare>::validate() const
+{
+    ValidationResult result = { nullptr, nullptr };
+    if(root_ == nullptr){
+        if(size_ != 0)
+            result.reason = "empty tree with nonzero size()";
+        return result;
+    }
+    struct Frame
+    {
+        const Node* node;
+        const Key* lo;      // keys must be >= *lo, if set
+        const Key* hi;      // keys must be < *hi, if set
+        size_t depth;
+    };
+    std::vector<Frame> stack;
+    Frame top = { root_, nullptr, nullptr, 1 };
+    stack.push_back(top);
+    size_t leafDepth = 0;
+    size_t items = 0;
+    const Leaf* prevLeaf = nullptr;
+    while(!stack.empty()){
+        Frame frame = stack.back();
+        stack.pop_back();
+        if(frame.node->leaf_){
+            const Leaf* leaf = static_cast<const Leaf*>(frame.node);
+            if(leaf->count_ > 0)
+                result.item = &leaf->item(0);
+            if(leafDepth == 0)
+                leafDepth = frame.depth;
+            if(frame.depth != leafDepth){
+                result.reason = "leaves at different depths";
+                return result;
+            }
+            if(leaf->count_ > kLeafSlots || (frame.node != root_ && leaf->count_ < kMinLeaf)){
+                result.reason = "leaf item count out of range";
+                return result;
+            }
+            for(size_t j = 0; j < leaf->count_; ++j){
+                const Key& k = leaf->item(j).first;
+                if((j > 0 && !comp_(leaf->item(j - 1).first, k)) ||
+                   (frame.lo != nullptr && comp_(k, *frame.lo)) ||
+                   (frame.hi != nullptr && !comp_(k, *frame.hi))){
+                    result.item = &leaf->item(j);
+                    result.reason = "key out of order";
+                    return result;
+                }
+            }
+            if(leaf->prev_ != prevLeaf || (prevLeaf != nullptr && prevLeaf->next_ != leaf)){
+                result.reason = "leaf chain out of order";
+                return result;
+            }
+            prevLeaf = leaf;
+            items += leaf->count_;
+            continue;
+        }
+        const Inner* inner = static_cast<const Inner*>(frame.node);
+        if(inner->count_ + 1u > kInnerSlots || inner->count_ == 0 ||
+           (frame.node != root_ && inner->count_ + 1u < kMinInner)){
+            result.reason = "inner child count out of range";
+            return result;
+        }
+        for(size_t j = 0; j < inner->count_; ++j){
+            const Key& k = inner->keys_[j];
+            if((j > 0 && !comp_(inner->keys_[j - 1], k)) ||
+               (frame.lo != nullptr && comp_(k, *frame.lo)) ||
+               (frame.hi != nullptr && !comp_(k, *frame.hi))){
+                result.reason = "separator out of order";
+                return result;
+            }
+        }
+        // push right to left so that leaves are visited in key order
+        for(size_t j = inner->count_ + 1; j-- > 0; ){
+            Frame child = { inner->children_[j],
+                            j > 0 ? &inner->keys_[j - 1] : frame.lo,
+                            j < inner->count_ ? &inner->keys_[j] : frame.hi,
+                            frame.depth + 1 };
+            stack.push_back(child);
+        }
+    }
+    result.item = nullptr;
+    if(prevLeaf->next_ != nullptr)
+        result.reason = "leaf chain runs past the last leaf";
+    else if(items != size_)
+        result.reason = "item count does not match size()";
+    return result;
+}
+
+/*
+-------------------------------------------------------------
+End implementations for the BPlusTree class.
+-------------------------------------------------------------
+*/
+
+#endif
@@ -0,0 +1,1163 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <numeric>
+#include <cstdlib>
+#include <cstdint>
+#include <cstdio>
+#include <unistd.h>
+#include <thread>
+#include <mutex>
+#include "bst.h"
+#include "avlbst.h"
+#include "compact_avl.h"
+#include "bplus_tree.h"
+#include "persistent_avl.h"
+#include "concurrent_avl.h"
+#include "rcu_avl.h"
+#include "sharded_avl.h"
+#include "avl_image.h"
+
+using namespace std;
+
+/**
+ * Micro benchmarks for the search trees.
+ * Usage: ./bst-bench [benchmark] [n]
+ * With no arguments every benchmark is run with its default size.
+ */
+
+typedef chrono::steady_clock Clock;
+
+double secondsSince(Clock::time_point start)
+{
+    return chrono::duration<double>(Clock::now() - start).count();
+}
+
+void report(const string& name, size_t ops, double secs)
+{
+    cout << "  " << left << setw(36) << name << right
+         << setw(10) << fixed << setprecision(3) << secs << " s"
+         << setw(14) << setprecision(2) << (ops / secs / 1e6) << " Mops/s" << endl;
+}
+
+vector<int> makeKeys(size_t n, const string& order)
+{
+    vector<int> keys(n);
+    for(size_t i = 0; i < n; ++i) {
+        keys[i] = (int)i;
+    }
+    if(order == "reverse") {
+        reverse(keys.begin(), keys.end());
+    }
+    else if(order == "random") {
+        srand(1);
+        random_shuffle(keys.begin(), keys.end());
+    }
+    return keys;
+}
+
+// Resident set size of this process in MB (Linux only).
+double residentMB()
+{
+    long pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if(f == NULL) return 0;
+    if(fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+    fclose(f);
+    return resident * (double)sysconf(_SC_PAGESIZE) / (1024 * 1024);
+}
+
+// Keeps the optimizer from discarding a result.
+volatile long sink;
+
+/**
+ * Reproduces the old AVLTree::insert cost: a find to check for the key, the
+ * insert descent itself, and another find to get the new node back.
+ */
+template<typename Key, typename Value>
+class ThreePassAVLTree : public AVLTree<Key, Value>
+{
+public:
+    void insert(const pair<const Key, Value>& item)
+    {
+        sink += (this->internalFind(item.first) != nullptr);
+        AVLTree<Key, Value>::insert(item);
+        sink += (this->internalFind(item.first) != nullptr);
+    }
+};
+
+struct SumValues
+{
+    long operator()(long total, const pair<const int,int>& item) const
+    {
+        return total + item.second;
+    }
+};
+
+template<typename Tree>
+double timeInserts(const vector<int>& keys)
+{
+    Tree tree;
+    Clock::time_point start = Clock::now();
+    for(size_t i = 0; i < keys.size(); ++i) {
+        tree.insert(make_pair(keys[i], keys[i]));
+    }
+    return secondsSince(start);
+}
+
+void benchInsert(size_t n)
+{
+    const char* orders[] = { "sorted", "reverse", "random" };
+    cout << "insert: " << n << " keys" << endl;
+    for(int i = 0; i < 3; ++i) {
+        vector<int> keys = makeKeys(n, orders[i]);
+        report(string("three-pass  ") + orders[i], n, timeInserts<ThreePassAVLTree<int,int> >(keys));
+        report(string("one-pass    ") + orders[i], n, timeInserts<AVLTree<int,int> >(keys));
+    }
+}
+
+/**
+ * Builds a tree of n random keys, then removes a random key and inserts a
+ * new one n times; clear() is timed separately.
+ */
+template<typename Alloc>
+void benchChurn(const string& name, size_t n)
+{
+    vector<int> keys = makeKeys(2 * n, "random");
+    double rssBefore = residentMB();
+    {
+        AVLTree<int,int,Alloc> tree;
+        Clock::time_point start = Clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            tree.insert(make_pair(keys[i], keys[i]));
+        }
+        report(name + " build", n, secondsSince(start));
+        double rss = residentMB() - rssBefore;
+
+        start = Clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            tree.remove(keys[i]);
+            tree.insert(make_pair(keys[n + i], keys[n + i]));
+        }
+        report(name + " erase+insert churn", 2 * n, secondsSince(start));
+
+        start = Clock::now();
+        tree.clear();
+        report(name + " clear", n, secondsSince(start));
+        cout << "  " << name << " RSS growth " << fixed << setprecision(1) << rss << " MB" << endl;
+    }
+}
+
+void benchValidate(size_t n)
+{
+    cout << "validate: " << n << " keys" << endl;
+    AVLTree<int,int> tree;
+    for(size_t i = 0; i < n; ++i) {
+        tree.insert(make_pair((int)i, (int)i));
+    }
+    Clock::time_point start = Clock::now();
+    bool ok = tree.validate().ok();
+    report(ok ? "validate (ok)" : "validate (FAILED)", n, secondsSince(start));
+    start = Clock::now();
+    ok = tree.isBalanced();
+    report(ok ? "isBalanced (ok)" : "isBalanced (FAILED)", n, secondsSince(start));
+}
+
+/**
+ * In-order scans over n keys, consumed through <numeric> and <algorithm>
+ * directly, against the same scans over a std::map.
+ */
+void benchScan(size_t n)
+{
+    cout << "scan: " << n << " keys, 10 passes" << endl;
+    vector<int> keys = makeKeys(n, "random");
+    AVLTree<int,int> tree;
+    map<int,int> ref;
+    for(size_t i = 0; i < n; ++i) {
+        tree.insert(make_pair(keys[i], keys[i]));
+        ref.insert(make_pair(keys[i], keys[i]));
+    }
+    const int passes = 10;
+    long total = 0;
+    Clock::time_point start = Clock::now();
+    for(int p = 0; p < passes; ++p) {
+        total += accumulate(tree.begin(), tree.end(), 0L, SumValues());
+    }
+    report("AVLTree forward", n * passes, secondsSince(start));
+    start = Clock::now();
+    for(int p = 0; p < passes; ++p) {
+        total += accumulate(tree.rbegin(), tree.rend(), 0L, SumValues());
+    }
+    report("AVLTree reverse", n * passes, secondsSince(start));
+    start = Clock::now();
+    for(int p = 0; p < passes; ++p) {
+        total += accumulate(ref.begin(), ref.end(), 0L, SumValues());
+    }
+    report("std::map forward", n * passes, secondsSince(start));
+    start = Clock::now();
+    for(int p = 0; p < passes; ++p) {
+        total += accumulate(ref.rbegin(), ref.rend(), 0L, SumValues());
+    }
+    report("std::map reverse", n * passes, secondsSince(start));
+    sink += total;
+}
+
+/**
+ * Loads n sorted pairs with one insert per key and with buildFromSorted.
+ */
+void benchBulkLoad(size_t n)
+{
+    cout << "bulk load: " << n << " sorted pairs" << endl;
+    vector<pair<int,int> > items(n);
+    for(size_t i = 0; i < n; ++i) {
+        items[i] = make_pair((int)i, (int)i);
+    }
+    {
+        AVLTree<int,int,SlabNodeAlloc> tree;
+        Clock::time_point start = Clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            tree.insert(items[i]);
+        }
+        report("insert per key", n, secondsSince(start));
+    }
+    {
+        AVLTree<int,int,SlabNodeAlloc> tree;
+        Clock::time_point start = Clock::now();
+        tree.buildFromSorted(items.begin(), items.end());
+        report("buildFromSorted", n, secondsSince(start));
+        sink += tree.height();
+    }
+}
+
+/**
+ * Random point lookups (hits and misses) on a tree of n random keys, plus
+ * the per-node footprint.
+ */
+template<typename Tree>
+void benchLookupOn(const string& name, const vector<int>& keys, const vector<int>& probes)
+{
+    Tree tree;
+    for(size_t i = 0; i < keys.size(); ++i) {
+        tree.insert(make_pair(keys[i], keys[i]));
+    }
+    long found = 0;
+    Clock::time_point start = Clock::now();
+    for(size_t i = 0; i < probes.size(); ++i) {
+        found += (tree.find(probes[i]) != tree.end());
+    }
+    report(name + " find", probes.size(), secondsSince(start));
+    sink += found;
+}
+
+void benchLookup(size_t n)
+{
+    cout << "lookup: " << n << " keys, " << 2 * n << " probes" << endl;
+    cout << "  sizeof(Node<int,int>)    " << sizeof(Node<int,int>) << " bytes" << endl;
+    cout << "  sizeof(AVLNode<int,int>) " << sizeof(AVLNode<int,int>) << " bytes" << endl;
+    cout << "  sizeof(CompactAVLNode<int,int>) " << sizeof(CompactAVLNode<int,int>) << " bytes" << endl;
+    vector<int> keys = makeKeys(2 * n, "random");
+    vector<int> probes(keys);
+    keys.resize(n);
+    srand(2);
+    random_shuffle(probes.begin(), probes.end());
+    benchLookupOn<AVLTree<int,int> >("AVLTree", keys, probes);
+    benchLookupOn<AVLTree<int,int,SlabNodeAlloc> >("AVLTree slab", keys, probes);
+    benchLookupOn<CompactAVLTree<int,int> >("CompactAVLTree", keys, probes);
+}
+
+/**
+ * Memory per item: resident growth while n random keys are inserted,
+ * divided by n. Includes allocator overhead and, for the compact tree,
+ * the unused part of the pool.
+ */
+template<typename Tree>
+void benchFootprint(const string& name, size_t n)
+{
+    vector<int> keys = makeKeys(n, "random");
+    double before = residentMB();
+    Clock::time_point start = Clock::now();
+    Tree tree;
+    for(size_t i = 0; i < n; ++i) {
+        tree.insert(make_pair(keys[i], keys[i]));
+    }
+    double secs = secondsSince(start);
+    double bytes = (residentMB() - before) * 1024 * 1024 / n;
+    report(name + " insert", n, secs);
+    cout << "  " << left << setw(36) << (name + " memory") << right
+         << setw(10) << setprecision(1) << bytes << " bytes/item" << endl;
+    sink += tree.size();
+}
+
+// Adds up the values of the items it is shown.
+struct ValueSum
+{
+    long* total;
+    void operator()(const pair<const int,int>& item) const { *total += item.second; }
+};
+
+/**
+ * One backend through the same workload: random inserts, random point
+ * lookups (half of them misses), range scans of about 100 items, and a
+ * full in-order pass.
+ */
+template<typename Tree>
+void benchBackendOn(const string& name, const vector<int>& keys, const vector<int>& probes)
+{
+    size_t n = keys.size();
+    Tree tree;
+    Clock::time_point start = Clock::now();
+    for(size_t i = 0; i < n; ++i) {
+        tree.insert(make_pair(keys[i], keys[i]));
+    }
+    report(name + " insert", n, secondsSince(start));
+
+    long found = 0;
+    start = Clock::now();
+    for(size_t i = 0; i < probes.size(); ++i) {
+        found += (tree.find(probes[i]) != tree.end());
+    }
+    report(name + " lookup", probes.size(), secondsSince(start));
+
+    // keys are 0..2n-1 and half of them are present, so a window of 200
+    // holds about 100 items
+    long total = 0;
+    ValueSum sum = { &total };
+    size_t scans = n / 100;
+    start = Clock::now();
+    for(size_t i = 0; i < scans; ++i) {
+        int lo = probes[i];
+        tree.forEachInRange(lo, lo + 200, sum);
+    }
+    report(name + " range scan (items)", scans * 100, secondsSince(start));
+
+    start = Clock::now();
+    total += accumulate(tree.begin(), tree.end(), 0L, SumValues());
+    report(name + " full scan", n, secondsSince(start));
+    sink += found + total;
+}
+
+void benchBackends(size_t n)
+{
+    cout << "backends: " << n << " random keys" << endl;
+    vector<int> keys = makeKeys(2 * n, "random");
+    vector<int> probes(keys);
+    keys.resize(n);
+    srand(3);
+    random_shuffle(probes.begin(), probes.end());
+    probes.resize(n);
+    benchBackendOn<AVLTree<int,int> >("AVLTree", keys, probes);
+    benchBackendOn<AVLTree<int,int,SlabNodeAlloc> >("AVLTree slab", keys, probes);
+    benchBackendOn<CompactAVLTree<int,int> >("CompactAVLTree", keys, probes);
+    benchBackendOn<BPlusTree<int,int,64> >("BPlusTree<64>", keys, probes);
+    benchBackendOn<BPlusTree<int,int,256> >("BPlusTree<256>", keys, probes);
+    benchBackendOn<BPlusTree<int,int,1024> >("BPlusTree<1024>", keys, probes);
+    benchBackendOn<BPlusTree<int,int,4096> >("BPlusTree<4096>", keys, probes);
+}
+
+// The in-node search BPlusTree used before KeySearch: a plain binary
+// search with a data-dependent branch per step.
+size_t branchyUpperBound(const int* keys, size_t n, int key)
+{
+    size_t lo = 0, hi = n;
+    while(lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if(key < keys[mid]) hi = mid;
+        else lo = mid + 1;
+    }
+    return lo;
+}
+
+/**
+ * Upper-bound searches over one sorted node-sized key array, the way an
+ * inner node is searched on the way down. Probes are random so the
+ * branch predictor cannot learn them.
+ */
+void benchNodeSearch(size_t width, size_t searches)
+{
+    vector<int> keys(width);
+    for(size_t i = 0; i < width; ++i) {
+        keys[i] = (int)(i * 4);
+    }
+    vector<int> probes(4096);
+    srand(5);
+    for(size_t i = 0; i < probes.size(); ++i) {
+        probes[i] = rand() % (int)(width * 4 + 8) - 4;
+    }
+    ostringstream label;
+    label << width << " keys ";
+
+    long total = 0;
+    Clock::time_point start = Clock::now();
+    for(size_t i = 0; i < searches; ++i) {
+        total += branchyUpperBound(&keys[0], width, probes[i & 4095]);
+    }
+    report(label.str() + "branchy", searches, secondsSince(start));
+
+    const char* names[] = { "scalar", "SSE2", "AVX2" };
+    int best = searchLevel();
+    for(int level = kSearchScalar; level <= best; ++level) {
+        searchLevel() = level;
+        start = Clock::now();
+        for(size_t i = 0; i < searches; ++i) {
+            total += KeySearch<int>::upperBound(&keys[0], width, probes[i & 4095]);
+        }
+        report(label.str() + names[level], searches, secondsSince(start));
+    }
+    searchLevel() = best;
+    sink += total;
+}
+
+template<typename Tree, typename Key>
+void benchTreeSearch(const string& name, const vector<Key>& keys, const vector<Key>& probes)
+{
+    Tree tree;
+    for(size_t i = 0; i < keys.size(); ++i) {
+        tree.insert(make_pair(keys[i], 0));
+    }
+    const char* names[] = { " scalar", " SSE2", " AVX2" };
+    int best = searchLevel();
+    for(int level = kSearchScalar; level <= best; ++level) {
+        searchLevel() = level;
+        long found = 0;
+        Clock::time_point start = Clock::now();
+        for(size_t i = 0; i < probes.size(); ++i) {
+            found += (tree.find(probes[i]) != tree.end());
+        }
+        report(name + names[level], probes.size(), secondsSince(start));
+        sink += found;
+    }
+    searchLevel() = best;
+}
+
+void benchSimd(size_t n)
+{
+    cout << "simd: in-node search, " << n << " searches per width" << endl;
+    benchNodeSearch(20, n);
+    benchNodeSearch(84, n);
+    benchNodeSearch(340, n);
+
+    cout << "simd: BPlusTree lookups, " << n << " random keys" << endl;
+    vector<int> keys = makeKeys(2 * n, "random");
+    vector<int> probes(keys);
+    keys.resize(n);
+    srand(3);
+    random_shuffle(probes.begin(), probes.end());
+    probes.resize(n);
+    benchTreeSearch<BPlusTree<int,int,256> >("BPlusTree<256>", keys, probes);
+    benchTreeSearch<BPlusTree<int,int,1024> >("BPlusTree<1024>", keys, probes);
+    benchTreeSearch<BPlusTree<int,int,4096> >("BPlusTree<4096>", keys, probes);
+
+    vector<double> dkeys(keys.begin(), keys.end());
+    vector<double> dprobes(probes.begin(), probes.end());
+    benchTreeSearch<BPlusTree<double,int,1024> >("BPlusTree<double,1024>", dkeys, dprobes);
+}
+
+// Orders strings with operator< alone, so the trees cannot use the
+// three-way std::string::compare hook and take the one-< descent instead.
+struct PlainStringLess
+{
+    bool operator()(const string& a, const string& b) const { return a < b; }
+};
+
+template<typename Tree>
+void benchStringsOn(const string& name, const vector<string>& keys, const vector<string>& probes)
+{
+    Tree tree;
+    Clock::time_point start = Clock::now();
+    for(size_t i = 0; i < keys.size(); ++i) {
+        tree.insert(make_pair(keys[i], (int)i));
+    }
+    report(name + " insert", keys.size(), secondsSince(start));
+
+    // small trees are probed several times over so that the time is spent
+    // comparing keys rather than missing the cache
+    size_t rounds = keys.size() < 1000000 ? 1000000 / keys.size() : 1;
+    long found = 0;
+    start = Clock::now();
+    for(size_t r = 0; r < rounds; ++r) {
+        for(size_t i = 0; i < probes.size(); ++i) {
+            found += (tree.find(probes[i]) != tree.end());
+        }
+    }
+    report(name + " lookup", rounds * probes.size(), secondsSince(start));
+    sink += found;
+}
+
+/**
+* String keys that share a long prefix, so every comparison has to scan
+* it before it finds a difference. Half of the lookups miss.
+*/
+void benchStrings(size_t n)
+{
+    cout << "strings: " << n << " keys with a 64-byte shared prefix" << endl;
+    vector<int> ids = makeKeys(2 * n, "random");
+    vector<string> keys, probes;
+    const string prefix(64, 'k');
+    for(size_t i = 0; i < 2 * n; ++i) {
+        char digits[16];
+        snprintf(digits, sizeof(digits), "%010d", ids[i]);
+        (i < n ? keys : probes).push_back(prefix + digits);
+    }
+    srand(4);
+    random_shuffle(probes.begin(), probes.end());
+    for(size_t i = 0; i < n / 2; ++i) {
+        probes[i] = keys[rand() % n];
+    }
+    benchStringsOn<AVLTree<string,int> >("AVLTree", keys, probes);
+    benchStringsOn<AVLTree<string,int,HeapNodeAlloc,AVLNode<string,int>,PlainStringLess> >(
+        "AVLTree operator<", keys, probes);
+    benchStringsOn<BinarySearchTree<string,int> >("BinarySearchTree", keys, probes);
+    benchStringsOn<CompactAVLTree<string,int> >("CompactAVLTree", keys, probes);
+    benchStringsOn<CompactAVLTree<string,int,PlainStringLess> >("CompactAVLTree operator<", keys, probes);
+    benchStringsOn<BPlusTree<string,int,1024> >("BPlusTree<1024>", keys, probes);
+    benchStringsOn<map<string,int> >("std::map", keys, probes);
+}
+
+// A bijection on 32-bit values, so mixKey(0..n-1) are n distinct keys in
+// random order that need no vector to hold them.
+int mixKey(uint32_t i)
+{
+    uint32_t x = i * 0x9E3779B1u;
+    x ^= x >> 16;
+    x *= 0x85EBCA6Bu;
+    x ^= x >> 13;
+    return (int)x;
+}
+
+/**
+* Looks up the same probes with a loop of find calls and with findBatch.
+* The tree is filled in random order so that nodes are scattered over the
+* heap as they would be after a long run of inserts. Half the probes miss.
+*/
+void benchFindBatchOn(size_t n, size_t lookups)
+{
+    cout << "batch: " << n << " keys, " << lookups << " lookups" << endl;
+    AVLTree<int,int,SlabNodeAlloc> tree;
+    for(size_t i = 0; i < n; ++i) {
+        tree.insert(make_pair(mixKey((uint32_t)i), (int)i));
+    }
+    vector<int> probes(lookups);
+    srand(9);
+    for(size_t i = 0; i < lookups; ++i) {
+        uint32_t r = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+        probes[i] = mixKey((uint32_t)(r % (2 * n)));
+    }
+
+    long found = 0;
+    Clock::time_point start = Clock::now();
+    for(size_t i = 0; i < lookups; ++i) {
+        found += (tree.find(probes[i]) != tree.end());
+    }
+    report("find loop", lookups, secondsSince(start));
+
+    // handlers look up a few hundred keys at a time
+    const size_t kRequest = 256;
+    vector<AVLTree<int,int,SlabNodeAlloc>::iterator> out(kRequest);
+    long batchFound = 0;
+    start = Clock::now();
+    for(size_t i = 0; i < lookups; i += kRequest) {
+        size_t len = min(kRequest, lookups - i);
+        tree.findBatch(probes.begin() + i, probes.begin() + i + len, out.begin());
+        for(size_t j = 0; j < len; ++j) {
+            batchFound += (out[j] != tree.end());
+        }
+    }
+    report("findBatch", lookups, secondsSince(start));
+    if(found != batchFound) {
+        cout << "  findBatch disagrees with find" << endl;
+    }
+    sink += found;
+}
+
+// 64M keys also fit in 5GB with the slab allocator, but take minutes to
+// build; pass the size to run them
+void benchFindBatch(size_t n)
+{
+    if(n) {
+        benchFindBatchOn(n, 2000000);
+        return;
+    }
+    benchFindBatchOn(1000000, 2000000);
+    benchFindBatchOn(16000000, 2000000);
+}
+
+typedef AVLTree<int,int> BatchTree;
+
+// A tree of n random even keys, filled in random order.
+void fillEven(BatchTree& tree, size_t n)
+{
+    for(size_t i = 0; i < n; ++i) {
+        int key = (int)(mixKey((uint32_t)i) & ~1u);
+        tree.insert(make_pair(key, (int)i));
+    }
+}
+
+/**
+* Applies a sorted batch of k keys to a tree of n keys, once as a loop of
+* insert/remove calls and once as insertBatch/eraseBatch. Half the
+* inserted keys are new (odd), and the erased keys are present.
+*/
+void benchBatchUpdateOn(size_t n, size_t k)
+{
+    vector<pair<int,int> > items(k);
+    vector<int> keys(k);
+    srand(13);
+    for(size_t i = 0; i < k; ++i) {
+        int key = (int)(mixKey((uint32_t)(rand() % n)) & ~1u);
+        items[i] = make_pair(key | (int)(i & 1), (int)i);
+        keys[i] = key;
+    }
+    sort(items.begin(), items.end());
+    sort(keys.begin(), keys.end());
+    ostringstream label;
+    label << "k=" << k << " ";
+
+    BatchTree a, b;
+    fillEven(a, n);
+    fillEven(b, n);
+    Clock::time_point start = Clock::now();
+    for(size_t i = 0; i < k; ++i) {
+        a.insert(items[i]);
+    }
+    report(label.str() + "insert loop", k, secondsSince(start));
+    start = Clock::now();
+    b.insertBatch(items.begin(), items.end());
+    report(label.str() + "insertBatch", k, secondsSince(start));
+
+    start = Clock::now();
+    for(size_t i = 0; i < k; ++i) {
+        a.remove(keys[i]);
+    }
+    report(label.str() + "remove loop", k, secondsSince(start));
+    start = Clock::now();
+    b.eraseBatch(keys.begin(), keys.end());
+    report(label.str() + "eraseBatch", k, secondsSince(start));
+    if(a.size() != b.size()) {
+        cout << "  batch and loop disagree" << endl;
+    }
+}
+
+void benchBatchUpdate(size_t n)
+{
+    cout << "batchupdate: tree of " << n << " keys" << endl;
+    // batch sizes as k = n * num / den, up to twice the tree
+    const size_t num[] = { 1, 1, 1, 1, 1, 1, 2 };
+    const size_t den[] = { 1000, 100, 16, 8, 2, 1, 1 };
+    for(size_t i = 0; i < sizeof(num) / sizeof(num[0]); ++i) {
+        benchBatchUpdateOn(n, n * num[i] / den[i]);
+    }
+}
+
+/**
+* Re-shards a tree of n keys in two at the median and merges the halves
+* back, once by copying the items into new trees and once with split and
+* join. A plain AVLTree leaves the sizes of the halves to be counted on
+* the first size() call, which is timed apart; the order-statistic tree
+* reads them off its counts.
+*/
+template<typename Tree>
+void benchSplitJoinOn(const string& name, size_t n)
+{
+    Tree tree;
+    vector<int> keys(n);
+    for(size_t i = 0; i < n; ++i) {
+        keys[i] = (int)(mixKey((uint32_t)i) & ~1u);
+        tree.insert(make_pair(keys[i], (int)i));
+    }
+    nth_element(keys.begin(), keys.begin() + n / 2, keys.end());
+    int median = keys[n / 2];
+
+    Clock::time_point start = Clock::now();
+    Tree less, greater;
+    for(typename Tree::iterator it = tree.begin(); it != tree.end(); ++it) {
+        (it->first < median ? less : greater).insert(*it);
+    }
+    report(name + " split by copying", n, secondsSince(start));
+    start = Clock::now();
+    Tree joined;
+    for(typename Tree::iterator it = less.begin(); it != less.end(); ++it) {
+        joined.insert(*it);
+    }
+    for(typename Tree::iterator it = greater.begin(); it != greater.end(); ++it) {
+        joined.insert(*it);
+    }
+    report(name + " join by copying", n, secondsSince(start));
+
+    Tree lessHalf, greaterHalf;
+    start = Clock::now();
+    tree.split(median, lessHalf, greaterHalf);
+    report(name + " split", n, secondsSince(start));
+    start = Clock::now();
+    tree.join(lessHalf, greaterHalf);
+    report(name + " join", n, secondsSince(start));
+    start = Clock::now();
+    size_t size = tree.size();
+    report(name + " first size()", n, secondsSince(start));
+    if(size != joined.size() || lessHalf.size() != 0) {
+        cout << "  split/join lost items" << endl;
+    }
+}
+
+void benchSplitJoin(size_t n)
+{
+    cout << "splitjoin: tree of " << n << " keys" << endl;
+    benchSplitJoinOn<AVLTree<int,int> >("AVLTree", n);
+    benchSplitJoinOn<OrderStatisticTree<int,int> >("OrderStatisticTree", n);
+}
+
+// The second tree of benchSetOps: n random even keys, a third of them
+// also in fillEven's tree of n.
+void fillShifted(BatchTree& tree, size_t n)
+{
+    for(size_t i = 0; i < n; ++i) {
+        int key = (int)(mixKey((uint32_t)(i + n * 2 / 3)) & ~1u);
+        tree.insert(make_pair(key, (int)i));
+    }
+}
+
+/**
+* Set operations on two trees of n random keys each: a loop that inserts
+* or removes the other tree's items, then unionWith, intersectWith and
+* differenceWith without a pool and on pools of 2 and 4 threads. The
+* trees are built again for every run, outside the timing.
+*/
+void benchSetOps(size_t n)
+{
+    cout << "setops: two trees of " << n << " keys, "
+         << thread::hardware_concurrency() << " hardware threads" << endl;
+    BatchTree a, b;
+    fillEven(a, n);
+    fillShifted(b, n);
+    Clock::time_point start = Clock::now();
+    for(BatchTree::iterator it = b.begin(); it != b.end(); ++it) {
+        a.insert(*it);
+    }
+    report("union by insert loop", n, secondsSince(start));
+    size_t unionSize = a.size();
+
+    BatchTree c;
+    fillEven(c, n);
+    start = Clock::now();
+    for(BatchTree::iterator it = b.begin(); it != b.end(); ++it) {
+        c.remove(it->first);
+    }
+    report("difference by remove loop", n, secondsSince(start));
+    size_t differenceSize = c.size();
+
+    const size_t threads[] = { 1, 2, 4 };
+    for(size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); ++t) {
+        TaskPool pool(threads[t]);
+        TaskPool* p = threads[t] > 1 ? &pool : NULL;
+        ostringstream label;
+        label << threads[t] << " thread" << (threads[t] > 1 ? "s " : " ");
+        for(int op = 0; op < 3; ++op) {
+            BatchTree x, y;
+            fillEven(x, n);
+            fillShifted(y, n);
+            start = Clock::now();
+            if(op == 0) {
+                x.unionWith(y, KeepOurs(), p);
+                report(label.str() + "unionWith", n, secondsSince(start));
+                if(x.size() != unionSize) {
+                    cout << "  unionWith and the insert loop disagree" << endl;
+                }
+            }
+            else if(op == 1) {
+                x.intersectWith(y, KeepOurs(), p);
+                report(label.str() + "intersectWith", n, secondsSince(start));
+            }
+            else {
+                x.differenceWith(y, p);
+                report(label.str() + "differenceWith", n, secondsSince(start));
+                if(x.size() != differenceSize) {
+                    cout << "  differenceWith and the remove loop disagree" << endl;
+                }
+            }
+        }
+    }
+}
+
+/**
+* PersistentAVLTree against AVLTree: random inserts, with and without a
+* snapshot taken every 1000 writes (each write after a snapshot copies
+* its path), then the cost of a consistent view: snapshot() against
+* copying the items into a new AVLTree.
+*/
+void benchPersistent(size_t n)
+{
+    cout << "persistent: " << n << " random keys" << endl;
+    AVLTree<int,int> plain;
+    Clock::time_point start = Clock::now();
+    for(size_t i = 0; i < n; ++i) {
+        plain.insert(make_pair((int)mixKey((uint32_t)i), (int)i));
+    }
+    report("AVLTree insert", n, secondsSince(start));
+
+    PersistentAVLTree<int,int> tree;
+    start = Clock::now();
+    for(size_t i = 0; i < n; ++i) {
+        tree.insert(make_pair((int)mixKey((uint32_t)i), (int)i));
+    }
+    report("PersistentAVLTree insert", n, secondsSince(start));
+
+    PersistentAVLTree<int,int> versioned;
+    vector<PersistentAVLTree<int,int> > versions;
+    start = Clock::now();
+    for(size_t i = 0; i < n; ++i) {
+        if(i % 1000 == 0) {
+            versions.push_back(versioned.snapshot());
+        }
+        versioned.insert(make_pair((int)mixKey((uint32_t)i), (int)i));
+    }
+    report("  with a snapshot every 1000", n, secondsSince(start));
+    start = Clock::now();
+    versions.clear();
+    report("  dropping the snapshots", n / 1000, secondsSince(start));
+
+    start = Clock::now();
+    long sum = 0;
+    for(size_t i = 0; i < n; ++i) {
+        sum += plain.find((int)mixKey((uint32_t)(i * 7 % n)))->second;
+    }
+    report("AVLTree find", n, secondsSince(start));
+    start = Clock::now();
+    for(size_t i = 0; i < n; ++i) {
+        sum += tree.find((int)mixKey((uint32_t)(i * 7 % n)))->second;
+    }
+    report("PersistentAVLTree find", n, secondsSince(start));
+    sink += sum;
+
+    const size_t views = 1000;
+    start = Clock::now();
+    for(size_t i = 0; i < views; ++i) {
+        PersistentAVLTree<int,int> view = tree.snapshot();
+        sink += view.size();
+    }
+    report("snapshot()", views, secondsSince(start));
+    start = Clock::now();
+    AVLTree<int,int> copy(plain.begin(), plain.end());
+    report("AVLTree copy", 1, secondsSince(start));
+    sink += copy.size();
+}
+
+/**
+* The baseline for benchConcurrent: AVLTree behind one std::mutex.
+*/
+class MutexAVLTree
+{
+public:
+    bool find(int key, int& value) const
+    {
+        lock_guard<mutex> guard(lock_);
+        AVLTree<int,int>::const_iterator it = tree_.find(key);
+        if(it == tree_.end()) {
+            return false;
+        }
+        value = it->second;
+        return true;
+    }
+    void insert(const pair<int,int>& item)
+    {
+        lock_guard<mutex> guard(lock_);
+        tree_.insert(item);
+    }
+    bool remove(int key)
+    {
+        lock_guard<mutex> guard(lock_);
+        tree_.remove(key);
+        return true;
+    }
+private:
+    AVLTree<int,int> tree_;
+    mutable mutex lock_;
+};
+
+/**
+* Runs ops operations split over the given number of threads on a tree
+* of n keys; writePercent of them are writes, half inserts and half
+* removes, so the size stays about n.
+*/
+template<typename Tree>
+double runMixed(Tree& tree, size_t n, size_t ops, size_t threads, int writePercent)
+{
+    vector<thread> workers;
+    Clock::time_point start = Clock::now();
+    for(size_t t = 0; t < threads; ++t) {
+        workers.push_back(thread([&tree, n, ops, threads, writePercent, t]() {
+            uint32_t state = (uint32_t)t * 7919u + 1;
+            long found = 0;
+            for(size_t i = 0; i < ops / threads; ++i) {
+                state = state * 1103515245u + 12345u;
+                int key = (int)mixKey((state >> 8) % (uint32_t)(2 * n));
+                int dice = (int)((state >> 4) % 100);
+                int value;
+                if(dice >= writePercent) {
+                    found += tree.find(key, value);
+                }
+                else if(dice % 2 == 0) {
+                    tree.insert(make_pair(key, (int)i));
+                }
+                else {
+                    tree.remove(key);
+                }
+            }
+            sink += found;
+        }));
+    }
+    for(size_t t = 0; t < workers.size(); ++t) {
+        workers[t].join();
+    }
+    return secondsSince(start);
+}
+
+/**
+* ConcurrentAVLTree, RWLockedAVLTree and RcuAVLTree against one global
+* mutex, at 95/5 and 50/50
+* read/write mixes and 1 to 64 threads. Keys are drawn from twice the
+* preloaded range, so half the lookups miss.
+*/
+void benchConcurrent(size_t n)
+{
+    const size_t ops = 2000000;
+    cout << "concurrent: " << n << " keys, " << ops << " operations, "
+         << thread::hardware_concurrency() << " hardware threads" << endl;
+    const int mixes[] = { 5, 50 };
+    const size_t threadCounts[] = { 1, 2, 4, 8, 16, 32, 64 };
+    for(size_t m = 0; m < 2; ++m) {
+        for(size_t t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); ++t) {
+            MutexAVLTree locked;
+            ConcurrentAVLTree<int,int> concurrent;
+            RWLockedAVLTree<int,int> rwLocked;
+            RcuAVLTree<int,int> rcu;
+            for(size_t i = 0; i < n; ++i) {
+                int key = (int)mixKey((uint32_t)(2 * i));
+                locked.insert(make_pair(key, (int)i));
+                concurrent.insert(make_pair(key, (int)i));
+                rwLocked.insert(make_pair(key, (int)i));
+                rcu.insert(make_pair(key, (int)i));
+            }
+            ostringstream label;
+            label << (100 - mixes[m]) << "/" << mixes[m] << " " << threadCounts[t] << " threads ";
+            report(label.str() + "mutex", ops, runMixed(locked, n, ops, threadCounts[t], mixes[m]));
+            report(label.str() + "concurrent", ops, runMixed(concurrent, n, ops, threadCounts[t], mixes[m]));
+            report(label.str() + "rw-locked", ops, runMixed(rwLocked, n, ops, threadCounts[t], mixes[m]));
+            report(label.str() + "rcu", ops, runMixed(rcu, n, ops, threadCounts[t], mixes[m]));
+        }
+    }
+}
+
+/**
+* Write-only throughput of ShardedAVLMap at 1, 8 and 32 shards against
+* the single-lock MutexAVLTree, then the cost of a full in-order scan
+* through the merge iterator against a scan of one tree.
+*/
+void benchSharded(size_t n)
+{
+    const size_t ops = 2000000;
+    cout << "sharded: " << n << " keys, " << ops << " writes, "
+         << thread::hardware_concurrency() << " hardware threads" << endl;
+    const size_t threadCounts[] = { 1, 2, 4, 8, 16, 32 };
+    const size_t shardCounts[] = { 1, 8, 32 };
+    for(size_t t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); ++t) {
+        ostringstream label;
+        label << threadCounts[t] << " threads ";
+        MutexAVLTree locked;
+        for(size_t i = 0; i < n; ++i) {
+            locked.insert(make_pair((int)mixKey((uint32_t)(2 * i)), (int)i));
+        }
+        report(label.str() + "mutex", ops, runMixed(locked, n, ops, threadCounts[t], 100));
+        for(size_t s = 0; s < sizeof(shardCounts) / sizeof(shardCounts[0]); ++s) {
+            ShardedAVLMap<int,int> map(shardCounts[s]);
+            for(size_t i = 0; i < n; ++i) {
+                map.insert(make_pair((int)mixKey((uint32_t)(2 * i)), (int)i));
+            }
+            ostringstream name;
+            name << label.str() << shardCounts[s] << " shards";
+            report(name.str(), ops, runMixed(map, n, ops, threadCounts[t], 100));
+        }
+    }
+
+    AVLTree<int,int> tree;
+    ShardedAVLMap<int,int> map(32);
+    for(size_t i = 0; i < n; ++i) {
+        int key = (int)mixKey((uint32_t)i);
+        tree.insert(make_pair(key, (int)i));
+        map.insert(make_pair(key, (int)i));
+    }
+    Clock::time_point start = Clock::now();
+    long sum = 0;
+    for(AVLTree<int,int>::const_iterator it = tree.begin(); it != tree.end(); ++it) {
+        sum += it->second;
+    }
+    report("scan one tree", n, secondsSince(start));
+    start = Clock::now();
+    for(ShardedAVLMap<int,int>::const_iterator it = map.begin(); it != map.end(); ++it) {
+        sum += it->second;
+    }
+    report("scan 32 shards merged", n, secondsSince(start));
+    sink += sum;
+}
+
+/**
+* A full-tree sum through begin()..end() against parallelReduce on 1 to
+* 8 threads, for trees without and with subtree counts.
+*/
+template<typename Tree>
+void benchParallelTraversal(const char* name, size_t n)
+{
+    Tree tree;
+    for(size_t i = 0; i < n; ++i) {
+        tree.insert(make_pair((int)mixKey((uint32_t)i), (int)i));
+    }
+    cout << name << ": " << n << " keys, " << thread::hardware_concurrency() << " hardware threads" << endl;
+    Clock::time_point start = Clock::now();
+    long sum = 0;
+    for(typename Tree::const_iterator it = tree.begin(); it != tree.end(); ++it) {
+        sum += it->second;
+    }
+    report("iterator sum", n, secondsSince(start));
+    const size_t threadCounts[] = { 1, 2, 4, 8 };
+    for(size_t t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); ++t) {
+        TaskPool pool(threadCounts[t]);
+        start = Clock::now();
+        long total = tree.parallelReduce([](const pair<const int,int>& item) { return (long)item.second; },
+                                         [](long a, long b) { return a + b; }, 0L, pool);
+        ostringstream label;
+        label << "parallelReduce " << threadCounts[t] << " threads";
+        report(label.str(), n, secondsSince(start));
+        sink += total == sum;
+    }
+}
+
+/**
+* A warm restart three ways: re-inserting every pair, loadFrom of a
+* saved image, and opening a MappedAVLTree over it; then random lookups
+* in the loaded tree against the mapped view.
+*/
+void benchImage(size_t n)
+{
+    const string path = "/tmp/bst-bench-image.bin";
+    vector<pair<int,int> > items;
+    for(size_t i = 0; i < n; ++i) {
+        items.push_back(make_pair((int)mixKey((uint32_t)i), (int)i));
+    }
+    cout << "image: " << n << " keys" << endl;
+    Clock::time_point start = Clock::now();
+    AVLTree<int,int> tree;
+    for(size_t i = 0; i < n; ++i) {
+        tree.insert(items[i]);
+    }
+    report("rebuild by insert", n, secondsSince(start));
+    start = Clock::now();
+    tree.saveTo(path);
+    report("saveTo", n, secondsSince(start));
+
+    start = Clock::now();
+    AVLTree<int,int> loaded;
+    loaded.loadFrom(path);
+    report("loadFrom", n, secondsSince(start));
+    start = Clock::now();
+    MappedAVLTree<int,int> mapped(path);
+    report("open mapped view", n, secondsSince(start));
+
+    vector<int> probes;
+    for(size_t i = 0; i < n; ++i) {
+        probes.push_back(items[(i * 7919) % n].first);
+    }
+    start = Clock::now();
+    long found = 0;
+    for(size_t i = 0; i < n; ++i) {
+        found += loaded.find(probes[i])->second;
+    }
+    report("find in loaded tree", n, secondsSince(start));
+    start = Clock::now();
+    for(size_t i = 0; i < n; ++i) {
+        found += mapped.find(probes[i])->second;
+    }
+    report("find in mapped view", n, secondsSince(start));
+    sink += found;
+    remove(path.c_str());
+}
+
+int main(int argc, char* argv[])
+{
+    string which = argc > 1 ? argv[1] : "all";
+    size_t n = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+
+    if(which == "all" || which == "insert") {
+        benchInsert(n ? n : 1000000);
+    }
+    if(which == "all" || which == "lookup") {
+        benchLookup(n ? n : 1000000);
+    }
+    if(which == "all" || which == "backends") {
+        benchBackends(n ? n : 1000000);
+    }
+    if(which == "all" || which == "simd") {
+        benchSimd(n ? n : 1000000);
+    }
+    if(which == "all" || which == "batch") {
+        benchFindBatch(n);
+    }
+    if(which == "all" || which == "batchupdate") {
+        benchBatchUpdate(n ? n : 1000000);
+    }
+    if(which == "all" || which == "splitjoin") {
+        benchSplitJoin(n ? n : 1000000);
+    }
+    if(which == "all" || which == "setops") {
+        benchSetOps(n ? n : 1000000);
+    }
+    if(which == "all" || which == "persistent") {
+        benchPersistent(n ? n : 1000000);
+    }
+    if(which == "all" || which == "concurrent") {
+        benchConcurrent(n ? n : 100000);
+    }
+    if(which == "all" || which == "sharded") {
+        benchSharded(n ? n : 100000);
+    }
+    if(which == "all" || which == "traversal") {
+        benchParallelTraversal<AVLTree<int,int> >("AVLTree traversal", n ? n : 1000000);
+        benchParallelTraversal<OrderStatisticTree<int,int> >("OrderStatisticTree traversal", n ? n : 1000000);
+    }
+    if(which == "all" || which == "image") {
+        benchImage(n ? n : 1000000);
+    }
+    if(which == "all" || which == "strings") {
+        benchStrings(n ? n : 1000000);
+    }
+    if(which == "all" || which == "scan") {
+        benchScan(n ? n : 1000000);
+    }
+    if(which == "all" || which == "bulkload") {
+        benchBulkLoad(n ? n : 50000000);
+    }
+    if(which == "all" || which == "validate") {
+        benchValidate(n ? n : 10000000);
+    }
+    // run footprint-* in separate processes for clean RSS numbers
+    if(which == "all" || which == "footprint" || which == "footprint-compact") {
+        cout << "footprint: " << (n ? n : 1000000) << " keys" << endl;
+        benchFootprint<CompactAVLTree<int,int> >("CompactAVLTree", n ? n : 1000000);
+    }
+    if(which == "all" || which == "footprint" || which == "footprint-avl") {
+        cout << "footprint: " << (n ? n : 1000000) << " keys" << endl;
+        benchFootprint<AVLTree<int,int> >("AVLTree", n ? n : 1000000);
+    }
+    // run alloc-heap and alloc-slab in separate processes for clean RSS numbers
+    if(which == "all" || which == "alloc" || which == "alloc-heap") {
+        cout << "allocator: " << (n ? n : 1000000) << " keys" << endl;
+        benchChurn<HeapNodeAlloc>("heap", n ? n : 1000000);
+    }
+    if(which == "all" || which == "alloc" || which == "alloc-slab") {
+        cout << "allocator: " << (n ? n : 1000000) << " keys" << endl;
+        benchChurn<SlabNodeAlloc>("slab", n ? n : 1000000);
+    }
+    return 0;
+}
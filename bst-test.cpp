@@ -1,10 +1,1487 @@
 #include <iostream>
 #include <map>
+#include <list>
+#include <vector>
+#include <cstdlib>
+#include <string>
+#include <algorithm>
+#include <iterator>
+#include <tuple>
+#include <climits>
+#include <functional>
+#include <stdexcept>
+#include <thread>
 #include "bst.h"
 #include "avlbst.h"
+#include "compact_avl.h"
+#include "bplus_tree.h"
+#include "persistent_avl.h"
+#include "concurrent_avl.h"
+#include "rcu_avl.h"
+#include "sharded_avl.h"
+#include "avl_image.h"
+#include <atomic>
 
 using namespace std;
 
+static int failures = 0;
+
+void check(bool cond, const char* msg)
+{
+    if(!cond) {
+        cout << "FAILED: " << msg << endl;
+        ++failures;
+    }
+}
+
+// Returns true iff the tree holds exactly the pairs in ref, in order.
+template<typename Tree>
+bool sameContents(const Tree& tree, const map<int,int>& ref)
+{
+    map<int,int>::const_iterator rit = ref.begin();
+    for(typename Tree::const_iterator it = tree.begin(); it != tree.end(); ++it, ++rit) {
+        if(rit == ref.end() || it->first != rit->first || it->second != rit->second) {
+            return false;
+        }
+    }
+    return rit == ref.end();
+}
+
+// Rounds of random inserts (including overwrites of existing keys) and
+// removes on keys below keyRange, applied to tree and ref alike. Returns
+// whether the tree matched ref and validated after every round.
+template<typename Tree>
+bool randomAgainstMap(Tree& tree, map<int,int>& ref, unsigned seed, int rounds, int keyRange,
+                      int inserts, int removes)
+{
+    srand(seed);
+    bool ok = true;
+    for(int round = 0; round < rounds; ++round) {
+        for(int i = 0; i < inserts; ++i) {
+            int k = rand() % keyRange;
+            tree.insert(make_pair(k, i));
+            ref[k] = i;
+        }
+        for(int i = 0; i < removes; ++i) {
+            int k = rand() % keyRange;
+            tree.remove(k);
+            ref.erase(k);
+        }
+        ok = ok && sameContents(tree, ref) && tree.size() == ref.size() && tree.validate().ok();
+    }
+    return ok;
+}
+
+template<typename Alloc>
+void randomAVLTest()
+{
+    AVLTree<int,int,Alloc> at;
+    BinarySearchTree<int,int,Alloc> bt;
+    map<int,int> atRef, btRef;
+    check(randomAgainstMap(at, atRef, 42, 20, 1000, 500, 250), "AVL matches std::map and validates");
+    check(randomAgainstMap(bt, btRef, 42, 20, 1000, 500, 250), "BST matches std::map and validates");
+    check(at.isBalanced(), "AVL stays balanced");
+}
+
+// Exposes the root so that validate() can be shown broken trees.
+class CorruptibleAVL : public AVLTree<int,int>
+{
+public:
+    AVLNode<int,int>* rootNode() { return static_cast<AVLNode<int,int>*>(root_); }
+};
+
+void validateTest()
+{
+    CorruptibleAVL at;
+    for(int i = 1; i <= 15; ++i) {
+        at.insert(make_pair(i, i));
+    }
+    check(at.validate().ok(), "valid tree passes");
+
+    AVLNode<int,int>* root = at.rootNode();
+    AVLNode<int,int>* leaf = root->getLeft()->getLeft()->getLeft();
+    leaf->setBalance(1);
+    AVLTree<int,int>::ValidationResult r = at.validate();
+    check(!r.ok() && r.node == leaf, "wrong balance field is reported at its node");
+    leaf->setBalance(0);
+
+    AVLNode<int,int>* left = root->getLeft();
+    left->getRight()->setParent(root);
+    r = at.validate();
+    check(!r.ok() && r.node == left, "broken parent pointer is reported");
+    left->getRight()->setParent(left);
+
+    Node<int,int>* a = left->getLeft();
+    left->setLeft(left->getRight());
+    left->setRight(a);
+    r = at.validate();
+    check(!r.ok() && string(r.reason) == "key out of order", "misordered keys are reported");
+    check(at.isBalanced(), "swapped children are still height balanced");
+    left->setRight(left->getLeft());
+    left->setLeft(a);
+    check(at.validate().ok(), "repaired tree passes");
+}
+
+// clear() on a slab-backed tree drops the arena; the tree must be
+// reusable afterwards and string values must still be destroyed.
+void slabClearTest()
+{
+    AVLTree<int,int,SlabNodeAlloc> at;
+    for(int i = 0; i < 5000; ++i) {
+        at.insert(make_pair(i, i));
+    }
+    at.clear();
+    check(at.empty() && at.begin() == at.end(), "slab clear empties the tree");
+    map<int,int> ref;
+    for(int i = 0; i < 3000; ++i) {
+        at.insert(make_pair(i * 7 % 3001, i));
+        ref[i * 7 % 3001] = i;
+    }
+    check(sameContents(at, ref), "slab tree reusable after clear");
+
+    AVLTree<int,string,SlabNodeAlloc> st;
+    for(int i = 0; i < 1000; ++i) {
+        st.insert(make_pair(i, string(40, 'x')));
+    }
+    for(int i = 0; i < 1000; i += 2) {
+        st.remove(i);
+    }
+    st.clear();
+    check(st.empty(), "slab clear with non-trivial values");
+}
+
+// Links ascending keys into a right-leaning chain in O(n): the shape that
+// sorted inserts give an unbalanced tree, without the O(n^2) insert cost.
+class ChainTree : public BinarySearchTree<int,int>
+{
+public:
+    void buildChain(int n)
+    {
+        clear();
+        Node<int,int>* tail = nullptr;
+        for(int i = 0; i < n; ++i) {
+            Node<int,int>* node = alloc_.create<Node<int,int> >(i, i, tail);
+            if(tail == nullptr) root_ = node;
+            else tail->setRight(node);
+            tail = node;
+        }
+    }
+};
+
+// A recursive teardown overflows the stack long before 10M levels.
+void degenerateTeardownTest()
+{
+    const int n = 10000000;
+    {
+        ChainTree chain;
+        chain.buildChain(n);
+        check(chain.height() == (size_t)n, "height of a 10M-deep chain");
+        check(chain.validate().ok() && !chain.isBalanced(), "validate a 10M-deep chain");
+        chain.clear();
+        check(chain.empty(), "clear of a 10M-deep chain");
+        // the destructor tears down the second chain; reaching the next
+        // test at all is the check
+        chain.buildChain(n);
+    }
+}
+
+typedef BinarySearchTree<int,int,HeapNodeAlloc,AVLNode<int,int> > AVLBase;
+
+// AVLTree::height() reads the balance fields; BinarySearchTree::height()
+// walks every node, so the two must agree. Heights past 127 used to wrap.
+void largeHeightTest()
+{
+    AVLTree<int,int> at;
+    const int n = (1 << 20) + 12345;
+    srand(7);
+    for(int i = 0; i < n; ++i) {
+        at.insert(make_pair(rand(), i));
+    }
+    size_t h = at.height();
+    check(h == at.AVLBase::height(), "AVL height matches a full walk");
+    check(h >= 21 && h <= 29, "AVL height within 1.44 log2(n)");
+
+    AVLTree<int,int> seq;
+    for(int i = 0; i < (1 << 21); ++i) {
+        seq.insert(make_pair(i, i));
+    }
+    check(seq.height() == seq.AVLBase::height(), "sequential AVL height matches a full walk");
+    check(BinarySearchTree<int,int>().height() == 0, "empty tree has height 0");
+}
+
+void iteratorTest()
+{
+    AVLTree<int,int> at;
+    map<int,int> ref;
+    for(int i = 0; i < 200; ++i) {
+        at.insert(make_pair(i * 37 % 211, i));
+        ref[i * 37 % 211] = i;
+    }
+
+    bool same = true;
+    map<int,int>::reverse_iterator rit = ref.rbegin();
+    for(AVLTree<int,int>::reverse_iterator it = at.rbegin(); it != at.rend(); ++it, ++rit) {
+        same = same && rit != ref.rend() && it->first == rit->first;
+    }
+    check(same && rit == ref.rend(), "reverse iteration");
+
+    AVLTree<int,int>::iterator last = at.end();
+    --last;
+    check(last->first == ref.rbegin()->first, "decrementing end() gives the largest item");
+    AVLTree<int,int>::iterator it = at.begin();
+    AVLTree<int,int>::iterator was = it++;
+    check(was == at.begin() && it == ++at.begin(), "post-increment");
+    was = it--;
+    check(it == at.begin() && was != it, "post-decrement");
+
+    check(distance(at.begin(), at.end()) == (ptrdiff_t)ref.size(), "std::distance");
+    check(find_if(at.begin(), at.end(), [](const pair<const int,int>& p) { return p.second == 150; })->first == 150 * 37 % 211,
+          "std::find_if");
+    at.begin()->second = -1;
+    check(at.find(0)->second == -1, "iterator gives mutable values");
+
+    const AVLTree<int,int>& cat = at;
+    AVLTree<int,int>::const_iterator cit = cat.find(5);
+    AVLTree<int,int>::const_iterator converted = at.find(5);
+    check(cit == converted && cit != cat.end(), "const find and conversion");
+    check(prev(cat.end())->first == last->first, "const iterators are bidirectional");
+}
+
+// Sums the keys handed to it.
+struct KeySum
+{
+    long* total;
+    void operator()(const pair<const int,int>& item) const { *total += item.first; }
+};
+
+template<typename Tree>
+void rangeQueryTest()
+{
+    Tree tree;
+    map<int,int> ref;
+    srand(11);
+    for(int i = 0; i < 2000; ++i) {
+        int k = rand() % 5000;
+        tree.insert(make_pair(k, i));
+        ref[k] = i;
+    }
+    const Tree& ctree = tree;
+    bool same = true;
+    for(int q = -10; q < 5010; q += 3) {
+        map<int,int>::iterator lo = ref.lower_bound(q);
+        map<int,int>::iterator hi = ref.upper_bound(q);
+        typename Tree::iterator tlo = tree.lower_bound(q);
+        typename Tree::const_iterator thi = ctree.upper_bound(q);
+        same = same && (lo == ref.end() ? tlo == tree.end() : tlo->first == lo->first);
+        same = same && (hi == ref.end() ? thi == ctree.end() : thi->first == hi->first);
+        pair<typename Tree::iterator, typename Tree::iterator> eq = tree.equal_range(q);
+        same = same && (distance(eq.first, eq.second) == (ptrdiff_t)ref.count(q));
+    }
+    check(same, "lower_bound/upper_bound/equal_range match std::map");
+
+    for(int lo = 0; lo < 5000; lo += 250) {
+        int hi = lo + 400;
+        long expected = 0, got = 0, constGot = 0;
+        for(map<int,int>::iterator it = ref.lower_bound(lo); it != ref.lower_bound(hi); ++it) {
+            expected += it->first;
+        }
+        KeySum sum = { &got };
+        tree.forEachInRange(lo, hi, sum);
+        KeySum constSum = { &constGot };
+        ctree.forEachInRange(lo, hi, constSum);
+        same = same && got == expected && constGot == expected;
+    }
+    check(same, "forEachInRange visits [lo, hi)");
+}
+
+// rank/select/countInRange against std::map, with the subtree counts
+// checked by validate() as inserts and removes rotate the tree.
+void orderStatisticTest()
+{
+    OrderStatisticTree<int,int> ot;
+    map<int,int> ref;
+    srand(5);
+    for(int round = 0; round < 10; ++round) {
+        for(int i = 0; i < 400; ++i) {
+            int k = rand() % 2000;
+            ot.insert(make_pair(k, i));
+            ref[k] = i;
+        }
+        for(int i = 0; i < 200; ++i) {
+            int k = rand() % 2000;
+            ot.remove(k);
+            ref.erase(k);
+        }
+        check(ot.validate().ok(), "order-statistic tree validates");
+        check(ot.size() == ref.size(), "size() tracks inserts and removes");
+    }
+
+    bool same = true;
+    size_t i = 0;
+    for(map<int,int>::iterator it = ref.begin(); it != ref.end(); ++it, ++i) {
+        same = same && ot.select(i)->first == it->first && ot.rank(it->first) == i;
+        same = same && ot.rank(it->first + 1) == i + 1;
+    }
+    check(same, "rank() and select() match std::map");
+    check(ot.select(ref.size()) == ot.end(), "select() past the end");
+    for(int lo = 0; lo < 2000; lo += 97) {
+        int hi = lo + 300;
+        size_t expected = distance(ref.lower_bound(lo), ref.lower_bound(hi));
+        same = same && ot.countInRange(lo, hi) == expected;
+    }
+    check(same && ot.countInRange(10, 5) == 0, "countInRange() matches std::map");
+
+    BinarySearchTree<int,int> bt;
+    AVLTree<int,int> at;
+    for(int k = 0; k < 100; ++k) {
+        bt.insert(make_pair(k % 60, k));
+        at.insert(make_pair(k % 60, k));
+    }
+    bt.remove(3);
+    at.remove(3);
+    check(bt.size() == 59 && at.size() == 59, "size() on plain trees");
+    at.clear();
+    check(at.size() == 0, "size() after clear()");
+}
+
+void bulkLoadTest()
+{
+    bool ok = true;
+    for(int n = 0; n < 300; ++n) {
+        vector<pair<int,int> > items;
+        map<int,int> ref;
+        for(int i = 0; i < n; ++i) {
+            items.push_back(make_pair(i * 3, i));
+            ref[i * 3] = i;
+        }
+        AVLTree<int,int> at(items.begin(), items.end());
+        ok = ok && at.validate().ok() && sameContents(at, ref) && at.size() == ref.size();
+        // the normal update paths must keep working on a bulk-loaded tree
+        for(int i = 0; i < n; i += 2) {
+            at.remove(i * 3);
+            at.insert(make_pair(i * 3 + 1, 0));
+        }
+        ok = ok && at.validate().ok();
+    }
+    check(ok, "bulk-loaded trees validate and accept inserts/removes");
+
+    list<pair<int,int> > dups;
+    map<int,int> ref;
+    for(int i = 0; i < 1000; ++i) {
+        dups.push_back(make_pair(i / 3, i));
+        ref[i / 3] = i;
+    }
+    OrderStatisticTree<int,int> ot;
+    ot.insert(make_pair(-5, 5));
+    ot.buildFromSorted(dups.begin(), dups.end());
+    check(sameContents(ot, ref) && ot.validate().ok(), "equal keys keep the last value; old contents dropped");
+    check(ot.select(100)->first == 100 && ot.rank(200) == 200, "bulk-loaded counts");
+
+    vector<pair<int,int> > unsorted;
+    for(int i = 0; i < 100; ++i) {
+        unsorted.push_back(make_pair((i * 37) % 100, i));
+    }
+    AVLTree<int,int> ut(unsorted.begin(), unsorted.end());
+    check(ut.validate().ok() && ut.size() == 100, "unsorted input falls back to inserts");
+}
+
+// A value that cannot be copied and counts how often it is moved.
+struct MoveOnly
+{
+    static int moves;
+    string data;
+    explicit MoveOnly(const string& d) : data(d) { }
+    MoveOnly(MoveOnly&& other) : data(std::move(other.data)) { ++moves; }
+    MoveOnly& operator=(MoveOnly&& other) { data = std::move(other.data); ++moves; return *this; }
+    MoveOnly(const MoveOnly&) = delete;
+    MoveOnly& operator=(const MoveOnly&) = delete;
+};
+int MoveOnly::moves = 0;
+
+ostream& operator<<(ostream& out, const MoveOnly& m)
+{
+    return out << m.data;
+}
+
+template<typename Tree>
+void moveOnlyTest()
+{
+    Tree tree;
+    MoveOnly::moves = 0;
+    pair<typename Tree::iterator, bool> r = tree.try_emplace(1, "one");
+    check(r.second && r.first->second.data == "one", "try_emplace builds the value");
+    r = tree.try_emplace(1, "uno");
+    check(!r.second && r.first->second.data == "one", "try_emplace leaves an existing key alone");
+    r = tree.emplace(piecewise_construct, forward_as_tuple(2), forward_as_tuple("two"));
+    check(r.second && tree.size() == 2, "emplace builds the pair in place");
+    check(MoveOnly::moves == 0, "in-place construction neither copies nor moves");
+
+    r = tree.insert_or_assign(3, MoveOnly("three"));
+    check(r.second && MoveOnly::moves == 1, "insert_or_assign moves a new value in once");
+    r = tree.insert_or_assign(3, MoveOnly("drei"));
+    check(!r.second && r.first->second.data == "drei" && MoveOnly::moves == 2,
+          "insert_or_assign move-assigns over an existing value");
+    tree.insert(pair<const int, MoveOnly>(4, MoveOnly("four")));
+    check(tree.find(4)->second.data == "four", "insert(pair&&)");
+    for(int i = 5; i < 200; ++i) {
+        tree.try_emplace(i, "x");
+    }
+    check(tree.validate().ok() && tree.size() == 199, "moves through rebalancing keep the tree valid");
+
+    string key = "k";
+    AVLTree<string,MoveOnly> st;
+    st.try_emplace(std::move(key), "v");
+    check(st.find("k") != st.end(), "try_emplace with an rvalue key");
+}
+
+void sortedInsertTest()
+{
+    AVLTree<int,int> up, down;
+    map<int,int> ref;
+    for(int i = 0; i < 4096; ++i) {
+        up.insert(make_pair(i, i));
+        down.insert(make_pair(4095 - i, 4095 - i));
+        ref[i] = i;
+    }
+    check(sameContents(up, ref), "ascending inserts");
+    check(sameContents(down, ref), "descending inserts");
+    check(up.isBalanced() && down.isBalanced(), "sorted inserts stay balanced");
+    up.insert(make_pair(7, 70));
+    check(up[7] == 70, "duplicate insert overwrites the value");
+}
+
+// The index-linked tree against std::map through inserts, removes, pool
+// growth with holes in it, reverse iteration, bulk load and clear.
+void compactAVLTest()
+{
+    check(sizeof(CompactAVLNode<int,int>) < 20, "compact int->int node is under 20 bytes");
+
+    CompactAVLTree<int,int> ct;
+    map<int,int> ref;
+    check(randomAgainstMap(ct, ref, 5, 20, 1000, 500, 250), "compact tree matches std::map and validates");
+
+    ct.reserve(ct.capacity() * 4);
+    check(sameContents(ct, ref) && ct.validate().ok(), "reserve moves only the live nodes");
+    CompactAVLTree<int,int>::iterator last = ct.end();
+    --last;
+    check(last->first == ref.rbegin()->first, "--end() is the largest item");
+    check(equal(ct.rbegin(), ct.rend(), ref.rbegin()), "reverse iteration");
+
+    ct.clear();
+    check(ct.empty() && ct.begin() == ct.end() && ct.validate().ok(), "clear empties the tree");
+    vector<pair<int,int> > sorted;
+    for(int i = 0; i < 1000; ++i) {
+        sorted.push_back(make_pair(i, i));
+    }
+    ct.buildFromSorted(sorted.begin(), sorted.end());
+    check(ct.size() == 1000 && ct.height() == 10 && ct.validate().ok(), "bulk load is perfectly balanced");
+    for(int i = 0; i < 1000; i += 2) {
+        ct.remove(i);
+    }
+    check(ct.size() == 500 && ct.validate().ok() && ct[501] == 501, "removes after a bulk load");
+
+    CompactAVLTree<string,string> st;
+    for(int i = 0; i < 300; ++i) {
+        st.insert(make_pair(to_string(i), string(40, 'a' + i % 26)));
+    }
+    st.remove("7");
+    check(st.size() == 299 && st.find("7") == st.end() && st["8"] == string(40, 'i') && st.validate().ok(),
+          "non-trivial keys and values survive pool growth");
+
+    // the value passed in may be an item of the tree, also when the insert grows the pool
+    bool selfOk = true;
+    for(int n = 1; n < 40; ++n) {
+        CompactAVLTree<int,string> t;
+        for(int i = 0; i < n; ++i) {
+            t.insert(make_pair(i, string(30, 'a' + i % 26)));
+        }
+        t.insert_or_assign(100, t[n / 2]);
+        selfOk = selfOk && t[100] == string(30, 'a' + (n / 2) % 26) && t.validate().ok();
+    }
+    check(selfOk, "compact tree inserts a value that refers to one of its items");
+}
+
+// Random inserts and removes against std::map. Small nodes make the tree
+// deep enough that splits, borrows and merges reach the inner levels.
+template<typename Tree>
+void bplusTreeTest(const char* name)
+{
+    Tree tree;
+    map<int,int> ref;
+    check(randomAgainstMap(tree, ref, 9, 20, 3000, 1000, 1200), name);
+    check(equal(tree.rbegin(), tree.rend(), ref.rbegin()), "B+ tree reverse iteration");
+    for(map<int,int>::iterator it = ref.begin(); it != ref.end(); ++it) {
+        tree.remove(it->first);
+    }
+    check(tree.empty() && tree.height() == 0 && tree.validate().ok(), "B+ tree removes down to empty");
+}
+
+// Inserts whose value is an item of the tree itself, for every target
+// and source pair among ten items, so that some of them split the leaf
+// the source sits in.
+template<typename Tree>
+bool selfReferenceInserts()
+{
+    bool ok = true;
+    for(int target = -1; target < 21; target += 2) {
+        for(int source = 0; source < 20; source += 2) {
+            Tree a, b;
+            for(int i = 0; i < 20; i += 2) {
+                a.insert(make_pair(i, string(30, 'a' + i)));
+                b.insert(make_pair(i, string(30, 'a' + i)));
+            }
+            a.insert_or_assign(target, a[source]);
+            b.try_emplace(target, b[source]);
+            ok = ok && a[target] == string(30, 'a' + source) && b[target] == string(30, 'a' + source) &&
+                 a.validate().ok() && b.validate().ok();
+        }
+    }
+    return ok;
+}
+
+void bplusTreeApiTest()
+{
+    bplusTreeTest<BPlusTree<int,int,64> >("B+ tree with small nodes matches std::map");
+    bplusTreeTest<BPlusTree<int,int> >("B+ tree matches std::map");
+
+    BPlusTree<int,MoveOnly,64> mt;
+    MoveOnly::moves = 0;
+    for(int i = 0; i < 100; ++i) {
+        mt.try_emplace(i, "x");
+    }
+    check(mt.size() == 100 && mt.validate().ok(), "B+ tree try_emplace with move-only values");
+    check(!mt.insert_or_assign(5, MoveOnly("five")).second && mt[5].data == "five", "B+ tree insert_or_assign");
+    check(mt.emplace(piecewise_construct, forward_as_tuple(200), forward_as_tuple("y")).second &&
+          mt.find(200)->second.data == "y", "B+ tree emplace");
+
+    BPlusTree<string,string> st;
+    for(int i = 0; i < 500; ++i) {
+        st.insert(make_pair(to_string(i), to_string(i * 2)));
+    }
+    st.remove("42");
+    check(st.size() == 499 && st.find("42") == st.end() && st["43"] == "86" && st.validate().ok(),
+          "B+ tree with string keys");
+    check(selfReferenceInserts<BPlusTree<int,string,128> >() && selfReferenceInserts<BPlusTree<int,string> >(),
+          "B+ tree inserts a value that refers to one of its items");
+}
+
+// KeySearch at every instruction set level the CPU has, against
+// std::lower_bound/upper_bound, on random sorted arrays that include the
+// extreme values of the type.
+template<typename Key>
+bool keySearchMatches(Key lowest, Key highest)
+{
+    bool ok = true;
+    srand(17);
+    for(size_t n = 0; n < 90; ++n) {
+        vector<Key> keys;
+        for(size_t i = 0; i < n; ++i) {
+            keys.push_back((Key)(rand() % 200) - (Key)(rand() % 100));
+        }
+        if(n > 2) {
+            keys[0] = lowest;
+            keys[1] = highest;
+        }
+        sort(keys.begin(), keys.end());
+        vector<Key> probes(keys);
+        probes.push_back(lowest);
+        probes.push_back(highest);
+        probes.push_back((Key)7);
+        for(size_t p = 0; p < probes.size(); ++p) {
+            const Key* data = keys.empty() ? NULL : &keys[0];
+            size_t lo = lower_bound(keys.begin(), keys.end(), probes[p]) - keys.begin();
+            size_t hi = upper_bound(keys.begin(), keys.end(), probes[p]) - keys.begin();
+            ok = ok && KeySearch<Key>::lowerBound(data, n, probes[p]) == lo;
+            ok = ok && KeySearch<Key>::upperBound(data, n, probes[p]) == hi;
+        }
+    }
+    return ok;
+}
+
+void keySearchTest()
+{
+    int best = searchLevel();
+    for(int level = kSearchScalar; level <= best; ++level) {
+        searchLevel() = level;
+        check(keySearchMatches<int>(INT_MIN, INT_MAX), "int key search");
+        check(keySearchMatches<unsigned>(0, UINT_MAX), "unsigned key search");
+        check(keySearchMatches<long>(LONG_MIN, LONG_MAX), "long key search");
+        check(keySearchMatches<float>(-1e30f, 1e30f), "float key search");
+        check(keySearchMatches<double>(-1e300, 1e300), "double key search");
+        check(keySearchMatches<short>(SHRT_MIN, SHRT_MAX), "short key search");
+    }
+    searchLevel() = best;
+}
+
+// A tree ordered by std::greater: random inserts and removes checked
+// against std::map with the same ordering, plus the range queries.
+template<typename Tree>
+void comparatorTest(const char* name)
+{
+    Tree tree((greater<int>()));
+    map<int,int,greater<int> > ref;
+    srand(23);
+    bool ok = true;
+    for(int round = 0; round < 10; ++round) {
+        for(int i = 0; i < 300; ++i) {
+            int k = rand() % 1000;
+            tree.insert(make_pair(k, i));
+            ref[k] = i;
+        }
+        for(int i = 0; i < 150; ++i) {
+            int k = rand() % 1000;
+            tree.remove(k);
+            ref.erase(k);
+        }
+        typename Tree::const_iterator it = tree.begin();
+        for(map<int,int,greater<int> >::iterator rit = ref.begin(); rit != ref.end(); ++rit, ++it) {
+            ok = ok && it != tree.end() && it->first == rit->first && it->second == rit->second;
+        }
+        ok = ok && it == tree.end() && tree.size() == ref.size() && tree.validate().ok();
+    }
+    for(int q = -5; q < 1005; q += 7) {
+        map<int,int,greater<int> >::iterator lo = ref.lower_bound(q);
+        typename Tree::iterator tlo = tree.lower_bound(q);
+        ok = ok && (lo == ref.end() ? tlo == tree.end() : tlo->first == lo->first);
+        ok = ok && (tree.find(q) != tree.end()) == (ref.count(q) == 1);
+    }
+    long sum = 0, expected = 0;
+    KeySum fn = { &sum };
+    tree.forEachInRange(600, 400, fn);
+    for(map<int,int,greater<int> >::iterator rit = ref.lower_bound(600); rit != ref.lower_bound(400); ++rit) {
+        expected += rit->first;
+    }
+    ok = ok && sum == expected;
+    check(ok, name);
+}
+
+// Counts calls so the tests can see how many comparisons a lookup makes.
+struct CountingLess
+{
+    long* calls;
+    bool operator()(const string& a, const string& b) const { ++*calls; return a < b; }
+};
+
+struct CountingThreeWay
+{
+    long* calls;
+    bool operator()(const string& a, const string& b) const { ++*calls; return a < b; }
+    int compare(const string& a, const string& b) const { ++*calls; return a.compare(b); }
+};
+
+void comparisonCountTest()
+{
+    static_assert(ThreeWayCompare<string, less<string> >::value, "std::string has compare()");
+    static_assert(!ThreeWayCompare<int, less<int> >::value, "int has no compare()");
+    static_assert(ThreeWayCompare<string, CountingThreeWay>::value, "comparator compare() is found");
+
+    long lessCalls = 0, threeWayCalls = 0;
+    CountingLess byLess = { &lessCalls };
+    CountingThreeWay byThreeWay = { &threeWayCalls };
+    AVLTree<string,int,HeapNodeAlloc,AVLNode<string,int>,CountingLess> lt(byLess);
+    AVLTree<string,int,HeapNodeAlloc,AVLNode<string,int>,CountingThreeWay> tt(byThreeWay);
+    for(int i = 0; i < 1000; ++i) {
+        string key = to_string(i * 7919 % 1000);
+        lt.insert(make_pair(key, i));
+        tt.insert(make_pair(key, i));
+    }
+    size_t height = lt.height();
+    bool ok = true;
+    for(int i = 0; i < 1000; ++i) {
+        string key = to_string(i);
+        lessCalls = threeWayCalls = 0;
+        ok = ok && lt.find(key) != lt.end() && tt.find(key) != tt.end();
+        // one comparison per level, plus one to settle equality
+        ok = ok && (size_t)lessCalls <= height + 1 && (size_t)threeWayCalls <= height;
+    }
+    check(ok, "one comparison per level");
+    check(lt.validate().ok() && tt.validate().ok(), "counting comparators validate");
+}
+
+// findBatch against one find per key: hits, misses and repeated keys, in
+// batches that do and do not fill the last group, and on an empty tree.
+template<typename Tree>
+void findBatchTest(const char* name)
+{
+    Tree tree;
+    vector<int> keys;
+    for(int i = 0; i < 37; ++i) {
+        keys.push_back(i * 3);
+    }
+    vector<typename Tree::iterator> out(keys.size());
+    bool ok = tree.findBatch(keys.begin(), keys.end(), out.begin()) == out.end();
+    for(size_t i = 0; i < out.size(); ++i) {
+        ok = ok && out[i] == tree.end();
+    }
+
+    srand(31);
+    for(int i = 0; i < 3000; ++i) {
+        tree.insert(make_pair(rand() % 6000, i));
+    }
+    keys.clear();
+    for(int i = 0; i < 1000; ++i) {
+        keys.push_back(rand() % 6100 - 50);
+    }
+    keys.push_back(keys[0]);
+    for(size_t len = 0; len <= keys.size(); len += 97) {
+        out.assign(len, tree.end());
+        tree.findBatch(keys.begin(), keys.begin() + len, out.begin());
+        for(size_t i = 0; i < len; ++i) {
+            ok = ok && out[i] == tree.find(keys[i]);
+        }
+    }
+    const Tree& ctree = tree;
+    vector<typename Tree::const_iterator> cfound;
+    ctree.findBatch(keys.begin(), keys.end(), back_inserter(cfound));
+    ok = ok && cfound.size() == keys.size();
+    for(size_t i = 0; i < cfound.size(); ++i) {
+        ok = ok && cfound[i] == ctree.find(keys[i]);
+    }
+    check(ok, name);
+}
+
+struct FirstLess
+{
+    bool operator()(const pair<int,int>& a, const pair<int,int>& b) const { return a.first < b.first; }
+};
+
+// insertBatch/eraseBatch against std::map. Batch sizes span both the
+// finger path and the merge path; batches hold repeated keys, and some
+// are left unsorted.
+template<typename Tree>
+void batchUpdateTest(const char* name)
+{
+    Tree tree;
+    map<int,int> ref;
+    srand(37);
+    bool ok = true;
+    const size_t sizes[] = { 1, 5, 40, 300, 2000, 5000 };
+    for(int round = 0; round < 12; ++round) {
+        size_t k = sizes[round % 6];
+        vector<pair<int,int> > items;
+        for(size_t i = 0; i < k; ++i) {
+            items.push_back(make_pair(rand() % 10000, round * 10000 + (int)i));
+        }
+        if(round % 4 != 3) {
+            stable_sort(items.begin(), items.end(), FirstLess());
+        }
+        tree.insertBatch(items.begin(), items.end());
+        for(size_t i = 0; i < items.size(); ++i) {
+            ref[items[i].first] = items[i].second;
+        }
+        ok = ok && sameContents(tree, ref) && tree.size() == ref.size() && tree.validate().ok();
+
+        list<int> keys;
+        for(size_t i = 0; i < k / 2 + 1; ++i) {
+            keys.push_back(rand() % 10000);
+        }
+        if(round % 4 != 1) {
+            keys.sort();
+        }
+        tree.eraseBatch(keys.begin(), keys.end());
+        for(list<int>::iterator it = keys.begin(); it != keys.end(); ++it) {
+            ref.erase(*it);
+        }
+        ok = ok && sameContents(tree, ref) && tree.size() == ref.size() && tree.validate().ok();
+    }
+    // whole groups of new keys that all descend to one empty slot
+    vector<pair<int,int> > run;
+    for(int i = 0; i < 100; ++i) {
+        run.push_back(make_pair(20099 - i, i));
+        run.push_back(make_pair(30000 + i, i));
+    }
+    tree.insertBatch(run.begin(), run.end());
+    for(size_t i = 0; i < run.size(); ++i) {
+        ref[run[i].first] = run[i].second;
+    }
+    sort(run.begin(), run.end());
+    for(size_t i = 0; i < run.size(); ++i) {
+        run[i].first += 20000;
+        ref[run[i].first] = run[i].second;
+    }
+    tree.insertBatch(run.begin(), run.end());
+    ok = ok && sameContents(tree, ref) && tree.size() == ref.size() && tree.validate().ok();
+    vector<int> all;
+    for(map<int,int>::iterator it = ref.begin(); it != ref.end(); ++it) {
+        all.push_back(it->first);
+    }
+    tree.eraseBatch(all.begin(), all.end());
+    ok = ok && tree.empty() && tree.begin() == tree.end() && tree.validate().ok();
+    vector<pair<int,int> > one(1, make_pair(4, 4));
+    tree.insertBatch(one.begin(), one.end());
+    ok = ok && tree.size() == 1 && tree.find(4) != tree.end();
+    check(ok, name);
+}
+
+// Splits random trees at present and absent keys and joins the halves
+// back, with and without a pivot, checking contents, sizes and balance.
+// Uneven splits also join trees of very different heights.
+template<typename Tree>
+void splitJoinTest(const char* name)
+{
+    srand(41);
+    bool ok = true;
+    const size_t sizes[] = { 0, 1, 2, 7, 100, 3000 };
+    for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        for(int round = 0; round < 6; ++round) {
+            Tree tree;
+            map<int,int> ref;
+            for(size_t i = 0; i < sizes[s]; ++i) {
+                int key = 2 * (rand() % 5000);
+                tree.insert(make_pair(key, (int)i));
+                ref[key] = (int)i;
+            }
+            // an odd key is absent; an even one usually present
+            int key = rand() % 10002 - 1;
+            map<int,int> refLess(ref.begin(), ref.lower_bound(key));
+            map<int,int> refGreater(ref.lower_bound(key), ref.end());
+
+            Tree less, greater;
+            tree.split(key, less, greater);
+            ok = ok && tree.empty() && tree.validate().ok();
+            ok = ok && sameContents(less, refLess) && less.size() == refLess.size() && less.validate().ok();
+            ok = ok && sameContents(greater, refGreater) && greater.size() == refGreater.size() &&
+                 greater.validate().ok();
+
+            if(round % 2 == 0) {
+                tree.join(less, greater);
+            }
+            else {
+                // re-join around a pivot taken from greater, or a new one
+                pair<int,int> pivot(10001, -1);
+                if(!greater.empty()) {
+                    pivot = *greater.begin();
+                    greater.remove(pivot.first);
+                }
+                tree.join(less, pivot, greater);
+                ref[pivot.first] = pivot.second;
+            }
+            ok = ok && less.empty() && greater.empty();
+            ok = ok && sameContents(tree, ref) && tree.size() == ref.size() && tree.validate().ok();
+        }
+    }
+
+    // a tree can be split into itself and joined back into either half
+    Tree a, b;
+    for(int i = 0; i < 1000; ++i) {
+        a.insert(make_pair(i, i));
+    }
+    a.split(300, a, b);
+    ok = ok && a.size() == 300 && b.size() == 700 && a.validate().ok() && b.validate().ok();
+    b.join(a, b);
+    ok = ok && a.empty() && b.size() == 1000 && b.validate().ok() && b.find(299) != b.end();
+
+    // halves changed and joined before anyone asks for their size
+    b.split(500, a, b);
+    a.insert(make_pair(-1, -1));
+    a.remove(10);
+    b.remove(700);
+    b.remove(5000);
+    Tree e;
+    e.join(a, b);
+    ok = ok && e.size() == 999 && a.size() == 0 && b.size() == 0 && e.validate().ok();
+
+    // keys out of order are refused and both trees are left alone
+    Tree c, d;
+    c.insert(make_pair(5, 5));
+    d.insert(make_pair(3, 3));
+    bool threw = false;
+    try {
+        c.join(c, d);
+    }
+    catch(const invalid_argument&) {
+        threw = true;
+    }
+    ok = ok && threw && c.size() == 1 && d.size() == 1;
+    check(ok, name);
+}
+
+// Sums the two values of a key both trees hold.
+struct SumValues
+{
+    void operator()(int& ours, int& theirs) const
+    {
+        ours += theirs;
+    }
+};
+
+// Union, intersection and difference of random overlapping trees against
+// std::map, without a pool and with one. 20000 keys are enough for the
+// recursion to fork.
+template<typename Tree>
+void setOperationTest(const char* name)
+{
+    bool ok = true;
+    TaskPool pool(4);
+    const size_t sizes[] = { 0, 1, 50, 20000 };
+    for(int op = 0; op < 4; ++op) {
+        for(size_t sa = 0; sa < 4; ++sa) {
+            for(size_t sb = 0; sb < 4; ++sb) {
+                srand((unsigned)(op * 16 + sa * 4 + sb));
+                Tree a, b;
+                map<int,int> refA, refB;
+                for(size_t i = 0; i < sizes[sa]; ++i) {
+                    int key = rand() % 30000;
+                    a.insert(make_pair(key, 1));
+                    refA[key] = 1;
+                }
+                for(size_t i = 0; i < sizes[sb]; ++i) {
+                    int key = rand() % 30000;
+                    b.insert(make_pair(key, 10));
+                    refB[key] = 10;
+                }
+                TaskPool* p = (sa + sb) % 2 ? &pool : NULL;
+                map<int,int> ref;
+                if(op == 0) {
+                    ref = refB;
+                    for(map<int,int>::iterator it = refA.begin(); it != refA.end(); ++it) {
+                        ref[it->first] = it->second;
+                    }
+                    a.unionWith(b, KeepOurs(), p);
+                }
+                else if(op == 1) {
+                    ref = refA;
+                    for(map<int,int>::iterator it = refB.begin(); it != refB.end(); ++it) {
+                        ref[it->first] += it->second;
+                    }
+                    a.unionWith(b, SumValues(), p);
+                }
+                else if(op == 2) {
+                    for(map<int,int>::iterator it = refA.begin(); it != refA.end(); ++it) {
+                        if(refB.count(it->first)) {
+                            ref[it->first] = 10;
+                        }
+                    }
+                    a.intersectWith(b, TakeTheirs(), p);
+                }
+                else {
+                    ref = refA;
+                    for(map<int,int>::iterator it = refB.begin(); it != refB.end(); ++it) {
+                        ref.erase(it->first);
+                    }
+                    a.differenceWith(b, p);
+                }
+                ok = ok && b.empty() && b.validate().ok();
+                ok = ok && sameContents(a, ref) && a.size() == ref.size() && a.validate().ok();
+            }
+        }
+    }
+    check(ok, name);
+}
+
+// The keys seen by a reduction: combining two runs checks that the
+// second starts after the first ends, so it also checks the order.
+struct KeyRun
+{
+    int first, last;
+    size_t count;
+    bool sorted;
+};
+KeyRun combineRuns(const KeyRun& a, const KeyRun& b)
+{
+    if(a.count == 0) return b;
+    if(b.count == 0) return a;
+    KeyRun run = { a.first, b.last, a.count + b.count, a.sorted && b.sorted && a.last < b.first };
+    return run;
+}
+
+// parallelReduce against a serial sum and an in-order run check, and
+// parallelForEach visiting every item once, on big and empty trees.
+template<typename Tree>
+void parallelReduceTest(const char* name)
+{
+    Tree tree;
+    srand(31);
+    long expected = 0;
+    for(int i = 0; i < 50000; ++i) {
+        int key = rand() % 200000;
+        if(tree.find(key) == tree.end()) {
+            tree.insert(make_pair(key, i));
+            expected += i;
+        }
+    }
+    TaskPool pool(4);
+    long sum = tree.parallelReduce([](const pair<const int,int>& item) { return (long)item.second; },
+                                   [](long a, long b) { return a + b; }, 0L, pool);
+    KeyRun none = { 0, 0, 0, true };
+    KeyRun run = tree.parallelReduce([](const pair<const int,int>& item) {
+                                         KeyRun one = { item.first, item.first, 1, true };
+                                         return one;
+                                     }, combineRuns, none, pool);
+    atomic<long> visited(0), forEachSum(0);
+    tree.parallelForEach([&](const pair<const int,int>& item) {
+        ++visited;
+        forEachSum += item.second;
+    }, pool);
+    bool ok = sum == expected && run.sorted && run.count == tree.size() &&
+              run.first == tree.begin()->first && (size_t)visited == tree.size() && forEachSum == expected;
+
+    Tree empty;
+    ok = ok && empty.parallelReduce([](const pair<const int,int>&) { return 1; },
+                                    [](int a, int b) { return a + b; }, 0, 2) == 0;
+    check(ok, name);
+}
+
+// saveTo, then loadFrom into both tree kinds and a MappedAVLTree over
+// the same file, which must all hold what was saved; images of other
+// types and damaged files must be refused. The rest goes through the
+// free functions the members forward to.
+void imageTest()
+{
+    const string path = "/tmp/bst-test-image.bin";
+    AVLTree<int,double> tree;
+    srand(37);
+    for(int i = 0; i < 5000; ++i) {
+        int key = rand() % 20000;
+        tree.insert(make_pair(key, key * 0.5));
+    }
+    tree.saveTo(path);
+
+    AVLTree<int,double> loaded;
+    loaded.insert(make_pair(-1, 0.0));
+    loaded.loadFrom(path);
+    OrderStatisticTree<int,double> counted;
+    counted.loadFrom(path);
+    MappedAVLTree<int,double> mapped(path);
+    bool ok = loaded.size() == tree.size() && counted.size() == tree.size() && mapped.size() == tree.size() &&
+              loaded.validate().ok() && counted.validate().ok();
+    MappedAVLTree<int,double>::const_iterator mit = mapped.begin();
+    size_t rank = 0;
+    for(AVLTree<int,double>::const_iterator it = tree.begin(); it != tree.end(); ++it, ++mit, ++rank) {
+        ok = ok && loaded[it->first] == it->second && counted.select(rank)->first == it->first &&
+             mit->first == it->first && mit->second == it->second && mapped[it->first] == it->second;
+    }
+    ok = ok && mit == mapped.end() && mapped.find(-1) == mapped.end() && loaded.find(-1) == loaded.end();
+    ok = ok && mapped.lower_bound(20000) == mapped.end() && mapped.lower_bound(-5) == mapped.begin();
+    check(ok, "tree image round trip through loadFrom and the mapped view");
+
+    int refused = 0;
+    try { AVLTree<long long,double> other; loadAVLImage(other, path); }
+    catch(const runtime_error&) { ++refused; }
+    try { MappedAVLTree<int,double> missing(path + ".missing"); }
+    catch(const runtime_error&) { ++refused; }
+    // cut the image short
+    FILE* in = fopen(path.c_str(), "rb");
+    vector<char> bytes(200);
+    size_t got = fread(bytes.data(), 1, bytes.size(), in);
+    fclose(in);
+    FILE* out = fopen(path.c_str(), "wb");
+    fwrite(bytes.data(), 1, got, out);
+    fclose(out);
+    try { loadAVLImage(loaded, path); }
+    catch(const runtime_error&) { ++refused; }
+    check(refused == 3 && loaded.size() == tree.size(), "bad tree images are refused and leave the tree alone");
+
+    AVLTree<int,int> empty;
+    saveAVLImage(empty, path);
+    MappedAVLTree<int,int> none(path);
+    AVLTree<int,int> reloaded;
+    reloaded.insert(make_pair(1, 1));
+    loadAVLImage(reloaded, path);
+    check(none.empty() && none.begin() == none.end() && reloaded.empty(), "empty tree image");
+    remove(path.c_str());
+}
+
+// Counts the live copies of itself, to find leaked or doubly freed nodes.
+struct Tracked
+{
+    static int live;
+    int value;
+    Tracked(int v = 0) : value(v) { ++live; }
+    Tracked(const Tracked& other) : value(other.value) { ++live; }
+    Tracked& operator=(const Tracked& other) { value = other.value; return *this; }
+    ~Tracked() { --live; }
+};
+int Tracked::live = 0;
+
+// Random updates with a snapshot after every round: each snapshot must
+// still match the contents it was taken with at the end, and once every
+// version is gone no node may be left.
+void persistentAVLTest()
+{
+    bool ok = true;
+    {
+        PersistentAVLTree<int,Tracked> tree;
+        map<int,int> ref;
+        vector<PersistentAVLTree<int,Tracked> > snapshots;
+        vector<map<int,int> > refs;
+        srand(23);
+        for(int round = 0; round < 40; ++round) {
+            for(int i = 0; i < 200; ++i) {
+                int key = rand() % 600;
+                tree.insert(make_pair(key, Tracked(round)));
+                ref[key] = round;
+            }
+            for(int i = 0; i < 150; ++i) {
+                int key = rand() % 600;
+                tree.remove(key);
+                ref.erase(key);
+            }
+            ok = ok && tree.size() == ref.size() && tree.validate().ok();
+            snapshots.push_back(tree.snapshot());
+            refs.push_back(ref);
+            // drop some versions early so that shared nodes get freed too
+            if(round % 3 == 2) {
+                snapshots[round - 1].clear();
+                refs[round - 1].clear();
+            }
+        }
+        for(size_t v = 0; v < snapshots.size(); ++v) {
+            map<int,int>::const_iterator rit = refs[v].begin();
+            for(PersistentAVLTree<int,Tracked>::const_iterator it = snapshots[v].begin();
+                it != snapshots[v].end(); ++it, ++rit) {
+                ok = ok && rit != refs[v].end() && it->first == rit->first && it->second.value == rit->second;
+            }
+            ok = ok && rit == refs[v].end() && snapshots[v].size() == refs[v].size() && snapshots[v].validate().ok();
+        }
+    }
+    check(ok && Tracked::live == 0, "persistent tree snapshots keep their contents and free every node");
+
+    // a write copies the path to its key only
+    PersistentAVLTree<int,int> a;
+    for(int i = 0; i < 1000; ++i) {
+        a.insert(make_pair(i, i));
+    }
+    PersistentAVLTree<int,int> b = a.snapshot();
+    b.insert(make_pair(0, -1));
+    b.remove(999);
+    check(a[0] == 0 && b[0] == -1 && a.find(999) != a.end() && b.find(999) == b.end() &&
+          &*a.find(500) == &*b.find(500) && &*a.find(0) != &*b.find(0) &&
+          a.validate().ok() && b.validate().ok(), "persistent tree writes copy only their path");
+
+    // a snapshot stays readable on another thread while the tree changes
+    PersistentAVLTree<int,int> live;
+    for(int i = 0; i < 20000; ++i) {
+        live.insert(make_pair(i, i));
+    }
+    PersistentAVLTree<int,int> frozen = live.snapshot();
+    bool readerOk = true;
+    thread reader([&]() {
+        for(int pass = 0; pass < 3; ++pass) {
+            int expected = 0;
+            for(PersistentAVLTree<int,int>::const_iterator it = frozen.begin(); it != frozen.end(); ++it) {
+                readerOk = readerOk && it->first == expected && it->second == expected;
+                ++expected;
+            }
+            readerOk = readerOk && expected == 20000;
+        }
+    });
+    for(int i = 0; i < 20000; i += 2) {
+        live.remove(i);
+        live.insert(make_pair(i + 1, -i));
+    }
+    reader.join();
+    check(readerOk && live.size() == 10000 && live.validate().ok(), "persistent snapshot read while the tree changes");
+}
+
+// Counts its deletions, for objects handed to an EpochDomain.
+struct Retiree
+{
+    static atomic<int> deleted;
+    ~Retiree() { ++deleted; }
+};
+atomic<int> Retiree::deleted(0);
+
+// An object retired while another thread is inside the domain must
+// survive any number of collections until that thread leaves.
+void epochTest()
+{
+    EpochDomain domain;
+    atomic<int> stage(0);
+    thread reader([&]() {
+        EpochGuard guard(domain);
+        stage = 1;
+        while(stage != 2) {
+            this_thread::yield();
+        }
+    });
+    while(stage != 1) {
+        this_thread::yield();
+    }
+    domain.retire(new Retiree);
+    for(int i = 0; i < 10; ++i) {
+        domain.collect();
+    }
+    bool held = Retiree::deleted == 0 && domain.pending() == 1;
+    stage = 2;
+    reader.join();
+    for(int i = 0; i < 3; ++i) {
+        domain.collect();
+    }
+    check(held && Retiree::deleted == 1 && domain.pending() == 0, "epoch domain frees retired objects after readers leave");
+
+    {
+        EpochDomain other;
+        other.retire(new Retiree);
+        EpochGuard guard(other);
+        EpochGuard nested(other);
+        other.collect();
+    }
+    check(Retiree::deleted == 2, "epoch domain frees what is pending when destroyed");
+}
+
+// A writer inserting and removing while readers walk whole versions:
+// every version a reader sees must be a valid tree whose size matches
+// its contents, and no node may outlive the tree.
+void rcuAVLTest()
+{
+    bool ok = true;
+    {
+        RcuAVLTree<int,Tracked> tree;
+        const int readers = 3, keys = 3000;
+        atomic<bool> done(false);
+        vector<thread> threads;
+        bool readersOk[readers];
+        for(int r = 0; r < readers; ++r) {
+            readersOk[r] = true;
+            threads.push_back(thread([&tree, &done, &readersOk, r]() {
+                unsigned state = r + 1;
+                while(!done) {
+                    tree.read([&readersOk, r](const RcuAVLTree<int,Tracked>::VersionT& version) {
+                        size_t count = 0;
+                        int last = -1;
+                        for(RcuAVLTree<int,Tracked>::VersionT::const_iterator it = version.begin();
+                            it != version.end(); ++it, ++count) {
+                            readersOk[r] = readersOk[r] && it->first > last && it->second.value == 2 * it->first;
+                            last = it->first;
+                        }
+                        readersOk[r] = readersOk[r] && count == version.size() && version.validate().ok();
+                    });
+                    state = state * 1103515245u + 12345u;
+                    int key = (state >> 8) % keys;
+                    if(tree.contains(key)) {
+                        // it may be gone by now, but never with a wrong value
+                        tree.read([&](const RcuAVLTree<int,Tracked>::VersionT& version) {
+                            RcuAVLTree<int,Tracked>::VersionT::const_iterator it = version.find(key);
+                            readersOk[r] = readersOk[r] && (it == version.end() || it->second.value == 2 * key);
+                        });
+                    }
+                }
+            }));
+        }
+        srand(29);
+        for(int i = 0; i < keys; ++i) {
+            tree.insert(make_pair(i, Tracked(2 * i)));
+        }
+        for(int i = 0; i < 4 * keys; ++i) {
+            int key = rand() % keys;
+            if(!tree.remove(key)) {
+                ok = ok && tree.insert_or_assign(key, Tracked(2 * key));
+            }
+        }
+        done = true;
+        for(size_t t = 0; t < threads.size(); ++t) {
+            threads[t].join();
+        }
+        for(int r = 0; r < readers; ++r) {
+            ok = ok && readersOk[r];
+        }
+        RcuAVLTree<int,Tracked>::VersionT kept = tree.snapshot();
+        tree.insert(make_pair(keys, Tracked(2 * keys)));
+        ok = ok && kept.size() + 1 == tree.size() && kept.validate().ok() && tree[keys].value == 2 * keys;
+        tree.clear();
+        ok = ok && tree.empty() && kept.find(keys) == kept.end();
+    }
+    check(ok && Tracked::live == 0, "RCU tree readers see consistent versions while a writer runs");
+}
+
+// Writers on interleaved keys filling a sharded map at once; iteration
+// must then merge the shards back into key order.
+void shardedMapTest()
+{
+    ShardedAVLMap<int,int> map(8);
+    const int writers = 4, perWriter = 4000;
+    vector<thread> threads;
+    for(int w = 0; w < writers; ++w) {
+        threads.push_back(thread([&map, w]() {
+            for(int i = 0; i < perWriter; ++i) {
+                int key = i * writers + w;
+                map.insert(make_pair(key, -key));
+            }
+            for(int i = 0; i < perWriter; i += 3) {
+                map.remove(i * writers + w);
+            }
+        }));
+    }
+    for(size_t t = 0; t < threads.size(); ++t) {
+        threads[t].join();
+    }
+    bool ok = true;
+    int expected = 0, count = 0;
+    for(ShardedAVLMap<int,int>::const_iterator it = map.begin(); it != map.end(); ++it, ++count) {
+        // skip the keys whose i was a multiple of 3
+        while((expected / writers) % 3 == 0) {
+            ++expected;
+        }
+        ok = ok && it->first == expected && it->second == -expected;
+        ++expected;
+    }
+    size_t biggest = 0;
+    for(size_t s = 0; s < map.shardCount(); ++s) {
+        map.write(s, [&biggest](ShardedAVLMap<int,int>::TreeT& tree) {
+            biggest = max(biggest, tree.size());
+        });
+    }
+    ok = ok && count == (int)map.size() && biggest < map.size() / 4;
+    int value;
+    ok = ok && map.find(5, value) && value == -5 && !map.find(0, value) && map[7] == -7 &&
+         map.remove(7) && !map.contains(7) && !map.remove(7);
+    map.clear();
+    ok = ok && map.empty() && map.begin() == map.end();
+    check(ok, "sharded map with parallel writers iterates in key order");
+
+    ShardedAVLMap<string,int> single(1);
+    single.insert(make_pair(string("b"), 2));
+    single.insert(make_pair(string("a"), 1));
+    ShardedAVLMap<string,int>::const_iterator it = single.begin();
+    check(it->first == "a" && (++it)->first == "b" && ++it == single.end(), "sharded map with one shard");
+}
+
+// Writers on disjoint key ranges and readers checking every value they
+// find, all at once; afterwards the tree must hold exactly the writers'
+// even keys, which the caller checks.
+template<typename Tree>
+bool writersAndReaders(Tree& tree)
+{
+    const int writers = 4, readers = 4, perWriter = 5000;
+    vector<thread> threads;
+    bool readersOk[readers];
+    for(int w = 0; w < writers; ++w) {
+        threads.push_back(thread([&tree, w]() {
+            for(int i = 0; i < perWriter; ++i) {
+                int key = w * perWriter + i;
+                tree.insert(make_pair(key, 2 * key));
+            }
+            // keep the even keys
+            for(int i = 1; i < perWriter; i += 2) {
+                tree.remove(w * perWriter + i);
+            }
+        }));
+    }
+    for(int r = 0; r < readers; ++r) {
+        readersOk[r] = true;
+        threads.push_back(thread([&tree, &readersOk, r]() {
+            srand(r);
+            for(int i = 0; i < 20000; ++i) {
+                int key = rand() % (writers * perWriter);
+                int value;
+                if(tree.find(key, value) && value != 2 * key) {
+                    readersOk[r] = false;
+                }
+            }
+        }));
+    }
+    for(size_t t = 0; t < threads.size(); ++t) {
+        threads[t].join();
+    }
+    bool ok = tree.size() == (size_t)(writers * perWriter / 2);
+    for(int r = 0; r < readers; ++r) {
+        ok = ok && readersOk[r];
+    }
+    return ok;
+}
+
+void rwLockedAVLTest()
+{
+    RWLockedAVLTree<int,int> tree;
+    bool ok = writersAndReaders(tree);
+    tree.read([&ok](const RWLockedAVLTree<int,int>::TreeT& t) {
+        int expected = 0;
+        for(RWLockedAVLTree<int,int>::TreeT::const_iterator it = t.begin(); it != t.end(); ++it, expected += 2) {
+            ok = ok && it->first == expected && it->second == 2 * expected;
+        }
+        ok = ok && t.validate().ok();
+    });
+    ok = ok && tree[4] == 8 && !tree.contains(5) && !tree.remove(5) && tree.remove(4) && !tree.contains(4);
+    check(ok, "read-write locked tree with parallel writers and readers");
+}
+
+// Calls fn(key, value) on a ConcurrentAVLTree and checks the items come
+// in order and match ref.
+struct MatchesRef
+{
+    map<int,int>::const_iterator next;
+    map<int,int>::const_iterator end;
+    bool ok;
+    void operator()(int key, int value)
+    {
+        ok = ok && next != end && next->first == key && next->second == value;
+        if(next != end) {
+            ++next;
+        }
+    }
+};
+
+bool concurrentMatches(const ConcurrentAVLTree<int,int>& tree, const map<int,int>& ref)
+{
+    MatchesRef match = { ref.begin(), ref.end(), true };
+    tree.forEach([&match](int key, int value) { match(key, value); });
+    return match.ok && match.next == ref.end() && tree.size() == ref.size();
+}
+
+// The AVL height bound, 1.44 log2(n + 2), with routing nodes counted in n.
+bool concurrentBalanced(const ConcurrentAVLTree<int,int>& tree, size_t nodes)
+{
+    size_t bound = 1;
+    for(size_t n = nodes + 2; n > 1; n >>= 1) {
+        ++bound;
+    }
+    return tree.height() <= bound * 144 / 100 + 1;
+}
+
+void concurrentAVLTest()
+{
+    ConcurrentAVLTree<int,int> tree;
+    bool ok = writersAndReaders(tree);
+    map<int,int> ref;
+    for(int key = 0; key < 20000; key += 2) {
+        ref[key] = 2 * key;
+    }
+    ok = ok && concurrentMatches(tree, ref) && concurrentBalanced(tree, 20000);
+    ok = ok && tree[4] == 8 && !tree.contains(5) && !tree.remove(5) && tree.remove(4) && !tree.contains(4);
+    bool threw = false;
+    try { tree[4]; }
+    catch(const out_of_range&) { threw = true; }
+    ok = ok && threw;
+    check(ok, "concurrent tree with parallel writers and readers");
+
+    // threads own interleaved keys, so they rotate and splice the same
+    // nodes; removing keys with two children leaves routing nodes
+    ConcurrentAVLTree<int,int> mixed;
+    const int threadCount = 8, keyRange = 4096;
+    vector<map<int,int> > owned(threadCount);
+    vector<thread> threads;
+    for(int t = 0; t < threadCount; ++t) {
+        threads.push_back(thread([&mixed, &owned, t]() {
+            uint32_t state = (uint32_t)t * 2654435761u + 1;
+            for(int i = 0; i < 40000; ++i) {
+                state = state * 1103515245u + 12345u;
+                int key = (int)((state >> 8) % (keyRange / threadCount)) * threadCount + t;
+                if((state >> 4) % 3 == 0) {
+                    mixed.remove(key);
+                    owned[t].erase(key);
+                }
+                else {
+                    mixed.insert_or_assign(key, i);
+                    owned[t][key] = i;
+                }
+            }
+        }));
+    }
+    for(size_t t = 0; t < threads.size(); ++t) {
+        threads[t].join();
+    }
+    map<int,int> all;
+    for(int t = 0; t < threadCount; ++t) {
+        all.insert(owned[t].begin(), owned[t].end());
+    }
+    ok = concurrentMatches(mixed, all) && concurrentBalanced(mixed, keyRange);
+    mixed.clear();
+    ok = ok && mixed.empty() && mixed.height() == 0 && !mixed.contains(0);
+    mixed.insert(make_pair(1, 1));
+    ok = ok && mixed[1] == 1 && mixed.size() == 1;
+    check(ok, "concurrent tree with writers on interleaved keys");
+}
 
 int main(int argc, char *argv[])
 {
@@ -44,5 +1521,54 @@ int main(int argc, char *argv[])
     cout << "Erasing b" << endl;
     at.remove('b');
 
-    return 0;
+    randomAVLTest<HeapNodeAlloc>();
+    randomAVLTest<SlabNodeAlloc>();
+    slabClearTest();
+    validateTest();
+    degenerateTeardownTest();
+    largeHeightTest();
+    sortedInsertTest();
+    iteratorTest();
+    orderStatisticTest();
+    bulkLoadTest();
+    moveOnlyTest<BinarySearchTree<int,MoveOnly> >();
+    moveOnlyTest<AVLTree<int,MoveOnly> >();
+    moveOnlyTest<OrderStatisticTree<int,MoveOnly> >();
+    rangeQueryTest<BinarySearchTree<int,int> >();
+    rangeQueryTest<AVLTree<int,int> >();
+    compactAVLTest();
+    moveOnlyTest<CompactAVLTree<int,MoveOnly> >();
+    rangeQueryTest<CompactAVLTree<int,int> >();
+    keySearchTest();
+    comparatorTest<BinarySearchTree<int,int,HeapNodeAlloc,Node<int,int>,greater<int> > >("BST with std::greater");
+    comparatorTest<AVLTree<int,int,HeapNodeAlloc,AVLNode<int,int>,greater<int> > >("AVLTree with std::greater");
+    comparatorTest<OrderStatisticTree<int,int,HeapNodeAlloc,greater<int> > >("OrderStatisticTree with std::greater");
+    comparatorTest<CompactAVLTree<int,int,greater<int> > >("CompactAVLTree with std::greater");
+    comparatorTest<BPlusTree<int,int,64,greater<int> > >("BPlusTree with std::greater");
+    comparisonCountTest();
+    findBatchTest<BinarySearchTree<int,int> >("BST findBatch");
+    findBatchTest<AVLTree<int,int> >("AVLTree findBatch");
+    findBatchTest<AVLTree<int,int,SlabNodeAlloc,AVLNode<int,int>,greater<int> > >("AVLTree findBatch with std::greater");
+    batchUpdateTest<AVLTree<int,int> >("AVLTree batch updates");
+    batchUpdateTest<OrderStatisticTree<int,int,SlabNodeAlloc> >("OrderStatisticTree batch updates");
+    splitJoinTest<AVLTree<int,int> >("AVLTree split/join");
+    splitJoinTest<OrderStatisticTree<int,int> >("OrderStatisticTree split/join");
+    setOperationTest<AVLTree<int,int> >("AVLTree set operations");
+    setOperationTest<OrderStatisticTree<int,int> >("OrderStatisticTree set operations");
+    parallelReduceTest<AVLTree<int,int> >("AVLTree parallel reduce and for_each");
+    parallelReduceTest<OrderStatisticTree<int,int> >("OrderStatisticTree parallel reduce and for_each");
+    imageTest();
+    persistentAVLTest();
+    rwLockedAVLTest();
+    concurrentAVLTest();
+    epochTest();
+    rcuAVLTest();
+    shardedMapTest();
+    bplusTreeApiTest();
+    rangeQueryTest<BPlusTree<int,int> >();
+    rangeQueryTest<BPlusTree<int,int,64> >();
+    if(failures == 0) {
+        cout << "\nAll checks passed" << endl;
+    }
+    return failures == 0 ? 0 : 1;
 }
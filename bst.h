@@ -5,20 +5,38 @@
 #include <exception>
 #include <cstdlib>
 #include <utility>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <tuple>
+#include <cstddef>
+#include "node_alloc.h"
+#include "key_compare.h"
+
+#if defined(__GNUC__)
+#define BST_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define BST_PREFETCH(addr) ((void)0)
+#endif
 
 /**
  * A templated class for a Node in a search tree.
- * The getters for parent/left/right are virtual so
- * that they can be overridden for future kinds of
- * search trees, such as Red Black trees, Splay trees,
- * and AVL trees.
+ * Nothing here is virtual, so a node carries no vtable pointer and every
+ * step of a traversal is a direct load. Nodes for other kinds of search
+ * trees (such as AVLNode) derive from this class and redeclare the
+ * parent/left/right getters to return their own type; the tree is told
+ * its node type through its NodeT template parameter.
  */
 template <typename Key, typename Value>
 class Node
 {
 public:
     Node(const Key& key, const Value& value, Node<Key, Value>* parent);
-    virtual ~Node();
+    template<typename... Args>
+    Node(Node<Key, Value>* parent, Args&&... args);
+    ~Node();
 
     const std::pair<const Key, Value>& getItem() const;
     std::pair<const Key, Value>& getItem();
@@ -26,14 +44,15 @@ public:
     const Value& getValue() const;
     Value& getValue();
 
-    virtual Node<Key, Value>* getParent() const;
-    virtual Node<Key, Value>* getLeft() const;
-    virtual Node<Key, Value>* getRight() const;
+    Node<Key, Value>* getParent() const;
+    Node<Key, Value>* getLeft() const;
+    Node<Key, Value>* getRight() const;
 
     void setParent(Node<Key, Value>* parent);
     void setLeft(Node<Key, Value>* left);
     void setRight(Node<Key, Value>* right);
     void setValue(const Value &value);
+    void setValue(Value &&value);
 
 protected:
     std::pair<const Key, Value> item_;
@@ -63,6 +82,22 @@ Node<Key, Value>::Node(const Key& key, const Value& value, Node<Key, Value>* par
 
 }
 
+/**
+* Constructs the item in place from args (anything std::pair's constructors
+* accept, including std::piecewise_construct), so that keys and values can
+* be moved or built directly inside the node.
+*/
+template<typename Key, typename Value>
+template<typename... Args>
+Node<Key, Value>::Node(Node<Key, Value>* parent, Args&&... args) :
+    item_(std::forward<Args>(args)...),
+    parent_(parent),
+    left_(NULL),
+    right_(NULL)
+{
+
+}
+
 /**
 * Destructor, which does not need to do anything since the pointers inside of a node
 * are only used as references to existing nodes. The nodes pointed to by parent/left/right
@@ -120,7 +155,7 @@ Value& Node<Key, Value>::getValue()
 }
 
 /**
-* An implementation of the virtual function for retreiving the parent.
+* A getter for the parent.
 */
 template<typename Key, typename Value>
 Node<Key, Value>* Node<Key, Value>::getParent() const
@@ -129,7 +164,7 @@ Node<Key, Value>* Node<Key, Value>::getParent() const
 }
 
 /**
-* An implementation of the virtual function for retreiving the left child.
+* A getter for the left child.
 */
 template<typename Key, typename Value>
 Node<Key, Value>* Node<Key, Value>::getLeft() const
@@ -138,7 +173,7 @@ Node<Key, Value>* Node<Key, Value>::getLeft() const
 }
 
 /**
-* An implementation of the virtual function for retreiving the right child.
+* A getter for the right child.
 */
 template<typename Key, typename Value>
 Node<Key, Value>* Node<Key, Value>::getRight() const
@@ -182,6 +217,15 @@ void Node<Key, Value>::setValue(const Value& value)
     item_.second = value;
 }
 
+/**
+* A setter that moves the new value in.
+*/
+template<typename Key, typename Value>
+void Node<Key, Value>::setValue(Value&& value)
+{
+    item_.second = std::move(value);
+}
+
 /*
   ---------------------------------------
   End implementations for the Node class.
@@ -190,29 +234,59 @@ void Node<Key, Value>::setValue(const Value& value)
 
 /**
 * A templated unbalanced binary search tree.
+* Alloc is the node allocator policy (see node_alloc.h). NodeT is the type
+* of node the tree creates; subclasses such as AVLTree pass their own.
+* Compare orders the keys, as for std::map (see key_compare.h).
 */
-template <typename Key, typename Value>
+template <typename Key, typename Value, typename Alloc = HeapNodeAlloc, typename NodeT = Node<Key, Value>,
+          typename Compare = std::less<Key> >
 class BinarySearchTree
 {
 public:
     BinarySearchTree(); //TODO
+    explicit BinarySearchTree(const Compare& comp);
     virtual ~BinarySearchTree(); //TODO
-    virtual void insert(const std::pair<const Key, Value>& keyValuePair); //TODO
+    void insert(const std::pair<const Key, Value>& keyValuePair); //TODO
+    void insert(std::pair<const Key, Value>&& keyValuePair);
     virtual void remove(const Key& key); //TODO
     void clear(); //TODO
     bool isBalanced() const; //TODO
+    virtual size_t height() const;
     void print() const;
     bool empty() const;
+    size_t size() const;
+    Compare key_comp() const;
+
+    /**
+    * The outcome of validate(). When an invariant is broken, node is the
+    * first offending node found and reason describes the violation.
+    */
+    struct ValidationResult
+    {
+        const Node<Key, Value>* node;
+        const char* reason;
+        bool ok() const { return reason == nullptr; }
+    };
+    ValidationResult validate() const;
 
     template<typename PPKey, typename PPValue>
     friend void prettyPrintBST(BinarySearchTree<PPKey, PPValue> & tree);
 public:
     /**
     * An internal iterator class for traversing the contents of the BST.
+    * Bidirectional: stepping follows the parent pointers, so a full
+    * traversal is O(n) and each step is O(1) amortized. Decrementing
+    * end() yields the largest item.
     */
     class iterator  // TODO
     {
     public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef value_type* pointer;
+        typedef value_type& reference;
+
         iterator();
 
         std::pair<const Key,Value>& operator*() const;
@@ -222,26 +296,108 @@ public:
         bool operator!=(const iterator& rhs) const;
 
         iterator& operator++();
+        iterator operator++(int);
+        iterator& operator--();
+        iterator operator--(int);
 
     protected:
-        friend class BinarySearchTree<Key, Value>;
-        iterator(Node<Key,Value>* ptr);
+        friend class BinarySearchTree<Key, Value, Alloc, NodeT, Compare>;
+        iterator(Node<Key,Value>* ptr, const BinarySearchTree<Key, Value, Alloc, NodeT, Compare>* tree);
         Node<Key, Value> *current_;
+        const BinarySearchTree<Key, Value, Alloc, NodeT, Compare>* tree_;
+    };
 
-    
+    /**
+    * The read-only counterpart of iterator, returned when the tree is const.
+    * An iterator converts implicitly to a const_iterator.
+    */
+    class const_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type* pointer;
+        typedef const value_type& reference;
+
+        const_iterator();
+        const_iterator(const iterator& it);
+
+        const std::pair<const Key,Value>& operator*() const;
+        const std::pair<const Key,Value>* operator->() const;
+
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+        const_iterator& operator--();
+        const_iterator operator--(int);
+
+    protected:
+        friend class BinarySearchTree<Key, Value, Alloc, NodeT, Compare>;
+        const_iterator(Node<Key,Value>* ptr, const BinarySearchTree<Key, Value, Alloc, NodeT, Compare>* tree);
+        Node<Key, Value> *current_;
+        const BinarySearchTree<Key, Value, Alloc, NodeT, Compare>* tree_;
     };
 
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
 public:
-    iterator begin() const;
-    iterator end() const;
-    iterator find(const Key& key) const;
+    iterator begin();
+    iterator end();
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator cbegin() const;
+    const_iterator cend() const;
+    reverse_iterator rbegin();
+    reverse_iterator rend();
+    const_reverse_iterator rbegin() const;
+    const_reverse_iterator rend() const;
+    iterator find(const Key& key);
+    const_iterator find(const Key& key) const;
+    template<typename ForwardIt, typename OutputIt>
+    OutputIt findBatch(ForwardIt first, ForwardIt last, OutputIt out);
+    template<typename ForwardIt, typename OutputIt>
+    OutputIt findBatch(ForwardIt first, ForwardIt last, OutputIt out) const;
+    iterator lower_bound(const Key& key);
+    const_iterator lower_bound(const Key& key) const;
+    iterator upper_bound(const Key& key);
+    const_iterator upper_bound(const Key& key) const;
+    std::pair<iterator, iterator> equal_range(const Key& key);
+    std::pair<const_iterator, const_iterator> equal_range(const Key& key) const;
+    template<typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args);
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign(const Key& key, M&& value);
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign(Key&& key, M&& value);
+    template<typename Function>
+    void forEachInRange(const Key& lo, const Key& hi, Function fn);
+    template<typename Function>
+    void forEachInRange(const Key& lo, const Key& hi, Function fn) const;
     Value& operator[](const Key& key);
     Value const & operator[](const Key& key) const;
 
 protected:
     // Mandatory helper functions
     Node<Key, Value>* internalFind(const Key& k) const; // TODO
+    void findGroup(const Key* const* keys, size_t n, Node<Key, Value>** found,
+                   Node<Key, Value>** last = nullptr) const;
+    Node<Key, Value>* internalLowerBound(const Key& k) const;
+    Node<Key, Value>* findSlot(const Key& key, Node<Key, Value>*& parent, bool& isLeft) const;
+    void linkNode(NodeT* node, Node<Key, Value>* parent, bool isLeft);
+    virtual void onInsert(NodeT* node);
+    Node<Key, Value>* internalUpperBound(const Key& k) const;
     Node<Key, Value> *getSmallestNode() const;  // TODO
+    Node<Key, Value> *getLargestNode() const;
+    iterator makeIterator(Node<Key, Value>* node);
+    const_iterator makeIterator(Node<Key, Value>* node) const;
     static Node<Key, Value>* predecessor(Node<Key, Value>* current); // TODO
     
     // Note:  static means these functions don't have a "this" pointer
@@ -255,12 +411,23 @@ protected:
     //helper functions
 protected:
     void deleteNodes(Node<Key, Value>* ptr);
-    int balanceCheck(Node<Key,Value>*ptr, bool& result) const;
+    ValidationResult checkInvariants(bool heightsOnly) const;
+    virtual const char* checkNode(const Node<Key, Value>* node,
+                                  size_t leftHeight, size_t rightHeight) const;
     static Node<Key, Value>* successor(Node<Key, Value>* current); // TODO
 
 protected:
+    typedef ThreeWayCompare<Key, Compare> ThreeWay;
+    // how many descents findBatch interleaves
+    static const size_t kBatchWidth = 32;
+
     Node<Key, Value>* root_;
-    // You should not need other data members
+    // sizeKnown_ is false after a split left size_ uncounted; size()
+    // then counts the nodes once
+    mutable size_t size_;
+    mutable bool sizeKnown_;
+    Alloc alloc_;
+    Compare comp_;
 };
 
 /*
@@ -270,32 +437,32 @@ Begin implementations for the BinarySearchTree::iterator class.
 */
 
 /**
-* Explicit constructor that initializes an iterator with a given node pointer.
+* Explicit constructor that initializes an iterator with a given node pointer
+* and the tree it belongs to (needed to step back from end()).
 */
-template<class Key, class Value>
-BinarySearchTree<Key, Value>::iterator::iterator(Node<Key,Value> *ptr)
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator::iterator(Node<Key,Value> *ptr, const BinarySearchTree<Key, Value, Alloc, NodeT, Compare>* tree) :
+    current_(ptr), tree_(tree)
 {
-    // TODO
-    current_ = ptr;
+
 }
 
 /**
 * A default constructor that initializes the iterator to NULL.
 */
-template<class Key, class Value>
-BinarySearchTree<Key, Value>::iterator::iterator() 
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator::iterator() :
+    current_(nullptr), tree_(nullptr)
 {
-    // TODO
-    current_ = nullptr;
 
 }
 
 /**
 * Provides access to the item.
 */
-template<class Key, class Value>
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
 std::pair<const Key,Value> &
-BinarySearchTree<Key, Value>::iterator::operator*() const
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator::operator*() const
 {
     return current_->getItem();
 }
@@ -303,9 +470,9 @@ BinarySearchTree<Key, Value>::iterator::operator*() const
 /**
 * Provides access to the address of the item.
 */
-template<class Key, class Value>
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
 std::pair<const Key,Value> *
-BinarySearchTree<Key, Value>::iterator::operator->() const
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator::operator->() const
 {
     return &(current_->getItem());
 }
@@ -314,61 +481,204 @@ BinarySearchTree<Key, Value>::iterator::operator->() const
 * Checks if 'this' iterator's internals have the same value
 * as 'rhs'
 */
-template<class Key, class Value>
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
 bool
-BinarySearchTree<Key, Value>::iterator::operator==(
-    const BinarySearchTree<Key, Value>::iterator& rhs) const
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator::operator==(
+    const BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator& rhs) const
 {
-    // TODO
     return this->current_ == rhs.current_;
-    
 }
 
 /**
 * Checks if 'this' iterator's internals have a different value
 * as 'rhs'
 */
-template<class Key, class Value>
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
 bool
-BinarySearchTree<Key, Value>::iterator::operator!=(
-    const BinarySearchTree<Key, Value>::iterator& rhs) const
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator::operator!=(
+    const BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator& rhs) const
 {
-    // TODO
     return this->current_ != rhs.current_;
+}
 
+/**
+* Advances the iterator's location using an in-order sequencing
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator&
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator::operator++()
+{
+    current_ = successor(current_);
+    return *this;
 }
 
+/**
+* Post-increment: advances and returns the previous position.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator::operator++(int)
+{
+    iterator old(*this);
+    current_ = successor(current_);
+    return old;
+}
+
+/**
+* Moves back one item in key order; end() steps back to the largest item.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator&
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator::operator--()
+{
+    if(current_ == nullptr) current_ = tree_->getLargestNode();
+    else current_ = predecessor(current_);
+    return *this;
+}
+
+/**
+* Post-decrement: moves back and returns the previous position.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator::operator--(int)
+{
+    iterator old(*this);
+    --(*this);
+    return old;
+}
+
+/*
+-------------------------------------------------------------------
+Begin implementations for the BinarySearchTree::const_iterator class.
+-------------------------------------------------------------------
+*/
+
+/**
+* Explicit constructor that initializes an iterator with a given node pointer
+* and the tree it belongs to (needed to step back from end()).
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator::const_iterator(Node<Key,Value> *ptr, const BinarySearchTree<Key, Value, Alloc, NodeT, Compare>* tree) :
+    current_(ptr), tree_(tree)
+{
+
+}
+
+/**
+* Converts a mutable iterator to a read-only one.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator::const_iterator(const iterator& it) :
+    current_(it.current_), tree_(it.tree_)
+{
+
+}
+
+/**
+* A default constructor that initializes the iterator to NULL.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator::const_iterator() :
+    current_(nullptr), tree_(nullptr)
+{
+
+}
+
+/**
+* Provides access to the item.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+const std::pair<const Key,Value> &
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator::operator*() const
+{
+    return current_->getItem();
+}
+
+/**
+* Provides access to the address of the item.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+const std::pair<const Key,Value> *
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator::operator->() const
+{
+    return &(current_->getItem());
+}
+
+/**
+* Checks if 'this' iterator's internals have the same value
+* as 'rhs'
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+bool
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator::operator==(
+    const BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator& rhs) const
+{
+    return this->current_ == rhs.current_;
+}
+
+/**
+* Checks if 'this' iterator's internals have a different value
+* as 'rhs'
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+bool
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator::operator!=(
+    const BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator& rhs) const
+{
+    return this->current_ != rhs.current_;
+}
 
 /**
 * Advances the iterator's location using an in-order sequencing
 */
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator&
-BinarySearchTree<Key, Value>::iterator::operator++()
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator&
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator::operator++()
 {
-    // TODO
-    //if right child exists, go right and then find the most left child
-    if (current_->getRight() != nullptr) {
-        current_ = current_->getRight();
-        while (current_->getLeft() != nullptr) {
-            current_ = current_->getLeft();
-        }
-    }
-    else {
-        while (current_->getParent() != nullptr && current_->getParent()->getRight() == current_) {
-            current_ = current_->getParent();
-        }
-        current_ = current_->getParent();
-    }
+    current_ = successor(current_);
     return *this;
+}
 
+/**
+* Post-increment: advances and returns the previous position.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator::operator++(int)
+{
+    const_iterator old(*this);
+    current_ = successor(current_);
+    return old;
+}
 
+/**
+* Moves back one item in key order; end() steps back to the largest item.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator&
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator::operator--()
+{
+    if(current_ == nullptr) current_ = tree_->getLargestNode();
+    else current_ = predecessor(current_);
+    return *this;
 }
 
+/**
+* Post-decrement: moves back and returns the previous position.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator::operator--(int)
+{
+    const_iterator old(*this);
+    --(*this);
+    return old;
+}
 
 /*
 -------------------------------------------------------------
-End implementations for the BinarySearchTree::iterator class.
+End implementations for the BinarySearchTree iterator classes.
 -------------------------------------------------------------
 */
 
@@ -381,15 +691,25 @@ Begin implementations for the BinarySearchTree class.
 /**
 * Default constructor for a BinarySearchTree, which sets the root to NULL.
 */
-template<class Key, class Value>
-BinarySearchTree<Key, Value>::BinarySearchTree() 
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::BinarySearchTree() :
+    root_(nullptr), size_(0), sizeKnown_(true), comp_()
 {
-    // TODO
-    root_ = nullptr;
+
 }
 
-template<typename Key, typename Value>
-BinarySearchTree<Key, Value>::~BinarySearchTree()
+/**
+* Constructs an empty tree ordered by comp.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::BinarySearchTree(const Compare& comp) :
+    root_(nullptr), size_(0), sizeKnown_(true), comp_(comp)
+{
+
+}
+
+template<typename Key, typename Value, typename Alloc, typename NodeT, typename Compare>
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::~BinarySearchTree()
 {
     // TODO
     clear();
@@ -400,14 +720,41 @@ BinarySearchTree<Key, Value>::~BinarySearchTree()
 /**
  * Returns true if tree is empty
 */
-template<class Key, class Value>
-bool BinarySearchTree<Key, Value>::empty() const
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+bool BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::empty() const
 {
     return root_ == NULL;
 }
 
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::print() const
+/**
+ * Returns the number of items in the tree, in O(1), except on the first
+ * call after AVLTree::split left the size uncounted, which walks the tree
+ * once. That call writes the count, so it must not race other readers.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+size_t BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::size() const
+{
+    if(!sizeKnown_){
+        size_t count = 0;
+        for(const_iterator it = begin(); it != end(); ++it)
+            ++count;
+        size_ = count;
+        sizeKnown_ = true;
+    }
+    return size_;
+}
+
+/**
+ * Returns a copy of the comparison object that orders the keys.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+Compare BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::key_comp() const
+{
+    return comp_;
+}
+
+template<typename Key, typename Value, typename Alloc, typename NodeT, typename Compare>
+void BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::print() const
 {
     printRoot(root_);
     std::cout << "\n";
@@ -416,51 +763,234 @@ void BinarySearchTree<Key, Value>::print() const
 /**
 * Returns an iterator to the "smallest" item in the tree
 */
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator
-BinarySearchTree<Key, Value>::begin() const
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::begin()
 {
-    BinarySearchTree<Key, Value>::iterator begin(getSmallestNode());
-    return begin;
+    return iterator(getSmallestNode(), this);
 }
 
 /**
 * Returns an iterator whose value means INVALID
 */
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator
-BinarySearchTree<Key, Value>::end() const
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::end()
+{
+    return iterator(NULL, this);
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::begin() const
+{
+    return const_iterator(getSmallestNode(), this);
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::end() const
+{
+    return const_iterator(NULL, this);
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::cbegin() const
+{
+    return begin();
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::cend() const
+{
+    return end();
+}
+
+/**
+* Reverse iteration starts at the largest item.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::reverse_iterator
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::rbegin()
+{
+    return reverse_iterator(end());
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::reverse_iterator
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::rend()
+{
+    return reverse_iterator(begin());
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_reverse_iterator
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::rbegin() const
+{
+    return const_reverse_iterator(end());
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_reverse_iterator
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::rend() const
 {
-    BinarySearchTree<Key, Value>::iterator end(NULL);
-    return end;
+    return const_reverse_iterator(begin());
 }
 
 /**
 * Returns an iterator to the item with the given key, k
 * or the end iterator if k does not exist in the tree
 */
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator
-BinarySearchTree<Key, Value>::find(const Key & k) const
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::find(const Key & k)
+{
+    return iterator(internalFind(k), this);
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::find(const Key & k) const
+{
+    return const_iterator(internalFind(k), this);
+}
+
+/**
+* Looks up every key in [first, last) and writes find(key) for each of
+* them to out, in order. Returns the end of the output.
+*
+* The keys are taken kBatchWidth at a time and their descents advance
+* together, one level per round, with a prefetch for each node the next
+* round will visit. A lone find waits out one cache miss per level; here
+* the misses of a whole group are in flight at once.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename ForwardIt, typename OutputIt>
+OutputIt BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::findBatch(ForwardIt first, ForwardIt last, OutputIt out)
+{
+    const Key* keys[kBatchWidth];
+    Node<Key, Value>* found[kBatchWidth];
+    while(first != last){
+        size_t n = 0;
+        for(; n < kBatchWidth && first != last; ++n, ++first)
+            keys[n] = &*first;
+        findGroup(keys, n, found);
+        for(size_t i = 0; i < n; ++i, ++out)
+            *out = iterator(found[i], this);
+    }
+    return out;
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename ForwardIt, typename OutputIt>
+OutputIt BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::findBatch(ForwardIt first, ForwardIt last, OutputIt out) const
+{
+    const Key* keys[kBatchWidth];
+    Node<Key, Value>* found[kBatchWidth];
+    while(first != last){
+        size_t n = 0;
+        for(; n < kBatchWidth && first != last; ++n, ++first)
+            keys[n] = &*first;
+        findGroup(keys, n, found);
+        for(size_t i = 0; i < n; ++i, ++out)
+            *out = const_iterator(found[i], this);
+    }
+    return out;
+}
+
+/**
+* Returns an iterator to the first item whose key is not less than key,
+* or end() if there is none.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::lower_bound(const Key& key)
+{
+    return iterator(internalLowerBound(key), this);
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::lower_bound(const Key& key) const
+{
+    return const_iterator(internalLowerBound(key), this);
+}
+
+/**
+* Returns an iterator to the first item whose key is greater than key,
+* or end() if there is none.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::upper_bound(const Key& key)
 {
-    Node<Key, Value> *curr = internalFind(k);
-    BinarySearchTree<Key, Value>::iterator it(curr);
-    return it;
+    return iterator(internalUpperBound(key), this);
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::upper_bound(const Key& key) const
+{
+    return const_iterator(internalUpperBound(key), this);
+}
+
+/**
+* Returns the range of items with the given key: empty, or just that item.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+std::pair<typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator, typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator>
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::equal_range(const Key& key)
+{
+    return std::make_pair(lower_bound(key), upper_bound(key));
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+std::pair<typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator, typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator>
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::equal_range(const Key& key) const
+{
+    return std::make_pair(lower_bound(key), upper_bound(key));
+}
+
+/**
+* Calls fn(item) on every item with lo <= key < hi, in key order, in
+* O(log n + k) for k items.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename Function>
+void BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::forEachInRange(const Key& lo, const Key& hi, Function fn)
+{
+    for(Node<Key, Value>* curr = internalLowerBound(lo);
+        curr != nullptr && comp_(curr->getKey(), hi); curr = successor(curr)) {
+        fn(curr->getItem());
+    }
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename Function>
+void BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::forEachInRange(const Key& lo, const Key& hi, Function fn) const
+{
+    for(Node<Key, Value>* curr = internalLowerBound(lo);
+        curr != nullptr && comp_(curr->getKey(), hi); curr = successor(curr)) {
+        const Node<Key, Value>* item = curr;
+        fn(item->getItem());
+    }
 }
 
 /**
  * @precondition The key exists in the map
  * Returns the value associated with the key
  */
-template<class Key, class Value>
-Value& BinarySearchTree<Key, Value>::operator[](const Key& key)
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+Value& BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::operator[](const Key& key)
 {
     Node<Key, Value> *curr = internalFind(key);
     if(curr == NULL) throw std::out_of_range("Invalid key");
     return curr->getValue();
 }
-template<class Key, class Value>
-Value const & BinarySearchTree<Key, Value>::operator[](const Key& key) const
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+Value const & BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::operator[](const Key& key) const
 {
     Node<Key, Value> *curr = internalFind(key);
     if(curr == NULL) throw std::out_of_range("Invalid key");
@@ -473,44 +1003,187 @@ Value const & BinarySearchTree<Key, Value>::operator[](const Key& key) const
 * Recall: If key is already in the tree, you should 
 * overwrite the current value with the updated value.
 */
-template<class Key, class Value>
-void BinarySearchTree<Key, Value>::insert(const std::pair<const Key, Value> &keyValuePair)
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::insert(const std::pair<const Key, Value> &keyValuePair)
 {
-    // TODO
-    Node<Key, Value> *newNode = new Node<Key, Value>(keyValuePair.first, keyValuePair.second,nullptr);
-    if (root_ == nullptr){
-        root_ = newNode;
+    insert_or_assign(keyValuePair.first, keyValuePair.second);
+}
+
+/**
+* Same as above, but the value is moved into the tree.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::insert(std::pair<const Key, Value> &&keyValuePair)
+{
+    insert_or_assign(keyValuePair.first, std::move(keyValuePair.second));
+}
+
+/**
+* Builds the item in a new node from args, as std::map::emplace does. If the
+* key is already present the new node is discarded and the tree is
+* unchanged. Returns the item's position and whether it was inserted.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::emplace(Args&&... args)
+{
+    NodeT* node = alloc_.template create<NodeT>(static_cast<NodeT*>(nullptr), std::forward<Args>(args)...);
+    Node<Key, Value>* parent;
+    bool isLeft;
+    Node<Key, Value>* found = findSlot(node->getKey(), parent, isLeft);
+    if(found != nullptr){
+        alloc_.destroy(node);
+        return std::make_pair(iterator(found, this), false);
     }
-    else{
-        Node<Key, Value> * curr = root_;
+    node->setParent(static_cast<NodeT*>(parent));
+    linkNode(node, parent, isLeft);
+    return std::make_pair(iterator(node, this), true);
+}
+
+/**
+* If key is absent, builds its value in place from args; otherwise does
+* nothing, and args are left untouched.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::try_emplace(const Key& key, Args&&... args)
+{
+    Node<Key, Value>* parent;
+    bool isLeft;
+    Node<Key, Value>* found = findSlot(key, parent, isLeft);
+    if(found != nullptr)
+        return std::make_pair(iterator(found, this), false);
+    NodeT* node = alloc_.template create<NodeT>(static_cast<NodeT*>(parent), std::piecewise_construct,
+        std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+    linkNode(node, parent, isLeft);
+    return std::make_pair(iterator(node, this), true);
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::try_emplace(Key&& key, Args&&... args)
+{
+    Node<Key, Value>* parent;
+    bool isLeft;
+    Node<Key, Value>* found = findSlot(key, parent, isLeft);
+    if(found != nullptr)
+        return std::make_pair(iterator(found, this), false);
+    NodeT* node = alloc_.template create<NodeT>(static_cast<NodeT*>(parent), std::piecewise_construct,
+        std::forward_as_tuple(std::move(key)), std::forward_as_tuple(std::forward<Args>(args)...));
+    linkNode(node, parent, isLeft);
+    return std::make_pair(iterator(node, this), true);
+}
+
+/**
+* Assigns value to key, inserting it if absent. Returns the item's position
+* and whether it was inserted.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename M>
+std::pair<typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::insert_or_assign(const Key& key, M&& value)
+{
+    Node<Key, Value>* parent;
+    bool isLeft;
+    Node<Key, Value>* found = findSlot(key, parent, isLeft);
+    if(found != nullptr){
+        found->getValue() = std::forward<M>(value);
+        return std::make_pair(iterator(found, this), false);
+    }
+    NodeT* node = alloc_.template create<NodeT>(static_cast<NodeT*>(parent), key, std::forward<M>(value));
+    linkNode(node, parent, isLeft);
+    return std::make_pair(iterator(node, this), true);
+}
+
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+template<typename M>
+std::pair<typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::insert_or_assign(Key&& key, M&& value)
+{
+    Node<Key, Value>* parent;
+    bool isLeft;
+    Node<Key, Value>* found = findSlot(key, parent, isLeft);
+    if(found != nullptr){
+        found->getValue() = std::forward<M>(value);
+        return std::make_pair(iterator(found, this), false);
+    }
+    NodeT* node = alloc_.template create<NodeT>(static_cast<NodeT*>(parent), std::move(key), std::forward<M>(value));
+    linkNode(node, parent, isLeft);
+    return std::make_pair(iterator(node, this), true);
+}
+
+/**
+* The single descent shared by every insert: returns the node holding key,
+* or NULL with parent/isLeft set to the empty slot where it belongs.
+* Each level asks only whether key goes left. The last node the descent
+* turned right at is the only one that can hold key, so equality is
+* checked once, at the bottom.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+Node<Key, Value>*
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::findSlot(const Key& key, Node<Key, Value>*& parent, bool& isLeft) const
+{
+    parent = nullptr;
+    isLeft = false;
+    Node<Key, Value>* curr = root_;
+    if(ThreeWay::value){
         while(curr != nullptr){
-            if (keyValuePair.first < curr->getKey()){
-                if (curr->getLeft() == nullptr){
-                    curr->setLeft(newNode);
-                    newNode->setParent(curr);
-                    break;
-                }
-                else{
-                    curr = curr->getLeft();
-                }
-            }
-            else if (keyValuePair.first > curr->getKey()){
-                if (curr->getRight() == nullptr){
-                    curr->setRight(newNode);
-                    newNode->setParent(curr);
-                    break;
-                }
-                else{
-                    curr = curr->getRight();
-                }
-            }
-            else{
-                delete newNode;
-                curr->setValue(keyValuePair.second);
-                break;
-            }
+            int c = ThreeWay::compare(comp_, key, curr->getKey());
+            if(c == 0)
+                return curr;
+            parent = curr;
+            isLeft = c < 0;
+            curr = isLeft ? curr->getLeft() : curr->getRight();
         }
+        return nullptr;
     }
+    Node<Key, Value>* candidate = nullptr;
+    while(curr != nullptr){
+        parent = curr;
+        isLeft = comp_(key, curr->getKey());
+        if(isLeft){
+            curr = curr->getLeft();
+        }
+        else{
+            candidate = curr;
+            curr = curr->getRight();
+        }
+    }
+    if(candidate != nullptr && !comp_(candidate->getKey(), key))
+        return candidate;
+    return nullptr;
+}
+
+/**
+* Hangs a new node in the slot found by findSlot and lets the kind of tree
+* react through onInsert.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::linkNode(NodeT* node, Node<Key, Value>* parent, bool isLeft)
+{
+    if (parent == nullptr){
+        root_ = node;
+    }
+    else if (isLeft){
+        parent->setLeft(node);
+    }
+    else{
+        parent->setRight(node);
+    }
+    ++size_;
+    onInsert(node);
+}
+
+/**
+* Hook called after a new node is linked in; a plain BST has nothing to do.
+*/
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
+void BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::onInsert(NodeT*)
+{
+
 }
 
 
@@ -520,14 +1193,15 @@ void BinarySearchTree<Key, Value>::insert(const std::pair<const Key, Value> &key
 * should swap with the predecessor and then remove.
 */
 //
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::remove(const Key& key)
+template<typename Key, typename Value, typename Alloc, typename NodeT, typename Compare>
+void BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::remove(const Key& key)
 {
     //void remove(const Key& key) : This function will remove the node with the specified key from the tree. There is no guarantee the tree is balanced before or after the removal. If the key is not already in the tree, this function will do nothing. If the node to be removed has two children, swap with its predecessor (not its successor) in the BST removal algorithm. If the node to be removed has exactly one child, you can promote the child. You may NOT just swap key,value pairs. You must swap the actual nodes by changing pointers, but we have given you a helper function to do this in the BST class: swapNode(). Runtime of removal should be O(h).
     
     Node<Key, Value> *curr = internalFind(key);
     if(curr == nullptr) return;
     else{
+        --size_;
         //if it has 2 children, swap with its predecessor
         if(curr->getLeft()!=nullptr && curr->getRight()!=nullptr){
             Node<Key, Value> *pred = predecessor(curr);
@@ -536,7 +1210,7 @@ void BinarySearchTree<Key, Value>::remove(const Key& key)
                 nodeSwap(pred,curr);
                 if(curr->getParent()->getLeft()==curr)curr->getParent()->setLeft(nullptr);
                 else if(curr->getParent()->getRight()==curr)curr->getParent()->setRight(nullptr);
-                delete curr;
+                alloc_.destroy(static_cast<NodeT*>(curr));
             }
             else{//if left child exists on the predecessor
                 nodeSwap(pred,curr);
@@ -559,7 +1233,7 @@ void BinarySearchTree<Key, Value>::remove(const Key& key)
                         
                     }
                 }
-                delete curr;
+                alloc_.destroy(static_cast<NodeT*>(curr));
             }
         }
         //following 2 cases are if it has 1 child
@@ -573,7 +1247,7 @@ void BinarySearchTree<Key, Value>::remove(const Key& key)
             else if(curr->getParent()->getLeft()==curr) curr->getParent()->setLeft(curr->getLeft());
             }
             
-            delete curr;
+            alloc_.destroy(static_cast<NodeT*>(curr));
         }
         else if(curr->getRight()!= nullptr){//child on current's right
             curr->getRight()->setParent(curr->getParent());
@@ -584,7 +1258,7 @@ void BinarySearchTree<Key, Value>::remove(const Key& key)
                 if(curr->getParent()->getRight()==curr) curr->getParent()->setRight(curr->getRight());
                 else if (curr->getParent()->getLeft()==curr) curr->getParent()->setLeft(curr->getRight());
             }
-            delete curr;
+            alloc_.destroy(static_cast<NodeT*>(curr));
             
         }
         else{
@@ -594,15 +1268,15 @@ void BinarySearchTree<Key, Value>::remove(const Key& key)
             else{
                 if(curr->getParent()->getLeft()==curr) curr->getParent()->setLeft(nullptr);
                 else if(curr->getParent()->getRight()==curr) curr->getParent()->setRight(nullptr);
-                delete curr;
+                alloc_.destroy(static_cast<NodeT*>(curr));
             }
         }
     }
 }
 
-template<class Key, class Value>
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
 Node<Key, Value>*
-BinarySearchTree<Key, Value>::successor(Node<Key, Value>* current)
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::successor(Node<Key, Value>* current)
 {
  
     //if right child exists, go right and then find the most left child
@@ -624,9 +1298,9 @@ BinarySearchTree<Key, Value>::successor(Node<Key, Value>* current)
     return current;
 
 }
-template<class Key, class Value>
+template<class Key, class Value, class Alloc, class NodeT, class Compare>
 Node<Key, Value>*
-BinarySearchTree<Key, Value>::predecessor(Node<Key, Value>* current)
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::predecessor(Node<Key, Value>* current)
 {
 
     
@@ -655,35 +1329,64 @@ BinarySearchTree<Key, Value>::predecessor(Node<Key, Value>* current)
 * A method to remove all contents of the tree and
 * reset the values in the tree for use again.
 */
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::clear()
+template<typename Key, typename Value, typename Alloc, typename NodeT, typename Compare>
+void BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::clear()
 {
-    // TODO
-    BinarySearchTree<Key, Value>::deleteNodes(root_);
+    // When no destructor has to run, an arena allocator can drop every
+    // node at once instead of visiting them.
+    if(std::is_trivially_destructible<Key>::value &&
+       std::is_trivially_destructible<Value>::value &&
+       alloc_.release()) {
+        root_ = nullptr;
+        size_ = 0;
+        sizeKnown_ = true;
+        return;
+    }
+    BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::deleteNodes(root_);
     root_ = nullptr;
-
-    
+    size_ = 0;
+    sizeKnown_ = true;
 }
-//helper function for delete node in 
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::deleteNodes(Node<Key, Value>* ptr)
-{       
-    //delete all the node in post traversal recursion
-    if(ptr == nullptr)
-        return;
-    Node<Key, Value>* left = ptr->getLeft();
-    Node<Key, Value>* right = ptr->getRight();
-    BinarySearchTree<Key, Value>::deleteNodes(left);
-    BinarySearchTree<Key, Value>::deleteNodes(right);
-    delete ptr;
+/**
+* Frees the subtree rooted at ptr without recursion, so that degenerate
+* trees of any depth can be torn down. Walks down to a leaf, frees it,
+* unhooks it from its parent and continues from the parent: every edge is
+* crossed once in each direction and no extra space is used.
+*/
+template<typename Key, typename Value, typename Alloc, typename NodeT, typename Compare>
+void BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::deleteNodes(Node<Key, Value>* ptr)
+{
+    Node<Key, Value>* top = ptr;
+    while(ptr != nullptr) {
+        if(ptr->getLeft() != nullptr) {
+            ptr = ptr->getLeft();
+        }
+        else if(ptr->getRight() != nullptr) {
+            ptr = ptr->getRight();
+        }
+        else {
+            Node<Key, Value>* parent = ptr->getParent();
+            if(ptr == top) {
+                parent = nullptr;
+            }
+            else if(parent->getLeft() == ptr) {
+                parent->setLeft(nullptr);
+            }
+            else {
+                parent->setRight(nullptr);
+            }
+            alloc_.destroy(static_cast<NodeT*>(ptr));
+            ptr = parent;
+        }
+    }
 }
 
 /**
 * A helper function to find the smallest node in the tree.
 */
-template<typename Key, typename Value>
+template<typename Key, typename Value, typename Alloc, typename NodeT, typename Compare>
 Node<Key, Value>*
-BinarySearchTree<Key, Value>::getSmallestNode() const
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::getSmallestNode() const
 {
     // TODO
     Node<Key, Value>* curr = root_;
@@ -694,61 +1397,316 @@ BinarySearchTree<Key, Value>::getSmallestNode() const
     
 }
 
+/**
+* Wraps a node of this tree in an iterator, for subclasses that find nodes
+* by other means than internalFind.
+*/
+template<typename Key, typename Value, typename Alloc, typename NodeT, typename Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::iterator
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::makeIterator(Node<Key, Value>* node)
+{
+    return iterator(node, this);
+}
+
+template<typename Key, typename Value, typename Alloc, typename NodeT, typename Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::const_iterator
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::makeIterator(Node<Key, Value>* node) const
+{
+    return const_iterator(node, this);
+}
+
+/**
+* A helper function to find the largest node in the tree.
+*/
+template<typename Key, typename Value, typename Alloc, typename NodeT, typename Compare>
+Node<Key, Value>*
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::getLargestNode() const
+{
+    Node<Key, Value>* curr = root_;
+    while (curr != nullptr && curr->getRight() != nullptr) {
+        curr = curr->getRight();
+    }
+    return curr;
+}
+
 /**
 * Helper function to find a node with given key, k and
 * return a pointer to it or NULL if no item with that key
 * exists
 */
-template<typename Key, typename Value>
-Node<Key, Value>* BinarySearchTree<Key, Value>::internalFind(const Key& key) const
+template<typename Key, typename Value, typename Alloc, typename NodeT, typename Compare>
+Node<Key, Value>* BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::internalFind(const Key& key) const
 {
     // TODO
     Node<Key, Value>* curr = root_;
+    if (ThreeWay::value) {
+        while (curr != nullptr) {
+            int c = ThreeWay::compare(comp_, key, curr->getKey());
+            if (c == 0) {
+                return curr;
+            }
+            curr = c < 0 ? curr->getLeft() : curr->getRight();
+        }
+        return nullptr;
+    }
+    // one comparison per level; the lower bound is the only candidate
+    Node<Key, Value>* result = internalLowerBound(key);
+    if (result != nullptr && !comp_(key, result->getKey())) {
+        return result;
+    }
+    return nullptr;
+}
+
+/**
+ * Runs the lower-bound descents of up to kBatchWidth keys side by side
+ * and stores each key's node, or NULL, in found. Lanes that reach the
+ * bottom drop out of the list of active ones. If last is given, it gets
+ * the node each descent ended at: for an absent key, the parent of the
+ * empty slot it belongs in (NULL in an empty tree).
+ */
+template<typename Key, typename Value, typename Alloc, typename NodeT, typename Compare>
+void BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::findGroup(const Key* const* keys, size_t n, Node<Key, Value>** found,
+                                                                    Node<Key, Value>** last) const
+{
+    Node<Key, Value>* curr[kBatchWidth];
+    size_t active[kBatchWidth];
+    size_t count = 0;
+    for(size_t i = 0; i < n; ++i){
+        found[i] = nullptr;
+        curr[i] = root_;
+        active[count++] = i;
+    }
+    if(root_ == nullptr)
+        count = 0;
+    while(count > 0){
+        size_t still = 0;
+        for(size_t j = 0; j < count; ++j){
+            size_t i = active[j];
+            Node<Key, Value>* node = curr[i];
+            bool goRight = comp_(node->getKey(), *keys[i]);
+            found[i] = goRight ? found[i] : node;
+            node = goRight ? node->getRight() : node->getLeft();
+            if(node != nullptr){
+                BST_PREFETCH(node);
+                curr[i] = node;
+                active[still++] = i;
+            }
+        }
+        count = still;
+    }
+    for(size_t i = 0; i < n; ++i){
+        if(found[i] != nullptr && comp_(*keys[i], found[i]->getKey()))
+            found[i] = nullptr;
+        if(last != nullptr)
+            last[i] = curr[i];
+    }
+}
+
+/**
+ * Returns the number of levels in the tree (0 when empty). An unbalanced
+ * tree has to be walked in full; this follows the parent pointers instead
+ * of recursing so that any depth works.
+ */
+template<typename Key, typename Value, typename Alloc, typename NodeT, typename Compare>
+size_t BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::height() const
+{
+    size_t maxDepth = 0;
+    size_t depth = 0;
+    Node<Key, Value>* curr = root_;
+    Node<Key, Value>* prev = nullptr;
+    while(curr != nullptr) {
+        Node<Key, Value>* next;
+        if(prev == curr->getParent()) {
+            // first visit: go left, else right, else back up
+            ++depth;
+            if(depth > maxDepth) maxDepth = depth;
+            if(curr->getLeft() != nullptr) next = curr->getLeft();
+            else if(curr->getRight() != nullptr) next = curr->getRight();
+            else next = curr->getParent();
+        }
+        else if(prev == curr->getLeft() && curr->getRight() != nullptr) {
+            next = curr->getRight();
+        }
+        else {
+            next = curr->getParent();
+        }
+        if(next == curr->getParent()) --depth;
+        prev = curr;
+        curr = next;
+    }
+    return maxDepth;
+}
+
+/**
+ * Returns the node with the smallest key not less than key, or NULL.
+ */
+template<typename Key, typename Value, typename Alloc, typename NodeT, typename Compare>
+Node<Key, Value>* BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::internalLowerBound(const Key& key) const
+{
+    Node<Key, Value>* curr = root_;
+    Node<Key, Value>* result = nullptr;
     while (curr != nullptr) {
-        if (curr->getKey() == key) {
-            return curr;
+        if (comp_(curr->getKey(), key)) {
+            curr = curr->getRight();
         }
-        else if (curr->getKey() > key) {
+        else {
+            result = curr;
+            curr = curr->getLeft();
+        }
+    }
+    return result;
+}
+
+/**
+ * Returns the node with the smallest key greater than key, or NULL.
+ */
+template<typename Key, typename Value, typename Alloc, typename NodeT, typename Compare>
+Node<Key, Value>* BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::internalUpperBound(const Key& key) const
+{
+    Node<Key, Value>* curr = root_;
+    Node<Key, Value>* result = nullptr;
+    while (curr != nullptr) {
+        if (comp_(key, curr->getKey())) {
+            result = curr;
             curr = curr->getLeft();
         }
         else {
             curr = curr->getRight();
         }
     }
-    return nullptr;
-    
+    return result;
 }
 
 /**
- * Return true iff the BST is balanced.
+ * Return true iff the BST is balanced. Stops at the first subtree whose
+ * children differ in height by more than one.
  */
-template<typename Key, typename Value>
-bool BinarySearchTree<Key, Value>::isBalanced() const
+template<typename Key, typename Value, typename Alloc, typename NodeT, typename Compare>
+bool BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::isBalanced() const
 {
-    // TODO
-    bool result = true;
-    balanceCheck(root_, result);
-    return result;
+    return checkInvariants(true).ok();
+}
 
+/**
+ * Checks in one O(n) pass that keys are in strictly increasing order, that
+ * every child points back to its parent, and whatever checkNode() adds for
+ * the kind of tree (the AVL balance fields). Stops at the first violation.
+ */
+template<typename Key, typename Value, typename Alloc, typename NodeT, typename Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::ValidationResult
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::validate() const
+{
+    return checkInvariants(false);
 }
 
-template<typename Key, typename Value>
-int BinarySearchTree<Key, Value>::balanceCheck(Node<Key,Value>*ptr, bool& result) const
+/**
+ * Post-order walk over the parent pointers shared by isBalanced() and
+ * validate(). Subtree heights wait on an explicit stack that never holds
+ * more than the tree's height, so degenerate trees do not recurse.
+ */
+template<typename Key, typename Value, typename Alloc, typename NodeT, typename Compare>
+typename BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::ValidationResult
+BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::checkInvariants(bool heightsOnly) const
 {
-    if(ptr == nullptr)
-        return 0;
-    int left = balanceCheck(ptr->getLeft(), result);
-    int right = balanceCheck(ptr->getRight(), result);
-    if(left - right!= 0 && left - right != 1 && left - right != -1)
-        result = false;
-    if(left > right)
-        return left + 1;
-    else
-        return right + 1;
+    ValidationResult result = { nullptr, nullptr };
+    if(root_ == nullptr)
+        return result;
+    if(root_->getParent() != nullptr){
+        result.node = root_;
+        result.reason = "root has a parent";
+        return result;
+    }
+
+    std::vector<size_t> heights;
+    const Node<Key, Value>* last = nullptr;   // previous node in key order
+    const Node<Key, Value>* prev = nullptr;
+    const Node<Key, Value>* curr = root_;
+    while(curr != nullptr){
+        const Node<Key, Value>* left = curr->getLeft();
+        const Node<Key, Value>* right = curr->getRight();
+        bool inorder = false;
+        bool postorder = false;
+
+        if(prev == curr->getParent()){
+            // arrived from above; the links are checked before following
+            // them so that a corrupt tree cannot send the walk astray
+            if((left != nullptr && left->getParent() != curr) ||
+               (right != nullptr && right->getParent() != curr)){
+                result.node = curr;
+                result.reason = "child does not point back to its parent";
+                return result;
+            }
+            if(left != nullptr){
+                prev = curr;
+                curr = left;
+                continue;
+            }
+            heights.push_back(0);
+            inorder = true;
+        }
+        else if(prev == left){
+            inorder = true;
+        }
+        else{
+            postorder = true;
+        }
+
+        if(inorder){
+            if(!heightsOnly && last != nullptr && !comp_(last->getKey(), curr->getKey())){
+                result.node = curr;
+                result.reason = "key out of order";
+                return result;
+            }
+            last = curr;
+            if(right != nullptr){
+                prev = curr;
+                curr = right;
+                continue;
+            }
+            heights.push_back(0);
+            postorder = true;
+        }
+
+        if(postorder){
+            size_t rightHeight = heights.back();
+            heights.pop_back();
+            size_t leftHeight = heights.back();
+            heights.pop_back();
+            if(heightsOnly){
+                if(leftHeight > rightHeight + 1 || rightHeight > leftHeight + 1){
+                    result.node = curr;
+                    result.reason = "subtree heights differ by more than one";
+                    return result;
+                }
+            }
+            else{
+                result.reason = checkNode(curr, leftHeight, rightHeight);
+                if(result.reason != nullptr){
+                    result.node = curr;
+                    return result;
+                }
+            }
+            heights.push_back(std::max(leftHeight, rightHeight) + 1);
+            prev = curr;
+            curr = curr->getParent();
+        }
+    }
+    return result;
 }
 
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::nodeSwap( Node<Key,Value>* n1, Node<Key,Value>* n2)
+/**
+ * Hook for the invariants of a particular kind of tree, called once per
+ * node with the heights of its subtrees. Returns NULL when the node is
+ * fine. A plain BST has nothing to add.
+ */
+template<typename Key, typename Value, typename Alloc, typename NodeT, typename Compare>
+const char* BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::checkNode(const Node<Key, Value>*, size_t, size_t) const
+{
+    return nullptr;
+}
+
+template<typename Key, typename Value, typename Alloc, typename NodeT, typename Compare>
+void BinarySearchTree<Key, Value, Alloc, NodeT, Compare>::nodeSwap( Node<Key,Value>* n1, Node<Key,Value>* n2)
 {
     if((n1 == n2) || (n1 == NULL) || (n2 == NULL) ) {
         return;
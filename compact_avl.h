@@ -0,0 +1,1513 @@
+#ifndef COMPACT_AVL_H
+#define COMPACT_AVL_H
+
+#include <iostream>
+#include <cstdlib>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+#include <iterator>
+#include <tuple>
+#include <algorithm>
+#include "key_compare.h"
+
+/**
+* A node of a CompactAVLTree. Children are 32-bit indices into the tree's
+* node pool (0 means none) and the balance lives in the top two bits of the
+* right link, so an int -> int node is 16 bytes. There is no parent link.
+*/
+template <typename Key, typename Value>
+class CompactAVLNode
+{
+public:
+    template<typename... Args>
+    explicit CompactAVLNode(Args&&... args);
+
+    std::pair<const Key, Value> item_;
+    uint32_t links_[2];    // left child; right child in the low 30 bits, balance + 1 in the high 2
+};
+
+template<typename Key, typename Value>
+template<typename... Args>
+CompactAVLNode<Key, Value>::CompactAVLNode(Args&&... args) :
+    item_(std::forward<Args>(args)...)
+{
+    links_[0] = 0;
+    links_[1] = 1u << 30;
+}
+
+/**
+* An AVL tree with the same interface as AVLTree, laid out for memory
+* footprint: nodes sit in one contiguous pool and refer to each other by
+* index, and insert/remove keep the path from the root on a fixed-size stack
+* instead of following parent links.
+*
+* Differences from AVLTree:
+*  - growing the pool may move the items, so an insert invalidates
+*    references and pointers to items (iterators stay valid, as they hold
+*    an index);
+*  - iterator steps without a right child search down from the root, so
+*    they cost O(log n) rather than O(1) amortized; forEachInRange walks
+*    with its own stack and is O(log n + k);
+*  - the tree holds at most 2^30 - 1 items and cannot be copied;
+*  - there are no order statistics.
+* Compare orders the keys, as for AVLTree.
+*/
+template <class Key, class Value, class Compare = std::less<Key> >
+class CompactAVLTree
+{
+public:
+    typedef CompactAVLNode<Key, Value> NodeT;
+
+    CompactAVLTree();
+    explicit CompactAVLTree(const Compare& comp);
+    template<typename InputIt>
+    CompactAVLTree(InputIt first, InputIt last, const Compare& comp = Compare());
+    ~CompactAVLTree();
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void insert(std::pair<const Key, Value>&& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+    bool isBalanced() const;
+    size_t height() const;
+    void print() const;
+    bool empty() const;
+    size_t size() const;
+    size_t capacity() const;
+    void reserve(size_t n);
+    Compare key_comp() const;
+    template<typename InputIt>
+    void buildFromSorted(InputIt first, InputIt last);
+
+    /**
+    * The outcome of validate(). When an invariant is broken, item is the
+    * first offending item found and reason describes the violation.
+    */
+    struct ValidationResult
+    {
+        const std::pair<const Key, Value>* item;
+        const char* reason;
+        bool ok() const { return reason == nullptr; }
+    };
+    ValidationResult validate() const;
+
+    /**
+    * A bidirectional iterator holding the index of the current node.
+    * Decrementing end() yields the largest item.
+    */
+    class iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef value_type* pointer;
+        typedef value_type& reference;
+
+        iterator();
+
+        std::pair<const Key,Value>& operator*() const;
+        std::pair<const Key,Value>* operator->() const;
+
+        bool operator==(const iterator& rhs) const;
+        bool operator!=(const iterator& rhs) const;
+
+        iterator& operator++();
+        iterator operator++(int);
+        iterator& operator--();
+        iterator operator--(int);
+
+    protected:
+        friend class CompactAVLTree<Key, Value, Compare>;
+        iterator(uint32_t index, const CompactAVLTree<Key, Value, Compare>* tree);
+        uint32_t current_;
+        const CompactAVLTree<Key, Value, Compare>* tree_;
+    };
+
+    /**
+    * The read-only counterpart of iterator, returned when the tree is const.
+    * An iterator converts implicitly to a const_iterator.
+    */
+    class const_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type* pointer;
+        typedef const value_type& reference;
+
+        const_iterator();
+        const_iterator(const iterator& it);
+
+        const std::pair<const Key,Value>& operator*() const;
+        const std::pair<const Key,Value>* operator->() const;
+
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+        const_iterator& operator--();
+        const_iterator operator--(int);
+
+    protected:
+        friend class CompactAVLTree<Key, Value, Compare>;
+        const_iterator(uint32_t index, const CompactAVLTree<Key, Value, Compare>* tree);
+        uint32_t current_;
+        const CompactAVLTree<Key, Value, Compare>* tree_;
+    };
+
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    iterator begin();
+    iterator end();
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator cbegin() const;
+    const_iterator cend() const;
+    reverse_iterator rbegin();
+    reverse_iterator rend();
+    const_reverse_iterator rbegin() const;
+    const_reverse_iterator rend() const;
+    iterator find(const Key& key);
+    const_iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key);
+    const_iterator lower_bound(const Key& key) const;
+    iterator upper_bound(const Key& key);
+    const_iterator upper_bound(const Key& key) const;
+    std::pair<iterator, iterator> equal_range(const Key& key);
+    std::pair<const_iterator, const_iterator> equal_range(const Key& key) const;
+    template<typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args);
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign(const Key& key, M&& value);
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign(Key&& key, M&& value);
+    template<typename Function>
+    void forEachInRange(const Key& lo, const Key& hi, Function fn);
+    template<typename Function>
+    void forEachInRange(const Key& lo, const Key& hi, Function fn) const;
+    Value& operator[](const Key& key);
+    Value const & operator[](const Key& key) const;
+
+protected:
+    // An AVL tree of 2^30 nodes is at most 44 levels high.
+    static const int kMaxDepth = 64;
+    static const uint32_t kIndexMask = (1u << 30) - 1;
+
+    /**
+    * The nodes from the root down to the current position, and the side
+    * (-1 left, +1 right) taken at each of them.
+    */
+    struct Path
+    {
+        uint32_t node[kMaxDepth];
+        int8_t dir[kMaxDepth];
+        int depth;
+    };
+
+    // Node access
+    NodeT& at(uint32_t index) const;
+    const Key& keyOf(uint32_t index) const;
+    uint32_t left(uint32_t index) const;
+    uint32_t right(uint32_t index) const;
+    uint32_t child(uint32_t index, int dir) const;
+    int balance(uint32_t index) const;
+    void setLeft(uint32_t index, uint32_t child);
+    void setRight(uint32_t index, uint32_t child);
+    void setChild(uint32_t index, int dir, uint32_t child);
+    void setBalance(uint32_t index, int balance);
+
+    // Pool management
+    template<typename... Args>
+    uint32_t newNode(Args&&... args);
+    void freeNode(uint32_t index);
+    void grow(size_t capacity);
+    void relocate(NodeT* pool, size_t capacity);
+    uint32_t& freeLink(uint32_t index) const;
+
+    // Helpers
+    uint32_t findPath(const Key& key, Path& path) const;
+    uint32_t internalFind(const Key& key) const;
+    uint32_t internalLowerBound(const Key& key) const;
+    uint32_t internalUpperBound(const Key& key) const;
+    uint32_t smallest() const;
+    uint32_t largest() const;
+    uint32_t successor(uint32_t index) const;
+    uint32_t predecessor(uint32_t index) const;
+    void linkNode(uint32_t node, Path& path);
+    void replaceAt(const Path& path, int i, uint32_t node);
+    uint32_t rebalance(uint32_t x, int balance, bool& shrunk);
+    void destroyNodes();
+    template<typename InputIt>
+    void buildFromSorted(InputIt first, InputIt last, std::input_iterator_tag);
+    template<typename ForwardIt>
+    void buildFromSorted(ForwardIt first, ForwardIt last, std::forward_iterator_tag);
+    template<typename ForwardIt>
+    uint32_t buildBalanced(ForwardIt& it, ForwardIt last, size_t n);
+
+private:
+    CompactAVLTree(const CompactAVLTree&);
+    CompactAVLTree& operator=(const CompactAVLTree&);
+
+protected:
+    typedef ThreeWayCompare<Key, Compare> ThreeWay;
+
+    NodeT* pool_;       // slot 0 is never used, so index 0 can mean "none"
+    size_t capacity_;   // slots in pool_
+    size_t used_;       // slots handed out so far, including slot 0
+    uint32_t free_;     // head of the list of freed slots
+    uint32_t root_;
+    size_t size_;
+    Compare comp_;
+};
+
+/*
+--------------------------------------------------------------
+Begin implementations for the CompactAVLTree iterators.
+---------------------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare>
+CompactAVLTree<Key, Value, Compare>::iterator::iterator(uint32_t index, const CompactAVLTree<Key, Value, Compare>* tree) :
+    current_(index), tree_(tree)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+CompactAVLTree<Key, Value, Compare>::iterator::iterator() :
+    current_(0), tree_(nullptr)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+std::pair<const Key,Value> & CompactAVLTree<Key, Value, Compare>::iterator::operator*() const
+{
+    return tree_->at(current_).item_;
+}
+
+template<class Key, class Value, class Compare>
+std::pair<const Key,Value> * CompactAVLTree<Key, Value, Compare>::iterator::operator->() const
+{
+    return &(tree_->at(current_).item_);
+}
+
+template<class Key, class Value, class Compare>
+bool CompactAVLTree<Key, Value, Compare>::iterator::operator==(const iterator& rhs) const
+{
+    return current_ == rhs.current_;
+}
+
+template<class Key, class Value, class Compare>
+bool CompactAVLTree<Key, Value, Compare>::iterator::operator!=(const iterator& rhs) const
+{
+    return current_ != rhs.current_;
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::iterator&
+CompactAVLTree<Key, Value, Compare>::iterator::operator++()
+{
+    current_ = tree_->successor(current_);
+    return *this;
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::iterator
+CompactAVLTree<Key, Value, Compare>::iterator::operator++(int)
+{
+    iterator old(*this);
+    ++(*this);
+    return old;
+}
+
+/**
+* Steps back; from end() this moves to the largest item.
+*/
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::iterator&
+CompactAVLTree<Key, Value, Compare>::iterator::operator--()
+{
+    current_ = current_ == 0 ? tree_->largest() : tree_->predecessor(current_);
+    return *this;
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::iterator
+CompactAVLTree<Key, Value, Compare>::iterator::operator--(int)
+{
+    iterator old(*this);
+    --(*this);
+    return old;
+}
+
+template<class Key, class Value, class Compare>
+CompactAVLTree<Key, Value, Compare>::const_iterator::const_iterator(uint32_t index, const CompactAVLTree<Key, Value, Compare>* tree) :
+    current_(index), tree_(tree)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+CompactAVLTree<Key, Value, Compare>::const_iterator::const_iterator() :
+    current_(0), tree_(nullptr)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+CompactAVLTree<Key, Value, Compare>::const_iterator::const_iterator(const iterator& it) :
+    current_(it.current_), tree_(it.tree_)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+const std::pair<const Key,Value> & CompactAVLTree<Key, Value, Compare>::const_iterator::operator*() const
+{
+    return tree_->at(current_).item_;
+}
+
+template<class Key, class Value, class Compare>
+const std::pair<const Key,Value> * CompactAVLTree<Key, Value, Compare>::const_iterator::operator->() const
+{
+    return &(tree_->at(current_).item_);
+}
+
+template<class Key, class Value, class Compare>
+bool CompactAVLTree<Key, Value, Compare>::const_iterator::operator==(const const_iterator& rhs) const
+{
+    return current_ == rhs.current_;
+}
+
+template<class Key, class Value, class Compare>
+bool CompactAVLTree<Key, Value, Compare>::const_iterator::operator!=(const const_iterator& rhs) const
+{
+    return current_ != rhs.current_;
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_iterator&
+CompactAVLTree<Key, Value, Compare>::const_iterator::operator++()
+{
+    current_ = tree_->successor(current_);
+    return *this;
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_iterator
+CompactAVLTree<Key, Value, Compare>::const_iterator::operator++(int)
+{
+    const_iterator old(*this);
+    ++(*this);
+    return old;
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_iterator&
+CompactAVLTree<Key, Value, Compare>::const_iterator::operator--()
+{
+    current_ = current_ == 0 ? tree_->largest() : tree_->predecessor(current_);
+    return *this;
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_iterator
+CompactAVLTree<Key, Value, Compare>::const_iterator::operator--(int)
+{
+    const_iterator old(*this);
+    --(*this);
+    return old;
+}
+
+/*
+-------------------------------------------------------------
+End implementations for the CompactAVLTree iterators.
+-------------------------------------------------------------
+*/
+
+/*
+-------------------------------------------------------------
+Begin implementations for the CompactAVLTree class.
+-------------------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare>
+CompactAVLTree<Key, Value, Compare>::CompactAVLTree() :
+    pool_(nullptr), capacity_(0), used_(1), free_(0), root_(0), size_(0), comp_()
+{
+
+}
+
+template<class Key, class Value, class Compare>
+CompactAVLTree<Key, Value, Compare>::CompactAVLTree(const Compare& comp) :
+    pool_(nullptr), capacity_(0), used_(1), free_(0), root_(0), size_(0), comp_(comp)
+{
+
+}
+
+/**
+* Builds the tree from the pairs in [first, last); see buildFromSorted.
+*/
+template<class Key, class Value, class Compare>
+template<typename InputIt>
+CompactAVLTree<Key, Value, Compare>::CompactAVLTree(InputIt first, InputIt last, const Compare& comp) :
+    pool_(nullptr), capacity_(0), used_(1), free_(0), root_(0), size_(0), comp_(comp)
+{
+    buildFromSorted(first, last);
+}
+
+template<class Key, class Value, class Compare>
+CompactAVLTree<Key, Value, Compare>::~CompactAVLTree()
+{
+    destroyNodes();
+    ::operator delete(pool_);
+}
+
+template<class Key, class Value, class Compare>
+bool CompactAVLTree<Key, Value, Compare>::empty() const
+{
+    return size_ == 0;
+}
+
+template<class Key, class Value, class Compare>
+size_t CompactAVLTree<Key, Value, Compare>::size() const
+{
+    return size_;
+}
+
+template<class Key, class Value, class Compare>
+Compare CompactAVLTree<Key, Value, Compare>::key_comp() const
+{
+    return comp_;
+}
+
+/**
+* Returns how many items fit in the pool before it has to grow.
+*/
+template<class Key, class Value, class Compare>
+size_t CompactAVLTree<Key, Value, Compare>::capacity() const
+{
+    return capacity_ == 0 ? 0 : capacity_ - 1;
+}
+
+/**
+* Makes room for n items so that the next inserts do not move the pool.
+*/
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::reserve(size_t n)
+{
+    if(n > kIndexMask)
+        throw std::length_error("CompactAVLTree holds at most 2^30 - 1 items");
+    if(n + 1 > capacity_)
+        grow(n + 1);
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::NodeT&
+CompactAVLTree<Key, Value, Compare>::at(uint32_t index) const
+{
+    return pool_[index];
+}
+
+template<class Key, class Value, class Compare>
+const Key& CompactAVLTree<Key, Value, Compare>::keyOf(uint32_t index) const
+{
+    return pool_[index].item_.first;
+}
+
+template<class Key, class Value, class Compare>
+uint32_t CompactAVLTree<Key, Value, Compare>::left(uint32_t index) const
+{
+    return pool_[index].links_[0];
+}
+
+template<class Key, class Value, class Compare>
+uint32_t CompactAVLTree<Key, Value, Compare>::right(uint32_t index) const
+{
+    return pool_[index].links_[1] & kIndexMask;
+}
+
+template<class Key, class Value, class Compare>
+uint32_t CompactAVLTree<Key, Value, Compare>::child(uint32_t index, int dir) const
+{
+    return pool_[index].links_[dir > 0] & kIndexMask;
+}
+
+/**
+* Returns the node's balance (height of right minus height of left subtree).
+*/
+template<class Key, class Value, class Compare>
+int CompactAVLTree<Key, Value, Compare>::balance(uint32_t index) const
+{
+    return (int)(pool_[index].links_[1] >> 30) - 1;
+}
+
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::setLeft(uint32_t index, uint32_t child)
+{
+    pool_[index].links_[0] = child;
+}
+
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::setRight(uint32_t index, uint32_t child)
+{
+    pool_[index].links_[1] = (pool_[index].links_[1] & ~kIndexMask) | child;
+}
+
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::setChild(uint32_t index, int dir, uint32_t child)
+{
+    uint32_t& link = pool_[index].links_[dir > 0];
+    link = (link & ~kIndexMask) | child;
+}
+
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::setBalance(uint32_t index, int balance)
+{
+    pool_[index].links_[1] = (pool_[index].links_[1] & kIndexMask) | ((uint32_t)(balance + 1) << 30);
+}
+
+/**
+* A freed slot holds the index of the next free slot in its first bytes.
+*/
+template<class Key, class Value, class Compare>
+uint32_t& CompactAVLTree<Key, Value, Compare>::freeLink(uint32_t index) const
+{
+    return *reinterpret_cast<uint32_t*>(pool_ + index);
+}
+
+/**
+* Builds a node from args in a free slot and returns its index. Freed slots
+* are reused first; otherwise the pool doubles when it is full.
+*/
+template<class Key, class Value, class Compare>
+template<typename... Args>
+uint32_t CompactAVLTree<Key, Value, Compare>::newNode(Args&&... args)
+{
+    uint32_t index;
+    if(free_ != 0){
+        index = free_;
+        uint32_t next = freeLink(index);
+        try {
+            new (pool_ + index) NodeT(std::forward<Args>(args)...);
+        }
+        catch(...) {
+            freeLink(index) = next;
+            throw;
+        }
+        free_ = next;
+        return index;
+    }
+    index = (uint32_t)used_;
+    if(used_ >= capacity_){
+        if(used_ > kIndexMask)
+            throw std::length_error("CompactAVLTree holds at most 2^30 - 1 items");
+        size_t grown = capacity_ < 16 ? 16 : capacity_ * 2;
+        if(grown > (size_t)kIndexMask + 1)
+            grown = (size_t)kIndexMask + 1;
+        // args may refer to an item in the old pool, so the new node is
+        // built before the old nodes move, as std::vector::push_back does
+        NodeT* pool = static_cast<NodeT*>(::operator new(grown * sizeof(NodeT)));
+        try {
+            new (pool + index) NodeT(std::forward<Args>(args)...);
+        }
+        catch(...) {
+            ::operator delete(pool);
+            throw;
+        }
+        relocate(pool, grown);
+    }
+    else{
+        new (pool_ + index) NodeT(std::forward<Args>(args)...);
+    }
+    ++used_;
+    return index;
+}
+
+/**
+* Destroys the node at index and puts its slot on the free list.
+*/
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::freeNode(uint32_t index)
+{
+    pool_[index].~NodeT();
+    freeLink(index) = free_;
+    free_ = index;
+}
+
+/**
+* Moves the pool to a block of the given number of slots.
+*/
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::grow(size_t capacity)
+{
+    relocate(static_cast<NodeT*>(::operator new(capacity * sizeof(NodeT))), capacity);
+}
+
+/**
+* Moves the nodes into pool, a block of the given number of slots, and
+* frees the old one. Slots of pool at or past used_ are left alone. When
+* the free list is empty every slot below used_ holds a node and they are
+* moved in order; otherwise the live nodes are found through the tree.
+*/
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::relocate(NodeT* pool, size_t capacity)
+{
+    if(free_ != 0){
+        std::vector<uint32_t> stack;
+        if(root_ != 0) stack.push_back(root_);
+        while(!stack.empty()){
+            uint32_t n = stack.back();
+            stack.pop_back();
+            new (pool + n) NodeT(std::move(pool_[n]));
+            pool_[n].~NodeT();
+            if(left(n) != 0) stack.push_back(left(n));
+            if(right(n) != 0) stack.push_back(right(n));
+        }
+        for(uint32_t f = free_; f != 0; f = freeLink(f))
+            *reinterpret_cast<uint32_t*>(pool + f) = freeLink(f);
+    }
+    else{
+        for(size_t i = 1; i < used_; ++i){
+            new (pool + i) NodeT(std::move(pool_[i]));
+            pool_[i].~NodeT();
+        }
+    }
+    ::operator delete(pool_);
+    pool_ = pool;
+    capacity_ = capacity;
+}
+
+/**
+* A method to remove all contents of the tree. The pool is kept for reuse,
+* and when no destructor has to run it is reset without visiting the nodes.
+*/
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::clear()
+{
+    destroyNodes();
+    used_ = 1;
+    free_ = 0;
+    root_ = 0;
+    size_ = 0;
+}
+
+/**
+* Runs the destructor of every node, with an explicit stack.
+*/
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::destroyNodes()
+{
+    if(std::is_trivially_destructible<Key>::value &&
+       std::is_trivially_destructible<Value>::value)
+        return;
+    std::vector<uint32_t> stack;
+    if(root_ != 0) stack.push_back(root_);
+    while(!stack.empty()){
+        uint32_t n = stack.back();
+        stack.pop_back();
+        if(left(n) != 0) stack.push_back(left(n));
+        if(right(n) != 0) stack.push_back(right(n));
+        pool_[n].~NodeT();
+    }
+}
+
+/**
+* Descends towards key, recording the path. Returns the index of the node
+* holding key (which is not on the path), or 0 with the path ending at the
+* node whose empty slot the key belongs in.
+* Without a three-way comparison each level only asks whether key goes
+* left; the last right turn is the only node that can hold key, and on a
+* match the path is cut back to it.
+*/
+template<class Key, class Value, class Compare>
+uint32_t CompactAVLTree<Key, Value, Compare>::findPath(const Key& key, Path& path) const
+{
+    path.depth = 0;
+    uint32_t curr = root_;
+    uint32_t candidate = 0;
+    int candidateDepth = 0;
+    while(curr != 0){
+        int dir;
+        if(ThreeWay::value){
+            int c = ThreeWay::compare(comp_, key, keyOf(curr));
+            if(c == 0)
+                return curr;
+            dir = c < 0 ? -1 : 1;
+        }
+        else if(comp_(key, keyOf(curr))){
+            dir = -1;
+        }
+        else{
+            dir = 1;
+            candidate = curr;
+            candidateDepth = path.depth;
+        }
+        path.node[path.depth] = curr;
+        path.dir[path.depth] = (int8_t)dir;
+        ++path.depth;
+        curr = child(curr, dir);
+    }
+    if(candidate != 0 && !comp_(keyOf(candidate), key)){
+        path.depth = candidateDepth;
+        return candidate;
+    }
+    return 0;
+}
+
+/**
+* Makes node the subtree found at step i of the path: the child of the
+* node before it on the path, or the root.
+*/
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::replaceAt(const Path& path, int i, uint32_t node)
+{
+    if(i == 0)
+        root_ = node;
+    else
+        setChild(path.node[i - 1], path.dir[i - 1], node);
+}
+
+/**
+* Hangs a new leaf at the end of the path and restores the balance on the
+* way back up. At most one (single or double) rotation is needed.
+*/
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::linkNode(uint32_t node, Path& path)
+{
+    replaceAt(path, path.depth, node);
+    ++size_;
+    for(int i = path.depth - 1; i >= 0; --i){
+        uint32_t x = path.node[i];
+        int b = balance(x) + path.dir[i];
+        if(b == 0){
+            setBalance(x, 0);
+            return;
+        }
+        if(b == 1 || b == -1){
+            setBalance(x, b);
+            continue;
+        }
+        bool shrunk;
+        replaceAt(path, i, rebalance(x, b, shrunk));
+        return;
+    }
+}
+
+/**
+* Rotates the subtree at x, whose balance has reached b = +2 or -2 (that
+* value does not fit in the node, so it is passed in). Returns the new root
+* of the subtree; shrunk says whether the subtree is now one level lower
+* than it was before x went out of balance.
+*/
+template<class Key, class Value, class Compare>
+uint32_t CompactAVLTree<Key, Value, Compare>::rebalance(uint32_t x, int b, bool& shrunk)
+{
+    int d = b > 0 ? 1 : -1;
+    uint32_t c = child(x, d);
+    int cb = balance(c);
+    if(cb == -d){
+        // double rotation: the inner grandchild g becomes the root
+        uint32_t g = child(c, -d);
+        int gb = balance(g);
+        setChild(x, d, child(g, -d));
+        setChild(c, -d, child(g, d));
+        setChild(g, -d, x);
+        setChild(g, d, c);
+        setBalance(x, gb == d ? -d : 0);
+        setBalance(c, gb == -d ? d : 0);
+        setBalance(g, 0);
+        shrunk = true;
+        return g;
+    }
+    setChild(x, d, child(c, -d));
+    setChild(c, -d, x);
+    if(cb == 0){
+        // only possible after a removal
+        setBalance(x, d);
+        setBalance(c, -d);
+        shrunk = false;
+    }
+    else{
+        setBalance(x, 0);
+        setBalance(c, 0);
+        shrunk = true;
+    }
+    return c;
+}
+
+/**
+* An insert method to insert into the tree. If key is already in the tree,
+* the current value is overwritten with the new one.
+*/
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::insert(const std::pair<const Key, Value> &keyValuePair)
+{
+    insert_or_assign(keyValuePair.first, keyValuePair.second);
+}
+
+/**
+* Same as above, but the value is moved into the tree.
+*/
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::insert(std::pair<const Key, Value> &&keyValuePair)
+{
+    insert_or_assign(keyValuePair.first, std::move(keyValuePair.second));
+}
+
+/**
+* Builds the item in a new node from args, as std::map::emplace does. If the
+* key is already present the new node is discarded and the tree is
+* unchanged. Returns the item's position and whether it was inserted.
+*/
+template<class Key, class Value, class Compare>
+template<typename... Args>
+std::pair<typename CompactAVLTree<Key, Value, Compare>::iterator, bool>
+CompactAVLTree<Key, Value, Compare>::emplace(Args&&... args)
+{
+    uint32_t node = newNode(std::forward<Args>(args)...);
+    Path path;
+    uint32_t found = findPath(keyOf(node), path);
+    if(found != 0){
+        freeNode(node);
+        return std::make_pair(iterator(found, this), false);
+    }
+    linkNode(node, path);
+    return std::make_pair(iterator(node, this), true);
+}
+
+/**
+* If key is absent, builds its value in place from args; otherwise does
+* nothing, and args are left untouched.
+*/
+template<class Key, class Value, class Compare>
+template<typename... Args>
+std::pair<typename CompactAVLTree<Key, Value, Compare>::iterator, bool>
+CompactAVLTree<Key, Value, Compare>::try_emplace(const Key& key, Args&&... args)
+{
+    Path path;
+    uint32_t found = findPath(key, path);
+    if(found != 0)
+        return std::make_pair(iterator(found, this), false);
+    uint32_t node = newNode(std::piecewise_construct,
+        std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+    linkNode(node, path);
+    return std::make_pair(iterator(node, this), true);
+}
+
+template<class Key, class Value, class Compare>
+template<typename... Args>
+std::pair<typename CompactAVLTree<Key, Value, Compare>::iterator, bool>
+CompactAVLTree<Key, Value, Compare>::try_emplace(Key&& key, Args&&... args)
+{
+    Path path;
+    uint32_t found = findPath(key, path);
+    if(found != 0)
+        return std::make_pair(iterator(found, this), false);
+    uint32_t node = newNode(std::piecewise_construct,
+        std::forward_as_tuple(std::move(key)), std::forward_as_tuple(std::forward<Args>(args)...));
+    linkNode(node, path);
+    return std::make_pair(iterator(node, this), true);
+}
+
+/**
+* Assigns value to key, inserting it if absent. Returns the item's position
+* and whether it was inserted.
+*/
+template<class Key, class Value, class Compare>
+template<typename M>
+std::pair<typename CompactAVLTree<Key, Value, Compare>::iterator, bool>
+CompactAVLTree<Key, Value, Compare>::insert_or_assign(const Key& key, M&& value)
+{
+    Path path;
+    uint32_t found = findPath(key, path);
+    if(found != 0){
+        at(found).item_.second = std::forward<M>(value);
+        return std::make_pair(iterator(found, this), false);
+    }
+    uint32_t node = newNode(key, std::forward<M>(value));
+    linkNode(node, path);
+    return std::make_pair(iterator(node, this), true);
+}
+
+template<class Key, class Value, class Compare>
+template<typename M>
+std::pair<typename CompactAVLTree<Key, Value, Compare>::iterator, bool>
+CompactAVLTree<Key, Value, Compare>::insert_or_assign(Key&& key, M&& value)
+{
+    Path path;
+    uint32_t found = findPath(key, path);
+    if(found != 0){
+        at(found).item_.second = std::forward<M>(value);
+        return std::make_pair(iterator(found, this), false);
+    }
+    uint32_t node = newNode(std::move(key), std::forward<M>(value));
+    linkNode(node, path);
+    return std::make_pair(iterator(node, this), true);
+}
+
+/**
+* Removes key from the tree, or does nothing if it is absent. A node with
+* two children is replaced by its predecessor, which is relinked rather
+* than copied. Balances are then repaired up the recorded path.
+*/
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::remove(const Key& key)
+{
+    Path path;
+    uint32_t z = findPath(key, path);
+    if(z == 0)
+        return;
+
+    if(left(z) != 0 && right(z) != 0){
+        int zpos = path.depth;
+        path.node[path.depth] = z;
+        path.dir[path.depth] = -1;
+        ++path.depth;
+        uint32_t y = left(z);
+        while(right(y) != 0){
+            path.node[path.depth] = y;
+            path.dir[path.depth] = 1;
+            ++path.depth;
+            y = right(y);
+        }
+        // unhook the predecessor, then put it where z was
+        setChild(path.node[path.depth - 1], path.dir[path.depth - 1], left(y));
+        setLeft(y, left(z));
+        setRight(y, right(z));
+        setBalance(y, balance(z));
+        path.node[zpos] = y;
+        replaceAt(path, zpos, y);
+    }
+    else{
+        replaceAt(path, path.depth, left(z) != 0 ? left(z) : right(z));
+    }
+    freeNode(z);
+    --size_;
+
+    // the subtree on side dir[i] of node[i] has lost a level
+    for(int i = path.depth - 1; i >= 0; --i){
+        uint32_t x = path.node[i];
+        int b = balance(x) - path.dir[i];
+        if(b == 1 || b == -1){
+            setBalance(x, b);
+            return;
+        }
+        if(b == 0){
+            setBalance(x, 0);
+            continue;
+        }
+        bool shrunk;
+        replaceAt(path, i, rebalance(x, b, shrunk));
+        if(!shrunk)
+            return;
+    }
+}
+
+/**
+* Replaces the contents of the tree with the pairs in [first, last), which
+* should be sorted by key. Sorted input is linked into a perfectly balanced
+* tree in O(n), with the nodes laid out in key order in the pool; for equal
+* keys the last pair wins. Input that turns out not to be sorted is
+* inserted one pair at a time instead.
+*/
+template<class Key, class Value, class Compare>
+template<typename InputIt>
+void CompactAVLTree<Key, Value, Compare>::buildFromSorted(InputIt first, InputIt last)
+{
+    buildFromSorted(first, last, typename std::iterator_traits<InputIt>::iterator_category());
+}
+
+template<class Key, class Value, class Compare>
+template<typename InputIt>
+void CompactAVLTree<Key, Value, Compare>::buildFromSorted(InputIt first, InputIt last, std::input_iterator_tag)
+{
+    std::vector<std::pair<Key, Value> > items(first, last);
+    buildFromSorted(items.begin(), items.end(), std::forward_iterator_tag());
+}
+
+template<class Key, class Value, class Compare>
+template<typename ForwardIt>
+void CompactAVLTree<Key, Value, Compare>::buildFromSorted(ForwardIt first, ForwardIt last, std::forward_iterator_tag)
+{
+    clear();
+    size_t distinct = 0;
+    for(ForwardIt it = first, prev = first; it != last; prev = it, ++it){
+        if(it == first || comp_(prev->first, it->first)){
+            ++distinct;
+        }
+        else if(comp_(it->first, prev->first)){
+            for(; first != last; ++first)
+                insert(*first);
+            return;
+        }
+    }
+    reserve(distinct);
+    root_ = buildBalanced(first, last, distinct);
+    size_ = distinct;
+}
+
+/**
+* Links the next n distinct keys from it into a subtree and returns its
+* root; see AVLTree::buildBalanced.
+*/
+template<class Key, class Value, class Compare>
+template<typename ForwardIt>
+uint32_t CompactAVLTree<Key, Value, Compare>::buildBalanced(ForwardIt& it, ForwardIt last, size_t n)
+{
+    if(n == 0)
+        return 0;
+    size_t leftCount = (n - 1) / 2;
+    size_t rightCount = n - 1 - leftCount;
+    uint32_t left = buildBalanced(it, last, leftCount);
+
+    ForwardIt item = it;
+    for(++it; it != last && !comp_(item->first, it->first); ++it)
+        item = it;
+    uint32_t node = newNode(item->first, item->second);
+
+    uint32_t right = buildBalanced(it, last, rightCount);
+    setLeft(node, left);
+    setRight(node, right);
+    int leftHeight = 0, rightHeight = 0;
+    for(size_t c = leftCount; c != 0; c >>= 1) ++leftHeight;
+    for(size_t c = rightCount; c != 0; c >>= 1) ++rightHeight;
+    setBalance(node, rightHeight - leftHeight);
+    return node;
+}
+
+template<class Key, class Value, class Compare>
+uint32_t CompactAVLTree<Key, Value, Compare>::internalFind(const Key& key) const
+{
+    uint32_t curr = internalLowerBound(key);
+    if(curr != 0 && !comp_(key, keyOf(curr)))
+        return curr;
+    return 0;
+}
+
+/**
+ * Returns the node with the smallest key not less than key, or 0.
+ * The descent has no data-dependent branch: the link to follow is picked
+ * by indexing links_ with the comparison (the mask is applied after the
+ * choice; left links have no high bits). Finds go through here too,
+ * since stopping early at an equal key costs a mispredicted branch per
+ * level and saves only about one level.
+ */
+template<class Key, class Value, class Compare>
+uint32_t CompactAVLTree<Key, Value, Compare>::internalLowerBound(const Key& key) const
+{
+    uint32_t curr = root_;
+    uint32_t result = 0;
+    while(curr != 0){
+        const NodeT& node = pool_[curr];
+        bool goRight = comp_(node.item_.first, key);
+        result = goRight ? result : curr;
+        curr = node.links_[goRight] & kIndexMask;
+    }
+    return result;
+}
+
+/**
+ * Returns the node with the smallest key greater than key, or 0.
+ */
+template<class Key, class Value, class Compare>
+uint32_t CompactAVLTree<Key, Value, Compare>::internalUpperBound(const Key& key) const
+{
+    uint32_t curr = root_;
+    uint32_t result = 0;
+    while(curr != 0){
+        if(comp_(key, keyOf(curr))){
+            result = curr;
+            curr = left(curr);
+        }
+        else{
+            curr = right(curr);
+        }
+    }
+    return result;
+}
+
+template<class Key, class Value, class Compare>
+uint32_t CompactAVLTree<Key, Value, Compare>::smallest() const
+{
+    uint32_t curr = root_;
+    while(curr != 0 && left(curr) != 0)
+        curr = left(curr);
+    return curr;
+}
+
+template<class Key, class Value, class Compare>
+uint32_t CompactAVLTree<Key, Value, Compare>::largest() const
+{
+    uint32_t curr = root_;
+    while(curr != 0 && right(curr) != 0)
+        curr = right(curr);
+    return curr;
+}
+
+/**
+* The next node in key order, or 0. Without parent links the way up is
+* found by searching down from the root for the key.
+*/
+template<class Key, class Value, class Compare>
+uint32_t CompactAVLTree<Key, Value, Compare>::successor(uint32_t index) const
+{
+    if(right(index) != 0){
+        index = right(index);
+        while(left(index) != 0)
+            index = left(index);
+        return index;
+    }
+    return internalUpperBound(keyOf(index));
+}
+
+template<class Key, class Value, class Compare>
+uint32_t CompactAVLTree<Key, Value, Compare>::predecessor(uint32_t index) const
+{
+    if(left(index) != 0){
+        index = left(index);
+        while(right(index) != 0)
+            index = right(index);
+        return index;
+    }
+    const Key& key = keyOf(index);
+    uint32_t curr = root_;
+    uint32_t result = 0;
+    while(curr != 0){
+        if(comp_(keyOf(curr), key)){
+            result = curr;
+            curr = right(curr);
+        }
+        else{
+            curr = left(curr);
+        }
+    }
+    return result;
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::iterator
+CompactAVLTree<Key, Value, Compare>::begin()
+{
+    return iterator(smallest(), this);
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::iterator
+CompactAVLTree<Key, Value, Compare>::end()
+{
+    return iterator(0, this);
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_iterator
+CompactAVLTree<Key, Value, Compare>::begin() const
+{
+    return const_iterator(smallest(), this);
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_iterator
+CompactAVLTree<Key, Value, Compare>::end() const
+{
+    return const_iterator(0, this);
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_iterator
+CompactAVLTree<Key, Value, Compare>::cbegin() const
+{
+    return begin();
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_iterator
+CompactAVLTree<Key, Value, Compare>::cend() const
+{
+    return end();
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::reverse_iterator
+CompactAVLTree<Key, Value, Compare>::rbegin()
+{
+    return reverse_iterator(end());
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::reverse_iterator
+CompactAVLTree<Key, Value, Compare>::rend()
+{
+    return reverse_iterator(begin());
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_reverse_iterator
+CompactAVLTree<Key, Value, Compare>::rbegin() const
+{
+    return const_reverse_iterator(end());
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_reverse_iterator
+CompactAVLTree<Key, Value, Compare>::rend() const
+{
+    return const_reverse_iterator(begin());
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::iterator
+CompactAVLTree<Key, Value, Compare>::find(const Key& key)
+{
+    return iterator(internalFind(key), this);
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_iterator
+CompactAVLTree<Key, Value, Compare>::find(const Key& key) const
+{
+    return const_iterator(internalFind(key), this);
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::iterator
+CompactAVLTree<Key, Value, Compare>::lower_bound(const Key& key)
+{
+    return iterator(internalLowerBound(key), this);
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_iterator
+CompactAVLTree<Key, Value, Compare>::lower_bound(const Key& key) const
+{
+    return const_iterator(internalLowerBound(key), this);
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::iterator
+CompactAVLTree<Key, Value, Compare>::upper_bound(const Key& key)
+{
+    return iterator(internalUpperBound(key), this);
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_iterator
+CompactAVLTree<Key, Value, Compare>::upper_bound(const Key& key) const
+{
+    return const_iterator(internalUpperBound(key), this);
+}
+
+template<class Key, class Value, class Compare>
+std::pair<typename CompactAVLTree<Key, Value, Compare>::iterator,
+          typename CompactAVLTree<Key, Value, Compare>::iterator>
+CompactAVLTree<Key, Value, Compare>::equal_range(const Key& key)
+{
+    return std::make_pair(lower_bound(key), upper_bound(key));
+}
+
+template<class Key, class Value, class Compare>
+std::pair<typename CompactAVLTree<Key, Value, Compare>::const_iterator,
+          typename CompactAVLTree<Key, Value, Compare>::const_iterator>
+CompactAVLTree<Key, Value, Compare>::equal_range(const Key& key) const
+{
+    return std::make_pair(lower_bound(key), upper_bound(key));
+}
+
+/**
+ * Calls fn on every item with lo <= key < hi, in key order. The walk keeps
+ * the pending ancestors on a stack, so it costs O(log n + k).
+ */
+template<class Key, class Value, class Compare>
+template<typename Function>
+void CompactAVLTree<Key, Value, Compare>::forEachInRange(const Key& lo, const Key& hi, Function fn)
+{
+    uint32_t stack[kMaxDepth];
+    int depth = 0;
+    uint32_t curr = root_;
+    while(curr != 0){
+        if(comp_(keyOf(curr), lo)){
+            curr = right(curr);
+        }
+        else{
+            stack[depth++] = curr;
+            curr = left(curr);
+        }
+    }
+    while(depth > 0){
+        curr = stack[--depth];
+        if(!comp_(keyOf(curr), hi))
+            return;
+        fn(at(curr).item_);
+        for(curr = right(curr); curr != 0; curr = left(curr))
+            stack[depth++] = curr;
+    }
+}
+
+template<class Key, class Value, class Compare>
+template<typename Function>
+void CompactAVLTree<Key, Value, Compare>::forEachInRange(const Key& lo, const Key& hi, Function fn) const
+{
+    const_cast<CompactAVLTree<Key, Value, Compare>*>(this)->forEachInRange(lo, hi,
+        [&fn](const std::pair<const Key, Value>& item) { fn(item); });
+}
+
+/**
+ * @precondition The key exists in the map
+ * Returns the value associated with the key
+ */
+template<class Key, class Value, class Compare>
+Value& CompactAVLTree<Key, Value, Compare>::operator[](const Key& key)
+{
+    uint32_t curr = internalFind(key);
+    if(curr == 0) throw std::out_of_range("Invalid key");
+    return at(curr).item_.second;
+}
+
+template<class Key, class Value, class Compare>
+Value const & CompactAVLTree<Key, Value, Compare>::operator[](const Key& key) const
+{
+    uint32_t curr = internalFind(key);
+    if(curr == 0) throw std::out_of_range("Invalid key");
+    return at(curr).item_.second;
+}
+
+/**
+* Returns the height of the tree in O(log n) by following the taller child.
+*/
+template<class Key, class Value, class Compare>
+size_t CompactAVLTree<Key, Value, Compare>::height() const
+{
+    size_t height = 0;
+    for(uint32_t curr = root_; curr != 0; curr = balance(curr) > 0 ? right(curr) : left(curr))
+        ++height;
+    return height;
+}
+
+template<class Key, class Value, class Compare>
+bool CompactAVLTree<Key, Value, Compare>::isBalanced() const
+{
+    return validate().ok();
+}
+
+/**
+* Prints the items in key order.
+*/
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::print() const
+{
+    if(root_ == 0){
+        std::cout << "<empty tree>" << std::endl;
+        return;
+    }
+    for(const_iterator it = begin(); it != end(); ++it)
+        std::cout << it->first << ": " << it->second << std::endl;
+}
+
+/**
+* Checks every invariant of the tree in one iterative walk: keys in order,
+* stored balances within [-1, 1] and equal to the height differences, no
+* path deeper than the insert/remove stack, and exactly size() reachable
+* nodes (which also catches cycles).
+*/
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::ValidationResult
+CompactAVLTree<Key, Value, Compare>::validate() const
+{
+    ValidationResult result = { nullptr, nullptr };
+    struct Frame
+    {
+        uint32_t node;
+        int stage;          // 0: left pending, 1: right pending, 2: done
+    };
+    std::vector<Frame> stack;
+    std::vector<size_t> heights;
+    uint32_t last = 0;
+    size_t visited = 0;
+    if(root_ != 0){
+        Frame root = { root_, 0 };
+        stack.push_back(root);
+    }
+    while(!stack.empty()){
+        Frame& frame = stack.back();
+        uint32_t n = frame.node;
+        if(frame.stage == 0){
+            if(++visited > size_ || n >= used_){
+                result.reason = "more nodes reachable than size() or link out of range";
+                return result;
+            }
+            if(stack.size() > (size_t)kMaxDepth){
+                result.item = &at(n).item_;
+                result.reason = "tree deeper than the path stack";
+                return result;
+            }
+            frame.stage = 1;
+            if(left(n) != 0){
+                Frame next = { left(n), 0 };
+                stack.push_back(next);
+            }
+            else{
+                heights.push_back(0);
+            }
+        }
+        else if(frame.stage == 1){
+            if(last != 0 && !comp_(keyOf(last), keyOf(n))){
+                result.item = &at(n).item_;
+                result.reason = "key out of order";
+                return result;
+            }
+            last = n;
+            frame.stage = 2;
+            if(right(n) != 0){
+                Frame next = { right(n), 0 };
+                stack.push_back(next);
+            }
+            else{
+                heights.push_back(0);
+            }
+        }
+        else{
+            size_t rightHeight = heights.back();
+            heights.pop_back();
+            size_t leftHeight = heights.back();
+            heights.pop_back();
+            int b = balance(n);
+            if(b < -1 || b > 1){
+                result.item = &at(n).item_;
+                result.reason = "balance out of range";
+                return result;
+            }
+            if((int)rightHeight - (int)leftHeight != b){
+                result.item = &at(n).item_;
+                result.reason = "stored balance does not match subtree heights";
+                return result;
+            }
+            heights.push_back(std::max(leftHeight, rightHeight) + 1);
+            stack.pop_back();
+        }
+    }
+    if(visited != size_)
+        result.reason = "fewer nodes reachable than size()";
+    return result;
+}
+
+/*
+-------------------------------------------------------------
+End implementations for the CompactAVLTree class.
+-------------------------------------------------------------
+*/
+
+#endif
@@ -0,0 +1,1164 @@
+#ifndef CONCURRENT_AVL_H
+#define CONCURRENT_AVL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include "avlbst.h"
+#include "key_compare.h"
+#include "epoch.h"
+
+/**
+* A reader-writer lock whose readers never write to a shared cache line.
+* Each thread counts itself in one of kSlots padded slots (threads are
+* spread over them round robin), so readers on different cores neither
+* block nor slow each other down. A writer raises a flag and waits for
+* every slot to drain; readers that see the flag step back until the
+* writer is done, so a steady stream of readers cannot starve it.
+*
+* Taking the lock is a few uncontended atomic operations for a reader
+* and a sweep of all slots for a writer: the right trade when reads far
+* outnumber writes. The lock is not recursive.
+*/
+class DistributedRWLock
+{
+public:
+    DistributedRWLock();
+
+    size_t lockShared();
+    void unlockShared(size_t slot);
+    void lock();
+    void unlock();
+
+    static const size_t kSlots = 64;
+
+private:
+    DistributedRWLock(const DistributedRWLock&);
+    DistributedRWLock& operator=(const DistributedRWLock&);
+
+    // One slot per 64-byte line. The padding rather than alignas keeps
+    // slots apart even where new ignores over-alignment (before C++17).
+    struct Slot
+    {
+        std::atomic<uint32_t> readers;
+        char pad[64 - sizeof(std::atomic<uint32_t>)];
+    };
+
+    static size_t threadSlot();
+
+    Slot slots_[kSlots];
+    std::atomic<bool> writing_;
+    std::mutex writers_;
+};
+
+/**
+* A thread-safe map over AVLTree for read-mostly use, behind one
+* DistributedRWLock. find, contains and operator[] take the lock shared,
+* so any number of them run at once; insert, insert_or_assign and remove
+* take it exclusively, and readers wait for them. ConcurrentAVLTree
+* below lets readers and writers run at the same time instead.
+*
+* Lookups return values by copy: a reference into the tree could be
+* changed or freed by the next writer. read() and write() run a function
+* on the underlying tree under the lock, for anything else (iteration,
+* range queries, batch updates).
+*/
+template <class Key, class Value, class Alloc = HeapNodeAlloc, class Compare = std::less<Key> >
+class RWLockedAVLTree
+{
+public:
+    typedef AVLTree<Key, Value, Alloc, AVLNode<Key, Value>, Compare> TreeT;
+
+    RWLockedAVLTree();
+    explicit RWLockedAVLTree(const Compare& comp);
+
+    bool find(const Key& key, Value& value) const;
+    bool contains(const Key& key) const;
+    Value operator[](const Key& key) const;
+    size_t size() const;
+    bool empty() const;
+
+    bool insert(const std::pair<const Key, Value>& keyValuePair);
+    bool insert_or_assign(const Key& key, const Value& value);
+    bool remove(const Key& key);
+    void clear();
+
+    template<typename Function>
+    void read(Function fn) const;
+    template<typename Function>
+    void write(Function fn);
+
+protected:
+    /**
+    * Holds the lock shared for a scope.
+    */
+    class SharedGuard
+    {
+    public:
+        explicit SharedGuard(DistributedRWLock& lock);
+        ~SharedGuard();
+    private:
+        DistributedRWLock& lock_;
+        size_t slot_;
+    };
+
+    TreeT tree_;
+    mutable DistributedRWLock lock_;
+};
+
+/*
+  ---------------------------------------------
+  Begin implementations for DistributedRWLock.
+  ---------------------------------------------
+*/
+
+inline DistributedRWLock::DistributedRWLock() :
+    writing_(false)
+{
+    for(size_t i = 0; i < kSlots; ++i) {
+        slots_[i].readers.store(0, std::memory_order_relaxed);
+    }
+}
+
+/**
+* The calling thread's slot, handed out round robin on first use.
+*/
+inline size_t DistributedRWLock::threadSlot()
+{
+    static std::atomic<size_t> next(0);
+    static thread_local size_t slot = next.fetch_add(1, std::memory_order_relaxed) % kSlots;
+    return slot;
+}
+
+/**
+* Returns the slot to pass to unlockShared. The reader announces itself
+* before it looks at the flag and the writer raises the flag before it
+* looks at the slots, both sequentially consistent, so at least one of
+* them sees the other.
+*/
+inline size_t DistributedRWLock::lockShared()
+{
+    size_t slot = threadSlot();
+    for(;;) {
+        slots_[slot].readers.fetch_add(1, std::memory_order_seq_cst);
+        if(!writing_.load(std::memory_order_seq_cst)) {
+            return slot;
+        }
+        slots_[slot].readers.fetch_sub(1, std::memory_order_release);
+        while(writing_.load(std::memory_order_relaxed)) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+inline void DistributedRWLock::unlockShared(size_t slot)
+{
+    slots_[slot].readers.fetch_sub(1, std::memory_order_release);
+}
+
+inline void DistributedRWLock::lock()
+{
+    writers_.lock();
+    writing_.store(true, std::memory_order_seq_cst);
+    for(size_t i = 0; i < kSlots; ++i) {
+        while(slots_[i].readers.load(std::memory_order_seq_cst) != 0) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+inline void DistributedRWLock::unlock()
+{
+    writing_.store(false, std::memory_order_release);
+    writers_.unlock();
+}
+
+/*
+  ---------------------------------------------
+  Begin implementations for RWLockedAVLTree.
+  ---------------------------------------------
+*/
+
+template<class Key, class Value, class Alloc, class Compare>
+RWLockedAVLTree<Key, Value, Alloc, Compare>::SharedGuard::SharedGuard(DistributedRWLock& lock) :
+    lock_(lock), slot_(lock.lockShared())
+{
+
+}
+
+template<class Key, class Value, class Alloc, class Compare>
+RWLockedAVLTree<Key, Value, Alloc, Compare>::SharedGuard::~SharedGuard()
+{
+    lock_.unlockShared(slot_);
+}
+
+template<class Key, class Value, class Alloc, class Compare>
+RWLockedAVLTree<Key, Value, Alloc, Compare>::RWLockedAVLTree()
+{
+
+}
+
+template<class Key, class Value, class Alloc, class Compare>
+RWLockedAVLTree<Key, Value, Alloc, Compare>::RWLockedAVLTree(const Compare& comp) :
+    tree_(comp)
+{
+
+}
+
+/**
+* Copies the value of key into value and returns true, or returns false
+* if the key is absent.
+*/
+template<class Key, class Value, class Alloc, class Compare>
+bool RWLockedAVLTree<Key, Value, Alloc, Compare>::find(const Key& key, Value& value) const
+{
+    SharedGuard guard(lock_);
+    typename TreeT::const_iterator it = tree_.find(key);
+    if(it == tree_.end())
+        return false;
+    value = it->second;
+    return true;
+}
+
+template<class Key, class Value, class Alloc, class Compare>
+bool RWLockedAVLTree<Key, Value, Alloc, Compare>::contains(const Key& key) const
+{
+    SharedGuard guard(lock_);
+    return tree_.find(key) != tree_.end();
+}
+
+/**
+* Returns a copy of the value of key; throws std::out_of_range if absent.
+*/
+template<class Key, class Value, class Alloc, class Compare>
+Value RWLockedAVLTree<Key, Value, Alloc, Compare>::operator[](const Key& key) const
+{
+    SharedGuard guard(lock_);
+    return tree_[key];
+}
+
+template<class Key, class Value, class Alloc, class Compare>
+size_t RWLockedAVLTree<Key, Value, Alloc, Compare>::size() const
+{
+    SharedGuard guard(lock_);
+    return tree_.size();
+}
+
+template<class Key, class Value, class Alloc, class Compare>
+bool RWLockedAVLTree<Key, Value, Alloc, Compare>::empty() const
+{
+    return size() == 0;
+}
+
+/**
+* Inserts the pair, or overwrites the value if the key is present.
+* Returns whether the key was new.
+*/
+template<class Key, class Value, class Alloc, class Compare>
+bool RWLockedAVLTree<Key, Value, Alloc, Compare>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    return insert_or_assign(keyValuePair.first, keyValuePair.second);
+}
+
+template<class Key, class Value, class Alloc, class Compare>
+bool RWLockedAVLTree<Key, Value, Alloc, Compare>::insert_or_assign(const Key& key, const Value& value)
+{
+    std::lock_guard<DistributedRWLock> guard(lock_);
+    return tree_.insert_or_assign(key, value).second;
+}
+
+/**
+* Removes the key if present and returns whether it was.
+*/
+template<class Key, class Value, class Alloc, class Compare>
+bool RWLockedAVLTree<Key, Value, Alloc, Compare>::remove(const Key& key)
+{
+    std::lock_guard<DistributedRWLock> guard(lock_);
+    size_t before = tree_.size();
+    tree_.remove(key);
+    return tree_.size() != before;
+}
+
+template<class Key, class Value, class Alloc, class Compare>
+void RWLockedAVLTree<Key, Value, Alloc, Compare>::clear()
+{
+    std::lock_guard<DistributedRWLock> guard(lock_);
+    tree_.clear();
+}
+
+/**
+* Calls fn(const TreeT&) with the lock held shared.
+*/
+template<class Key, class Value, class Alloc, class Compare>
+template<typename Function>
+void RWLockedAVLTree<Key, Value, Alloc, Compare>::read(Function fn) const
+{
+    SharedGuard guard(lock_);
+    fn(tree_);
+}
+
+/**
+* Calls fn(TreeT&) with the lock held exclusively.
+*/
+template<class Key, class Value, class Alloc, class Compare>
+template<typename Function>
+void RWLockedAVLTree<Key, Value, Alloc, Compare>::write(Function fn)
+{
+    std::lock_guard<DistributedRWLock> guard(lock_);
+    fn(tree_);
+}
+
+template <typename Key, typename Value>
+class ConcurrentAVLNode;
+
+/**
+* Everything a node of a ConcurrentAVLTree holds except its key, so that
+* the tree's root holder, which has no key, can be one too.
+*
+* Every field is read without the lock. value_ points to a copy of the
+* value on the heap, so that it can be replaced whole, and is NULL in a
+* routing node: a node whose key was removed while it had two children
+* and which stays as a signpost until it can be spliced out. version_
+* changes whenever a rotation shrinks the range of keys under the node
+* and becomes kUnlinked once it is out of the tree; a reader that finds
+* it unchanged after following a link knows the link was still the
+* right one to follow. height_ may lag behind during an update, and
+* whoever changes a node is responsible for repairing it.
+*/
+template <typename Key, typename Value>
+class ConcurrentAVLLinks
+{
+public:
+    typedef ConcurrentAVLNode<Key, Value> NodeT;
+
+    ConcurrentAVLLinks(const Value* value, ConcurrentAVLLinks* parent);
+
+    NodeT* child(int dir) const;
+    void setChild(int dir, NodeT* child);
+    void waitUntilChanged(uint64_t version);
+
+    // version_ is kUnlinked once the node is out of the tree, has
+    // kShrinking set during a rotation that shrinks it and grows by
+    // kShrinkStep after each one
+    static const uint64_t kUnlinked = 1;
+    static const uint64_t kShrinking = 2;
+    static const uint64_t kShrinkStep = 4;
+    static const int kSpins = 100;
+
+    std::atomic<const Value*> value_;
+    std::atomic<int> height_;
+    std::atomic<uint64_t> version_;
+    std::atomic<ConcurrentAVLLinks*> parent_;
+    std::atomic<NodeT*> left_;
+    std::atomic<NodeT*> right_;
+    std::mutex lock_;
+};
+
+/**
+* A node of a ConcurrentAVLTree. The key never changes, and nodes never
+* swap places: removal unlinks a node with at most one child and turns
+* one with two into a routing node.
+*/
+template <typename Key, typename Value>
+class ConcurrentAVLNode : public ConcurrentAVLLinks<Key, Value>
+{
+public:
+    ConcurrentAVLNode(const Key& key, const Value* value, ConcurrentAVLLinks<Key, Value>* parent);
+
+    const Key key_;
+};
+
+/**
+* A thread-safe map in which readers never block and writers lock only
+* the nodes they change, after Bronson et al., "A Practical Concurrent
+* Binary Search Tree" (PPoPP 2010).
+*
+* A lookup takes no lock and writes nothing shared. It walks down as in
+* an ordinary tree, and after following each link it checks that the
+* version of the node it came from is unchanged, so that no rotation has
+* moved the key out of the subtree it entered; if one has, it backs up
+* one level and tries again. Nodes a rotation shrinks are marked first,
+* so a reader that meets one waits for the rotation to finish.
+*
+* insert and insert_or_assign lock the node they change or hang a new
+* leaf from; remove locks the node and, to splice it out, its parent. A
+* removed key with two children stays behind as a routing node without
+* a value. Rebalancing then walks up from the damaged node and fixes
+* heights and rotates with the locks of the parent, the node and the
+* child or grandchild involved, always taken top-down. Balance is thus
+* relaxed while updates are in flight but restored once they finish;
+* routing nodes are spliced out when a rotation leaves them with one
+* child.
+*
+* Nodes and replaced values are retired to an EpochDomain, which every
+* operation enters, and freed once no thread can still reach them.
+* Lookups return values by copy. forEach, size and height are exact only
+* when no writer runs, and clear must run alone. Compare must not throw.
+*/
+template <class Key, class Value, class Compare = std::less<Key> >
+class ConcurrentAVLTree
+{
+public:
+    typedef ConcurrentAVLLinks<Key, Value> LinksT;
+    typedef ConcurrentAVLNode<Key, Value> NodeT;
+
+    ConcurrentAVLTree();
+    explicit ConcurrentAVLTree(const Compare& comp);
+    ~ConcurrentAVLTree();
+
+    bool find(const Key& key, Value& value) const;
+    bool contains(const Key& key) const;
+    Value operator[](const Key& key) const;
+    size_t size() const;
+    bool empty() const;
+    size_t height() const;
+
+    bool insert(const std::pair<const Key, Value>& keyValuePair);
+    bool insert_or_assign(const Key& key, const Value& value);
+    bool remove(const Key& key);
+    void clear();
+
+    template<typename Function>
+    void forEach(Function fn) const;
+
+protected:
+    // What an attempt found: the key had no value, had one, or the
+    // attempt has to be repeated one level up
+    enum Attempt { kAbsent, kPresent, kRetry };
+
+    // nodeCondition results other than a new height
+    static const int kUnlinkRequired = -1;
+    static const int kRebalanceRequired = -2;
+    static const int kNothingRequired = -3;
+
+    int compare(const Key& a, const Key& b) const;
+    Attempt attemptGet(const Key& key, LinksT* node, int dir, uint64_t nodeVersion,
+                       const Value*& value) const;
+    Attempt update(const Key& key, const Value* value);
+    Attempt attemptUpdate(const Key& key, const Value* value, NodeT* node, uint64_t nodeVersion);
+    Attempt attemptNodeUpdate(const Value* value, LinksT* parent, NodeT* node);
+    bool attemptUnlink(LinksT* parent, NodeT* node);
+
+    static int heightOf(const NodeT* node);
+    int nodeCondition(LinksT* node) const;
+    void fixHeightAndRebalance(LinksT* node);
+    LinksT* fixHeight(LinksT* node);
+    LinksT* rebalance(LinksT* parent, NodeT* node);
+    LinksT* rebalanceToward(LinksT* parent, NodeT* node, int heavy, NodeT* child, int lightHeight);
+    LinksT* rotate(LinksT* parent, NodeT* node, int heavy, NodeT* child, int lightHeight,
+                   int outerHeight, NodeT* inner, int innerHeight);
+    LinksT* rotateDouble(LinksT* parent, NodeT* node, int heavy, NodeT* child, int lightHeight,
+                         int outerHeight, NodeT* inner, int innerOuterHeight);
+
+    template<typename Function>
+    static void forEachNode(const NodeT* node, Function& fn);
+    static size_t heightBelow(const NodeT* node);
+    static void deleteNodes(NodeT* node);
+
+private:
+    ConcurrentAVLTree(const ConcurrentAVLTree&);
+    ConcurrentAVLTree& operator=(const ConcurrentAVLTree&);
+
+    // the root is holder_'s right child
+    mutable LinksT holder_;
+    std::atomic<size_t> size_;
+    mutable EpochDomain epoch_;
+    Compare comp_;
+};
+
+/*
+  ---------------------------------------------
+  Begin implementations for ConcurrentAVLLinks and ConcurrentAVLNode.
+  ---------------------------------------------
+*/
+
+template<typename Key, typename Value>
+ConcurrentAVLLinks<Key, Value>::ConcurrentAVLLinks(const Value* value, ConcurrentAVLLinks* parent) :
+    value_(value), height_(1), version_(0), parent_(parent), left_(nullptr), right_(nullptr)
+{
+
+}
+
+/**
+* The left child for dir < 0, the right one otherwise.
+*/
+template<typename Key, typename Value>
+typename ConcurrentAVLLinks<Key, Value>::NodeT* ConcurrentAVLLinks<Key, Value>::child(int dir) const
+{
+    return dir < 0 ? left_.load(std::memory_order_acquire) : right_.load(std::memory_order_acquire);
+}
+
+template<typename Key, typename Value>
+void ConcurrentAVLLinks<Key, Value>::setChild(int dir, NodeT* child)
+{
+    if(dir < 0)
+        left_.store(child, std::memory_order_release);
+    else
+        right_.store(child, std::memory_order_release);
+}
+
+/**
+* Returns once a rotation that version shows in progress is over. The
+* rotating thread holds the node's lock throughout, so after a short
+* spin the caller queues up on the lock.
+*/
+template<typename Key, typename Value>
+void ConcurrentAVLLinks<Key, Value>::waitUntilChanged(uint64_t version)
+{
+    if((version & kShrinking) == 0)
+        return;
+    for(int i = 0; i < kSpins; ++i){
+        if(version_.load(std::memory_order_acquire) != version)
+            return;
+    }
+    std::lock_guard<std::mutex> lock(lock_);
+}
+
+template<typename Key, typename Value>
+ConcurrentAVLNode<Key, Value>::ConcurrentAVLNode(const Key& key, const Value* value,
+                                                 ConcurrentAVLLinks<Key, Value>* parent) :
+    ConcurrentAVLLinks<Key, Value>(value, parent), key_(key)
+{
+
+}
+
+/*
+  ---------------------------------------------
+  Begin implementations for ConcurrentAVLTree.
+  ---------------------------------------------
+*/
+
+template<class Key, class Value, class Compare>
+ConcurrentAVLTree<Key, Value, Compare>::ConcurrentAVLTree() :
+    holder_(nullptr, nullptr), size_(0), comp_()
+{
+
+}
+
+template<class Key, class Value, class Compare>
+ConcurrentAVLTree<Key, Value, Compare>::ConcurrentAVLTree(const Compare& comp) :
+    holder_(nullptr, nullptr), size_(0), comp_(comp)
+{
+
+}
+
+/**
+* No thread may be using the tree. The domain then frees what was
+* retired.
+*/
+template<class Key, class Value, class Compare>
+ConcurrentAVLTree<Key, Value, Compare>::~ConcurrentAVLTree()
+{
+    deleteNodes(holder_.right_.load(std::memory_order_relaxed));
+}
+
+template<class Key, class Value, class Compare>
+int ConcurrentAVLTree<Key, Value, Compare>::compare(const Key& a, const Key& b) const
+{
+    if(ThreeWayCompare<Key, Compare>::value)
+        return ThreeWayCompare<Key, Compare>::compare(comp_, a, b);
+    return comp_(a, b) ? -1 : comp_(b, a) ? 1 : 0;
+}
+
+/**
+* Copies the value of key into value and returns true, or returns false
+* if the key is absent. Takes no lock.
+*/
+template<class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::find(const Key& key, Value& value) const
+{
+    EpochGuard guard(epoch_);
+    const Value* found = nullptr;
+    // the holder never changes its version, so this never retries
+    if(attemptGet(key, &holder_, 1, 0, found) != kPresent)
+        return false;
+    value = *found;
+    return true;
+}
+
+template<class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::contains(const Key& key) const
+{
+    EpochGuard guard(epoch_);
+    const Value* found = nullptr;
+    return attemptGet(key, &holder_, 1, 0, found) == kPresent;
+}
+
+/**
+* Returns a copy of the value of key; throws std::out_of_range if absent.
+*/
+template<class Key, class Value, class Compare>
+Value ConcurrentAVLTree<Key, Value, Compare>::operator[](const Key& key) const
+{
+    EpochGuard guard(epoch_);
+    const Value* found = nullptr;
+    if(attemptGet(key, &holder_, 1, 0, found) != kPresent)
+        throw std::out_of_range("Invalid key");
+    return *found;
+}
+
+template<class Key, class Value, class Compare>
+size_t ConcurrentAVLTree<Key, Value, Compare>::size() const
+{
+    return size_.load(std::memory_order_relaxed);
+}
+
+template<class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::empty() const
+{
+    return size() == 0;
+}
+
+/**
+* The number of levels, routing nodes included, found by walking the
+* whole tree.
+*/
+template<class Key, class Value, class Compare>
+size_t ConcurrentAVLTree<Key, Value, Compare>::height() const
+{
+    EpochGuard guard(epoch_);
+    return heightBelow(holder_.right_.load(std::memory_order_acquire));
+}
+
+/**
+* Inserts the pair, or overwrites the value if the key is present.
+* Returns whether the key was new.
+*/
+template<class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    return insert_or_assign(keyValuePair.first, keyValuePair.second);
+}
+
+/**
+* If copying the key or value throws, the tree is unchanged.
+*/
+template<class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::insert_or_assign(const Key& key, const Value& value)
+{
+    std::unique_ptr<Value> copy(new Value(value));
+    bool added = update(key, copy.get()) == kAbsent;
+    copy.release();
+    if(added)
+        size_.fetch_add(1, std::memory_order_relaxed);
+    return added;
+}
+
+/**
+* Removes the key if present and returns whether it was.
+*/
+template<class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::remove(const Key& key)
+{
+    bool removed = update(key, nullptr) == kPresent;
+    if(removed)
+        size_.fetch_sub(1, std::memory_order_relaxed);
+    return removed;
+}
+
+/**
+* No other thread may be using the tree meanwhile.
+*/
+template<class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::clear()
+{
+    deleteNodes(holder_.right_.load(std::memory_order_relaxed));
+    holder_.right_.store(nullptr, std::memory_order_release);
+    holder_.height_.store(1, std::memory_order_relaxed);
+    size_.store(0, std::memory_order_relaxed);
+}
+
+/**
+* Calls fn(key, value) for every item in key order. Items that writers
+* move meanwhile may be missed or seen twice.
+*/
+template<class Key, class Value, class Compare>
+template<typename Function>
+void ConcurrentAVLTree<Key, Value, Compare>::forEach(Function fn) const
+{
+    EpochGuard guard(epoch_);
+    forEachNode(holder_.right_.load(std::memory_order_acquire), fn);
+}
+
+/**
+* Looks for key below node's child in direction dir. nodeVersion is the
+* version node had when the caller decided to descend into it; once it
+* changes, the search returns kRetry for the caller to read its link to
+* node again.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Attempt
+ConcurrentAVLTree<Key, Value, Compare>::attemptGet(const Key& key, LinksT* node, int dir, uint64_t nodeVersion,
+                                                   const Value*& value) const
+{
+    for(;;){
+        NodeT* child = node->child(dir);
+        if(node->version_.load(std::memory_order_acquire) != nodeVersion)
+            return kRetry;
+        if(child == nullptr)
+            return kAbsent;
+        int next = compare(key, child->key_);
+        if(next == 0){
+            value = child->value_.load(std::memory_order_acquire);
+            return value != nullptr ? kPresent : kAbsent;
+        }
+        uint64_t childVersion = child->version_.load(std::memory_order_acquire);
+        if(childVersion & LinksT::kShrinking){
+            child->waitUntilChanged(childVersion);
+        }
+        else if(childVersion != LinksT::kUnlinked && child == node->child(dir)){
+            if(node->version_.load(std::memory_order_acquire) != nodeVersion)
+                return kRetry;
+            Attempt found = attemptGet(key, child, next, childVersion, value);
+            if(found != kRetry)
+                return found;
+        }
+    }
+}
+
+/**
+* Sets the value of key to *value, a heap copy the tree takes over, or
+* removes the key if value is NULL. Returns whether the key had a value.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Attempt
+ConcurrentAVLTree<Key, Value, Compare>::update(const Key& key, const Value* value)
+{
+    EpochGuard guard(epoch_);
+    for(;;){
+        NodeT* root = holder_.right_.load(std::memory_order_acquire);
+        if(root == nullptr){
+            if(value == nullptr)
+                return kAbsent;
+            std::lock_guard<std::mutex> lock(holder_.lock_);
+            if(holder_.right_.load(std::memory_order_acquire) == nullptr){
+                holder_.right_.store(new NodeT(key, value, &holder_), std::memory_order_release);
+                holder_.height_.store(2, std::memory_order_relaxed);
+                return kAbsent;
+            }
+        }
+        else{
+            uint64_t version = root->version_.load(std::memory_order_acquire);
+            if(version & (LinksT::kShrinking | LinksT::kUnlinked)){
+                root->waitUntilChanged(version);
+            }
+            else if(root == holder_.right_.load(std::memory_order_acquire)){
+                Attempt done = attemptUpdate(key, value, root, version);
+                if(done != kRetry)
+                    return done;
+            }
+        }
+    }
+}
+
+/**
+* update below node, reached with nodeVersion. A new key is hung as a
+* leaf with only the parent-to-be locked.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Attempt
+ConcurrentAVLTree<Key, Value, Compare>::attemptUpdate(const Key& key, const Value* value, NodeT* node,
+                                                      uint64_t nodeVersion)
+{
+    int dir = compare(key, node->key_);
+    if(dir == 0)
+        return attemptNodeUpdate(value, node->parent_.load(std::memory_order_acquire), node);
+    for(;;){
+        NodeT* child = node->child(dir);
+        if(node->version_.load(std::memory_order_acquire) != nodeVersion)
+            return kRetry;
+        if(child == nullptr){
+            if(value == nullptr)
+                return kAbsent;
+            LinksT* damaged;
+            {
+                std::lock_guard<std::mutex> lock(node->lock_);
+                // with the lock held no rotation can move node any more
+                if(node->version_.load(std::memory_order_acquire) != nodeVersion)
+                    return kRetry;
+                // a concurrent insert took the slot; look again below
+                if(node->child(dir) != nullptr)
+                    continue;
+                node->setChild(dir, new NodeT(key, value, node));
+                damaged = fixHeight(node);
+            }
+            fixHeightAndRebalance(damaged);
+            return kAbsent;
+        }
+        uint64_t childVersion = child->version_.load(std::memory_order_acquire);
+        if(childVersion & (LinksT::kShrinking | LinksT::kUnlinked)){
+            child->waitUntilChanged(childVersion);
+        }
+        else if(child == node->child(dir)){
+            // the link was read under childVersion; node still being
+            // unchanged makes the whole path valid
+            if(node->version_.load(std::memory_order_acquire) != nodeVersion)
+                return kRetry;
+            Attempt done = attemptUpdate(key, value, child, childVersion);
+            if(done != kRetry)
+                return done;
+        }
+    }
+}
+
+/**
+* update at node, which holds the key. A removal splices the node out
+* if it has at most one child, locking the parent and then the node;
+* otherwise the value is swapped under the node's lock alone, leaving a
+* routing node behind on removal.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Attempt
+ConcurrentAVLTree<Key, Value, Compare>::attemptNodeUpdate(const Value* value, LinksT* parent, NodeT* node)
+{
+    if(value == nullptr && node->value_.load(std::memory_order_acquire) == nullptr)
+        return kAbsent;
+    const Value* previous;
+    if(value == nullptr && (node->left_.load(std::memory_order_acquire) == nullptr ||
+                            node->right_.load(std::memory_order_acquire) == nullptr)){
+        LinksT* damaged;
+        {
+            std::lock_guard<std::mutex> parentLock(parent->lock_);
+            if(parent->version_.load(std::memory_order_acquire) == LinksT::kUnlinked ||
+               node->parent_.load(std::memory_order_acquire) != parent)
+                return kRetry;
+            {
+                std::lock_guard<std::mutex> nodeLock(node->lock_);
+                previous = node->value_.load(std::memory_order_acquire);
+                if(previous == nullptr)
+                    return kAbsent;
+                if(!attemptUnlink(parent, node))
+                    return kRetry;
+            }
+            damaged = fixHeight(parent);
+        }
+        epoch_.retire(const_cast<Value*>(previous));
+        fixHeightAndRebalance(damaged);
+        return kPresent;
+    }
+    {
+        std::lock_guard<std::mutex> nodeLock(node->lock_);
+        if(node->version_.load(std::memory_order_acquire) == LinksT::kUnlinked)
+            return kRetry;
+        previous = node->value_.load(std::memory_order_acquire);
+        // a child went away since; the node can be spliced out now
+        if(value == nullptr && (node->left_.load(std::memory_order_acquire) == nullptr ||
+                                node->right_.load(std::memory_order_acquire) == nullptr))
+            return kRetry;
+        node->value_.store(value, std::memory_order_release);
+    }
+    if(previous == nullptr)
+        return kAbsent;
+    epoch_.retire(const_cast<Value*>(previous));
+    return kPresent;
+}
+
+/**
+* Splices node, which has at most one child, out from under parent and
+* retires it. Both are locked. Returns false if node is no longer
+* parent's child or has two children by now. The node's value is left
+* to the caller.
+*/
+template<class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::attemptUnlink(LinksT* parent, NodeT* node)
+{
+    NodeT* parentLeft = parent->left_.load(std::memory_order_acquire);
+    NodeT* parentRight = parent->right_.load(std::memory_order_acquire);
+    if(parentLeft != node && parentRight != node)
+        return false;
+    NodeT* left = node->left_.load(std::memory_order_acquire);
+    NodeT* right = node->right_.load(std::memory_order_acquire);
+    if(left != nullptr && right != nullptr)
+        return false;
+    NodeT* splice = left != nullptr ? left : right;
+    parent->setChild(parentLeft == node ? -1 : 1, splice);
+    if(splice != nullptr)
+        splice->parent_.store(parent, std::memory_order_release);
+    node->version_.store(LinksT::kUnlinked, std::memory_order_release);
+    node->value_.store(nullptr, std::memory_order_release);
+    epoch_.retire(node);
+    return true;
+}
+
+template<class Key, class Value, class Compare>
+int ConcurrentAVLTree<Key, Value, Compare>::heightOf(const NodeT* node)
+{
+    return node == nullptr ? 0 : node->height_.load(std::memory_order_relaxed);
+}
+
+/**
+* What node needs: to be spliced out (a routing node with at most one
+* child), a rotation, a new height (returned), or nothing. The fields
+* are read without locks; if they were inconsistent, some thread that
+* changed them is still responsible for the node.
+*/
+template<class Key, class Value, class Compare>
+int ConcurrentAVLTree<Key, Value, Compare>::nodeCondition(LinksT* node) const
+{
+    NodeT* left = node->left_.load(std::memory_order_acquire);
+    NodeT* right = node->right_.load(std::memory_order_acquire);
+    if((left == nullptr || right == nullptr) && node->value_.load(std::memory_order_acquire) == nullptr)
+        return kUnlinkRequired;
+    int height = node->height_.load(std::memory_order_relaxed);
+    int leftHeight = heightOf(left);
+    int rightHeight = heightOf(right);
+    int balance = leftHeight - rightHeight;
+    if(balance < -1 || balance > 1)
+        return kRebalanceRequired;
+    int repaired = 1 + std::max(leftHeight, rightHeight);
+    return height != repaired ? repaired : kNothingRequired;
+}
+
+/**
+* Repairs node and then its ancestors, as long as they need it, until
+* the holder is reached. A height is fixed under the node's lock; a
+* splice or rotation also locks the parent, above it.
+*/
+template<class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::fixHeightAndRebalance(LinksT* node)
+{
+    while(node != nullptr && node->parent_.load(std::memory_order_acquire) != nullptr){
+        int condition = nodeCondition(node);
+        if(condition == kNothingRequired || node->version_.load(std::memory_order_acquire) == LinksT::kUnlinked)
+            return;
+        if(condition != kUnlinkRequired && condition != kRebalanceRequired){
+            std::lock_guard<std::mutex> lock(node->lock_);
+            node = fixHeight(node);
+        }
+        else{
+            LinksT* parent = node->parent_.load(std::memory_order_acquire);
+            std::lock_guard<std::mutex> parentLock(parent->lock_);
+            if(parent->version_.load(std::memory_order_acquire) != LinksT::kUnlinked &&
+               node->parent_.load(std::memory_order_acquire) == parent){
+                std::lock_guard<std::mutex> nodeLock(node->lock_);
+                node = rebalance(parent, static_cast<NodeT*>(node));
+            }
+        }
+    }
+}
+
+/**
+* Fixes the height of node, which is locked, if that is all it needs.
+* Returns the node to repair next: node itself if it needs more, its
+* parent if its height changed, or NULL.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::LinksT*
+ConcurrentAVLTree<Key, Value, Compare>::fixHeight(LinksT* node)
+{
+    int condition = nodeCondition(node);
+    if(condition == kRebalanceRequired || condition == kUnlinkRequired)
+        return node;
+    if(condition == kNothingRequired)
+        return nullptr;
+    node->height_.store(condition, std::memory_order_relaxed);
+    return node->parent_.load(std::memory_order_acquire);
+}
+
+/**
+* Splices out, rotates or fixes the height of node, with parent and node
+* locked. Returns the node to repair next, or NULL.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::LinksT*
+ConcurrentAVLTree<Key, Value, Compare>::rebalance(LinksT* parent, NodeT* node)
+{
+    NodeT* left = node->left_.load(std::memory_order_acquire);
+    NodeT* right = node->right_.load(std::memory_order_acquire);
+    if((left == nullptr || right == nullptr) && node->value_.load(std::memory_order_acquire) == nullptr){
+        if(attemptUnlink(parent, node))
+            return fixHeight(parent);
+        return node;
+    }
+    int height = node->height_.load(std::memory_order_relaxed);
+    int leftHeight = heightOf(left);
+    int rightHeight = heightOf(right);
+    int balance = leftHeight - rightHeight;
+    if(balance > 1)
+        return rebalanceToward(parent, node, -1, left, rightHeight);
+    if(balance < -1)
+        return rebalanceToward(parent, node, 1, right, leftHeight);
+    int repaired = 1 + std::max(leftHeight, rightHeight);
+    if(repaired != height){
+        node->height_.store(repaired, std::memory_order_relaxed);
+        return fixHeight(parent);
+    }
+    return nullptr;
+}
+
+/**
+* node is too high on side heavy (-1 left, 1 right), where child is, and
+* its other side is lightHeight high. Locks child and rotates node away
+* from it, first rotating child the other way if its inner subtree is
+* the higher one; if that inner rotation would leave child out of
+* balance, child is rebalanced on its own first.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::LinksT*
+ConcurrentAVLTree<Key, Value, Compare>::rebalanceToward(LinksT* parent, NodeT* node, int heavy, NodeT* child,
+                                                        int lightHeight)
+{
+    std::lock_guard<std::mutex> childLock(child->lock_);
+    if(child->height_.load(std::memory_order_relaxed) - lightHeight <= 1)
+        return node;
+    NodeT* inner = child->child(-heavy);
+    int outerHeight = heightOf(child->child(heavy));
+    int innerHeight = heightOf(inner);
+    if(outerHeight >= innerHeight)
+        return rotate(parent, node, heavy, child, lightHeight, outerHeight, inner, innerHeight);
+    {
+        std::lock_guard<std::mutex> innerLock(inner->lock_);
+        // the height read before the lock may have been stale
+        innerHeight = inner->height_.load(std::memory_order_relaxed);
+        if(outerHeight >= innerHeight)
+            return rotate(parent, node, heavy, child, lightHeight, outerHeight, inner, innerHeight);
+        int innerOuterHeight = heightOf(inner->child(heavy));
+        int balance = outerHeight - innerOuterHeight;
+        if(balance >= -1 && balance <= 1 &&
+           !((outerHeight == 0 || innerOuterHeight == 0) && child->value_.load(std::memory_order_acquire) == nullptr))
+            return rotateDouble(parent, node, heavy, child, lightHeight, outerHeight, inner, innerOuterHeight);
+    }
+    return rebalanceToward(node, child, -heavy, inner, outerHeight);
+}
+
+/**
+* Rotates child, on side heavy of node, up into node's place; inner, the
+* child's subtree on the other side, moves over to node. parent, node
+* and child are locked. node's range shrinks, so its version is marked
+* for the duration; the link from parent changes last, so that a reader
+* still coming down it meets the mark.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::LinksT*
+ConcurrentAVLTree<Key, Value, Compare>::rotate(LinksT* parent, NodeT* node, int heavy, NodeT* child,
+                                               int lightHeight, int outerHeight, NodeT* inner, int innerHeight)
+{
+    uint64_t nodeVersion = node->version_.load(std::memory_order_relaxed);
+    bool wasLeft = parent->left_.load(std::memory_order_relaxed) == node;
+    node->version_.store(nodeVersion | LinksT::kShrinking, std::memory_order_release);
+
+    node->setChild(heavy, inner);
+    child->setChild(-heavy, node);
+    parent->setChild(wasLeft ? -1 : 1, child);
+    child->parent_.store(parent, std::memory_order_release);
+    node->parent_.store(child, std::memory_order_release);
+    if(inner != nullptr)
+        inner->parent_.store(node, std::memory_order_release);
+
+    int nodeHeight = 1 + std::max(innerHeight, lightHeight);
+    node->height_.store(nodeHeight, std::memory_order_relaxed);
+    child->height_.store(1 + std::max(outerHeight, nodeHeight), std::memory_order_relaxed);
+    node->version_.store(nodeVersion + LinksT::kShrinkStep, std::memory_order_release);
+
+    // fix what can be fixed with the locks held, deepest first
+    int nodeBalance = innerHeight - lightHeight;
+    if(nodeBalance < -1 || nodeBalance > 1)
+        return node;
+    if((inner == nullptr || lightHeight == 0) && node->value_.load(std::memory_order_acquire) == nullptr)
+        return node;
+    int childBalance = outerHeight - nodeHeight;
+    if(childBalance < -1 || childBalance > 1)
+        return child;
+    if(outerHeight == 0 && child->value_.load(std::memory_order_acquire) == nullptr)
+        return child;
+    return fixHeight(parent);
+}
+
+/**
+* The double rotation: inner, child's subtree away from side heavy, goes
+* up into node's place with child and node as its children, and its own
+* subtrees are shared out between them. parent, node, child and inner
+* are locked. Both node and child shrink.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::LinksT*
+ConcurrentAVLTree<Key, Value, Compare>::rotateDouble(LinksT* parent, NodeT* node, int heavy, NodeT* child,
+                                                     int lightHeight, int outerHeight, NodeT* inner,
+                                                     int innerOuterHeight)
+{
+    uint64_t nodeVersion = node->version_.load(std::memory_order_relaxed);
+    uint64_t childVersion = child->version_.load(std::memory_order_relaxed);
+    bool wasLeft = parent->left_.load(std::memory_order_relaxed) == node;
+    NodeT* innerOuter = inner->child(heavy);
+    NodeT* innerInner = inner->child(-heavy);
+    int innerInnerHeight = heightOf(innerInner);
+    node->version_.store(nodeVersion | LinksT::kShrinking, std::memory_order_release);
+    child->version_.store(childVersion | LinksT::kShrinking, std::memory_order_release);
+
+    node->setChild(heavy, innerInner);
+    child->setChild(-heavy, innerOuter);
+    inner->setChild(heavy, child);
+    inner->setChild(-heavy, node);
+    parent->setChild(wasLeft ? -1 : 1, inner);
+    inner->parent_.store(parent, std::memory_order_release);
+    child->parent_.store(inner, std::memory_order_release);
+    node->parent_.store(inner, std::memory_order_release);
+    if(innerInner != nullptr)
+        innerInner->parent_.store(node, std::memory_order_release);
+    if(innerOuter != nullptr)
+        innerOuter->parent_.store(child, std::memory_order_release);
+
+    int nodeHeight = 1 + std::max(innerInnerHeight, lightHeight);
+    node->height_.store(nodeHeight, std::memory_order_relaxed);
+    int childHeight = 1 + std::max(outerHeight, innerOuterHeight);
+    child->height_.store(childHeight, std::memory_order_relaxed);
+    inner->height_.store(1 + std::max(childHeight, nodeHeight), std::memory_order_relaxed);
+    child->version_.store(childVersion + LinksT::kShrinkStep, std::memory_order_release);
+    node->version_.store(nodeVersion + LinksT::kShrinkStep, std::memory_order_release);
+
+    int nodeBalance = innerInnerHeight - lightHeight;
+    if(nodeBalance < -1 || nodeBalance > 1)
+        return node;
+    if((innerInner == nullptr || lightHeight == 0) && node->value_.load(std::memory_order_acquire) == nullptr)
+        return node;
+    int innerBalance = childHeight - nodeHeight;
+    if(innerBalance < -1 || innerBalance > 1)
+        return inner;
+    return fixHeight(parent);
+}
+
+template<class Key, class Value, class Compare>
+template<typename Function>
+void ConcurrentAVLTree<Key, Value, Compare>::forEachNode(const NodeT* node, Function& fn)
+{
+    while(node != nullptr){
+        forEachNode(node->left_.load(std::memory_order_acquire), fn);
+        const Value* value = node->value_.load(std::memory_order_acquire);
+        if(value != nullptr)
+            fn(node->key_, *value);
+        node = node->right_.load(std::memory_order_acquire);
+    }
+}
+
+template<class Key, class Value, class Compare>
+size_t ConcurrentAVLTree<Key, Value, Compare>::heightBelow(const NodeT* node)
+{
+    if(node == nullptr)
+        return 0;
+    return 1 + std::max(heightBelow(node->left_.load(std::memory_order_acquire)),
+                        heightBelow(node->right_.load(std::memory_order_acquire)));
+}
+
+/**
+* Frees the subtree at node with its values. Only for a tree nobody else
+* is using.
+*/
+template<class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::deleteNodes(NodeT* node)
+{
+    while(node != nullptr){
+        deleteNodes(node->left_.load(std::memory_order_relaxed));
+        NodeT* right = node->right_.load(std::memory_order_relaxed);
+        delete node->value_.load(std::memory_order_relaxed);
+        delete node;
+        node = right;
+    }
+}
+
+#endif
@@ -0,0 +1,331 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <vector>
+
+/**
+* Epoch-based reclamation. Readers enter the domain (an EpochGuard) before
+* they load a shared pointer and exit when they no longer use anything
+* they reached through it; entering and exiting touch only the thread's
+* own record, so readers never write a shared cache line. A writer that
+* unlinks an object hands it to retire() instead of deleting it, and the
+* domain frees it once every reader that could still be looking at it
+* has exited.
+*
+* The domain keeps a global epoch. A reader announces the epoch it
+* entered in; the epoch only advances when every active reader has
+* announced the current one. An object retired in epoch e was unlinked
+* before any reader announcing e + 1 entered, so once the epoch reaches
+* e + 2 nobody can hold it.
+*
+* Each thread gets its own record the first time it uses a domain, with
+* its own list of retired objects. When a thread exits its record is
+* released, pending list included, and the next new thread takes it
+* over. Entering is reentrant. A reader that stays inside the domain
+* holds back the freeing of everything retired after it entered.
+*/
+class EpochDomain
+{
+public:
+    EpochDomain();
+    ~EpochDomain();
+
+    void enter();
+    void exit();
+
+    void retire(void* object, void (*deleter)(void*));
+    template<typename T>
+    void retire(T* object);
+    void collect();
+
+    size_t pending() const;
+
+    static const size_t kCollectEvery = 64;
+
+private:
+    EpochDomain(const EpochDomain&);
+    EpochDomain& operator=(const EpochDomain&);
+
+    struct Retired
+    {
+        void* object;
+        void (*deleter)(void*);
+        uint64_t epoch;
+    };
+
+    // The state of one thread in this domain. announced is the epoch the
+    // thread entered in, shifted left, with the low bit set while it is
+    // inside; only the owner writes it. Padded so that readers on
+    // different cores do not share a line.
+    struct Record
+    {
+        std::atomic<uint64_t> announced;
+        std::atomic<bool> claimed;
+        size_t nesting;
+        std::deque<Retired> retired;
+        char pad[64];
+    };
+
+    // What a thread remembers about the domains it has used.
+    struct ThreadEntry
+    {
+        uint64_t domain;
+        Record* record;
+    };
+    struct ThreadRecords
+    {
+        std::vector<ThreadEntry> entries;
+        ~ThreadRecords();
+    };
+
+    Record* threadRecord();
+    bool tryAdvance();
+    void freeRetired(Record* record, uint64_t epoch);
+
+    template<typename T>
+    static void deleteObject(void* object);
+
+    static std::mutex& registryMutex();
+    static std::set<uint64_t>& liveDomains();
+
+    std::atomic<uint64_t> epoch_;
+    std::vector<Record*> records_;
+    std::mutex recordsMutex_;
+    uint64_t id_;
+};
+
+/**
+* Keeps the calling thread inside an EpochDomain for a scope.
+*/
+class EpochGuard
+{
+public:
+    explicit EpochGuard(EpochDomain& domain);
+    ~EpochGuard();
+
+private:
+    EpochGuard(const EpochGuard&);
+    EpochGuard& operator=(const EpochGuard&);
+
+    EpochDomain& domain_;
+};
+
+/*
+  ---------------------------------------------
+  Begin implementations for EpochDomain.
+  ---------------------------------------------
+*/
+
+inline std::mutex& EpochDomain::registryMutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
+/**
+* The ids of the domains alive now, so that an exiting thread releases
+* records only in domains that still exist.
+*/
+inline std::set<uint64_t>& EpochDomain::liveDomains()
+{
+    static std::set<uint64_t> domains;
+    return domains;
+}
+
+inline EpochDomain::EpochDomain() :
+    epoch_(0)
+{
+    static uint64_t nextId = 0;
+    std::lock_guard<std::mutex> lock(registryMutex());
+    id_ = ++nextId;
+    liveDomains().insert(id_);
+}
+
+/**
+* Frees everything still retired. No thread may be inside the domain.
+*/
+inline EpochDomain::~EpochDomain()
+{
+    {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        liveDomains().erase(id_);
+    }
+    for(size_t i = 0; i < records_.size(); ++i) {
+        freeRetired(records_[i], UINT64_MAX);
+        delete records_[i];
+    }
+}
+
+inline EpochDomain::ThreadRecords::~ThreadRecords()
+{
+    std::lock_guard<std::mutex> lock(registryMutex());
+    for(size_t i = 0; i < entries.size(); ++i) {
+        if(liveDomains().count(entries[i].domain)) {
+            entries[i].record->claimed.store(false, std::memory_order_release);
+        }
+    }
+}
+
+/**
+* The calling thread's record: one it already has, a released one, or a
+* new one.
+*/
+inline EpochDomain::Record* EpochDomain::threadRecord()
+{
+    static thread_local ThreadRecords mine;
+    for(size_t i = 0; i < mine.entries.size(); ++i) {
+        if(mine.entries[i].domain == id_) {
+            return mine.entries[i].record;
+        }
+    }
+    std::lock_guard<std::mutex> lock(recordsMutex_);
+    Record* record = nullptr;
+    for(size_t i = 0; i < records_.size() && record == nullptr; ++i) {
+        bool expected = false;
+        if(records_[i]->claimed.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            record = records_[i];
+        }
+    }
+    if(record == nullptr) {
+        record = new Record;
+        record->announced.store(0, std::memory_order_relaxed);
+        record->claimed.store(true, std::memory_order_relaxed);
+        record->nesting = 0;
+        records_.push_back(record);
+    }
+    // a thread's entries outlive the domain only if the thread outlives
+    // it; drop entries of dead domains so ids are never confused
+    {
+        std::lock_guard<std::mutex> registry(registryMutex());
+        for(size_t i = 0; i < mine.entries.size(); ) {
+            if(liveDomains().count(mine.entries[i].domain) == 0) {
+                mine.entries[i] = mine.entries.back();
+                mine.entries.pop_back();
+            }
+            else {
+                ++i;
+            }
+        }
+    }
+    ThreadEntry entry = { id_, record };
+    mine.entries.push_back(entry);
+    return record;
+}
+
+/**
+* Announces the current epoch. The announcement is sequentially
+* consistent, so it is ordered before every load the reader makes
+* afterwards; a writer advancing the epoch sees it.
+*/
+inline void EpochDomain::enter()
+{
+    Record* record = threadRecord();
+    if(record->nesting++ == 0) {
+        uint64_t epoch = epoch_.load(std::memory_order_relaxed);
+        record->announced.exchange((epoch << 1) | 1, std::memory_order_seq_cst);
+    }
+}
+
+inline void EpochDomain::exit()
+{
+    Record* record = threadRecord();
+    if(--record->nesting == 0) {
+        record->announced.store(0, std::memory_order_release);
+    }
+}
+
+/**
+* Frees object with deleter once no reader can reach it. The caller has
+* already unlinked it, so readers entering from now on cannot find it.
+* Every kCollectEvery retirements the thread collects.
+*/
+inline void EpochDomain::retire(void* object, void (*deleter)(void*))
+{
+    Record* record = threadRecord();
+    Retired item = { object, deleter, epoch_.load(std::memory_order_seq_cst) };
+    record->retired.push_back(item);
+    if(record->retired.size() % kCollectEvery == 0) {
+        collect();
+    }
+}
+
+template<typename T>
+void EpochDomain::retire(T* object)
+{
+    retire(object, &EpochDomain::deleteObject<T>);
+}
+
+template<typename T>
+void EpochDomain::deleteObject(void* object)
+{
+    delete static_cast<T*>(object);
+}
+
+/**
+* Advances the epoch if every reader allows it and frees what the
+* calling thread retired at least two epochs ago.
+*/
+inline void EpochDomain::collect()
+{
+    tryAdvance();
+    freeRetired(threadRecord(), epoch_.load(std::memory_order_acquire));
+}
+
+/**
+* The number of objects the calling thread has retired but not freed.
+*/
+inline size_t EpochDomain::pending() const
+{
+    return const_cast<EpochDomain*>(this)->threadRecord()->retired.size();
+}
+
+inline bool EpochDomain::tryAdvance()
+{
+    uint64_t epoch = epoch_.load(std::memory_order_seq_cst);
+    std::lock_guard<std::mutex> lock(recordsMutex_);
+    for(size_t i = 0; i < records_.size(); ++i) {
+        uint64_t announced = records_[i]->announced.load(std::memory_order_seq_cst);
+        if((announced & 1) && (announced >> 1) != epoch) {
+            return false;
+        }
+    }
+    return epoch_.compare_exchange_strong(epoch, epoch + 1, std::memory_order_seq_cst);
+}
+
+/**
+* Frees the objects of record retired before epoch - 1, oldest first.
+*/
+inline void EpochDomain::freeRetired(Record* record, uint64_t epoch)
+{
+    while(!record->retired.empty() &&
+          (epoch == UINT64_MAX || record->retired.front().epoch + 2 <= epoch)) {
+        Retired item = record->retired.front();
+        record->retired.pop_front();
+        item.deleter(item.object);
+    }
+}
+
+/*
+  ---------------------------------------------
+  Begin implementations for EpochGuard.
+  ---------------------------------------------
+*/
+
+inline EpochGuard::EpochGuard(EpochDomain& domain) :
+    domain_(domain)
+{
+    domain_.enter();
+}
+
+inline EpochGuard::~EpochGuard()
+{
+    domain_.exit();
+}
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef KEY_COMPARE_H
+#define KEY_COMPARE_H
+
+#include <functional>
+#include <type_traits>
+#include <utility>
+
+/**
+* How the trees order their keys. Every tree takes a Compare parameter,
+* a strict weak ordering as for std::map, and asks it one question per
+* level of a descent: "is the key below this node's key?". Equality is
+* settled once at the bottom of the descent, so a lookup costs about one
+* comparison per level instead of the two or three of an ==, <, > chain.
+*
+* When a three-way comparison is available the descents use it instead
+* and stop at the matching node. ThreeWayCompare<Key, Compare> finds one:
+*   - Compare has a member  int compare(const Key& a, const Key& b) const
+*     returning <0, 0 or >0 (a comparator written for this hook), or
+*   - Compare is std::less<Key> and Key has a member a.compare(b) with
+*     the same meaning, as std::string does.
+* For other key types value is false and compare() must not be called.
+*/
+
+template<typename T>
+struct VoidType
+{
+    typedef void type;
+};
+
+template<typename Key, typename Compare, typename Enable = void>
+struct ThreeWayCompare
+{
+    static const bool value = false;
+    static int compare(const Compare&, const Key&, const Key&)
+    {
+        return 0;
+    }
+};
+
+template<typename Key, typename Compare>
+struct ThreeWayCompare<Key, Compare, typename VoidType<decltype(
+    std::declval<const Compare&>().compare(std::declval<const Key&>(), std::declval<const Key&>()))>::type>
+{
+    static const bool value = true;
+    static int compare(const Compare& comp, const Key& a, const Key& b)
+    {
+        return comp.compare(a, b);
+    }
+};
+
+template<typename Key>
+struct ThreeWayCompare<Key, std::less<Key>, typename VoidType<decltype(
+    std::declval<const Key&>().compare(std::declval<const Key&>()))>::type>
+{
+    static const bool value = true;
+    static int compare(const std::less<Key>&, const Key& a, const Key& b)
+    {
+        return a.compare(b);
+    }
+};
+
+#endif
@@ -0,0 +1,249 @@
+#ifndef NODE_ALLOC_H
+#define NODE_ALLOC_H
+
+#include <cstddef>
+#include <new>
+#include <utility>
+
+/**
+ * Allocator policies for the nodes of BinarySearchTree and AVLTree.
+ *
+ * A policy provides:
+ *   template<typename T, typename... Args> T* create(Args&&... args);
+ *   template<typename T> void destroy(T* node);
+ *   bool release();
+ *   static const bool kSharesNodes;
+ *
+ * release() drops every node the policy handed out without visiting them
+ * and returns true, or returns false if the policy cannot do that (the tree
+ * then destroys its nodes one at a time). It is only called once no node
+ * needs its destructor run.
+ *
+ * kSharesNodes says whether a node created by one instance of the policy
+ * may be destroyed by another, which lets AVLTree::split and join hand
+ * nodes from tree to tree.
+ */
+
+/**
+ * The default policy: every node is a separate new/delete.
+ */
+class HeapNodeAlloc
+{
+public:
+    template<typename T, typename... Args>
+    T* create(Args&&... args);
+    template<typename T>
+    void destroy(T* node);
+    bool release();
+
+    static const bool kSharesNodes = true;
+};
+
+/**
+ * A slab allocator with an intrusive free list. Nodes are carved out of
+ * large slabs so that they sit next to each other in memory, freed nodes
+ * are recycled before a slab is touched again, and release() resets the
+ * whole arena in O(1) while keeping the slabs around for reuse.
+ *
+ * All nodes from one arena must have the same size (a tree only ever
+ * allocates one node type). The arena owns its memory, so it cannot be
+ * copied; trees using it cannot be copied either.
+ */
+class SlabNodeAlloc
+{
+public:
+    explicit SlabNodeAlloc(size_t nodesPerSlab = 1024);
+    ~SlabNodeAlloc();
+
+    template<typename T, typename... Args>
+    T* create(Args&&... args);
+    template<typename T>
+    void destroy(T* node);
+    bool release();
+
+    // nodes live in this arena's slabs and cannot outlive it
+    static const bool kSharesNodes = false;
+
+    size_t slabCount() const;
+
+private:
+    SlabNodeAlloc(const SlabNodeAlloc&);
+    SlabNodeAlloc& operator=(const SlabNodeAlloc&);
+
+    struct Slab
+    {
+        Slab* next;
+    };
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    void* allocate(size_t bytes, size_t align);
+    void deallocate(void* block);
+    static size_t headerSize();
+    char* slabBegin(Slab* slab) const;
+
+    size_t nodesPerSlab_;
+    size_t blockSize_;      // fixed by the first allocation
+    Slab* slabs_;           // every slab ever allocated, newest last
+    Slab* current_;         // slab being carved, or NULL
+    Slab* last_;
+    size_t used_;           // blocks carved out of current_
+    FreeBlock* free_;
+};
+
+/*
+  ---------------------------------------------
+  Begin implementations for HeapNodeAlloc.
+  ---------------------------------------------
+*/
+
+template<typename T, typename... Args>
+T* HeapNodeAlloc::create(Args&&... args)
+{
+    return new T(std::forward<Args>(args)...);
+}
+
+template<typename T>
+void HeapNodeAlloc::destroy(T* node)
+{
+    delete node;
+}
+
+/**
+* Heap nodes have to be deleted one by one.
+*/
+inline bool HeapNodeAlloc::release()
+{
+    return false;
+}
+
+/*
+  ---------------------------------------------
+  Begin implementations for SlabNodeAlloc.
+  ---------------------------------------------
+*/
+
+inline SlabNodeAlloc::SlabNodeAlloc(size_t nodesPerSlab) :
+    nodesPerSlab_(nodesPerSlab == 0 ? 1 : nodesPerSlab),
+    blockSize_(0),
+    slabs_(NULL),
+    current_(NULL),
+    last_(NULL),
+    used_(0),
+    free_(NULL)
+{
+
+}
+
+/**
+* Returns every slab to the heap. Node destructors are not run; the tree
+* has already done that.
+*/
+inline SlabNodeAlloc::~SlabNodeAlloc()
+{
+    while(slabs_ != NULL) {
+        Slab* next = slabs_->next;
+        ::operator delete(slabs_);
+        slabs_ = next;
+    }
+}
+
+template<typename T, typename... Args>
+T* SlabNodeAlloc::create(Args&&... args)
+{
+    void* block = allocate(sizeof(T), alignof(T));
+    try {
+        return new (block) T(std::forward<Args>(args)...);
+    }
+    catch(...) {
+        deallocate(block);
+        throw;
+    }
+}
+
+template<typename T>
+void SlabNodeAlloc::destroy(T* node)
+{
+    node->~T();
+    deallocate(node);
+}
+
+/**
+* Forgets every node in O(1). The slabs stay allocated and are carved
+* again from the first one.
+*/
+inline bool SlabNodeAlloc::release()
+{
+    current_ = slabs_;
+    used_ = 0;
+    free_ = NULL;
+    return true;
+}
+
+inline size_t SlabNodeAlloc::slabCount() const
+{
+    size_t count = 0;
+    for(Slab* s = slabs_; s != NULL; s = s->next) {
+        ++count;
+    }
+    return count;
+}
+
+/**
+* Blocks start after the slab header, aligned for any node type.
+*/
+inline size_t SlabNodeAlloc::headerSize()
+{
+    const size_t align = alignof(std::max_align_t);
+    return (sizeof(Slab) + align - 1) / align * align;
+}
+
+inline char* SlabNodeAlloc::slabBegin(Slab* slab) const
+{
+    return reinterpret_cast<char*>(slab) + headerSize();
+}
+
+inline void* SlabNodeAlloc::allocate(size_t bytes, size_t align)
+{
+    if(blockSize_ == 0) {
+        // slabs are aligned for anything, so blocks only need to be a
+        // multiple of the node's own alignment
+        if(align < alignof(FreeBlock)) align = alignof(FreeBlock);
+        if(bytes < sizeof(FreeBlock)) bytes = sizeof(FreeBlock);
+        blockSize_ = (bytes + align - 1) / align * align;
+    }
+    else if(bytes > blockSize_) {
+        throw std::bad_alloc();
+    }
+
+    if(free_ != NULL) {
+        FreeBlock* block = free_;
+        free_ = block->next;
+        return block;
+    }
+    if(current_ != NULL && used_ == nodesPerSlab_) {
+        current_ = current_->next;
+        used_ = 0;
+    }
+    if(current_ == NULL) {
+        Slab* slab = static_cast<Slab*>(::operator new(headerSize() + blockSize_ * nodesPerSlab_));
+        slab->next = NULL;
+        if(last_ == NULL) slabs_ = slab;
+        else last_->next = slab;
+        last_ = slab;
+        current_ = slab;
+        used_ = 0;
+    }
+    return slabBegin(current_) + blockSize_ * used_++;
+}
+
+inline void SlabNodeAlloc::deallocate(void* block)
+{
+    FreeBlock* freed = static_cast<FreeBlock*>(block);
+    freed->next = free_;
+    free_ = freed;
+}
+
+#endif
@@ -0,0 +1,755 @@
+#ifndef PERSISTENT_AVL_H
+#define PERSISTENT_AVL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <utility>
+#include <iterator>
+#include <stdexcept>
+#include <algorithm>
+#include <functional>
+
+/**
+* A node of a PersistentAVLTree. There is no parent link, so a node can
+* be a child of nodes in several versions of the tree at once; refs_
+* counts those parents plus the trees that have it as their root. A node
+* with refs_ == 1 belongs to one version only and may be changed in
+* place, any other node is frozen. The height is stored rather than the
+* balance since rebalancing works on copies whose parents it cannot see.
+*/
+template <typename Key, typename Value>
+class PersistentAVLNode
+{
+public:
+    PersistentAVLNode(const Key& key, const Value& value);
+    PersistentAVLNode(const PersistentAVLNode& other);
+
+    std::pair<const Key, Value> item_;
+    PersistentAVLNode* left_;
+    PersistentAVLNode* right_;
+    std::atomic<uint32_t> refs_;
+    uint8_t height_;
+};
+
+template<typename Key, typename Value>
+PersistentAVLNode<Key, Value>::PersistentAVLNode(const Key& key, const Value& value) :
+    item_(key, value), left_(nullptr), right_(nullptr), refs_(1), height_(1)
+{
+
+}
+
+/**
+* Copies the item and shares the children: each gains a parent.
+*/
+template<typename Key, typename Value>
+PersistentAVLNode<Key, Value>::PersistentAVLNode(const PersistentAVLNode& other) :
+    item_(other.item_), left_(other.left_), right_(other.right_), refs_(1), height_(other.height_)
+{
+    if(left_ != nullptr)
+        left_->refs_.fetch_add(1, std::memory_order_relaxed);
+    if(right_ != nullptr)
+        right_->refs_.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+* An AVL tree with persistent versions. snapshot() (or copying the tree)
+* is O(1): the copy shares every node with the original. A write then
+* copies only the nodes on its path from the root that another version
+* can still see, O(log n) of them, and leaves all other versions as they
+* were; nodes that only this version sees are updated in place. A node
+* is freed by whichever version drops the last reference to it.
+*
+* Items cannot be changed through iterators, since they may be shared.
+* A tree object is not thread-safe, but its versions are independent:
+* a snapshot can be read, changed or destroyed on another thread while
+* the tree it came from keeps being written. Iterators refer to the
+* version they came from and are invalidated when it changes.
+* Compare orders the keys, as for AVLTree.
+*/
+template <class Key, class Value, class Compare = std::less<Key> >
+class PersistentAVLTree
+{
+public:
+    typedef PersistentAVLNode<Key, Value> NodeT;
+
+    PersistentAVLTree();
+    explicit PersistentAVLTree(const Compare& comp);
+    PersistentAVLTree(const PersistentAVLTree& other);
+    PersistentAVLTree(PersistentAVLTree&& other);
+    PersistentAVLTree& operator=(const PersistentAVLTree& other);
+    PersistentAVLTree& operator=(PersistentAVLTree&& other);
+    ~PersistentAVLTree();
+
+    PersistentAVLTree snapshot() const;
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    bool insert_or_assign(const Key& key, const Value& value);
+    void remove(const Key& key);
+    void clear();
+    bool empty() const;
+    size_t size() const;
+    size_t height() const;
+    Compare key_comp() const;
+    Value const & operator[](const Key& key) const;
+
+    /**
+    * The outcome of validate(). When an invariant is broken, item is the
+    * first offending item found and reason describes the violation.
+    */
+    struct ValidationResult
+    {
+        const std::pair<const Key, Value>* item;
+        const char* reason;
+        bool ok() const { return reason == nullptr; }
+    };
+    ValidationResult validate() const;
+
+    /**
+    * A forward iterator over one version. With no parent links to climb,
+    * a step from a node without a right child searches down from the
+    * root, as CompactAVLTree's iterators do: O(log n) per such step.
+    */
+    class const_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type* pointer;
+        typedef const value_type& reference;
+
+        const_iterator();
+
+        const std::pair<const Key,Value>& operator*() const;
+        const std::pair<const Key,Value>* operator->() const;
+
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+
+    protected:
+        friend class PersistentAVLTree<Key, Value, Compare>;
+        const_iterator(const NodeT* node, const PersistentAVLTree<Key, Value, Compare>* tree);
+        const NodeT* current_;
+        const PersistentAVLTree<Key, Value, Compare>* tree_;
+    };
+    typedef const_iterator iterator;
+
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator find(const Key& key) const;
+    const_iterator lower_bound(const Key& key) const;
+
+protected:
+    static void retain(NodeT* node);
+    static void release(NodeT* node);
+    static size_t heightOf(const NodeT* node);
+    static void update(NodeT* node);
+
+    // Writers work on slots, the links that own a reference to a node,
+    // and keep every slot owning a valid node at all times, so that a
+    // copy that throws halfway leaves a tree with the same items.
+    static void unshare(NodeT*& slot);
+    static void rotateLeft(NodeT*& slot);
+    static void rotateRight(NodeT*& slot);
+    static void rebalance(NodeT*& slot);
+    void insertNode(NodeT*& slot, const Key& key, const Value& value, bool& added);
+    void removeNode(NodeT*& slot, const Key& key, bool& removed);
+    static void removeMin(NodeT*& slot, NodeT*& min);
+    const NodeT* internalLowerBound(const Key& key) const;
+    const NodeT* internalUpperBound(const Key& key) const;
+    const NodeT* internalFind(const Key& key) const;
+    const char* checkNode(const NodeT* node, const NodeT*& bad) const;
+
+    NodeT* root_;
+    size_t size_;
+    Compare comp_;
+};
+
+/*
+  -----------------------------------------------------
+  Begin implementations for the PersistentAVLTree iterator.
+  -----------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare>
+PersistentAVLTree<Key, Value, Compare>::const_iterator::const_iterator() :
+    current_(nullptr), tree_(nullptr)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+PersistentAVLTree<Key, Value, Compare>::const_iterator::const_iterator(
+    const NodeT* node, const PersistentAVLTree<Key, Value, Compare>* tree) :
+    current_(node), tree_(tree)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+const std::pair<const Key,Value>&
+PersistentAVLTree<Key, Value, Compare>::const_iterator::operator*() const
+{
+    return current_->item_;
+}
+
+template<class Key, class Value, class Compare>
+const std::pair<const Key,Value>*
+PersistentAVLTree<Key, Value, Compare>::const_iterator::operator->() const
+{
+    return &(current_->item_);
+}
+
+template<class Key, class Value, class Compare>
+bool PersistentAVLTree<Key, Value, Compare>::const_iterator::operator==(const const_iterator& rhs) const
+{
+    return current_ == rhs.current_;
+}
+
+template<class Key, class Value, class Compare>
+bool PersistentAVLTree<Key, Value, Compare>::const_iterator::operator!=(const const_iterator& rhs) const
+{
+    return current_ != rhs.current_;
+}
+
+template<class Key, class Value, class Compare>
+typename PersistentAVLTree<Key, Value, Compare>::const_iterator&
+PersistentAVLTree<Key, Value, Compare>::const_iterator::operator++()
+{
+    if(current_->right_ != nullptr){
+        current_ = current_->right_;
+        while(current_->left_ != nullptr)
+            current_ = current_->left_;
+    }
+    else{
+        current_ = tree_->internalUpperBound(current_->item_.first);
+    }
+    return *this;
+}
+
+template<class Key, class Value, class Compare>
+typename PersistentAVLTree<Key, Value, Compare>::const_iterator
+PersistentAVLTree<Key, Value, Compare>::const_iterator::operator++(int)
+{
+    const_iterator old(*this);
+    ++(*this);
+    return old;
+}
+
+/*
+  -----------------------------------------------------
+  Begin implementations for the PersistentAVLTree class.
+  -----------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare>
+PersistentAVLTree<Key, Value, Compare>::PersistentAVLTree() :
+    root_(nullptr), size_(0)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+PersistentAVLTree<Key, Value, Compare>::PersistentAVLTree(const Compare& comp) :
+    root_(nullptr), size_(0), comp_(comp)
+{
+
+}
+
+/**
+* Shares every node with other in O(1).
+*/
+template<class Key, class Value, class Compare>
+PersistentAVLTree<Key, Value, Compare>::PersistentAVLTree(const PersistentAVLTree& other) :
+    root_(other.root_), size_(other.size_), comp_(other.comp_)
+{
+    retain(root_);
+}
+
+template<class Key, class Value, class Compare>
+PersistentAVLTree<Key, Value, Compare>::PersistentAVLTree(PersistentAVLTree&& other) :
+    root_(other.root_), size_(other.size_), comp_(other.comp_)
+{
+    other.root_ = nullptr;
+    other.size_ = 0;
+}
+
+template<class Key, class Value, class Compare>
+PersistentAVLTree<Key, Value, Compare>&
+PersistentAVLTree<Key, Value, Compare>::operator=(const PersistentAVLTree& other)
+{
+    retain(other.root_);
+    release(root_);
+    root_ = other.root_;
+    size_ = other.size_;
+    comp_ = other.comp_;
+    return *this;
+}
+
+template<class Key, class Value, class Compare>
+PersistentAVLTree<Key, Value, Compare>&
+PersistentAVLTree<Key, Value, Compare>::operator=(PersistentAVLTree&& other)
+{
+    if(this != &other){
+        release(root_);
+        root_ = other.root_;
+        size_ = other.size_;
+        comp_ = other.comp_;
+        other.root_ = nullptr;
+        other.size_ = 0;
+    }
+    return *this;
+}
+
+template<class Key, class Value, class Compare>
+PersistentAVLTree<Key, Value, Compare>::~PersistentAVLTree()
+{
+    release(root_);
+}
+
+/**
+* Returns a version that keeps the current contents whatever happens to
+* this tree later. O(1).
+*/
+template<class Key, class Value, class Compare>
+PersistentAVLTree<Key, Value, Compare> PersistentAVLTree<Key, Value, Compare>::snapshot() const
+{
+    return PersistentAVLTree(*this);
+}
+
+/**
+* Inserts the pair, or overwrites the value if the key is present.
+*/
+template<class Key, class Value, class Compare>
+void PersistentAVLTree<Key, Value, Compare>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    insert_or_assign(keyValuePair.first, keyValuePair.second);
+}
+
+/**
+* Same as insert; returns whether the key was new. Either way the path
+* to the key is copied where it is shared, as the value changes too.
+*
+* If copying a node throws, the exception is passed on and the tree is
+* still a valid search tree: the item is either in or not, and size()
+* says which. A throw while rebalancing can leave it out of balance.
+*/
+template<class Key, class Value, class Compare>
+bool PersistentAVLTree<Key, Value, Compare>::insert_or_assign(const Key& key, const Value& value)
+{
+    bool added = false;
+    try{
+        insertNode(root_, key, value, added);
+    }
+    catch(...){
+        if(added)
+            ++size_;
+        throw;
+    }
+    if(added)
+        ++size_;
+    return added;
+}
+
+/**
+* Removes the key if present. A miss copies nothing. Exceptions are
+* handled as by insert_or_assign.
+*/
+template<class Key, class Value, class Compare>
+void PersistentAVLTree<Key, Value, Compare>::remove(const Key& key)
+{
+    if(internalFind(key) == nullptr)
+        return;
+    bool removed = false;
+    try{
+        removeNode(root_, key, removed);
+    }
+    catch(...){
+        if(removed)
+            --size_;
+        throw;
+    }
+    --size_;
+}
+
+/**
+* Drops this version's nodes; those other versions share survive.
+*/
+template<class Key, class Value, class Compare>
+void PersistentAVLTree<Key, Value, Compare>::clear()
+{
+    release(root_);
+    root_ = nullptr;
+    size_ = 0;
+}
+
+template<class Key, class Value, class Compare>
+bool PersistentAVLTree<Key, Value, Compare>::empty() const
+{
+    return size_ == 0;
+}
+
+template<class Key, class Value, class Compare>
+size_t PersistentAVLTree<Key, Value, Compare>::size() const
+{
+    return size_;
+}
+
+template<class Key, class Value, class Compare>
+size_t PersistentAVLTree<Key, Value, Compare>::height() const
+{
+    return heightOf(root_);
+}
+
+template<class Key, class Value, class Compare>
+Compare PersistentAVLTree<Key, Value, Compare>::key_comp() const
+{
+    return comp_;
+}
+
+template<class Key, class Value, class Compare>
+Value const & PersistentAVLTree<Key, Value, Compare>::operator[](const Key& key) const
+{
+    const NodeT* node = internalFind(key);
+    if(node == nullptr) throw std::out_of_range("Invalid key");
+    return node->item_.second;
+}
+
+template<class Key, class Value, class Compare>
+typename PersistentAVLTree<Key, Value, Compare>::const_iterator
+PersistentAVLTree<Key, Value, Compare>::begin() const
+{
+    const NodeT* node = root_;
+    while(node != nullptr && node->left_ != nullptr)
+        node = node->left_;
+    return const_iterator(node, this);
+}
+
+template<class Key, class Value, class Compare>
+typename PersistentAVLTree<Key, Value, Compare>::const_iterator
+PersistentAVLTree<Key, Value, Compare>::end() const
+{
+    return const_iterator(nullptr, this);
+}
+
+template<class Key, class Value, class Compare>
+typename PersistentAVLTree<Key, Value, Compare>::const_iterator
+PersistentAVLTree<Key, Value, Compare>::find(const Key& key) const
+{
+    return const_iterator(internalFind(key), this);
+}
+
+template<class Key, class Value, class Compare>
+typename PersistentAVLTree<Key, Value, Compare>::const_iterator
+PersistentAVLTree<Key, Value, Compare>::lower_bound(const Key& key) const
+{
+    return const_iterator(internalLowerBound(key), this);
+}
+
+/**
+* Checks the order of the keys, the stored heights, the balance and that
+* every node is referenced.
+*/
+template<class Key, class Value, class Compare>
+typename PersistentAVLTree<Key, Value, Compare>::ValidationResult
+PersistentAVLTree<Key, Value, Compare>::validate() const
+{
+    ValidationResult result;
+    const NodeT* bad = nullptr;
+    result.reason = checkNode(root_, bad);
+    result.item = bad == nullptr ? nullptr : &bad->item_;
+    if(result.reason == nullptr){
+        size_t count = 0;
+        for(const_iterator it = begin(); it != end(); ++it)
+            ++count;
+        if(count != size_)
+            result.reason = "size does not match the number of items";
+    }
+    return result;
+}
+
+template<class Key, class Value, class Compare>
+const char* PersistentAVLTree<Key, Value, Compare>::checkNode(const NodeT* node, const NodeT*& bad) const
+{
+    if(node == nullptr)
+        return nullptr;
+    bad = node;
+    if(node->refs_.load(std::memory_order_relaxed) == 0)
+        return "node has no references";
+    size_t lh = heightOf(node->left_);
+    size_t rh = heightOf(node->right_);
+    if(node->height_ != std::max(lh, rh) + 1)
+        return "stored height does not match the subtrees";
+    if(lh > rh + 1 || rh > lh + 1)
+        return "subtree heights differ by more than one";
+    const char* reason = checkNode(node->left_, bad);
+    if(reason == nullptr)
+        reason = checkNode(node->right_, bad);
+    // the subtrees are in order, so only their extremes need comparing
+    if(reason == nullptr){
+        const NodeT* n = node->left_;
+        for(; n != nullptr && n->right_ != nullptr; n = n->right_) ;
+        if(n != nullptr && !comp_(n->item_.first, node->item_.first)){
+            bad = node;
+            return "left subtree holds a key not less than the node";
+        }
+        n = node->right_;
+        for(; n != nullptr && n->left_ != nullptr; n = n->left_) ;
+        if(n != nullptr && !comp_(node->item_.first, n->item_.first)){
+            bad = node;
+            return "right subtree holds a key not greater than the node";
+        }
+    }
+    return reason;
+}
+
+template<class Key, class Value, class Compare>
+void PersistentAVLTree<Key, Value, Compare>::retain(NodeT* node)
+{
+    if(node != nullptr)
+        node->refs_.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+* Drops one reference to node and frees it if that was the last, which
+* drops its references to its children in turn. Another thread may be
+* releasing other parents of the same children; acq_rel makes its writes
+* to a node visible before the node is freed here.
+*/
+template<class Key, class Value, class Compare>
+void PersistentAVLTree<Key, Value, Compare>::release(NodeT* node)
+{
+    while(node != nullptr){
+        if(node->refs_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            return;
+        NodeT* left = node->left_;
+        NodeT* right = node->right_;
+        delete node;
+        release(left);
+        // the right child is released in the loop, so a long right spine
+        // does not deepen the recursion
+        node = right;
+    }
+}
+
+template<class Key, class Value, class Compare>
+size_t PersistentAVLTree<Key, Value, Compare>::heightOf(const NodeT* node)
+{
+    return node == nullptr ? 0 : node->height_;
+}
+
+template<class Key, class Value, class Compare>
+void PersistentAVLTree<Key, Value, Compare>::update(NodeT* node)
+{
+    node->height_ = (uint8_t)(std::max(heightOf(node->left_), heightOf(node->right_)) + 1);
+}
+
+/**
+* Makes slot point to a node that only it refers to: the node itself
+* when nobody else does, else a copy. The copy is made before the old
+* reference is dropped, so if it throws the slot is unchanged.
+*
+* refs_ == 1 cannot turn into 2 behind our back: only a version that
+* reaches the node can add a reference, and this slot is the only one.
+*/
+template<class Key, class Value, class Compare>
+void PersistentAVLTree<Key, Value, Compare>::unshare(NodeT*& slot)
+{
+    if(slot->refs_.load(std::memory_order_acquire) == 1)
+        return;
+    NodeT* copy = new NodeT(*slot);
+    release(slot);
+    slot = copy;
+}
+
+/**
+* The rotations take the slot of an unshared node. The child that rises
+* changes too, so it is unshared first; nothing else can throw.
+*/
+template<class Key, class Value, class Compare>
+void PersistentAVLTree<Key, Value, Compare>::rotateLeft(NodeT*& slot)
+{
+    NodeT* node = slot;
+    unshare(node->right_);
+    NodeT* right = node->right_;
+    node->right_ = right->left_;
+    update(node);
+    right->left_ = node;
+    update(right);
+    slot = right;
+}
+
+template<class Key, class Value, class Compare>
+void PersistentAVLTree<Key, Value, Compare>::rotateRight(NodeT*& slot)
+{
+    NodeT* node = slot;
+    unshare(node->left_);
+    NodeT* left = node->left_;
+    node->left_ = left->right_;
+    update(node);
+    left->right_ = node;
+    update(left);
+    slot = left;
+}
+
+/**
+* Restores the balance of an unshared node whose subtrees differ in
+* height by at most two; slot ends up at the subtree's new root.
+*/
+template<class Key, class Value, class Compare>
+void PersistentAVLTree<Key, Value, Compare>::rebalance(NodeT*& slot)
+{
+    NodeT* node = slot;
+    size_t lh = heightOf(node->left_);
+    size_t rh = heightOf(node->right_);
+    if(rh > lh + 1){
+        if(heightOf(node->right_->left_) > heightOf(node->right_->right_)){
+            unshare(node->right_);
+            rotateRight(node->right_);
+        }
+        rotateLeft(slot);
+    }
+    else if(lh > rh + 1){
+        if(heightOf(node->left_->right_) > heightOf(node->left_->left_)){
+            unshare(node->left_);
+            rotateLeft(node->left_);
+        }
+        rotateRight(slot);
+    }
+    else{
+        update(node);
+    }
+}
+
+/**
+* Inserts key into the subtree at slot, unsharing the nodes on the way
+* down and rebalancing on the way up. added is set as soon as the new
+* node is linked in.
+*/
+template<class Key, class Value, class Compare>
+void PersistentAVLTree<Key, Value, Compare>::insertNode(NodeT*& slot, const Key& key, const Value& value,
+                                                        bool& added)
+{
+    if(slot == nullptr){
+        slot = new NodeT(key, value);
+        added = true;
+        return;
+    }
+    unshare(slot);
+    if(comp_(key, slot->item_.first)){
+        insertNode(slot->left_, key, value, added);
+    }
+    else if(comp_(slot->item_.first, key)){
+        insertNode(slot->right_, key, value, added);
+    }
+    else{
+        slot->item_.second = value;
+        return;
+    }
+    if(added)
+        rebalance(slot);
+}
+
+/**
+* As insertNode; key is known to be present. The node holding it is
+* replaced by the smallest node of its right subtree, relinked rather
+* than copied since keys are const. That node is unlinked before the
+* old one is dropped, so a throw in between loses nothing.
+*/
+template<class Key, class Value, class Compare>
+void PersistentAVLTree<Key, Value, Compare>::removeNode(NodeT*& slot, const Key& key, bool& removed)
+{
+    unshare(slot);
+    NodeT* node = slot;
+    if(comp_(key, node->item_.first)){
+        removeNode(node->left_, key, removed);
+    }
+    else if(comp_(node->item_.first, key)){
+        removeNode(node->right_, key, removed);
+    }
+    else{
+        bool twoChildren = node->left_ != nullptr && node->right_ != nullptr;
+        if(twoChildren){
+            NodeT* min;
+            removeMin(node->right_, min);
+            min->left_ = node->left_;
+            min->right_ = node->right_;
+            slot = min;
+        }
+        else{
+            slot = node->left_ == nullptr ? node->right_ : node->left_;
+        }
+        node->left_ = node->right_ = nullptr;
+        release(node);
+        removed = true;
+        // a lone child may be shared, and is balanced already
+        if(!twoChildren)
+            return;
+    }
+    rebalance(slot);
+}
+
+/**
+* Unlinks the smallest node of the subtree at slot, unshared and without
+* children, into min.
+*/
+template<class Key, class Value, class Compare>
+void PersistentAVLTree<Key, Value, Compare>::removeMin(NodeT*& slot, NodeT*& min)
+{
+    unshare(slot);
+    if(slot->left_ == nullptr){
+        min = slot;
+        slot = min->right_;
+        min->right_ = nullptr;
+        return;
+    }
+    removeMin(slot->left_, min);
+    rebalance(slot);
+}
+
+template<class Key, class Value, class Compare>
+const typename PersistentAVLTree<Key, Value, Compare>::NodeT*
+PersistentAVLTree<Key, Value, Compare>::internalLowerBound(const Key& key) const
+{
+    const NodeT* candidate = nullptr;
+    for(const NodeT* node = root_; node != nullptr; ){
+        if(comp_(node->item_.first, key)){
+            node = node->right_;
+        }
+        else{
+            candidate = node;
+            node = node->left_;
+        }
+    }
+    return candidate;
+}
+
+template<class Key, class Value, class Compare>
+const typename PersistentAVLTree<Key, Value, Compare>::NodeT*
+PersistentAVLTree<Key, Value, Compare>::internalUpperBound(const Key& key) const
+{
+    const NodeT* candidate = nullptr;
+    for(const NodeT* node = root_; node != nullptr; ){
+        if(comp_(key, node->item_.first)){
+            candidate = node;
+            node = node->left_;
+        }
+        else{
+            node = node->right_;
+        }
+    }
+    return candidate;
+}
+
+template<class Key, class Value, class Compare>
+const typename PersistentAVLTree<Key, Value, Compare>::NodeT*
+PersistentAVLTree<Key, Value, Compare>::internalFind(const Key& key) const
+{
+    const NodeT* node = internalLowerBound(key);
+    return node != nullptr && !comp_(key, node->item_.first) ? node : nullptr;
+}
+
+#endif
@@ -0,0 +1,227 @@
+#ifndef RCU_AVL_H
+#define RCU_AVL_H
+
+#include <cstddef>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <stdexcept>
+#include <functional>
+#include "persistent_avl.h"
+#include "epoch.h"
+
+/**
+* A thread-safe map whose readers take no lock and touch no reference
+* count: read-copy-update over PersistentAVLTree. The current version is
+* published through an atomic pointer. A writer copies it (O(1)), makes
+* its change on the copy, which copies only the path to the key, and
+* publishes the copy; the old version is retired to an EpochDomain and
+* destroyed, freeing the nodes no newer version shares, once no reader
+* can still be inside it.
+*
+* A reader enters the domain, loads the pointer and walks the version it
+* got, which nothing ever changes. read() hands that version to a
+* function, so its iterators stay valid and see one consistent state for
+* the whole call however many writers publish meanwhile. snapshot()
+* keeps a version past the call, at the price of one reference count.
+*
+* Writers are serialized by a mutex and pay for the path copy, so this
+* suits read-mostly maps. A reader that stays inside read() for long
+* holds back the freeing of every version retired after it entered.
+*/
+template <class Key, class Value, class Compare = std::less<Key> >
+class RcuAVLTree
+{
+public:
+    typedef PersistentAVLTree<Key, Value, Compare> VersionT;
+
+    RcuAVLTree();
+    explicit RcuAVLTree(const Compare& comp);
+    ~RcuAVLTree();
+
+    bool find(const Key& key, Value& value) const;
+    bool contains(const Key& key) const;
+    Value operator[](const Key& key) const;
+    size_t size() const;
+    bool empty() const;
+    VersionT snapshot() const;
+
+    bool insert(const std::pair<const Key, Value>& keyValuePair);
+    bool insert_or_assign(const Key& key, const Value& value);
+    bool remove(const Key& key);
+    void clear();
+
+    template<typename Function>
+    void read(Function fn) const;
+
+private:
+    RcuAVLTree(const RcuAVLTree&);
+    RcuAVLTree& operator=(const RcuAVLTree&);
+
+    void publish(VersionT* next);
+
+    mutable EpochDomain epoch_;
+    std::atomic<VersionT*> current_;
+    std::mutex writers_;
+};
+
+/*
+  ---------------------------------------------
+  Begin implementations for RcuAVLTree.
+  ---------------------------------------------
+*/
+
+template<class Key, class Value, class Compare>
+RcuAVLTree<Key, Value, Compare>::RcuAVLTree() :
+    current_(new VersionT())
+{
+
+}
+
+template<class Key, class Value, class Compare>
+RcuAVLTree<Key, Value, Compare>::RcuAVLTree(const Compare& comp) :
+    current_(new VersionT(comp))
+{
+
+}
+
+/**
+* No thread may be reading. The domain then frees the retired versions.
+*/
+template<class Key, class Value, class Compare>
+RcuAVLTree<Key, Value, Compare>::~RcuAVLTree()
+{
+    delete current_.load(std::memory_order_relaxed);
+}
+
+/**
+* Copies the value of key into value and returns true, or returns false
+* if the key is absent.
+*/
+template<class Key, class Value, class Compare>
+bool RcuAVLTree<Key, Value, Compare>::find(const Key& key, Value& value) const
+{
+    EpochGuard guard(epoch_);
+    const VersionT* version = current_.load(std::memory_order_seq_cst);
+    typename VersionT::const_iterator it = version->find(key);
+    if(it == version->end())
+        return false;
+    value = it->second;
+    return true;
+}
+
+template<class Key, class Value, class Compare>
+bool RcuAVLTree<Key, Value, Compare>::contains(const Key& key) const
+{
+    EpochGuard guard(epoch_);
+    const VersionT* version = current_.load(std::memory_order_seq_cst);
+    return version->find(key) != version->end();
+}
+
+/**
+* Returns a copy of the value of key; throws std::out_of_range if absent.
+*/
+template<class Key, class Value, class Compare>
+Value RcuAVLTree<Key, Value, Compare>::operator[](const Key& key) const
+{
+    EpochGuard guard(epoch_);
+    return (*current_.load(std::memory_order_seq_cst))[key];
+}
+
+template<class Key, class Value, class Compare>
+size_t RcuAVLTree<Key, Value, Compare>::size() const
+{
+    EpochGuard guard(epoch_);
+    return current_.load(std::memory_order_seq_cst)->size();
+}
+
+template<class Key, class Value, class Compare>
+bool RcuAVLTree<Key, Value, Compare>::empty() const
+{
+    return size() == 0;
+}
+
+/**
+* The current version, which the caller may keep, read and change
+* without affecting this tree. O(1).
+*/
+template<class Key, class Value, class Compare>
+typename RcuAVLTree<Key, Value, Compare>::VersionT RcuAVLTree<Key, Value, Compare>::snapshot() const
+{
+    EpochGuard guard(epoch_);
+    return current_.load(std::memory_order_seq_cst)->snapshot();
+}
+
+/**
+* Inserts the pair, or overwrites the value if the key is present.
+* Returns whether the key was new.
+*/
+template<class Key, class Value, class Compare>
+bool RcuAVLTree<Key, Value, Compare>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    return insert_or_assign(keyValuePair.first, keyValuePair.second);
+}
+
+/**
+* If copying throws, nothing is published and the tree is unchanged.
+*/
+template<class Key, class Value, class Compare>
+bool RcuAVLTree<Key, Value, Compare>::insert_or_assign(const Key& key, const Value& value)
+{
+    std::lock_guard<std::mutex> lock(writers_);
+    std::unique_ptr<VersionT> next(new VersionT(*current_.load(std::memory_order_relaxed)));
+    bool added = next->insert_or_assign(key, value);
+    publish(next.release());
+    return added;
+}
+
+/**
+* Removes the key if present and returns whether it was. A miss
+* publishes nothing.
+*/
+template<class Key, class Value, class Compare>
+bool RcuAVLTree<Key, Value, Compare>::remove(const Key& key)
+{
+    std::lock_guard<std::mutex> lock(writers_);
+    const VersionT* version = current_.load(std::memory_order_relaxed);
+    if(version->find(key) == version->end())
+        return false;
+    std::unique_ptr<VersionT> next(new VersionT(*version));
+    next->remove(key);
+    publish(next.release());
+    return true;
+}
+
+template<class Key, class Value, class Compare>
+void RcuAVLTree<Key, Value, Compare>::clear()
+{
+    std::lock_guard<std::mutex> lock(writers_);
+    publish(new VersionT(current_.load(std::memory_order_relaxed)->key_comp()));
+}
+
+/**
+* Calls fn(const VersionT&) on the current version. Writers do not wait
+* for fn, and the version it sees does not change while it runs.
+*/
+template<class Key, class Value, class Compare>
+template<typename Function>
+void RcuAVLTree<Key, Value, Compare>::read(Function fn) const
+{
+    EpochGuard guard(epoch_);
+    fn(*current_.load(std::memory_order_seq_cst));
+}
+
+/**
+* Makes next the current version and retires the old one. Called with
+* writers_ held. The exchange is sequentially consistent so that it is
+* ordered before the epoch the domain stamps on the old version.
+*/
+template<class Key, class Value, class Compare>
+void RcuAVLTree<Key, Value, Compare>::publish(VersionT* next)
+{
+    VersionT* old = current_.exchange(next, std::memory_order_seq_cst);
+    epoch_.retire(old);
+}
+
+#endif
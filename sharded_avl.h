@@ -0,0 +1,385 @@
+#ifndef SHARDED_AVL_H
+#define SHARDED_AVL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <utility>
+#include <iterator>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+#include "avlbst.h"
+
+/**
+* A thread-safe map that hash-partitions its keys over several AVLTrees,
+* each behind its own mutex, so writers to different shards run at the
+* same time. insert, remove, find and operator[] lock the one shard
+* their key hashes to; lookups return values by copy, as in
+* ConcurrentAVLTree.
+*
+* Hashing rather than ranges keeps the shards even whatever the key
+* distribution, at the cost of order: each shard is sorted but the map
+* as a whole is not, so begin() merges the shards, keeping the shard
+* iterators in a heap ordered by Compare. A step costs O(log shards).
+* Iteration, size() summed over the shards aside, takes no locks: run
+* it when no writer is active, or inside a write() of every shard.
+*
+* Hash must agree with Compare: keys that compare equal hash the same.
+* The shard count is fixed at construction; a few per core is plenty.
+*/
+template <class Key, class Value, class Hash = std::hash<Key>, class Alloc = HeapNodeAlloc,
+          class Compare = std::less<Key> >
+class ShardedAVLMap
+{
+public:
+    typedef AVLTree<Key, Value, Alloc, AVLNode<Key, Value>, Compare> TreeT;
+
+    explicit ShardedAVLMap(size_t shards = 16, const Hash& hash = Hash(), const Compare& comp = Compare());
+
+    bool find(const Key& key, Value& value) const;
+    bool contains(const Key& key) const;
+    Value operator[](const Key& key) const;
+    size_t size() const;
+    bool empty() const;
+
+    bool insert(const std::pair<const Key, Value>& keyValuePair);
+    bool insert_or_assign(const Key& key, const Value& value);
+    bool remove(const Key& key);
+    void clear();
+
+    size_t shardCount() const;
+    size_t shardOf(const Key& key) const;
+    template<typename Function>
+    void write(size_t shard, Function fn);
+
+    /**
+    * A forward iterator over all shards in key order.
+    */
+    class const_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type* pointer;
+        typedef const value_type& reference;
+
+        const_iterator();
+
+        const std::pair<const Key,Value>& operator*() const;
+        const std::pair<const Key,Value>* operator->() const;
+
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+
+    protected:
+        friend class ShardedAVLMap<Key, Value, Hash, Alloc, Compare>;
+
+        // The unfinished shards, each at its smallest unvisited item.
+        struct Cursor
+        {
+            typename TreeT::const_iterator current;
+            typename TreeT::const_iterator end;
+        };
+
+        // Orders the heap so that the smallest key is at the front.
+        struct Later
+        {
+            Compare comp;
+            bool operator()(const Cursor& a, const Cursor& b) const
+            {
+                return comp(b.current->first, a.current->first);
+            }
+        };
+
+        explicit const_iterator(const Compare& comp);
+
+        std::vector<Cursor> heap_;
+        Later later_;
+    };
+    typedef const_iterator iterator;
+
+    const_iterator begin() const;
+    const_iterator end() const;
+
+protected:
+    // Padded so that the locks of neighbouring shards, allocated one
+    // after the other, do not share a cache line.
+    struct Shard
+    {
+        explicit Shard(const Compare& comp) : tree(comp) {}
+        TreeT tree;
+        std::mutex lock;
+        char pad[64];
+    };
+
+    Shard& shardFor(const Key& key) const;
+
+    std::vector<std::unique_ptr<Shard> > shards_;
+    Hash hash_;
+    Compare comp_;
+};
+
+/*
+  -----------------------------------------------------
+  Begin implementations for the ShardedAVLMap iterator.
+  -----------------------------------------------------
+*/
+
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::const_iterator::const_iterator()
+{
+
+}
+
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::const_iterator::const_iterator(const Compare& comp)
+{
+    later_.comp = comp;
+}
+
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+const std::pair<const Key,Value>&
+ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::const_iterator::operator*() const
+{
+    return *(heap_.front().current);
+}
+
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+const std::pair<const Key,Value>*
+ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::const_iterator::operator->() const
+{
+    return &*(heap_.front().current);
+}
+
+/**
+* Iterators are equal when they stand on the same item, or are both at
+* the end.
+*/
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+bool ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::const_iterator::operator==(const const_iterator& rhs) const
+{
+    if(heap_.empty() || rhs.heap_.empty())
+        return heap_.empty() == rhs.heap_.empty();
+    return heap_.front().current == rhs.heap_.front().current;
+}
+
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+bool ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::const_iterator::operator!=(const const_iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+/**
+* Advances the shard at the front and sifts it back into the heap, or
+* drops it when it is done.
+*/
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+typename ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::const_iterator&
+ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::const_iterator::operator++()
+{
+    std::pop_heap(heap_.begin(), heap_.end(), later_);
+    Cursor& cursor = heap_.back();
+    ++cursor.current;
+    if(cursor.current == cursor.end)
+        heap_.pop_back();
+    else
+        std::push_heap(heap_.begin(), heap_.end(), later_);
+    return *this;
+}
+
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+typename ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::const_iterator
+ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::const_iterator::operator++(int)
+{
+    const_iterator old(*this);
+    ++(*this);
+    return old;
+}
+
+/*
+  ---------------------------------------------
+  Begin implementations for ShardedAVLMap.
+  ---------------------------------------------
+*/
+
+/**
+* shards is clamped to at least one.
+*/
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::ShardedAVLMap(size_t shards, const Hash& hash, const Compare& comp) :
+    hash_(hash), comp_(comp)
+{
+    if(shards == 0)
+        shards = 1;
+    for(size_t i = 0; i < shards; ++i) {
+        shards_.push_back(std::unique_ptr<Shard>(new Shard(comp)));
+    }
+}
+
+/**
+* The shard key belongs to. The hash is mixed first: std::hash of an
+* integer is the integer itself, and strided keys would otherwise pile
+* up in a few shards.
+*/
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+size_t ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::shardOf(const Key& key) const
+{
+    uint64_t h = (uint64_t)hash_(key) * 0x9E3779B97F4A7C15ull;
+    return (size_t)((h >> 32) % shards_.size());
+}
+
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+typename ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::Shard&
+ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::shardFor(const Key& key) const
+{
+    return *shards_[shardOf(key)];
+}
+
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+size_t ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::shardCount() const
+{
+    return shards_.size();
+}
+
+/**
+* Copies the value of key into value and returns true, or returns false
+* if the key is absent.
+*/
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+bool ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::find(const Key& key, Value& value) const
+{
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    typename TreeT::const_iterator it = shard.tree.find(key);
+    if(it == shard.tree.end())
+        return false;
+    value = it->second;
+    return true;
+}
+
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+bool ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::contains(const Key& key) const
+{
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    return shard.tree.find(key) != shard.tree.end();
+}
+
+/**
+* Returns a copy of the value of key; throws std::out_of_range if absent.
+*/
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+Value ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::operator[](const Key& key) const
+{
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    return shard.tree[key];
+}
+
+/**
+* The shards are counted one at a time, so with writers running the
+* total is only approximate.
+*/
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+size_t ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::size() const
+{
+    size_t total = 0;
+    for(size_t i = 0; i < shards_.size(); ++i) {
+        std::lock_guard<std::mutex> guard(shards_[i]->lock);
+        total += shards_[i]->tree.size();
+    }
+    return total;
+}
+
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+bool ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::empty() const
+{
+    return size() == 0;
+}
+
+/**
+* Inserts the pair, or overwrites the value if the key is present.
+* Returns whether the key was new.
+*/
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+bool ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    return insert_or_assign(keyValuePair.first, keyValuePair.second);
+}
+
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+bool ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::insert_or_assign(const Key& key, const Value& value)
+{
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    return shard.tree.insert_or_assign(key, value).second;
+}
+
+/**
+* Removes the key if present and returns whether it was.
+*/
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+bool ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::remove(const Key& key)
+{
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    size_t before = shard.tree.size();
+    shard.tree.remove(key);
+    return shard.tree.size() != before;
+}
+
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+void ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::clear()
+{
+    for(size_t i = 0; i < shards_.size(); ++i) {
+        std::lock_guard<std::mutex> guard(shards_[i]->lock);
+        shards_[i]->tree.clear();
+    }
+}
+
+/**
+* Calls fn(TreeT&) on one shard with its lock held, for batch updates of
+* the keys that shardOf maps to it.
+*/
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+template<typename Function>
+void ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::write(size_t shard, Function fn)
+{
+    std::lock_guard<std::mutex> guard(shards_[shard]->lock);
+    fn(shards_[shard]->tree);
+}
+
+/**
+* Starts the merge: one heap entry per non-empty shard. O(shards).
+*/
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+typename ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::const_iterator
+ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::begin() const
+{
+    const_iterator it(comp_);
+    it.heap_.reserve(shards_.size());
+    for(size_t i = 0; i < shards_.size(); ++i) {
+        const TreeT& tree = shards_[i]->tree;
+        typename const_iterator::Cursor cursor = { tree.begin(), tree.end() };
+        if(cursor.current != cursor.end)
+            it.heap_.push_back(cursor);
+    }
+    std::make_heap(it.heap_.begin(), it.heap_.end(), it.later_);
+    return it;
+}
+
+template<class Key, class Value, class Hash, class Alloc, class Compare>
+typename ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::const_iterator
+ShardedAVLMap<Key, Value, Hash, Alloc, Compare>::end() const
+{
+    return const_iterator(comp_);
+}
+
+#endif
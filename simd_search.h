@@ -0,0 +1,353 @@
+#ifndef SIMD_SEARCH_H
+#define SIMD_SEARCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <functional>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && defined(__GNUC__)
+#include <immintrin.h>
+#define SIMD_SEARCH_X86 1
+#endif
+
+/**
+* Searches of a sorted array of keys, as used inside the nodes of
+* BPlusTree. Both return a count: lowerBound the number of keys less than
+* key, upperBound the number not greater than key.
+*
+* The generic version is a binary search with no data-dependent branch.
+* For arithmetic keys the search is narrowed the same way to a window of
+* at most kSearchWindow keys, and the window is then counted with SSE2 or
+* AVX2 compares, several keys per instruction. Which instruction set is
+* used is decided once at startup from the CPU (see searchLevel()): AVX2
+* when it is there, the scalar search otherwise. SSE2 can be selected by
+* hand; 64-bit integers need AVX2 and are counted with plain compares
+* under SSE2.
+* Floating-point keys must not be NaN, as with operator<.
+*/
+
+enum SearchLevel
+{
+    kSearchScalar = 0,
+    kSearchSSE2 = 1,
+    kSearchAVX2 = 2
+};
+
+static const size_t kSearchWindow = 16;
+
+inline int detectSearchLevel()
+{
+#ifdef SIMD_SEARCH_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return kSearchAVX2;
+    // four lanes do not pay for the counting loop; the branch-free binary
+    // search is as fast or faster
+    return kSearchScalar;
+#else
+    return kSearchScalar;
+#endif
+}
+
+template<int N>
+struct SearchLevelHolder
+{
+    static int level;
+};
+
+template<int N>
+int SearchLevelHolder<N>::level = detectSearchLevel();
+
+/**
+* The instruction set the searches use, chosen by detectSearchLevel();
+* tests and benchmarks may set it to compare the versions.
+*/
+inline int& searchLevel()
+{
+    return SearchLevelHolder<0>::level;
+}
+
+/**
+* Branch-free binary search for the first key that is not "below" key,
+* where below means k < key (lower bound) or !(key < k) (upper bound),
+* with < given by comp. Returns the number of keys before it.
+*/
+template<typename Key, typename Compare>
+size_t scalarBound(const Key* keys, size_t n, const Key& key, bool upper, const Compare& comp)
+{
+    if(n == 0)
+        return 0;
+    const Key* base = keys;
+    while(n > 1){
+        size_t half = n / 2;
+        bool below = upper ? !comp(key, base[half]) : comp(base[half], key);
+        base = below ? base + half : base;
+        n -= half;
+    }
+    bool below = upper ? !comp(key, *base) : comp(*base, key);
+    return (base - keys) + below;
+}
+
+#ifdef SIMD_SEARCH_X86
+
+/*
+  ---------------------------------------------
+  Counting kernels: how many of keys[0..n) are
+  below key (or not above it when inclusive).
+  ---------------------------------------------
+*/
+
+inline size_t countSSE2(const int32_t* keys, size_t n, int32_t key, bool inclusive)
+{
+    // k < key, or k <= key as k < key + 1 (key + 1 cannot overflow
+    // unless key is the maximum, where every key qualifies)
+    if(inclusive && key == INT32_MAX)
+        return n;
+    __m128i probe = _mm_set1_epi32(inclusive ? key + 1 : key);
+    size_t count = 0, i = 0;
+    for(; i + 4 <= n; i += 4){
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+        count += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(v, probe))));
+    }
+    for(; i < n; ++i)
+        count += inclusive ? keys[i] <= key : keys[i] < key;
+    return count;
+}
+
+inline size_t countSSE2(const uint32_t* keys, size_t n, uint32_t key, bool inclusive)
+{
+    if(inclusive && key == UINT32_MAX)
+        return n;
+    // flip the sign bit so that the signed compare orders unsigned values
+    const __m128i bias = _mm_set1_epi32((int)0x80000000u);
+    __m128i probe = _mm_xor_si128(_mm_set1_epi32((int)(inclusive ? key + 1 : key)), bias);
+    size_t count = 0, i = 0;
+    for(; i + 4 <= n; i += 4){
+        __m128i v = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i)), bias);
+        count += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(v, probe))));
+    }
+    for(; i < n; ++i)
+        count += inclusive ? keys[i] <= key : keys[i] < key;
+    return count;
+}
+
+inline size_t countSSE2(const float* keys, size_t n, float key, bool inclusive)
+{
+    __m128 probe = _mm_set1_ps(key);
+    size_t count = 0, i = 0;
+    for(; i + 4 <= n; i += 4){
+        __m128 v = _mm_loadu_ps(keys + i);
+        __m128 below = inclusive ? _mm_cmple_ps(v, probe) : _mm_cmplt_ps(v, probe);
+        count += __builtin_popcount(_mm_movemask_ps(below));
+    }
+    for(; i < n; ++i)
+        count += inclusive ? keys[i] <= key : keys[i] < key;
+    return count;
+}
+
+inline size_t countSSE2(const double* keys, size_t n, double key, bool inclusive)
+{
+    __m128d probe = _mm_set1_pd(key);
+    size_t count = 0, i = 0;
+    for(; i + 2 <= n; i += 2){
+        __m128d v = _mm_loadu_pd(keys + i);
+        __m128d below = inclusive ? _mm_cmple_pd(v, probe) : _mm_cmplt_pd(v, probe);
+        count += __builtin_popcount(_mm_movemask_pd(below));
+    }
+    for(; i < n; ++i)
+        count += inclusive ? keys[i] <= key : keys[i] < key;
+    return count;
+}
+
+__attribute__((target("avx2")))
+inline size_t countAVX2(const int32_t* keys, size_t n, int32_t key, bool inclusive)
+{
+    if(inclusive && key == INT32_MAX)
+        return n;
+    __m256i probe = _mm256_set1_epi32(inclusive ? key + 1 : key);
+    size_t count = 0, i = 0;
+    for(; i + 8 <= n; i += 8){
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+        count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(probe, v))));
+    }
+    for(; i < n; ++i)
+        count += inclusive ? keys[i] <= key : keys[i] < key;
+    return count;
+}
+
+__attribute__((target("avx2")))
+inline size_t countAVX2(const uint32_t* keys, size_t n, uint32_t key, bool inclusive)
+{
+    if(inclusive && key == UINT32_MAX)
+        return n;
+    const __m256i bias = _mm256_set1_epi32((int)0x80000000u);
+    __m256i probe = _mm256_xor_si256(_mm256_set1_epi32((int)(inclusive ? key + 1 : key)), bias);
+    size_t count = 0, i = 0;
+    for(; i + 8 <= n; i += 8){
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i)), bias);
+        count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(probe, v))));
+    }
+    for(; i < n; ++i)
+        count += inclusive ? keys[i] <= key : keys[i] < key;
+    return count;
+}
+
+__attribute__((target("avx2")))
+inline size_t countAVX2(const int64_t* keys, size_t n, int64_t key, bool inclusive)
+{
+    if(inclusive && key == INT64_MAX)
+        return n;
+    __m256i probe = _mm256_set1_epi64x(inclusive ? key + 1 : key);
+    size_t count = 0, i = 0;
+    for(; i + 4 <= n; i += 4){
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+        count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(probe, v))));
+    }
+    for(; i < n; ++i)
+        count += inclusive ? keys[i] <= key : keys[i] < key;
+    return count;
+}
+
+__attribute__((target("avx2")))
+inline size_t countAVX2(const float* keys, size_t n, float key, bool inclusive)
+{
+    __m256 probe = _mm256_set1_ps(key);
+    size_t count = 0, i = 0;
+    for(; i + 8 <= n; i += 8){
+        __m256 v = _mm256_loadu_ps(keys + i);
+        __m256 below = inclusive ? _mm256_cmp_ps(v, probe, _CMP_LE_OQ) : _mm256_cmp_ps(v, probe, _CMP_LT_OQ);
+        count += __builtin_popcount(_mm256_movemask_ps(below));
+    }
+    for(; i < n; ++i)
+        count += inclusive ? keys[i] <= key : keys[i] < key;
+    return count;
+}
+
+__attribute__((target("avx2")))
+inline size_t countAVX2(const double* keys, size_t n, double key, bool inclusive)
+{
+    __m256d probe = _mm256_set1_pd(key);
+    size_t count = 0, i = 0;
+    for(; i + 4 <= n; i += 4){
+        __m256d v = _mm256_loadu_pd(keys + i);
+        __m256d below = inclusive ? _mm256_cmp_pd(v, probe, _CMP_LE_OQ) : _mm256_cmp_pd(v, probe, _CMP_LT_OQ);
+        count += __builtin_popcount(_mm256_movemask_pd(below));
+    }
+    for(; i < n; ++i)
+        count += inclusive ? keys[i] <= key : keys[i] < key;
+    return count;
+}
+
+/**
+* The lane type a key is compared as: the fixed-width type of the same
+* size and kind, or void when there is no kernel for it.
+*/
+template<typename Key>
+struct SearchLane
+{
+    typedef typename std::conditional<std::is_floating_point<Key>::value,
+        typename std::conditional<sizeof(Key) == 4, float,
+            typename std::conditional<sizeof(Key) == 8, double, void>::type>::type,
+        typename std::conditional<std::is_integral<Key>::value && sizeof(Key) == 4,
+            typename std::conditional<std::is_signed<Key>::value, int32_t, uint32_t>::type,
+            typename std::conditional<std::is_integral<Key>::value && sizeof(Key) == 8 &&
+                                      std::is_signed<Key>::value, int64_t, void>::type>::type>::type type;
+};
+
+inline size_t countBelow(const int32_t* keys, size_t n, int32_t key, bool inclusive)
+{
+    return searchLevel() == kSearchAVX2 ? countAVX2(keys, n, key, inclusive)
+                                        : countSSE2(keys, n, key, inclusive);
+}
+
+inline size_t countBelow(const uint32_t* keys, size_t n, uint32_t key, bool inclusive)
+{
+    return searchLevel() == kSearchAVX2 ? countAVX2(keys, n, key, inclusive)
+                                        : countSSE2(keys, n, key, inclusive);
+}
+
+inline size_t countBelow(const int64_t* keys, size_t n, int64_t key, bool inclusive)
+{
+    // SSE2 has no 64-bit compare
+    if(searchLevel() == kSearchAVX2)
+        return countAVX2(keys, n, key, inclusive);
+    size_t count = 0;
+    for(size_t i = 0; i < n; ++i)
+        count += inclusive ? keys[i] <= key : keys[i] < key;
+    return count;
+}
+
+inline size_t countBelow(const float* keys, size_t n, float key, bool inclusive)
+{
+    return searchLevel() == kSearchAVX2 ? countAVX2(keys, n, key, inclusive)
+                                        : countSSE2(keys, n, key, inclusive);
+}
+
+inline size_t countBelow(const double* keys, size_t n, double key, bool inclusive)
+{
+    return searchLevel() == kSearchAVX2 ? countAVX2(keys, n, key, inclusive)
+                                        : countSSE2(keys, n, key, inclusive);
+}
+
+#endif
+
+/**
+* Key search for any key type, ordered by Compare.
+*/
+template<typename Key, typename Compare = std::less<Key>, typename Enable = void>
+struct KeySearch
+{
+    static size_t lowerBound(const Key* keys, size_t n, const Key& key, const Compare& comp = Compare())
+    {
+        return scalarBound(keys, n, key, false, comp);
+    }
+    static size_t upperBound(const Key* keys, size_t n, const Key& key, const Compare& comp = Compare())
+    {
+        return scalarBound(keys, n, key, true, comp);
+    }
+};
+
+#ifdef SIMD_SEARCH_X86
+
+/**
+* Key search for arithmetic keys in their natural order that have a
+* counting kernel.
+*/
+template<typename Key>
+struct KeySearch<Key, std::less<Key>, typename std::enable_if<std::is_arithmetic<Key>::value &&
+    !std::is_same<typename SearchLane<Key>::type, void>::value>::type>
+{
+    typedef typename SearchLane<Key>::type Lane;
+
+    static size_t lowerBound(const Key* keys, size_t n, const Key& key, const std::less<Key>& = std::less<Key>())
+    {
+        return bound(keys, n, key, false);
+    }
+    static size_t upperBound(const Key* keys, size_t n, const Key& key, const std::less<Key>& = std::less<Key>())
+    {
+        return bound(keys, n, key, true);
+    }
+
+    /**
+    * Halves the range without branches until it fits the window, then
+    * counts the window.
+    */
+    static size_t bound(const Key* keys, size_t n, const Key& key, bool upper)
+    {
+        if(searchLevel() == kSearchScalar)
+            return scalarBound(keys, n, key, upper, std::less<Key>());
+        const Key* base = keys;
+        while(n > kSearchWindow){
+            size_t half = n / 2;
+            bool below = upper ? !(key < base[half]) : base[half] < key;
+            base = below ? base + half : base;
+            n -= half;
+        }
+        return (base - keys) + countBelow(reinterpret_cast<const Lane*>(base), n, (Lane)key, upper);
+    }
+};
+
+#endif
+
+#endif
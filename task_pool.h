@@ -0,0 +1,187 @@
+#ifndef TASK_POOL_H
+#define TASK_POOL_H
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <iterator>
+#include <exception>
+
+/**
+* A fork-join pool for divide-and-conquer work such as the set operations
+* of AVLTree. invoke(f, g) runs f and g, possibly at the same time, and
+* returns once both are done: g is queued for the pool's threads while
+* the caller runs f, and if nobody has picked g up by then the caller
+* runs it itself. A caller waiting for its g helps with other queued work
+* instead of sleeping, so nested invoke calls cannot starve the pool.
+*
+* A pool of n threads is the caller plus n - 1 workers; with n = 1
+* invoke simply runs f and then g. An exception thrown by f or g is
+* rethrown from invoke after both have finished.
+*/
+class TaskPool
+{
+public:
+    explicit TaskPool(size_t threads = std::thread::hardware_concurrency());
+    ~TaskPool();
+
+    size_t threads() const;
+
+    template<typename F, typename G>
+    void invoke(F f, G g);
+
+private:
+    TaskPool(const TaskPool&);
+    TaskPool& operator=(const TaskPool&);
+
+    struct Task
+    {
+        std::function<void()> run;
+        std::exception_ptr error;
+        bool done;
+    };
+
+    void workerLoop();
+    bool runOne(std::unique_lock<std::mutex>& lock);
+
+    std::vector<std::thread> workers_;
+    std::deque<Task*> queue_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    bool stopping_;
+};
+
+/*
+  ---------------------------------------------
+  Begin implementations for TaskPool.
+  ---------------------------------------------
+*/
+
+inline TaskPool::TaskPool(size_t threads) :
+    stopping_(false)
+{
+    for(size_t i = 1; i < threads; ++i) {
+        workers_.push_back(std::thread(&TaskPool::workerLoop, this));
+    }
+}
+
+/**
+* Waits for the workers to finish what they are running. Every invoke
+* has returned by then, so the queue is empty.
+*/
+inline TaskPool::~TaskPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    for(size_t i = 0; i < workers_.size(); ++i) {
+        workers_[i].join();
+    }
+}
+
+inline size_t TaskPool::threads() const
+{
+    return workers_.size() + 1;
+}
+
+/**
+* Runs f and g and returns when both are done.
+*/
+template<typename F, typename G>
+void TaskPool::invoke(F f, G g)
+{
+    if(workers_.empty()) {
+        f();
+        g();
+        return;
+    }
+    Task task;
+    task.run = g;
+    task.done = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back(&task);
+    }
+    wake_.notify_one();
+
+    std::exception_ptr error;
+    try {
+        f();
+    }
+    catch(...) {
+        error = std::current_exception();
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    // take g back if no worker has started it; it is usually at the back
+    for(std::deque<Task*>::reverse_iterator it = queue_.rbegin(); it != queue_.rend(); ++it) {
+        if(*it == &task) {
+            queue_.erase(std::next(it).base());
+            lock.unlock();
+            try {
+                g();
+            }
+            catch(...) {
+                task.error = std::current_exception();
+            }
+            lock.lock();
+            task.done = true;
+            break;
+        }
+    }
+    while(!task.done) {
+        if(!runOne(lock)) {
+            wake_.wait(lock);
+        }
+    }
+    lock.unlock();
+    if(error) {
+        std::rethrow_exception(error);
+    }
+    if(task.error) {
+        std::rethrow_exception(task.error);
+    }
+}
+
+inline void TaskPool::workerLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while(!stopping_) {
+        if(!runOne(lock)) {
+            wake_.wait(lock);
+        }
+    }
+}
+
+/**
+* Runs the oldest queued task, if any, with the lock released while it
+* runs. Returns whether there was one.
+*/
+inline bool TaskPool::runOne(std::unique_lock<std::mutex>& lock)
+{
+    if(queue_.empty()) {
+        return false;
+    }
+    Task* task = queue_.front();
+    queue_.pop_front();
+    lock.unlock();
+    try {
+        task->run();
+    }
+    catch(...) {
+        task->error = std::current_exception();
+    }
+    lock.lock();
+    // its owner may be waiting for it
+    task->done = true;
+    wake_.notify_all();
+    return true;
+}
+
+#endif